@@ -0,0 +1,85 @@
+# Copyright (c) 2001-2005 Python Software Foundation.  All rights reserved.
+#
+# This code is released under the standard PSF license.
+# See the file LICENSE.
+
+"""Measure the per-call overhead of the spread module's methods.
+
+usage: python benchcalls.py [-d daemon] [-n calls]
+
+Each line is the best of three runs of n calls, in nanoseconds per call.
+The calls do as little Spread work as they can (a poll that finds
+nothing, a multicast to a group nobody has joined), so what is left is
+mostly the cost of getting from Python to the C function and back.
+"""
+
+from __future__ import print_function
+
+import getopt
+import sys
+import time
+from itertools import repeat
+
+import spread
+
+clock = getattr(time, "perf_counter", time.time)
+
+
+def bench(name, stmt, namespace, n):
+    """Time stmt, a call spelled as it would be in an application."""
+    ns = dict(namespace, repeat=repeat)
+    exec("def loop(n):\n"
+         "    for _ in repeat(None, n):\n"
+         "        %s\n" % stmt, ns)
+    loop = ns["loop"]
+    try:
+        loop(1)
+    except TypeError:
+        # Not supported by this version of the module.
+        print("%-56s %8s" % (name or stmt, "n/a"))
+        return
+    best = None
+    for run in range(3):
+        t0 = clock()
+        loop(n)
+        t = clock() - t0
+        if best is None or t < best:
+            best = t
+    print("%-56s %8.0f ns" % (name or stmt, best / n * 1e9))
+
+
+def main():
+    daemon = str(spread.DEFAULT_SPREAD_PORT) + "@localhost"
+    n = 200000
+    opts, args = getopt.getopt(sys.argv[1:], "d:n:")
+    for o, a in opts:
+        if o == "-d":
+            daemon = a
+        elif o == "-n":
+            n = int(a)
+
+    mbox = spread.connect(daemon, "bench", 0, 0)
+    print("Python %d.%d.%d, %d calls" % (sys.version_info[:3] + (n,)))
+    ns = {"spread": spread, "mbox": mbox, "FIFO_MESS": spread.FIFO_MESS,
+          "group": "bench-nobody", "data": b"x" * 16}
+    for stmt in ("spread.version()",
+                 "mbox.fileno()",
+                 "mbox.poll()",
+                 "mbox.receive(0)",
+                 "mbox.receive(timeout=0)",
+                 "mbox.multicast(FIFO_MESS, group, data)",
+                 "mbox.multicast(FIFO_MESS, group, data, 1)",
+                 "mbox.multicast(FIFO_MESS, group, data, message_type=1)"):
+        bench(None, stmt, ns, n)
+
+    # A message to ourselves and back, one receive per multicast.
+    ns["group"] = "bench-self"
+    mbox.join(ns["group"])
+    bench("multicast() + receive()",
+          "mbox.multicast(FIFO_MESS, group, data); mbox.receive()",
+          ns, n // 4)
+    mbox.disconnect()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,382 @@
+# Copyright (c) 2001-2005 Python Software Foundation.  All rights reserved.
+#
+# This code is released under the standard PSF license.
+# See the file LICENSE.
+
+"""Measure message throughput and latency through a Spread daemon.
+
+usage: python benchspread.py [options]
+
+    -d daemon   use this running daemon instead of starting one
+    -S path     the spread daemon to start (default: spread, on $PATH)
+    -p port     the port the started daemon listens on (default 24803)
+    -n count    messages each sender sends per run (default 2000)
+    -s sizes    payload sizes in bytes (default 64,1024,16384,102400)
+    -t types    service types (default UNRELIABLE,RELIABLE,FIFO,CAUSAL,
+                AGREED,SAFE)
+    -w widths   fan-out widths (default 1,4)
+    -j threads  numbers of sender threads (default 1,4)
+    -o file     write the results there instead of to stdout
+
+Unless -d is given, a daemon is started for the run on a loopback-only
+configuration in a temporary directory, and stopped afterwards.
+
+Every combination of operation, service type, payload size, fan-out
+width and thread count is one run.  For multicast(), the fan-out width
+is the number of receiving mailboxes that have joined the group; for
+multigroup_multicast(), it is the number of groups each message is sent
+to, with one receiving mailbox in each.  Each sender thread has its own
+mailbox and its own groups and receivers, each receiver its own thread,
+and all of them receive with receive().  A sender keeps at most a
+window of messages ahead of its first receiver, so the daemon is never
+flooded, and stops waiting once that receiver has given up.  The send
+time is carried in the first bytes of the payload, and latency is
+measured to when receive() returns it.
+
+The results are written as one JSON document:  the Python and Spread
+versions, the settings, and for each run the messages sent and
+received, the rates in messages per second, the messages lost (only
+UNRELIABLE_MESS may lose any), and the 50th, 99th and 99.9th percentile
+latencies in microseconds.
+"""
+
+from __future__ import print_function
+
+import getopt
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from sysconfig import get_platform
+
+
+def setup_path():
+    # Prefer the module just built in place; see testspread.py.
+    PLAT = get_platform()
+    DIRS = [os.path.join("build", "lib.%s-%d.%d" % ((PLAT,) +
+                                                   sys.version_info[:2])),
+            ]
+    if hasattr(sys, "implementation"):
+        DIRS.append(os.path.join("build", "lib.%s-%s" %
+                                 (PLAT, sys.implementation.cache_tag)))
+    for d in DIRS:
+        sys.path.insert(0, d)
+
+setup_path()
+
+import spread
+
+clock = getattr(time, "perf_counter", time.time)
+
+SERVICE_TYPES = ["UNRELIABLE", "RELIABLE", "FIFO", "CAUSAL", "AGREED",
+                 "SAFE"]
+OPERATIONS = ["multicast", "multigroup_multicast"]
+STAMP = struct.Struct("<d")     # the send time, at the front of a payload
+WINDOW = 64                     # messages a sender may be ahead
+IDLE = 2.0                      # seconds of silence that end a receiver
+
+CONFIG = """\
+Spread_Segment 127.0.0.255:%(port)d {
+    localhost 127.0.0.1
+}
+RuntimeDir = %(dir)s
+EventLogFile = %(dir)s/spread.log
+"""
+
+
+def start_daemon(binary, port):
+    """Start a daemon on a loopback-only configuration.
+
+    Return (daemon name, process, temporary directory).
+    """
+    tmp = tempfile.mkdtemp(prefix="benchspread")
+    conf = os.path.join(tmp, "spread.conf")
+    f = open(conf, "w")
+    f.write(CONFIG % {"port": port, "dir": tmp})
+    f.close()
+    log = open(os.path.join(tmp, "stdout.log"), "w")
+    try:
+        proc = subprocess.Popen([binary, "-n", "localhost", "-c", conf],
+                                stdout=log, stderr=subprocess.STDOUT)
+    except OSError as e:
+        shutil.rmtree(tmp, True)
+        raise SystemExit("could not run %s: %s (use -d to name a running "
+                         "daemon)" % (binary, e))
+    finally:
+        log.close()
+    daemon = "%d@localhost" % port
+    deadline = time.time() + 10
+    while True:
+        try:
+            spread.connect(daemon, "probe", 0, 0).disconnect()
+            return daemon, proc, tmp
+        except spread.error:
+            if proc.poll() is not None or time.time() > deadline:
+                stop_daemon(proc, tmp)
+                raise SystemExit("could not start %s" % binary)
+            time.sleep(0.1)
+
+
+def stop_daemon(proc, tmp):
+    if proc.poll() is None:
+        proc.terminate()
+        proc.wait()
+    shutil.rmtree(tmp, True)
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return None
+    i = min(len(sorted_values) - 1, int(p * len(sorted_values)))
+    return round(sorted_values[i] * 1e6, 1)
+
+
+class Counter:
+    """A connection and group name source unique across runs."""
+
+    def __init__(self):
+        self.n = 0
+        self.lock = threading.Lock()
+
+    def next(self, prefix):
+        self.lock.acquire()
+        self.n += 1
+        n = self.n
+        self.lock.release()
+        return "%s%d" % (prefix, n)
+
+names = Counter()
+
+
+class Window:
+    """The messages a sender may send ahead of its first receiver:  at
+    most WINDOW while that receiver runs, any number once it has stopped
+    (it may have given up on lost messages)."""
+
+    def __init__(self):
+        self.free = WINDOW
+        self.closed = False
+        self.cond = threading.Condition()
+
+    def take(self):
+        self.cond.acquire()
+        while self.free <= 0 and not self.closed:
+            self.cond.wait()
+        self.free -= 1
+        self.cond.release()
+
+    def give(self):
+        self.cond.acquire()
+        self.free += 1
+        self.cond.notify()
+        self.cond.release()
+
+    def close(self):
+        self.cond.acquire()
+        self.closed = True
+        self.cond.notify_all()
+        self.cond.release()
+
+
+def connect_receivers(daemon, groups, per_group):
+    """Connect per_group receivers to each group, and wait until each has
+    seen itself join."""
+    mboxes = []
+    for group in groups:
+        for i in range(per_group):
+            mbox = spread.connect(daemon, names.next("r"), 0, 1)
+            mbox.join(group)
+            while True:
+                msg = mbox.receive(10)
+                if msg is None:
+                    raise SystemExit("no membership message for %s" %
+                                     group)
+                if (isinstance(msg, spread.MembershipMsgType) and
+                        mbox.private_group in msg.members):
+                    break
+            mboxes.append(mbox)
+    return mboxes
+
+
+def receiver(mbox, count, latencies, window, result):
+    """Receive count messages (or until IDLE seconds pass without one),
+    noting each one's latency.  If window is a Window, let the sender go
+    on as each message arrives."""
+    got = 0
+    last = None
+    while got < count:
+        msg = mbox.receive(IDLE)
+        if msg is None:
+            break
+        now = clock()
+        if not isinstance(msg, spread.RegularMsgType):
+            continue
+        latencies.append(now - STAMP.unpack_from(msg.message)[0])
+        got += 1
+        last = now
+        if window is not None:
+            window.give()
+    if window is not None:
+        # Don't leave the sender waiting for messages that were lost.
+        window.close()
+    result.append((got, last))
+
+
+def sender(mbox, op, svc_type, target, count, size, window, result):
+    pad = b"x" * max(0, size - STAMP.size)
+    send = getattr(mbox, op)
+    first = clock()
+    for i in range(count):
+        window.take()
+        send(svc_type, target, STAMP.pack(clock()) + pad)
+    result.append((first, clock()))
+
+
+def run(daemon, op, svc_name, size, width, threads, count):
+    svc_type = getattr(spread, svc_name + "_MESS")
+    senders, receivers, sent, received, latencies = [], [], [], [], []
+    mboxes = []
+    for t in range(threads):
+        if op == "multicast":
+            groups = [names.next("g")]
+            target = groups[0]
+            rboxes = connect_receivers(daemon, groups, width)
+        else:
+            groups = [names.next("g") for i in range(width)]
+            target = tuple(groups)
+            rboxes = connect_receivers(daemon, groups, 1)
+        smbox = spread.connect(daemon, names.next("s"), 0, 0)
+        mboxes += rboxes + [smbox]
+        window = Window()
+        for i, rbox in enumerate(rboxes):
+            lat = []
+            latencies.append(lat)
+            receivers.append(threading.Thread(
+                target=receiver,
+                args=(rbox, count, lat, i == 0 and window or None,
+                      received)))
+        senders.append(threading.Thread(
+            target=sender,
+            args=(smbox, op, svc_type, target, count, size, window, sent)))
+    for th in receivers + senders:
+        th.start()
+    for th in senders + receivers:
+        th.join()
+    for mbox in mboxes:
+        mbox.disconnect()
+
+    start = min(first for first, end in sent)
+    send_end = max(end for first, end in sent)
+    got = sum(n for n, last in received)
+    ends = [last for n, last in received if last is not None]
+    all_latencies = sorted(x for lat in latencies for x in lat)
+    expected = count * threads * width
+    return {
+        "op": op,
+        "service_type": svc_name + "_MESS",
+        "size": size,
+        "width": width,
+        "threads": threads,
+        "sent": count * threads,
+        "received": got,
+        "lost": expected - got,
+        "sent_per_sec": round(count * threads / (send_end - start), 1),
+        "received_per_sec": (ends and
+                             round(got / (max(ends) - start), 1) or 0.0),
+        "p50_us": percentile(all_latencies, 0.50),
+        "p99_us": percentile(all_latencies, 0.99),
+        "p999_us": percentile(all_latencies, 0.999),
+    }
+
+
+def int_list(arg):
+    return [int(x) for x in arg.split(",")]
+
+
+def main():
+    daemon = None
+    binary = "spread"
+    port = 24803
+    count = 2000
+    sizes = [64, 1024, 16384, 102400]
+    svc_names = SERVICE_TYPES
+    widths = [1, 4]
+    thread_counts = [1, 4]
+    output = None
+    try:
+        opts, args = getopt.getopt(sys.argv[1:], "d:S:p:n:s:t:w:j:o:")
+        for o, a in opts:
+            if o == "-d":
+                daemon = a
+            elif o == "-S":
+                binary = a
+            elif o == "-p":
+                port = int(a)
+            elif o == "-n":
+                count = int(a)
+            elif o == "-s":
+                sizes = int_list(a)
+            elif o == "-t":
+                svc_names = [x.upper().replace("_MESS", "")
+                             for x in a.split(",")]
+                for x in svc_names:
+                    if x not in SERVICE_TYPES:
+                        raise ValueError("unknown service type: " + x)
+            elif o == "-w":
+                widths = int_list(a)
+            elif o == "-j":
+                thread_counts = int_list(a)
+            elif o == "-o":
+                output = a
+    except (getopt.error, ValueError) as e:
+        print(e, file=sys.stderr)
+        print(__doc__, file=sys.stderr)
+        sys.exit(2)
+
+    proc = tmp = None
+    if daemon is None:
+        daemon, proc, tmp = start_daemon(binary, port)
+    try:
+        results = []
+        for op in OPERATIONS:
+            for svc_name in svc_names:
+                for size in sizes:
+                    for width in widths:
+                        for threads in thread_counts:
+                            r = run(daemon, op, svc_name, size, width,
+                                    threads, count)
+                            print("%(op)s %(service_type)s size=%(size)d "
+                                  "width=%(width)d threads=%(threads)d: "
+                                  "%(received_per_sec).0f msgs/s, "
+                                  "p99 %(p99_us)s us" % r,
+                                  file=sys.stderr)
+                            results.append(r)
+    finally:
+        if proc is not None:
+            stop_daemon(proc, tmp)
+
+    report = {
+        "python": "%d.%d.%d" % sys.version_info[:3],
+        "spread": "%d.%d.%d" % spread.version(),
+        "daemon": daemon,
+        "count": count,
+        "window": WINDOW,
+        "results": results,
+    }
+    if output is None:
+        json.dump(report, sys.stdout, indent=1, sort_keys=True)
+        print()
+    else:
+        f = open(output, "w")
+        json.dump(report, f, indent=1, sort_keys=True)
+        f.write("\n")
+        f.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,986 @@
+/* Copyright (c) 2013 Gyepi Sam.
+
+   This code is released under the standard PSF license.
+   See the file LICENSE.
+*/
+
+/* In-process stand-in for the Spread client library.
+
+   Every session lives in this process:  SP_connect() creates a session
+   with an in-memory message queue, and the group table is shared by all
+   sessions, so the Spread semantics the wrapper depends on can be
+   exercised without a daemon.  What is emulated:
+
+   - private group names ("#name#fakespread"), REJECT_NOT_UNIQUE and the
+     other connect-time name checks;
+   - join/leave/disconnect membership messages, self-leave messages, and
+     a membership body that SP_get_memb_info() and
+     SP_get_vs_set_members() decode;
+   - SP_multicast()/SP_multigroup_multicast() and their scatter forms,
+     SELF_DISCARD, delivery to private groups, MESSAGE_TOO_LONG;
+   - SP_receive()'s BUFFER_TOO_SHORT/GROUPS_TOO_SHORT protocol:  the
+     message stays queued and the required size is returned negated in
+     *endian_mismatch or *num_groups;
+   - a real file descriptor per mailbox that is readable exactly when a
+     message is queued, so select()/poll() on fileno() work, and that
+     reports POLLHUP once the session is gone.
+
+   What is not:  ordering guarantees are trivially met (delivery is
+   synchronous), there is no network, and DROP_RECV truncates instead of
+   following Spread's backward compatible rules.
+
+   Two extra entry points script events a daemon would originate:
+   SPfake_membership_event() installs an arbitrary view (e.g. a network
+   partition or merge, possibly naming members that have no local
+   session) and SPfake_kill_session() drops a client, now or, with
+   SPfake_kill_session_after(), once it has multicast a few more
+   messages.
+
+   Setting FAKESPREAD_CONNECT_DELAY_US in the environment makes every
+   SP_connect() sleep that long, to stand in for the daemon round trip.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sp.h"
+
+#define MAX_SESSIONS		1024
+#define MAX_MESSAGE_BODY_LEN	144000
+#define HEADER_OVERHEAD		48
+#define PROC_NAME		"fakespread"
+
+typedef struct fake_msg {
+	struct fake_msg *next;
+	service svc_type;
+	char sender[MAX_GROUP_NAME];
+	int num_groups;
+	char (*groups)[MAX_GROUP_NAME];
+	int16 mess_type;
+	int len;
+	char *body;
+} fake_msg;
+
+typedef struct {
+	int used;
+	mailbox mbox;		/* read end of the wakeup pipe */
+	int wfd;		/* write end; holds one byte iff head != NULL */
+	int membership;
+	char private_group[MAX_GROUP_NAME];
+	fake_msg *head, *tail;
+	int queued_bytes;
+	int kill_after;		/* multicasts left before it is dropped */
+} session;
+
+typedef struct fake_group {
+	struct fake_group *next;
+	char name[MAX_GROUP_NAME];
+	int num_members;
+	int max_members;
+	char (*members)[MAX_GROUP_NAME];
+	group_id gid;
+} fake_group;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static session sessions[MAX_SESSIONS];
+static fake_group *groups_head;
+static int32 view_counter;
+static int name_counter;
+
+/* Membership message body:  group_id, int32 number of vs sets (0 or 1),
+   then for a vs set an int32 member count and that many names. */
+#define MEMB_VS_COUNT_OFFSET	((int)sizeof(group_id))
+#define MEMB_VS_OFFSET		(MEMB_VS_COUNT_OFFSET + (int)sizeof(int32))
+#define MEMB_NAMES_OFFSET	(MEMB_VS_OFFSET + (int)sizeof(int32))
+
+static session *
+find_session(mailbox mbox)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+		if (sessions[i].used && sessions[i].mbox == mbox)
+			return &sessions[i];
+	return NULL;
+}
+
+static session *
+find_private(const char *name)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+		if (sessions[i].used &&
+		    strcmp(sessions[i].private_group, name) == 0)
+			return &sessions[i];
+	return NULL;
+}
+
+static fake_group *
+find_group(const char *name)
+{
+	fake_group *g;
+
+	for (g = groups_head; g != NULL; g = g->next)
+		if (strcmp(g->name, name) == 0)
+			return g;
+	return NULL;
+}
+
+static int
+group_index(fake_group *g, const char *member)
+{
+	int i;
+
+	for (i = 0; i < g->num_members; i++)
+		if (strcmp(g->members[i], member) == 0)
+			return i;
+	return -1;
+}
+
+static int
+valid_group_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 0 && len < MAX_GROUP_NAME;
+}
+
+/* Copy a name into a MAX_GROUP_NAME buffer, cut short if need be, and
+   always NUL-terminated. */
+static void
+copy_name(char *dst, const char *src)
+{
+	size_t len = strlen(src);
+
+	if (len >= MAX_GROUP_NAME)
+		len = MAX_GROUP_NAME - 1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+static void
+free_msg(fake_msg *m)
+{
+	free(m->groups);
+	free(m->body);
+	free(m);
+}
+
+static fake_msg *
+new_msg(service svc_type, const char *sender, int num_groups,
+	const char (*groups)[MAX_GROUP_NAME], int16 mess_type,
+	int len, const char *body)
+{
+	fake_msg *m = calloc(1, sizeof(fake_msg));
+
+	if (m == NULL)
+		return NULL;
+	m->svc_type = svc_type;
+	copy_name(m->sender, sender);
+	m->num_groups = num_groups;
+	m->groups = malloc(MAX_GROUP_NAME * (num_groups ? num_groups : 1));
+	m->body = malloc(len ? len : 1);
+	if (m->groups == NULL || m->body == NULL) {
+		free_msg(m);
+		return NULL;
+	}
+	if (num_groups)
+		memcpy(m->groups, groups, MAX_GROUP_NAME * num_groups);
+	if (len)
+		memcpy(m->body, body, len);
+	m->mess_type = mess_type;
+	m->len = len;
+	return m;
+}
+
+static int
+msg_bytes(fake_msg *m)
+{
+	return HEADER_OVERHEAD + m->num_groups * MAX_GROUP_NAME + m->len;
+}
+
+/* Queue m on s; the caller holds the lock. */
+static void
+enqueue(session *s, fake_msg *m)
+{
+	char c = 0;
+
+	if (s->head == NULL) {
+		s->head = m;
+		if (write(s->wfd, &c, 1) != 1)
+			perror("fakespread: write");
+	}
+	else
+		s->tail->next = m;
+	s->tail = m;
+	s->queued_bytes += msg_bytes(m);
+}
+
+static void
+dequeue(session *s)
+{
+	fake_msg *m = s->head;
+	char c;
+
+	s->head = m->next;
+	if (s->head == NULL) {
+		s->tail = NULL;
+		if (read(s->mbox, &c, 1) != 1)
+			perror("fakespread: read");
+	}
+	s->queued_bytes -= msg_bytes(m);
+	free_msg(m);
+}
+
+static void
+deliver_copy(session *s, service svc_type, const char *sender,
+	     int num_groups, const char (*groups)[MAX_GROUP_NAME],
+	     int16 mess_type, int len, const char *body)
+{
+	fake_msg *m = new_msg(svc_type, sender, num_groups, groups,
+			      mess_type, len, body);
+
+	if (m != NULL)
+		enqueue(s, m);
+}
+
+static void
+new_view(fake_group *g)
+{
+	g->gid.id[0] = 0x7f000001;
+	g->gid.id[1] = ++view_counter;
+	g->gid.id[2] = 0;
+}
+
+/* Send the current view of g to every local member that asked for
+   membership messages.  'vs' names the members reported in the vs set. */
+static void
+send_view(fake_group *g, service reason, int num_vs,
+	  const char (*vs)[MAX_GROUP_NAME])
+{
+	int i, len;
+	char *body;
+	int32 n = 1, count = num_vs;
+
+	len = MEMB_NAMES_OFFSET + num_vs * MAX_GROUP_NAME;
+	body = malloc(len);
+	if (body == NULL)
+		return;
+	memcpy(body, &g->gid, sizeof(group_id));
+	memcpy(body + MEMB_VS_COUNT_OFFSET, &n, sizeof(int32));
+	memcpy(body + MEMB_VS_OFFSET, &count, sizeof(int32));
+	if (num_vs)
+		memcpy(body + MEMB_NAMES_OFFSET, vs, num_vs * MAX_GROUP_NAME);
+	for (i = 0; i < g->num_members; i++) {
+		session *s = find_private(g->members[i]);
+
+		if (s != NULL && s->membership)
+			deliver_copy(s, REG_MEMB_MESS | reason, g->name,
+				     g->num_members,
+				     (const char (*)[MAX_GROUP_NAME])g->members,
+				     0, len, body);
+	}
+	free(body);
+}
+
+static void
+send_self_leave(session *s, fake_group *g)
+{
+	char body[MEMB_NAMES_OFFSET];
+	int32 zero = 0;
+
+	if (!s->membership)
+		return;
+	memcpy(body, &g->gid, sizeof(group_id));
+	memcpy(body + MEMB_VS_COUNT_OFFSET, &zero, sizeof(int32));
+	memcpy(body + MEMB_VS_OFFSET, &zero, sizeof(int32));
+	deliver_copy(s, CAUSED_BY_LEAVE, g->name, 0, NULL, 0,
+		     MEMB_VS_OFFSET, body);
+}
+
+static int
+add_member(fake_group *g, const char *member)
+{
+	if (g->num_members == g->max_members) {
+		int n = g->max_members ? 2 * g->max_members : 8;
+		char (*p)[MAX_GROUP_NAME] = realloc(g->members,
+						    n * MAX_GROUP_NAME);
+		if (p == NULL)
+			return -1;
+		g->members = p;
+		g->max_members = n;
+	}
+	memset(g->members[g->num_members], 0, MAX_GROUP_NAME);
+	copy_name(g->members[g->num_members], member);
+	g->num_members++;
+	return 0;
+}
+
+static void
+remove_member(fake_group *g, int i)
+{
+	memmove(g->members[i], g->members[i + 1],
+		(g->num_members - i - 1) * MAX_GROUP_NAME);
+	g->num_members--;
+}
+
+static void
+drop_empty_groups(void)
+{
+	fake_group **pg = &groups_head;
+
+	while (*pg != NULL) {
+		fake_group *g = *pg;
+
+		if (g->num_members == 0) {
+			*pg = g->next;
+			free(g->members);
+			free(g);
+		}
+		else
+			pg = &g->next;
+	}
+}
+
+/* Remove s from every group it belongs to, telling the remaining
+   members why; the caller holds the lock. */
+static void
+leave_all(session *s, service reason)
+{
+	fake_group *g;
+	char vs[1][MAX_GROUP_NAME];
+
+	memcpy(vs[0], s->private_group, MAX_GROUP_NAME);
+	for (g = groups_head; g != NULL; g = g->next) {
+		int i = group_index(g, s->private_group);
+
+		if (i < 0)
+			continue;
+		remove_member(g, i);
+		new_view(g);
+		send_view(g, reason, 1, (const char (*)[MAX_GROUP_NAME])vs);
+	}
+	drop_empty_groups();
+}
+
+static void
+close_session(session *s)
+{
+	while (s->head != NULL)
+		dequeue(s);
+	/* Closing the write end first wakes any thread polling the read
+	   end with POLLHUP. */
+	close(s->wfd);
+	close(s->mbox);
+	s->used = 0;
+}
+
+int
+SP_version(int *major_version, int *minor_version, int *patch_version)
+{
+	*major_version = SP_MAJOR_VERSION;
+	*minor_version = SP_MINOR_VERSION;
+	*patch_version = SP_PATCH_VERSION;
+	return 1;
+}
+
+static int
+valid_daemon(const char *spread_name)
+{
+	const char *p = spread_name;
+
+	if (*p < '0' || *p > '9')
+		return 0;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '\0')
+		return 1;
+	return *p == '@' && p[1] != '\0' && strchr(p + 1, ' ') == NULL;
+}
+
+int
+SP_connect(const char *spread_name, const char *private_name,
+	   int priority, int group_membership, mailbox *mbox,
+	   char *private_group)
+{
+	char name[MAX_GROUP_NAME];
+	const char *delay;
+	session *s = NULL;
+	int fds[2];
+	int i;
+
+	(void)priority;
+	delay = getenv("FAKESPREAD_CONNECT_DELAY_US");
+	if (delay != NULL)
+		usleep(atoi(delay));
+	if (spread_name == NULL || !valid_daemon(spread_name))
+		return ILLEGAL_SPREAD;
+	if (private_name == NULL)
+		private_name = "";
+	if (strlen(private_name) > MAX_PRIVATE_NAME ||
+	    strpbrk(private_name, "# ") != NULL)
+		return REJECT_ILLEGAL_NAME;
+
+	pthread_mutex_lock(&lock);
+	if (*private_name)
+		snprintf(name, sizeof(name), "#%s#%s", private_name,
+			 PROC_NAME);
+	else
+		snprintf(name, sizeof(name), "#u%d#%s", ++name_counter,
+			 PROC_NAME);
+	if (find_private(name) != NULL) {
+		pthread_mutex_unlock(&lock);
+		return REJECT_NOT_UNIQUE;
+	}
+	for (i = 0; i < MAX_SESSIONS; i++)
+		if (!sessions[i].used) {
+			s = &sessions[i];
+			break;
+		}
+	if (s == NULL || pipe(fds) < 0) {
+		pthread_mutex_unlock(&lock);
+		return REJECT_QUOTA;
+	}
+	memset(s, 0, sizeof(session));
+	s->used = 1;
+	s->mbox = fds[0];
+	s->wfd = fds[1];
+	s->membership = group_membership;
+	strcpy(s->private_group, name);
+	pthread_mutex_unlock(&lock);
+
+	*mbox = s->mbox;
+	strcpy(private_group, name);
+	return ACCEPT_SESSION;
+}
+
+int
+SP_disconnect(mailbox mbox)
+{
+	session *s;
+
+	pthread_mutex_lock(&lock);
+	s = find_session(mbox);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	leave_all(s, CAUSED_BY_DISCONNECT);
+	close_session(s);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int
+SP_join(mailbox mbox, const char *group)
+{
+	session *s;
+	fake_group *g;
+	char vs[1][MAX_GROUP_NAME];
+
+	if (!valid_group_name(group) || group[0] == '#')
+		return ILLEGAL_GROUP;
+	pthread_mutex_lock(&lock);
+	s = find_session(mbox);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	g = find_group(group);
+	if (g == NULL) {
+		g = calloc(1, sizeof(fake_group));
+		if (g == NULL) {
+			pthread_mutex_unlock(&lock);
+			return ILLEGAL_GROUP;
+		}
+		strcpy(g->name, group);
+		g->next = groups_head;
+		groups_head = g;
+	}
+	if (group_index(g, s->private_group) < 0) {
+		if (add_member(g, s->private_group) < 0) {
+			pthread_mutex_unlock(&lock);
+			return ILLEGAL_GROUP;
+		}
+		new_view(g);
+		memset(vs, 0, sizeof(vs));
+		strcpy(vs[0], s->private_group);
+		send_view(g, CAUSED_BY_JOIN, 1,
+			  (const char (*)[MAX_GROUP_NAME])vs);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int
+SP_leave(mailbox mbox, const char *group)
+{
+	session *s;
+	fake_group *g;
+	int i;
+	char vs[1][MAX_GROUP_NAME];
+
+	if (!valid_group_name(group) || group[0] == '#')
+		return ILLEGAL_GROUP;
+	pthread_mutex_lock(&lock);
+	s = find_session(mbox);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	g = find_group(group);
+	if (g != NULL && (i = group_index(g, s->private_group)) >= 0) {
+		remove_member(g, i);
+		new_view(g);
+		send_self_leave(s, g);
+		memset(vs, 0, sizeof(vs));
+		strcpy(vs[0], s->private_group);
+		send_view(g, CAUSED_BY_LEAVE, 1,
+			  (const char (*)[MAX_GROUP_NAME])vs);
+		drop_empty_groups();
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static int
+add_recipient(session **rcpt, int n, session *s)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (rcpt[i] == s)
+			return n;
+	rcpt[n] = s;
+	return n + 1;
+}
+
+static int
+multicast(mailbox mbox, service service_type, int num_groups,
+	  const char groups[][MAX_GROUP_NAME], int16 mess_type,
+	  int mess_len, const char *mess)
+{
+	static session *rcpt[MAX_SESSIONS];
+	session *sender;
+	int i, j, n = 0;
+	service svc = service_type & ~SELF_DISCARD;
+
+	if (svc == 0 || (svc & ~REGULAR_MESS) != 0 || (svc & (svc - 1)) != 0)
+		return ILLEGAL_SERVICE;
+	if (num_groups <= 0)
+		return ILLEGAL_GROUP;
+	if (mess_len < 0)
+		return ILLEGAL_MESSAGE;
+	if (mess_len + num_groups * MAX_GROUP_NAME > MAX_MESSAGE_BODY_LEN)
+		return MESSAGE_TOO_LONG;
+	for (i = 0; i < num_groups; i++)
+		if (memchr(groups[i], '\0', MAX_GROUP_NAME) == NULL ||
+		    !valid_group_name(groups[i]))
+			return ILLEGAL_GROUP;
+
+	pthread_mutex_lock(&lock);
+	sender = find_session(mbox);
+	if (sender == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	for (i = 0; i < num_groups; i++) {
+		if (groups[i][0] == '#') {
+			session *s = find_private(groups[i]);
+
+			if (s != NULL)
+				n = add_recipient(rcpt, n, s);
+			continue;
+		}
+		else {
+			fake_group *g = find_group(groups[i]);
+
+			if (g == NULL)
+				continue;
+			for (j = 0; j < g->num_members; j++) {
+				session *s = find_private(g->members[j]);
+
+				if (s != NULL)
+					n = add_recipient(rcpt, n, s);
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (rcpt[i] == sender && Is_self_discard(service_type))
+			continue;
+		deliver_copy(rcpt[i], svc, sender->private_group,
+			     num_groups, groups, mess_type, mess_len, mess);
+	}
+	if (sender->kill_after > 0 && --sender->kill_after == 0) {
+		leave_all(sender, CAUSED_BY_DISCONNECT);
+		close_session(sender);
+	}
+	pthread_mutex_unlock(&lock);
+	return mess_len;
+}
+
+int
+SP_multicast(mailbox mbox, service service_type, const char *group,
+	     int16 mess_type, int mess_len, const char *mess)
+{
+	char groups[1][MAX_GROUP_NAME];
+
+	if (strlen(group) >= MAX_GROUP_NAME)
+		return ILLEGAL_GROUP;
+	memset(groups, 0, sizeof(groups));
+	strcpy(groups[0], group);
+	return multicast(mbox, service_type, 1,
+			 (const char (*)[MAX_GROUP_NAME])groups,
+			 mess_type, mess_len, mess);
+}
+
+int
+SP_multigroup_multicast(mailbox mbox, service service_type, int num_groups,
+			const char groups[][MAX_GROUP_NAME],
+			int16 mess_type, int mess_len, const char *mess)
+{
+	return multicast(mbox, service_type, num_groups, groups,
+			 mess_type, mess_len, mess);
+}
+
+/* Flatten a scatter into one malloc'ed buffer. */
+static char *
+gather(const scatter *scat_mess, int *len)
+{
+	int i, n = 0;
+	char *buf, *p;
+
+	if (scat_mess->num_elements < 0 ||
+	    scat_mess->num_elements > MAX_CLIENT_SCATTER_ELEMENTS)
+		return NULL;
+	for (i = 0; i < scat_mess->num_elements; i++)
+		n += scat_mess->elements[i].len;
+	buf = p = malloc(n ? n : 1);
+	if (buf == NULL)
+		return NULL;
+	for (i = 0; i < scat_mess->num_elements; i++) {
+		memcpy(p, scat_mess->elements[i].buf,
+		       scat_mess->elements[i].len);
+		p += scat_mess->elements[i].len;
+	}
+	*len = n;
+	return buf;
+}
+
+int
+SP_scat_multicast(mailbox mbox, service service_type, const char *group,
+		  int16 mess_type, const scatter *scat_mess)
+{
+	int len, ret;
+	char *buf = gather(scat_mess, &len);
+
+	if (buf == NULL)
+		return ILLEGAL_MESSAGE;
+	ret = SP_multicast(mbox, service_type, group, mess_type, len, buf);
+	free(buf);
+	return ret;
+}
+
+int
+SP_multigroup_scat_multicast(mailbox mbox, service service_type,
+			     int num_groups,
+			     const char groups[][MAX_GROUP_NAME],
+			     int16 mess_type, const scatter *scat_mess)
+{
+	int len, ret;
+	char *buf = gather(scat_mess, &len);
+
+	if (buf == NULL)
+		return ILLEGAL_MESSAGE;
+	ret = multicast(mbox, service_type, num_groups, groups, mess_type,
+			len, buf);
+	free(buf);
+	return ret;
+}
+
+int
+SP_receive(mailbox mbox, service *service_type,
+	   char sender[MAX_GROUP_NAME], int max_groups, int *num_groups,
+	   char groups[][MAX_GROUP_NAME], int16 *mess_type,
+	   int *endian_mismatch, int max_mess_len, char *mess)
+{
+	int drop = Is_drop_recv(*service_type);
+
+	for (;;) {
+		session *s;
+		fake_msg *m;
+		struct pollfd pfd;
+		int ret, n;
+
+		pthread_mutex_lock(&lock);
+		s = find_session(mbox);
+		if (s == NULL) {
+			pthread_mutex_unlock(&lock);
+			return CONNECTION_CLOSED;
+		}
+		m = s->head;
+		if (m == NULL) {
+			pthread_mutex_unlock(&lock);
+			pfd.fd = mbox;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				return CONNECTION_CLOSED;
+			if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+				return CONNECTION_CLOSED;
+			continue;
+		}
+
+		*service_type = m->svc_type;
+		strcpy(sender, m->sender);
+		*mess_type = m->mess_type;
+		if (m->num_groups > max_groups && !drop) {
+			*num_groups = -m->num_groups;
+			*endian_mismatch = m->len > max_mess_len ? -m->len : 0;
+			pthread_mutex_unlock(&lock);
+			return GROUPS_TOO_SHORT;
+		}
+		if (m->len > max_mess_len && !drop) {
+			*num_groups = m->num_groups;
+			*endian_mismatch = -m->len;
+			pthread_mutex_unlock(&lock);
+			return BUFFER_TOO_SHORT;
+		}
+		n = m->num_groups < max_groups ? m->num_groups : max_groups;
+		if (n > 0)
+			memcpy(groups, m->groups, n * MAX_GROUP_NAME);
+		*num_groups = n;
+		*endian_mismatch = 0;
+		ret = m->len < max_mess_len ? m->len : max_mess_len;
+		if (ret > 0)
+			memcpy(mess, m->body, ret);
+		if (ret < m->len)
+			ret = BUFFER_TOO_SHORT;
+		else if (n < m->num_groups)
+			ret = GROUPS_TOO_SHORT;
+		dequeue(s);
+		pthread_mutex_unlock(&lock);
+		return ret;
+	}
+}
+
+int
+SP_scat_receive(mailbox mbox, service *service_type,
+		char sender[MAX_GROUP_NAME], int max_groups,
+		int *num_groups, char groups[][MAX_GROUP_NAME],
+		int16 *mess_type, int *endian_mismatch, scatter *scat_mess)
+{
+	int i, len = 0, ret, off;
+	char *buf;
+
+	for (i = 0; i < scat_mess->num_elements; i++)
+		len += scat_mess->elements[i].len;
+	buf = malloc(len ? len : 1);
+	if (buf == NULL)
+		return ILLEGAL_MESSAGE;
+	ret = SP_receive(mbox, service_type, sender, max_groups, num_groups,
+			 groups, mess_type, endian_mismatch, len, buf);
+	for (i = 0, off = 0; ret > 0 && off < ret; i++) {
+		int n = scat_mess->elements[i].len;
+
+		if (n > ret - off)
+			n = ret - off;
+		memcpy(scat_mess->elements[i].buf, buf + off, n);
+		off += n;
+	}
+	free(buf);
+	return ret;
+}
+
+int
+SP_poll(mailbox mbox)
+{
+	session *s;
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	s = find_session(mbox);
+	ret = s == NULL ? ILLEGAL_SESSION : s->queued_bytes;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int
+SP_equal_group_ids(group_id g1, group_id g2)
+{
+	return g1.id[0] == g2.id[0] && g1.id[1] == g2.id[1] &&
+	       g1.id[2] == g2.id[2];
+}
+
+int
+SP_get_memb_info(const char *memb_mess, const service service_type,
+		 membership_info *memb_info)
+{
+	int32 num_vs_sets, num_members;
+
+	if (!Is_membership_mess(service_type))
+		return ILLEGAL_MESSAGE;
+	memcpy(&memb_info->gid, memb_mess, sizeof(group_id));
+	memcpy(&num_vs_sets, memb_mess + MEMB_VS_COUNT_OFFSET, sizeof(int32));
+	memset(memb_info->changed_member, 0, MAX_GROUP_NAME);
+	memb_info->num_vs_sets = num_vs_sets;
+	memb_info->my_vs_set.num_members = 0;
+	memb_info->my_vs_set.members_offset = MEMB_NAMES_OFFSET;
+	if (num_vs_sets == 0)
+		return 1;
+	memcpy(&num_members, memb_mess + MEMB_VS_OFFSET, sizeof(int32));
+	memb_info->my_vs_set.num_members = num_members;
+	if (Is_reg_memb_mess(service_type) && num_members > 0 &&
+	    (Is_caused_join_mess(service_type) ||
+	     Is_caused_leave_mess(service_type) ||
+	     Is_caused_disconnect_mess(service_type)))
+		memcpy(memb_info->changed_member,
+		       memb_mess + MEMB_NAMES_OFFSET, MAX_GROUP_NAME);
+	return 1;
+}
+
+int
+SP_get_vs_sets_info(const char *memb_mess, vs_set_info *vs_sets,
+		    int num_vs_sets, unsigned int *my_vs_set_index)
+{
+	int32 n, num_members;
+
+	memcpy(&n, memb_mess + MEMB_VS_COUNT_OFFSET, sizeof(int32));
+	if (n > num_vs_sets)
+		return BUFFER_TOO_SHORT;
+	if (n > 0) {
+		memcpy(&num_members, memb_mess + MEMB_VS_OFFSET,
+		       sizeof(int32));
+		vs_sets[0].num_members = num_members;
+		vs_sets[0].members_offset = MEMB_NAMES_OFFSET;
+	}
+	*my_vs_set_index = 0;
+	return n;
+}
+
+int
+SP_get_vs_set_members(const char *memb_mess, const vs_set_info *vs_set,
+		      char member_names[][MAX_GROUP_NAME],
+		      unsigned int member_names_count)
+{
+	if (member_names_count < vs_set->num_members)
+		return BUFFER_TOO_SHORT;
+	memcpy(member_names, memb_mess + vs_set->members_offset,
+	       vs_set->num_members * MAX_GROUP_NAME);
+	return vs_set->num_members;
+}
+
+void
+SP_error(int error)
+{
+	printf("fakespread: error %d\n", error);
+}
+
+int
+SPfake_membership_event(const char *group, int reason, int num_members,
+			const char members[][MAX_GROUP_NAME])
+{
+	fake_group *g;
+	char (*vs)[MAX_GROUP_NAME];
+	int i, num_vs = 0;
+
+	if (!valid_group_name(group) || group[0] == '#' || num_members < 0)
+		return ILLEGAL_GROUP;
+	pthread_mutex_lock(&lock);
+	g = find_group(group);
+	if (g == NULL) {
+		g = calloc(1, sizeof(fake_group));
+		if (g == NULL) {
+			pthread_mutex_unlock(&lock);
+			return ILLEGAL_GROUP;
+		}
+		strcpy(g->name, group);
+		g->next = groups_head;
+		groups_head = g;
+	}
+	vs = malloc(MAX_GROUP_NAME * (g->num_members + num_members + 1));
+	if (vs == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_GROUP;
+	}
+	/* For a network event the vs set is the members that survive from
+	   the previous view; otherwise it is whoever changed. */
+	for (i = 0; i < g->num_members; i++) {
+		int j, kept = 0;
+
+		for (j = 0; j < num_members; j++)
+			if (strncmp(g->members[i], members[j],
+				    MAX_GROUP_NAME) == 0)
+				kept = 1;
+		if (kept == (reason == CAUSED_BY_NETWORK))
+			memcpy(vs[num_vs++], g->members[i], MAX_GROUP_NAME);
+	}
+	for (i = 0; i < num_members; i++)
+		if (group_index(g, members[i]) < 0 &&
+		    reason != CAUSED_BY_NETWORK)
+			memcpy(vs[num_vs++], members[i], MAX_GROUP_NAME);
+	/* Members dropped from the view that have a local session are out
+	   of the group, and are told so as if they had left it. */
+	for (i = 0; i < g->num_members; i++) {
+		session *s;
+		int j, kept = 0;
+
+		for (j = 0; j < num_members && !kept; j++)
+			kept = strncmp(g->members[i], members[j],
+				       MAX_GROUP_NAME) == 0;
+		if (!kept && (s = find_private(g->members[i])) != NULL)
+			send_self_leave(s, g);
+	}
+	g->num_members = 0;
+	for (i = 0; i < num_members; i++)
+		if (add_member(g, members[i]) < 0)
+			break;
+	new_view(g);
+	send_view(g, reason, num_vs, (const char (*)[MAX_GROUP_NAME])vs);
+	free(vs);
+	drop_empty_groups();
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int
+SPfake_kill_session(const char *private_group)
+{
+	session *s;
+
+	pthread_mutex_lock(&lock);
+	s = find_private(private_group);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	leave_all(s, CAUSED_BY_DISCONNECT);
+	close_session(s);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+int
+SPfake_kill_session_after(const char *private_group, int num_msgs)
+{
+	session *s;
+
+	if (num_msgs <= 0)
+		return SPfake_kill_session(private_group);
+	pthread_mutex_lock(&lock);
+	s = find_private(private_group);
+	if (s == NULL) {
+		pthread_mutex_unlock(&lock);
+		return ILLEGAL_SESSION;
+	}
+	s->kill_after = num_msgs;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
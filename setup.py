@@ -2,9 +2,8 @@
 """ SpreadModule:  Python wrapper for Spread client libraries
 
 This package contains a simple Python wrapper module for the Spread
-toolkit.  The wrapper is known to be compatible with Python 2.3, 2.4,
-2.6 and 2.7.
-It may work with earlier Pythons, but this has not been tested.
+toolkit.  The wrapper is known to be compatible with Python 2.6, 2.7
+and 3.6 through 3.13.
 
 Spread (www.spread.org) is a group communications package.  You'll
 need to download and install it separately.  The Python API has been
@@ -30,26 +29,34 @@ Development Status :: 5 - Production/Stable
 Intended Audience :: Developers
 License :: OSI Approved :: Python Software Foundation License
 Programming Language :: Python
+Programming Language :: Python :: 2
+Programming Language :: Python :: 3
+Programming Language :: Python :: Free Threading :: 2 - Beta
 Topic :: System :: Distributed Computing
 Topic :: Software Development :: Libraries :: Python Modules
 Operating System :: Microsoft :: Windows
 Operating System :: Unix
 """
 
-import sys
 import os
-from distutils.core import setup, Extension
-
-if sys.version_info < (2, 3):
-    _setup = setup
-    def setup(**kwargs):
-        if kwargs.has_key("classifiers"):
-            del kwargs["classifiers"]
-        _setup(**kwargs)
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
 
 doclines = __doc__.split('\n')
 
-if os.name == 'nt':
+if os.environ.get('SPREAD_FAKE'):
+    # Build against the in-process stand-in for the Spread client library
+    # in fakespread/ instead of the real one, for testing and measuring
+    # the wrapper without a daemon ("make fake").  POSIX only.
+    ext = Extension('spread', ['spreadmodule.c', 'fakespread/fakespread.c'],
+                include_dirs = ['fakespread'],
+                libraries = ['pthread', 'z'],
+                define_macros = [('HAVE_ZLIB', None)],
+                depends = ['fakespread/sp.h'],
+                )
+elif os.name == 'nt':
     # The directory into which Tim unpacks the Spread bin tarball on Windows.
     SPREAD_DIR = r"\spread-bin-3.17.3"
     ext = Extension('spread', ['spreadmodule.c'],
@@ -64,10 +71,20 @@ if os.name == 'nt':
                 )
 else:
     SPREAD_DIR = "/usr/local"
+    # multicast(compress=...) can use zlib, which is everywhere, and lz4
+    # if its header can be found.
+    libraries = ['tspread-core', 'z']
+    macros = [('HAVE_ZLIB', None)]
+    for d in (SPREAD_DIR + "/include", "/usr/include"):
+        if os.path.exists(os.path.join(d, "lz4.h")):
+            libraries.append('lz4')
+            macros.append(('HAVE_LZ4', None))
+            break
     ext = Extension('spread', ['spreadmodule.c'],
                 include_dirs = [SPREAD_DIR + "/include"],
                 library_dirs = [SPREAD_DIR + "/lib"],
-                libraries = ['tspread-core'],
+                libraries = libraries,
+                define_macros = macros,
                 )
 
 setup(name = "SpreadModule",
@@ -79,6 +96,6 @@ setup(name = "SpreadModule",
       license = "Python",
       platforms = ["unix", "ms-windows"],
       url = "http://zope.org/Members/tim_one/spread",
-      classifiers = filter(None, classifiers.split("\n")),
+      classifiers = [c for c in classifiers.split("\n") if c],
       ext_modules = [ext],
       )
@@ -10,6 +10,173 @@
 #include "structmember.h"
 #include "sp.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#ifndef MS_WINDOWS
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* One source for Python 2.6/2.7 and Python 3.  Names (groups, senders,
+   private groups) are str on both:  byte strings on 2, text on 3, always
+   UTF-8 on the wire.  Message data is bytes on both. */
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_FromLong		PyLong_FromLong
+#define Name_Check		PyUnicode_Check
+#define Name_FromString		PyUnicode_FromString
+#define Name_FromFormat		PyUnicode_FromFormat
+#define Name_InternInPlace	PyUnicode_InternInPlace
+#define Name_AsString		PyUnicode_AsUTF8
+#else
+#define Name_Check		PyString_Check
+#define Name_FromString		PyString_FromString
+#define Name_FromFormat		PyString_FromFormat
+#define Name_InternInPlace	PyString_InternInPlace
+#define Name_AsString		PyString_AsString
+#endif
+
+/* Methods that take arguments use METH_FASTCALL | METH_KEYWORDS where
+   the interpreter has it (3.7 and later), so no argument tuple or
+   keyword dict is built per call, and METH_VARARGS | METH_KEYWORDS
+   elsewhere.  ARGS_DECL and ARGS spell the parameters for either, and
+   unpack_args() takes them apart. */
+#if PY_VERSION_HEX >= 0x03070000
+#define METH_ARGS	(METH_FASTCALL | METH_KEYWORDS)
+#define ARGS_DECL	PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define ARGS		args, nargs, kwnames
+#else
+#define METH_ARGS	(METH_VARARGS | METH_KEYWORDS)
+#define ARGS_DECL	PyObject *args, PyObject *kwds
+#define ARGS		args, kwds
+#endif
+
+/* The types are heap types made from PyType_Spec on Python 3; see
+   make_type().  Their instances hold a reference to the type from 3.8
+   on, which dealloc gives back. */
+#if PY_VERSION_HEX >= 0x03080000
+#define HEAPTYPE_DECREF(tp)	Py_DECREF(tp)
+#else
+#define HEAPTYPE_DECREF(tp)
+#endif
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+#define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
+#endif
+#define SPREAD_TPFLAGS	(Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE | \
+			 Py_TPFLAGS_DISALLOW_INSTANTIATION)
+
+/* PyThread_start_new_thread() returns a signed long before 3.7. */
+#ifndef PYTHREAD_INVALID_THREAD_ID
+#define PYTHREAD_INVALID_THREAD_ID	((unsigned long)-1)
+#endif
+
+/* Free-threaded builds (Py_GIL_DISABLED, 3.13 and later) run Python
+   threads in parallel, so the module locks what the GIL used to protect.
+   A mailbox's own fields are guarded by a critical section on the mailbox,
+   which is a no-op where there is a GIL, and held only for a few loads and
+   stores.  A critical section is suspended whenever its thread blocks, so
+   the things whose locked sections allocate or take other locks (name
+   caches, lazily decoded messages, receive queues, the message freelists)
+   get a PyMutex instead:  MUTEX declares it, and MUTEX_INIT(), LOCK() and
+   UNLOCK() take the object that has it.  All of them vanish where there
+   is a GIL. */
+#if PY_VERSION_HEX < 0x030D0000
+#define Py_BEGIN_CRITICAL_SECTION(op)	{
+#define Py_END_CRITICAL_SECTION()	}
+#endif
+#ifdef Py_GIL_DISABLED
+#define MUTEX		PyMutex mutex;
+#define MUTEX_INIT(p)	((p)->mutex = (PyMutex){0})
+#define LOCK(p)		PyMutex_Lock(&(p)->mutex)
+#define UNLOCK(p)	PyMutex_Unlock(&(p)->mutex)
+#else
+#define MUTEX
+#define MUTEX_INIT(p)
+#define LOCK(p)
+#define UNLOCK(p)
+#endif
+
+#if PY_MAJOR_VERSION < 3
+/* Enough of PyType_FromSpec() for the slots used here, so Python 2
+   builds its (static) types from the same specs. */
+#define Py_tp_dealloc		52
+#define Py_tp_getset		73
+#define Py_tp_members		72
+#define Py_tp_methods		64
+#define Py_tp_repr		66
+#define Py_tp_richcompare	67
+#define Py_tp_traverse		71
+#define Py_tp_clear		51
+#define Py_sq_length		45
+
+typedef struct {
+	int slot;
+	void *pfunc;
+} PyType_Slot;
+
+typedef struct {
+	const char *name;
+	int basicsize;
+	int itemsize;
+	unsigned int flags;
+	PyType_Slot *slots;
+} PyType_Spec;
+
+static PyObject *
+PyType_FromSpec(PyType_Spec *spec)
+{
+	PyTypeObject *tp;
+	PySequenceMethods *sq;
+	PyType_Slot *s;
+
+	tp = calloc(1, sizeof(PyTypeObject));
+	sq = calloc(1, sizeof(PySequenceMethods));
+	if (tp == NULL || sq == NULL) {
+		free(tp);
+		free(sq);
+		return PyErr_NoMemory();
+	}
+	(void)PyObject_INIT_VAR(tp, &PyType_Type, 0);
+	tp->tp_name = spec->name;
+	tp->tp_basicsize = spec->basicsize;
+	tp->tp_itemsize = spec->itemsize;
+	tp->tp_flags = spec->flags;
+	for (s = spec->slots; s->slot; s++) {
+		switch (s->slot) {
+		case Py_tp_dealloc:	tp->tp_dealloc = s->pfunc; break;
+		case Py_tp_getset:	tp->tp_getset = s->pfunc; break;
+		case Py_tp_members:	tp->tp_members = s->pfunc; break;
+		case Py_tp_methods:	tp->tp_methods = s->pfunc; break;
+		case Py_tp_repr:	tp->tp_repr = s->pfunc; break;
+		case Py_tp_richcompare:	tp->tp_richcompare = s->pfunc; break;
+		case Py_tp_traverse:	tp->tp_traverse = s->pfunc; break;
+		case Py_tp_clear:	tp->tp_clear = s->pfunc; break;
+		case Py_sq_length:
+			sq->sq_length = s->pfunc;
+			tp->tp_as_sequence = sq;
+			break;
+		}
+	}
+	if (tp->tp_as_sequence == NULL)
+		free(sq);
+	if (PyType_Ready(tp) < 0)
+		return NULL;
+	return (PyObject *)tp;
+}
+#endif
+
 #ifdef WITH_THREAD
 /*
 Jonathan Stanton (of Spread) verified multithreaded apps can suffer races
@@ -25,36 +192,36 @@ source and determined that those were the only Spread errors that closed
 the socket descriptor.  Alas, it takes another level of locking to do the
 {check that flag, call Spread, maybe set that flag} sequence indivisibly.
 
-However that also has the effect of serializing all calls to Spread via a
-given mailbox, and so a call to receive() in one thread blocks all threads
-from invoking Spread on that mailbox until the receive() returns.  But if
-the receive is waiting for a multicast from another thread, that's deadlock.
-
-Until Spread disconnection semantics are fixed, we can't win:  we either
-leave the Spread disconnection race unaddressed, or leave apps open to
-deadlock.  For now we choose the former.
+A lock held across each call would serialize all calls to Spread via a
+given mailbox, so a receive() in one thread would block every other thread
+from multicasting on that mailbox until it returned -- deadlock, if the
+receive is waiting for that multicast.  (That was SPREAD_DISCONNECT_RACE_BUG,
+which was never turned on.)
+
+So there is no lock.  Sends and receives run concurrently; the only thing
+they share is a count of the calls in progress, kept with the GIL held or,
+on a free-threaded build, in a critical section on the mailbox (see
+mbox_enter() and mbox_leave()).  disconnect() marks the mailbox closing, so
+no new call starts, wakes the receives blocked in it, and waits without the
+GIL until the count drops to zero before calling SP_disconnect().  No call
+can then be using the descriptor when it is closed, and none can start
+using it afterwards.  A receive that blocks always waits in poll(2) on the
+mailbox and on a pipe of its own (see wait_readable()), and disconnect()
+writes to the pipe; so it never sleeps inside SP_receive(), where nothing
+could wake it but a message.  (Windows has no such pipe, so there a
+receive() without a timeout holds up disconnect() until a message comes.)
+The batching timer thread counts its sends the same way, taking the GIL
+for it (see batch_timer_send()).
 */
 #include "pythread.h"
-/* #define SPREAD_DISCONNECT_RACE_BUG */
 #endif
 
-#ifdef SPREAD_DISCONNECT_RACE_BUG
-/* Acquiring the lock is ugly, because another thread may be holding on to
-   it:  we need to release the GIL in order to allow the other thread to
-   make progress.
-*/
-#define ACQUIRE_MBOX_LOCK(MBOX)					\
-	do {							\
-		Py_BEGIN_ALLOW_THREADS				\
-		PyThread_acquire_lock((MBOX)->spread_lock, 1);	\
-		Py_END_ALLOW_THREADS				\
-	} while(0)
-
-#define RELEASE_MBOX_LOCK(MBOX) PyThread_release_lock((MBOX)->spread_lock)
-
-#else
-#define ACQUIRE_MBOX_LOCK(MBOX)
-#define RELEASE_MBOX_LOCK(MBOX)
+/* The background receiver (see start_receiver()) needs threads, poll(2)
+   and pipes, and the GCC atomic builtins for its ring buffer. */
+#if defined(WITH_THREAD) && !defined(MS_WINDOWS) && defined(__GNUC__)
+#define HAVE_RECEIVER
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
 #endif
 
 static PyObject *SpreadError;
@@ -62,25 +229,750 @@ static PyObject *SpreadError;
 #define DEFAULT_GROUPS_SIZE 10
 #define DEFAULT_BUFFER_SIZE 10000
 
+/* Default number of slots in a mailbox's name caches; see NameCache. */
+#define DEFAULT_NAME_CACHE_SIZE 1024
+#define GROUPS_CACHE_SIZE 64
+
+/* A bounded cache of the string objects made for sender, group and member
+ * names, so the names that recur (as they nearly always do) aren't
+ * allocated again for every message.  It is direct mapped:  a name hashes
+ * to one slot, and a miss replaces whatever was there.  A second, smaller
+ * table does the same for the groups tuples of regular messages, keyed on
+ * the whole list of names.  Both tables are allocated on first use.  The
+ * cache is shared by its mailbox and by the messages that haven't decoded
+ * their names yet, and freed when the last of them lets go.
+ */
+typedef struct {
+	char name[MAX_GROUP_NAME];
+	PyObject *str;
+} NameSlot;
+
+typedef struct {
+	unsigned long hash;
+	PyObject *groups;
+} GroupsSlot;
+
+typedef struct {
+	NameSlot *names;
+	GroupsSlot *groups;
+	int size;		/* slots in names, a power of 2; 0 disables */
+	int refcnt;
+	long hits;
+	long misses;
+	long groups_hits;
+	long groups_misses;
+	MUTEX			/* guards all of the above */
+} NameCache;
+
+/* A receive filter, set by set_filter():  the receive methods drop the
+ * messages it rejects before building any object for them.  Its sets are
+ * fixed once made; set_filter() replaces the whole filter, and a receive
+ * in progress keeps a reference to the one it started with.  Each drop
+ * is counted under one of the FILTER_* reasons.
+ */
+#define FILTER_MSG_TYPE		0
+#define FILTER_GROUP		1
+#define FILTER_SENDER		2
+#define FILTER_MEMBERSHIP	3
+#define FILTER_REASONS		4
+
+/* A set of names, hashed with name_hash() into 'size' slots (a power of
+ * 2) with linear probing; an empty name marks a free slot.  names is
+ * NULL when the set wasn't given, which lets everything through.
+ */
+typedef struct {
+	char (*names)[MAX_GROUP_NAME];
+	int size;
+} NameSet;
+
+typedef struct {
+	unsigned char *allow_types;	/* bitmaps indexed by msg_type, */
+	unsigned char *deny_types;	/* or NULL if not given */
+	NameSet allow_groups;
+	NameSet deny_groups;
+	NameSet allow_senders;
+	NameSet deny_senders;
+	int membership;		/* membership messages wanted */
+	int refcnt;
+	long drops[FILTER_REASONS];
+	MUTEX			/* guards refcnt and drops */
+} MsgFilter;
+
+/* A callback registered for run() by register(), in a hash table keyed on
+ * group and msg_type (see handler_find()).  An empty group matches any
+ * group, and any_type any msg_type.
+ */
+typedef struct {
+	char group[MAX_GROUP_NAME];
+	int msg_type;
+	int any_type;
+	PyObject *callback;	/* NULL for a free slot */
+} Handler;
+
+/* Batching, turned on by set_batching():  small messages multicast to
+ * one group with one service type are gathered into a single Spread
+ * message, a batch frame, sent with the reserved msg_type BATCH_MSG_TYPE.
+ * A frame's data is a run of records, each a 2-byte msg_type and a 4-byte
+ * length (both big-endian) followed by that many bytes of message.  A
+ * mailbox with set_unbatching() on takes frames apart again, and its
+ * receive methods hand out each record as a message of its own.
+ */
+#define BATCH_MSG_TYPE		(-32768)
+#define BATCH_HEADER		6
+#define IS_BATCH(rm) \
+	(Is_regular_mess((rm)->svc_type) && \
+	 (rm)->msg_type == BATCH_MSG_TYPE && !(rm)->codec && \
+	 !(rm)->frag)
+
+/* A mailbox's batching sender.  The frame being gathered is sent when the
+ * next message wouldn't fit in max_bytes or is going somewhere else, when
+ * it holds max_msgs messages, when its first message has waited 'delay'
+ * seconds (checked as messages are added, and by a timer thread where
+ * there is a background receiver), and by flush().  Like a filter, it is
+ * replaced whole by set_batching(), and a send in progress keeps a
+ * reference to the one it started with.  All but refcnt is used without
+ * the GIL.
+ */
+typedef struct {
+	mailbox mbox;
+	PyObject *owner;	/* the mailbox, borrowed:  it closes the
+				   batcher before it goes */
+	int max_bytes;
+	int max_msgs;
+	double delay;		/* negative for no timer */
+#ifdef WITH_THREAD
+	PyThread_type_lock lock;	/* guards the rest; held while sending */
+#endif
+	char *buf;		/* the frame, max_bytes long */
+	int len;
+	int count;		/* messages in it */
+	char group[MAX_GROUP_NAME];
+	int svc_type;
+	double first;		/* when the first of them was added */
+	int closed;		/* replaced or disconnected:  don't gather */
+	int err;		/* the timer's send failed; not reported yet */
+#ifdef HAVE_RECEIVER
+	int ctl[2];		/* wakes the timer thread */
+	PyThread_type_lock running;	/* held until the timer thread exits */
+#endif
+	int refcnt;
+	MUTEX			/* guards refcnt */
+} Batcher;
+
+/* Compression, asked for by multicast(compress=...):  the message is
+ * sent with the reserved msg_type COMPRESSED_MSG_TYPE, and its data is a
+ * header -- the codec (1 byte), the original msg_type (2 bytes) and the
+ * original length (4 bytes), big-endian -- followed by the compressed
+ * data.  Receiving mailboxes decompress such messages by themselves.
+ * The codecs are those the module was built with (HAVE_ZLIB, HAVE_LZ4).
+ */
+#define COMPRESSED_MSG_TYPE	(-32767)
+#define COMPRESS_HEADER		7
+#define CODEC_ZLIB		1
+#define CODEC_LZ4		2
+
+/* Messages shorter than this are sent as they are by default. */
+#define DEFAULT_COMPRESS_MIN	512
+
+/* Fragments, sent by multicast_large() for messages too long for one
+ * Spread message:  each has the reserved msg_type FRAGMENT_MSG_TYPE, and
+ * its data is a header -- the message's msg_type (2 bytes), its sequence
+ * number among the sender's large messages (4 bytes), the fragment's
+ * offset in it (4 bytes) and its total length (4 bytes), big-endian --
+ * followed by that part of the message.  The sender is Spread's.
+ * Receiving mailboxes put them back together; see reasm_take().
+ */
+#define FRAGMENT_MSG_TYPE	(-32766)
+#define FRAGMENT_HEADER		14
+/* Leaves room for the header and a few hundred groups under Spread's
+   limit of 144000 bytes per message. */
+#define DEFAULT_FRAGMENT_SIZE	(128 * 1024)
+#define DEFAULT_REASSEMBLY_MAX	(64 << 20)
+
+/* A large message partly received; see reasm_take(). */
+struct partial {
+	char sender[MAX_GROUP_NAME];
+	char group[MAX_GROUP_NAME];	/* the first group it was sent to,
+					   the only one reasm_membership()
+					   watches */
+	unsigned long seq;
+	int total;
+	int got;			/* bytes received so far, in order */
+	PyObject *data;			/* a bytes object total long */
+	struct partial *next;
+};
+
+/* Timestamps, turned on by set_timestamps():  the message is sent with
+ * the reserved msg_type STAMPED_MSG_TYPE, and its data is a header -- the
+ * original msg_type (2 bytes) and the time it was sent, in microseconds
+ * since the epoch (8 bytes), big-endian -- followed by the message, which
+ * may itself be compressed.  Receiving mailboxes take the header off by
+ * themselves and note how long the message took; see latency().
+ */
+#define STAMPED_MSG_TYPE	(-32765)
+#define STAMP_HEADER		10
+
+/* Runtime statistics; see stats().  Service types are counted at the
+ * index of their bit, UNRELIABLE_MESS first, and Spread error codes at
+ * their negation, with [0] for any code out of range.  What a receive
+ * counts without the GIL goes in a RecvStats of its own first, added to
+ * the mailbox's with stats_receive_done() once it has the GIL back.
+ */
+#define STAT_SERVICES	6
+#define STAT_ERRORS	32
+
+typedef struct {
+	long long msgs[STAT_SERVICES];	/* regular messages, as Spread
+					   delivered them:  wire units */
+	long long bytes[STAT_SERVICES];
+	long long membership;		/* membership messages */
+	long long buffer_retries;	/* SP_receive() said BUFFER_TOO_SHORT */
+	long long groups_retries;	/* ... or GROUPS_TOO_SHORT */
+	int largest;
+	double blocked;		/* seconds waiting for and in SP_receive() */
+} RecvStats;
+
+typedef struct {
+	long long sent[STAT_SERVICES];	/* messages, as passed to a send */
+	long long sent_bytes[STAT_SERVICES];
+	int largest_sent;
+	RecvStats recv;
+	long long errors[STAT_ERRORS];	/* SpreadErrors raised */
+	double python;		/* seconds with no receive in progress */
+} MboxStats;
+
+/* A histogram of latencies in microseconds, log-linear like HdrHistogram:
+ * values below 2 * LAT_SUB each have a bucket of their own, and each
+ * power of 2 above that is split into LAT_SUB buckets, so a value is
+ * known to within 1 / LAT_SUB of itself.  Values are capped at
+ * 2 ** LAT_BITS - 1 microseconds (about 12 days).
+ */
+#define LAT_SUB_BITS	5
+#define LAT_SUB		(1 << LAT_SUB_BITS)
+#define LAT_BITS	40
+#define LAT_BUCKETS	((LAT_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+typedef struct {
+	long long counts[LAT_BUCKETS];
+	long long count;
+	long long sum;
+	long long min;
+	long long max;
+} LatHist;
+
+/* A mailbox's latency histograms for one group, by service type (see
+ * STAT_SERVICES), each allocated when its first message comes.
+ */
+typedef struct {
+	char group[MAX_GROUP_NAME];	/* "" for a free slot */
+	LatHist *hist[STAT_SERVICES];
+} LatGroup;
+
+/* Defaults for the receive buffer policy; see set_buffer_policy(). */
+#define DEFAULT_BUFFER_MAX (1 << 20)
+#define DEFAULT_BUFFER_WINDOW 1000
+
 typedef struct {
 	PyObject_HEAD
 	mailbox mbox;
 	PyObject *private_group;
 	int disconnected;
-#ifdef SPREAD_DISCONNECT_RACE_BUG
-	PyThread_type_lock spread_lock;
+	int closing;		/* disconnect() is waiting for calls to end */
+	int inflight;		/* calls into Spread in progress */
+#ifdef WITH_THREAD
+	PyThread_type_lock drained;	/* released when inflight drops to 0 */
+#endif
+#ifndef MS_WINDOWS
+	int wake[2];		/* written by disconnect(); see mbox_wake() */
+#endif
+	/* Receive buffers kept across calls, sized from the messages seen;
+	   see rbuf_acquire() and rbuf_release(). */
+	char *rbuf;
+	int rbuf_size;
+	char (*rgroups)[MAX_GROUP_NAME];
+	int rgroups_size;
+	int rbuf_busy;		/* a receive in some thread is using them */
+	int rbuf_min;		/* policy:  never smaller than this */
+	int rbuf_max;		/* policy:  never keep a larger one */
+	int rbuf_window;	/* policy:  receives between shrink checks */
+	int window_count;	/* receives so far in this window */
+	int window_size;	/* largest message in this window */
+	int window_groups;	/* most groups in this window */
+	long rbuf_grows;
+	long rbuf_shrinks;
+	long rbuf_retries;	/* SP_receive() calls repeated for a bigger buffer */
+	long rbuf_saved;	/* retries the default buffers would have needed */
+	int rbuf_high;		/* largest message received */
+	NameCache *names;
+	/* The membership view, if set_membership_view() turned it on:
+	   group name -> (group_id, members) from the group's latest regular
+	   membership message.  See view_update(). */
+	PyObject *views;	/* dict, or NULL when off */
+	PyObject *view_groups;	/* tuple of the keys; NULL when stale */
+	long view_version;	/* changes to views so far */
+	MsgFilter *filter;	/* NULL if set_filter() hasn't set one */
+	/* What run() calls; see register(). */
+	Handler *handlers;	/* NULL if none are registered */
+	int handlers_size;	/* slots in handlers, a power of 2 */
+	PyObject *on_membership;	/* or NULL */
+	int run_stop;		/* stop() was called */
+	int receiving;		/* receive calls in progress */
+	Batcher *batcher;	/* NULL if set_batching() hasn't set one */
+	int unbatch;		/* set_unbatching() is on */
+	struct frame *frames;	/* batch frames not all taken yet, */
+	struct frame *frames_tail;	/* oldest first; see unbatch_next() */
+	/* Compression counters; see compression_stats(). */
+	long z_msgs;		/* messages sent compressed */
+	long z_skipped;		/* ... and sent as they were, being no smaller */
+	long long z_in;		/* bytes before compression */
+	long long z_out;	/* ... and after */
+	double z_time;		/* CPU seconds spent compressing */
+	long unz_msgs;		/* messages decompressed */
+	long long unz_in;
+	long long unz_out;
+	double unz_time;
+	/* Reassembly of multicast_large() messages; see reasm_take(). */
+	unsigned long frag_seq;	/* the next one this mailbox sends */
+	struct partial *partials;	/* oldest first */
+	long long reasm_bytes;	/* total length of the partials */
+	long long reasm_max;	/* set_reassembly_limit() */
+	long reasm_done;	/* messages put back together */
+	long reasm_evicted;	/* partials dropped for room */
+	long reasm_left;	/* ... because their sender left */
+	long reasm_dropped;	/* fragments of no partial, or too long */
+	MboxStats stats;	/* see stats() */
+	double idle_since;	/* when the last receive ended, or 0 */
+	int stamp;		/* set_timestamps() is on */
+	/* Latency histograms by group, hashed with name_hash() into
+	   lat_size slots (a power of 2); see latency(). */
+	LatGroup *lat;		/* NULL until a stamped message comes */
+	int lat_size;
+	int lat_used;
+#ifdef HAVE_RECEIVER
+	PyObject *queue;	/* the running receiver's QueueObject */
 #endif
 } MailboxObject;
 
 static PyObject *spread_error(int, MailboxObject *);
+static PyObject *spread_error_extra(int, MailboxObject *, int);
+static char *error_message(int);
+static void note_disconnect(int, MailboxObject *);
+static void filter_decref(MsgFilter *);
+static void handlers_free(Handler *, int);
+static void lat_free(LatGroup *, int);
+static int batch_close(Batcher *, int);
+static void batch_decref(Batcher *);
+static void frames_free(struct frame *);
+static void partials_free(struct partial *);
+#ifdef HAVE_RECEIVER
+static int receiver_stop(MailboxObject *, PyObject **);
+#endif
+
+/* CPU seconds used by the calling thread (by the process where threads
+   can't be told apart); only differences mean anything. */
+static double
+cpu_time(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+#ifndef MS_WINDOWS
+/* Seconds on a clock that never goes backwards; only differences mean
+   anything. */
+static double
+monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Pipes for waking a thread sleeping in poll(2):  a mailbox's receives
+   (see mbox_wake()) and the background receiver and its consumers. */
+static void
+pipe_signal(int fd)
+{
+	char c = 0;
+
+	/* A full pipe already means "look again". */
+	while (write(fd, &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+static void
+pipe_drain(int fd)
+{
+	char buf[64];
+	ssize_t n;
+
+	do
+		n = read(fd, buf, sizeof(buf));
+	while (n > 0 || (n < 0 && errno == EINTR));
+}
+
+static int
+pipe_open(int fds[2])
+{
+	int i;
+
+	if (pipe(fds) < 0)
+		return -1;
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	return 0;
+}
+#endif
+
+/* Microseconds since the epoch, for timestamps that mean the same on
+   every host whose clock is kept in step. */
+static long long
+realtime_us(void)
+{
+#ifdef MS_WINDOWS
+	FILETIME ft;
+	unsigned long long t;
+
+	/* 100-nanosecond intervals since 1601 */
+	GetSystemTimeAsFileTime(&ft);
+	t = (unsigned long long)ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+	return (long long)(t / 10) - 11644473600000000LL;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+/* The sum of every mailbox's statistics, for spread.stats(); errors not
+   raised for any one mailbox (e.g. by connect()) are counted only here. */
+static struct {
+	MboxStats stats;
+	MUTEX			/* guards stats */
+} all_stats;
+
+/* Seconds for the time statistics, which stay 0 where there is no
+   monotonic(). */
+static double
+stat_clock(void)
+{
+#ifdef MS_WINDOWS
+	return 0;
+#else
+	return monotonic();
+#endif
+}
+
+/* Where svc_type is counted in the statistics, or -1 if nowhere. */
+static int
+stat_service(int svc_type)
+{
+	int i;
+
+	for (i = 0; i < STAT_SERVICES; i++)
+		if (svc_type & (UNRELIABLE_MESS << i))
+			return i;
+	return -1;
+}
+
+static void
+recv_add(RecvStats *dst, const RecvStats *src)
+{
+	int i;
+
+	for (i = 0; i < STAT_SERVICES; i++) {
+		dst->msgs[i] += src->msgs[i];
+		dst->bytes[i] += src->bytes[i];
+	}
+	dst->membership += src->membership;
+	dst->buffer_retries += src->buffer_retries;
+	dst->groups_retries += src->groups_retries;
+	if (src->largest > dst->largest)
+		dst->largest = src->largest;
+	dst->blocked += src->blocked;
+}
+
+/* Add what a receive counted in rs to self's statistics.  Called with the
+   GIL. */
+static void
+stats_receive_done(MailboxObject *self, RecvStats *rs)
+{
+	Py_BEGIN_CRITICAL_SECTION(self);
+	recv_add(&self->stats.recv, rs);
+	Py_END_CRITICAL_SECTION();
+	LOCK(&all_stats);
+	recv_add(&all_stats.stats.recv, rs);
+	UNLOCK(&all_stats);
+}
+
+static void
+sent_add(MboxStats *st, int i, int count, long long bytes, int largest)
+{
+	st->sent[i] += count;
+	st->sent_bytes[i] += bytes;
+	if (largest > st->largest_sent)
+		st->largest_sent = largest;
+}
+
+/* Count 'count' messages, 'bytes' long in all and the longest 'largest'
+   bytes, sent on self with svc_type.  Called with the GIL. */
+static void
+stats_sent(MailboxObject *self, int svc_type, int count, long long bytes,
+	   int largest)
+{
+	int i = stat_service(svc_type);
+
+	if (i < 0 || count <= 0)
+		return;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	sent_add(&self->stats, i, count, bytes, largest);
+	Py_END_CRITICAL_SECTION();
+	LOCK(&all_stats);
+	sent_add(&all_stats.stats, i, count, bytes, largest);
+	UNLOCK(&all_stats);
+}
+
+/* Count a SpreadError with Spread error code err, raised for mbox (which
+   may be NULL).  Called with the GIL. */
+static void
+stats_error(MailboxObject *mbox, int err)
+{
+	int i = err < 0 && err > -STAT_ERRORS ? -err : 0;
+
+	if (mbox != NULL) {
+		Py_BEGIN_CRITICAL_SECTION(mbox);
+		mbox->stats.errors[i]++;
+		Py_END_CRITICAL_SECTION();
+	}
+	LOCK(&all_stats);
+	all_stats.stats.errors[i]++;
+	UNLOCK(&all_stats);
+}
+
+/* Does the keyword name key match name? */
+static int
+kw_match(PyObject *key, const char *name)
+{
+#if PY_MAJOR_VERSION >= 3
+	return PyUnicode_Check(key) &&
+		PyUnicode_CompareWithASCIIString(key, name) == 0;
+#else
+	return PyString_Check(key) &&
+		strcmp(PyString_AS_STRING(key), name) == 0;
+#endif
+}
+
+/* Take apart the arguments of a METH_ARGS method called as fname:
+ * values[i] is set to a borrowed reference to the argument given for
+ * kwlist[i], by position or keyword, or NULL if it was left out.  The
+ * first 'required' must be given.  Returns 0, or sets TypeError and
+ * returns -1.
+ */
+static int
+unpack_args(const char *fname, ARGS_DECL, char **kwlist, int required,
+	    PyObject **values)
+{
+	Py_ssize_t i, k, n, nkw = 0;
+	PyObject *key, *value;
+#if PY_VERSION_HEX < 0x03070000
+	Py_ssize_t nargs = PyTuple_GET_SIZE(args), pos = 0;
+#endif
+
+	for (n = 0; kwlist[n] != NULL; n++)
+		values[n] = NULL;
+#if PY_VERSION_HEX >= 0x03070000
+	if (kwnames != NULL)
+		nkw = PyTuple_GET_SIZE(kwnames);
+#else
+	if (kwds != NULL)
+		nkw = PyDict_Size(kwds);
+#endif
+	if (nargs > n) {
+		PyErr_Format(PyExc_TypeError,
+			     "%.100s() takes at most %d arguments (%d given)",
+			     fname, (int)n, (int)(nargs + nkw));
+		return -1;
+	}
+	for (i = 0; i < nargs; i++)
+#if PY_VERSION_HEX >= 0x03070000
+		values[i] = args[i];
+#else
+		values[i] = PyTuple_GET_ITEM(args, i);
+#endif
+	for (k = 0; k < nkw; k++) {
+#if PY_VERSION_HEX >= 0x03070000
+		key = PyTuple_GET_ITEM(kwnames, k);
+		value = args[nargs + k];
+#else
+		PyDict_Next(kwds, &pos, &key, &value);
+#endif
+		for (i = 0; i < n; i++)
+			if (kw_match(key, kwlist[i]))
+				break;
+		if (i == n) {
+			PyObject *s = PyObject_Str(key);
+
+			PyErr_Format(PyExc_TypeError,
+				     "%.100s() got an unexpected keyword "
+				     "argument '%.100s'", fname,
+				     s != NULL ? Name_AsString(s) : "?");
+			Py_XDECREF(s);
+			return -1;
+		}
+		if (values[i] != NULL) {
+			PyErr_Format(PyExc_TypeError,
+				     "%.100s() got multiple values for "
+				     "argument '%s'", fname, kwlist[i]);
+			return -1;
+		}
+		values[i] = value;
+	}
+	for (i = 0; i < required; i++)
+		if (values[i] == NULL) {
+			PyErr_Format(PyExc_TypeError,
+				     "%.100s() missing required argument "
+				     "'%s' (pos %d)", fname, kwlist[i],
+				     (int)i + 1);
+			return -1;
+		}
+	return 0;
+}
+
+/* Converters for the values unpack_args() found.  Each leaves *out alone
+ * if the argument was left out (obj is NULL), and returns 0, or -1 with
+ * an exception set.
+ */
+static int
+arg_int(PyObject *obj, int *out)
+{
+	long v;
+
+	if (obj == NULL)
+		return 0;
+	if (PyFloat_Check(obj)) {
+		PyErr_SetString(PyExc_TypeError,
+				"integer argument expected, got float");
+		return -1;
+	}
+#if PY_MAJOR_VERSION >= 3
+	v = PyLong_AsLong(obj);
+#else
+	v = PyInt_AsLong(obj);
+#endif
+	if (v == -1 && PyErr_Occurred())
+		return -1;
+	if (v > INT_MAX || v < INT_MIN) {
+		PyErr_SetString(PyExc_OverflowError,
+				"Python int too large to convert to C int");
+		return -1;
+	}
+	*out = (int)v;
+	return 0;
+}
+
+/* The UTF-8 text of a name, with its length in *len. */
+static const char *
+name_chars(PyObject *obj, Py_ssize_t *len)
+{
+#if PY_MAJOR_VERSION >= 3
+	if (PyUnicode_Check(obj))
+		return PyUnicode_AsUTF8AndSize(obj, len);
+#else
+	if (PyString_Check(obj)) {
+		*len = PyString_GET_SIZE(obj);
+		return PyString_AS_STRING(obj);
+	}
+#endif
+	PyErr_Format(PyExc_TypeError, "expected str, got %.200s",
+		     Py_TYPE(obj)->tp_name);
+	return NULL;
+}
+
+static int
+arg_name(PyObject *obj, const char **out)
+{
+	const char *s;
+	Py_ssize_t len;
+
+	if (obj == NULL)
+		return 0;
+#if PY_MAJOR_VERSION < 3
+	if (PyUnicode_Check(obj))
+		/* Encoded with the default encoding, as "s" always did. */
+		return PyArg_Parse(obj, "s", out) ? 0 : -1;
+#endif
+	s = name_chars(obj, &len);
+	if (s == NULL)
+		return -1;
+	if (strlen(s) != (size_t)len) {
+		PyErr_SetString(PyExc_ValueError,
+				"embedded null character");
+		return -1;
+	}
+	*out = s;
+	return 0;
+}
+
+/* Get a buffer for obj through the buffer protocol (falling back to the
+ * old one on Python 2), to release with PyBuffer_Release().  Returns 0,
+ * or -1 with an exception set.
+ */
+static int
+get_buffer(PyObject *obj, Py_buffer *view, int writable)
+{
+#if PY_MAJOR_VERSION < 3
+	if (PyUnicode_Check(obj) && !writable) {
+		/* Encoded with the default encoding, as "s#" always did;
+		 * the encoded string is kept by obj. */
+		PyObject *s = _PyUnicode_AsDefaultEncodedString(obj, NULL);
+
+		if (s == NULL)
+			return -1;
+		return PyBuffer_FillInfo(view, obj, PyString_AS_STRING(s),
+					 PyString_GET_SIZE(s), 1,
+					 PyBUF_SIMPLE);
+	}
+	if (!PyObject_CheckBuffer(obj)) {
+		void *buf;
+		Py_ssize_t len;
+
+		if (writable) {
+			if (PyObject_AsWriteBuffer(obj, &buf, &len) < 0)
+				return -1;
+		}
+		else if (PyObject_AsReadBuffer(obj, (const void **)&buf,
+					       &len) < 0)
+			return -1;
+		return PyBuffer_FillInfo(view, obj, buf, len, !writable,
+					 PyBUF_SIMPLE);
+	}
+#endif
+	return PyObject_GetBuffer(obj, view,
+				  writable ? PyBUF_WRITABLE : PyBUF_SIMPLE);
+}
 
 typedef struct {
 	PyObject_HEAD
 	PyObject *sender;
-	PyObject *groups;
+	PyObject *groups;	/* NULL until first looked at */
 	int msg_type;
 	int endian;
 	PyObject *message;
+	/* The group names groups is built from, while it is NULL. */
+	NameCache *cache;
+	int num_groups;
+	char (*raw_groups)[MAX_GROUP_NAME];	/* group0, or malloc'ed */
+	char group0[MAX_GROUP_NAME];
+	MUTEX			/* guards the decoding of groups */
 } RegularMsg;
 
 typedef struct {
@@ -92,6 +984,14 @@ typedef struct {
 	PyObject *members;
 	PyObject *extra; /* that are still members */
   PyObject *changed_member;
+	/* The raw message, until all of the above have been decoded; see
+	   new_membership_msg(). */
+	NameCache *cache;
+	int svc_type;
+	int num_members;
+	char (*raw_members)[MAX_GROUP_NAME];	/* malloc'ed with raw_body */
+	char *raw_body;
+	MUTEX			/* guards the decoding */
 } MembershipMsg;
 
 typedef struct {
@@ -99,22 +999,25 @@ typedef struct {
 	group_id gid;
 } GroupId;
 
-staticforward PyTypeObject Mailbox_Type;
-staticforward PyTypeObject RegularMsg_Type;
-staticforward PyTypeObject MembershipMsg_Type;
-staticforward PyTypeObject GroupId_Type;
+/* The types, made by make_type() in module init. */
+static PyTypeObject *Mailbox_Type;
+static PyTypeObject *RegularMsg_Type;
+static PyTypeObject *MembershipMsg_Type;
+static PyTypeObject *GroupId_Type;
+static PyTypeObject *GroupSet_Type;
 
-#define MailboxObject_Check(v)	((v)->ob_type == &Mailbox_Type)
-#define RegularMsg_Check(v)	((v)->ob_type == &RegularMsg_Type)
-#define MembershipMsg_Check(v)	((v)->ob_type == &MembershipMsg_Type)
-#define GroupId_Check(v)	((v)->ob_type == &GroupId_Type)
+#define MailboxObject_Check(v)	(Py_TYPE(v) == Mailbox_Type)
+#define RegularMsg_Check(v)	(Py_TYPE(v) == RegularMsg_Type)
+#define MembershipMsg_Check(v)	(Py_TYPE(v) == MembershipMsg_Type)
+#define GroupId_Check(v)	(Py_TYPE(v) == GroupId_Type)
+#define GroupSet_Check(v)	(Py_TYPE(v) == GroupSet_Type)
 
 static PyObject *
 new_group_id(group_id gid)
 {
 	GroupId *self;
 
-	self = PyObject_New(GroupId, &GroupId_Type);
+	self = PyObject_New(GroupId, GroupId_Type);
 	if (!self)
 		return NULL;
 	self->gid = gid;
@@ -125,6 +1028,7 @@ static void
 group_id_dealloc(GroupId *v)
 {
 	PyObject_Del(v);
+	HEAPTYPE_DECREF(GroupId_Type);
 }
 
 static PyObject *
@@ -133,7 +1037,7 @@ group_id_repr(GroupId *v)
 	char buf[80];
 	sprintf(buf, "<group_id %08X:%08X:%08X>",
 		v->gid.id[0], v->gid.id[1], v->gid.id[2]);
-	return PyString_FromString(buf);
+	return Name_FromString(buf);
 }
 
 static PyObject *
@@ -156,322 +1060,776 @@ group_id_richcompare(PyObject *v, PyObject *w, int op)
 	return res;
 }
 
-static PyTypeObject GroupId_Type = {
-	/* The ob_type field must be initialized in the module init function
-	 * to be portable to Windows without using C++. */
-	PyObject_HEAD_INIT(NULL)
-	0,					/* ob_size */
-	"GroupId",				/* tp_name */
-	sizeof(GroupId),			/* tp_basicsize */
-	0,					/* tp_itemsize */
-	/* methods */
-	(destructor)group_id_dealloc,		/* tp_dealloc */
-	0,					/* tp_print */
-	0,					/* tp_getattr */
-	0,					/* tp_setattr */
-	0,					/* tp_compare */
-	(reprfunc)group_id_repr,		/* tp_repr */
-	0,					/* tp_as_number */
-	0,					/* tp_as_sequence */
-	0,					/* tp_as_mapping */
-	0,					/* tp_hash */
-	0,					/* tp_call */
-	0,					/* tp_str */
-	0,					/* tp_getattro */
-	0,					/* tp_setattro */
-	0,					/* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT,			/* tp_flags */
-	0,					/* tp_doc */
-	0,					/* tp_traverse */
-	0,					/* tp_clear */
-	group_id_richcompare,			/* tp_richcompare */
+static PyType_Slot GroupId_slots[] = {
+	{Py_tp_dealloc, group_id_dealloc},
+	{Py_tp_repr, group_id_repr},
+	{Py_tp_richcompare, group_id_richcompare},
+	{0, NULL}
 };
 
-#define CAUSED_BY_MASK (CAUSED_BY_JOIN | CAUSED_BY_LEAVE | \
-                        CAUSED_BY_DISCONNECT | CAUSED_BY_NETWORK)
+static PyType_Spec GroupId_spec = {
+	"spread.GroupId",			/* name */
+	sizeof(GroupId),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	GroupId_slots				/* slots */
+};
 
-static PyObject *
-new_membership_msg(int type, PyObject *group, int num_members,
-		   char (*members)[MAX_GROUP_NAME], char *buffer, int size)
-{
-    MembershipMsg *self;
-    group_id grp_id;
-    membership_info memb_info;
-    int32 num_extra_members = 0;
-    int i;
-    int ret;
-
-    assert(group != NULL);
-    self = PyObject_New(MembershipMsg, &MembershipMsg_Type);
-    if (self == NULL)
-        return NULL;
-    self->reason = type & CAUSED_BY_MASK; /* from sp.h defines */
-    self->msg_subtype = type & (TRANSITION_MESS | REG_MEMB_MESS);
-    Py_INCREF(group);
-    self->group = group;
-    self->members = NULL;
-    self->extra = NULL;
-    self->group_id = NULL;
-    self->changed_member = NULL;
-    self->members = PyTuple_New(num_members);
-    if (self->members == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
-    for (i = 0; i < num_members; ++i) {
-        PyObject *s = PyString_FromString(members[i]);
-        if (!s) {
-            Py_DECREF(self);
-            return NULL;
-        }
-        PyTuple_SET_ITEM(self->members, i, s);
-    }
-
-
-    if ((ret = SP_get_memb_info(buffer, type, &memb_info)) < 0) {
-	      PyErr_Format(SpreadError, "error %d on SP_get_memb_info", ret);
-        Py_DECREF(self);
-        return NULL;
-    }
-
-
-    memcpy(&grp_id, &memb_info.gid, sizeof(group_id));
-    self->group_id = new_group_id(grp_id);
-    if (self->group_id == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
-
-
-    /* The extra attribute is a tuple initialized for 0 or more items.
-     * If the member event is a single member event such as a join, leave or disconnect,
-     * the changed member attribute is set from memb_info.changed_member
-     * and a single value from vs_set, which is stored inside the message, is added to extra tuple.
-     * If the member event is a merge or partition, the list of member names
-     * from vs_set is stored in extra.
-     */
-
-
-    if (Is_reg_memb_mess(type) && (Is_caused_join_mess(type) || Is_caused_disconnect_mess(type) || Is_caused_leave_mess(type))) {
-        self->changed_member =  PyString_FromString(memb_info.changed_member);
-        if (!self->changed_member) {
-            Py_DECREF(self);
-            return NULL;
-        }
-    }
-    else {
-        self->changed_member = Py_BuildValue("");
-    }
-
-    num_extra_members = memb_info.my_vs_set.num_members;
-
-    self->extra = PyTuple_New(num_extra_members);
-    if (self->extra == NULL) {
-        Py_DECREF(self);
-        return NULL;
-    }
-
-    if (num_extra_members > 0) {
-
-        char (*member_names)[MAX_GROUP_NAME] = (char (*)[MAX_GROUP_NAME]) malloc(num_extra_members * MAX_GROUP_NAME);
-
-        if (member_names == NULL) {
-            Py_DECREF(self);
-            PyErr_NoMemory();
-            return NULL;
-        }
-
-        if ((ret = SP_get_vs_set_members(buffer, &memb_info.my_vs_set, member_names, num_extra_members)) < 0) {
-	          PyErr_Format(SpreadError, "error %d on SP_get_vs_set_members", ret);
-            Py_DECREF(self);
-            free(member_names);
-            return NULL;
-        }
-
-        for (i = 0; i < num_extra_members; i++) {
-            PyObject *s;
-            s = PyString_FromString(member_names[i]);
-            if (!s) {
-                Py_DECREF(self);
-                free(member_names);
-                return NULL;
-            }
-            PyTuple_SET_ITEM(self->extra, i, s);
-        }
-
-        free(member_names);
-    }
-
-    return (PyObject *)self;
+static unsigned long
+name_hash(const char *name)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < MAX_GROUP_NAME && name[i]; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619UL;
+	return h;
 }
 
+/* Empty the cache and give it a new size.  The old entries are let go
+ * after the lock is released.
+ */
 static void
-membership_msg_dealloc(MembershipMsg *self)
+cache_resize(NameCache *c, int size)
 {
-	Py_XDECREF(self->group);
-	Py_XDECREF(self->members);
-	Py_XDECREF(self->extra);
-	Py_XDECREF(self->group_id);
-  Py_XDECREF(self->changed_member);
-	PyObject_Del(self);
+	NameSlot *names;
+	GroupsSlot *groups;
+	int i, old_size;
+
+	LOCK(c);
+	names = c->names;
+	groups = c->groups;
+	old_size = c->size;
+	c->names = NULL;
+	c->groups = NULL;
+	c->size = size;
+	UNLOCK(c);
+	if (names != NULL) {
+		for (i = 0; i < old_size; i++)
+			Py_XDECREF(names[i].str);
+		free(names);
+	}
+	if (groups != NULL) {
+		for (i = 0; i < GROUPS_CACHE_SIZE; i++)
+			Py_XDECREF(groups[i].groups);
+		free(groups);
+	}
 }
 
-#define OFF(x) offsetof(MembershipMsg, x)
+static NameCache *
+cache_new(int size)
+{
+	NameCache *c = calloc(1, sizeof(NameCache));
 
-static struct memberlist MembershipMsg_memberlist[] = {
-	{"reason",	T_INT,		OFF(reason)},
-	{"msg_subtype",	T_INT,		OFF(msg_subtype)},
-	{"group",	T_OBJECT,	OFF(group)},
-	{"group_id",	T_OBJECT,	OFF(group_id)},
-	{"members",	T_OBJECT,	OFF(members)},
-	{"extra",	T_OBJECT,	OFF(extra)},
-	{"changed_member",	T_OBJECT,	OFF(changed_member)},
-	{NULL}
-};
+	if (c != NULL) {
+		c->size = size;
+		c->refcnt = 1;
+	}
+	return c;
+}
 
-#undef OFF
+static void
+cache_incref(NameCache *c)
+{
+	LOCK(c);
+	c->refcnt++;
+	UNLOCK(c);
+}
+
+static void
+cache_decref(NameCache *c)
+{
+	int refcnt;
+
+	LOCK(c);
+	refcnt = --c->refcnt;
+	UNLOCK(c);
+	if (refcnt == 0) {
+		cache_resize(c, 0);
+		free(c);
+	}
+}
 
+/* Return a new reference to a string object for the NUL-terminated name,
+ * from the cache if possible.  The string is made without the lock held;
+ * if another thread filled the slot meanwhile, the later one wins.
+ */
 static PyObject *
-membership_msg_getattr(MembershipMsg *self, char *name)
-{
-	return PyMember_Get((char *)self, MembershipMsg_memberlist, name);
-}
-
-static PyTypeObject MembershipMsg_Type = {
-	/* The ob_type field must be initialized in the module init function
-	 * to be portable to Windows without using C++. */
-	PyObject_HEAD_INIT(NULL)
-	0,					/* ob_size */
-	"MembershipMsg",			/* tp_name */
-	sizeof(MembershipMsg),			/* tp_basicsize */
-	0,					/* tp_itemsize */
-	/* methods */
-	(destructor)membership_msg_dealloc,	/* tp_dealloc */
-	0,					/* tp_print */
-	(getattrfunc)membership_msg_getattr,	/* tp_getattr */
-	0,					/* tp_setattr */
-	0,					/* tp_compare */
-	0,					/* tp_repr */
-	0,					/* tp_as_number */
-	0,					/* tp_as_sequence */
-	0,					/* tp_as_mapping */
-};
+cache_name(NameCache *c, const char *name)
+{
+	NameSlot *slot = NULL;
+	PyObject *s, *old = NULL;
+	unsigned long h = name_hash(name);
+	size_t len;
+
+	LOCK(c);
+	if (c->size > 0 && c->names == NULL)
+		c->names = calloc(c->size, sizeof(NameSlot));
+	if (c->names != NULL) {
+		slot = &c->names[h & (c->size - 1)];
+		if (slot->str != NULL &&
+		    strncmp(slot->name, name, MAX_GROUP_NAME) == 0) {
+			c->hits++;
+			s = slot->str;
+			Py_INCREF(s);
+			UNLOCK(c);
+			return s;
+		}
+		c->misses++;
+	}
+	UNLOCK(c);
+
+	s = Name_FromString(name);
+	if (s == NULL || slot == NULL)
+		return s;
+	/* Interned, so dict lookups keyed on names compare by identity. */
+	Name_InternInPlace(&s);
+	LOCK(c);
+	/* A resize may have replaced the table since. */
+	if (c->names != NULL && slot == &c->names[h & (c->size - 1)]) {
+		old = slot->str;
+		len = strlen(name);
+		if (len >= MAX_GROUP_NAME)
+			len = MAX_GROUP_NAME - 1;
+		memcpy(slot->name, name, len);
+		slot->name[len] = '\0';
+		Py_INCREF(s);
+		slot->str = s;
+	}
+	UNLOCK(c);
+	Py_XDECREF(old);
+	return s;
+}
 
+/* Return a new reference to a tuple of the n names in groups, from the
+ * cache if the same list of names was seen recently.
+ */
 static PyObject *
-new_regular_msg(PyObject *sender, int num_groups,
-		char (*groups)[MAX_GROUP_NAME], int msg_type,
-		int endian, PyObject *message)
+cache_groups(NameCache *c, int n, char (*groups)[MAX_GROUP_NAME])
 {
-	RegularMsg *self;
+	GroupsSlot *slot = NULL;
+	PyObject *t, *old = NULL;
+	unsigned long h = n;
 	int i;
 
-	self = PyObject_New(RegularMsg, &RegularMsg_Type);
-	if (self == NULL)
-		return NULL;
+	for (i = 0; i < n; i++)
+		h = h * 1000003UL ^ name_hash(groups[i]);
+	LOCK(c);
+	if (c->size > 0 && c->groups == NULL)
+		c->groups = calloc(GROUPS_CACHE_SIZE, sizeof(GroupsSlot));
+	if (c->groups != NULL) {
+		slot = &c->groups[h & (GROUPS_CACHE_SIZE - 1)];
+		t = slot->groups;
+		if (t != NULL && slot->hash == h && PyTuple_GET_SIZE(t) == n) {
+			for (i = 0; i < n; i++)
+				if (strncmp(Name_AsString(
+						PyTuple_GET_ITEM(t, i)),
+					    groups[i], MAX_GROUP_NAME) != 0)
+					break;
+			if (i == n) {
+				c->groups_hits++;
+				Py_INCREF(t);
+				UNLOCK(c);
+				return t;
+			}
+		}
+		c->groups_misses++;
+	}
+	UNLOCK(c);
 
-	self->message = NULL;
-	self->sender = NULL;
-	assert(num_groups >= 0);
-	self->groups = PyTuple_New(num_groups);
-	if (self->groups == NULL) {
-		Py_DECREF(self);
+	t = PyTuple_New(n);
+	if (t == NULL)
 		return NULL;
-	}
-	for (i = 0; i < num_groups; ++i) {
-		PyObject *s = PyString_FromString(groups[i]);
+	for (i = 0; i < n; ++i) {
+		PyObject *s = cache_name(c, groups[i]);
 		if (!s) {
-			Py_DECREF(self);
+			Py_DECREF(t);
 			return NULL;
 		}
-		PyTuple_SET_ITEM(self->groups, i, s);
+		PyTuple_SET_ITEM(t, i, s);
 	}
-
-	Py_INCREF(sender);
-	self->sender = sender;
-	Py_INCREF(message);
-	self->message = message;
-	self->msg_type = msg_type;
-	self->endian = endian;
-	return (PyObject *)self;
+	if (slot != NULL) {
+		LOCK(c);
+		if (c->groups != NULL &&
+		    slot == &c->groups[h & (GROUPS_CACHE_SIZE - 1)]) {
+			old = slot->groups;
+			Py_INCREF(t);
+			slot->groups = t;
+			slot->hash = h;
+		}
+		UNLOCK(c);
+		Py_XDECREF(old);
+	}
+	return t;
 }
 
-static void
-regular_msg_dealloc(RegularMsg *self)
-{
-	Py_XDECREF(self->sender);
-	Py_XDECREF(self->groups);
+#define CAUSED_BY_MASK (CAUSED_BY_JOIN | CAUSED_BY_LEAVE | \
+                        CAUSED_BY_DISCONNECT | CAUSED_BY_NETWORK)
+
+/* Message objects are recycled through a small freelist per type, so a
+ * steady stream of receives doesn't call the allocator for them.
+ */
+#define MSG_FREELIST_SIZE 128
+
+static struct {
+	MembershipMsg *membership[MSG_FREELIST_SIZE];
+	int num_membership;
+	RegularMsg *regular[MSG_FREELIST_SIZE];
+	int num_regular;
+	MUTEX
+} msg_free;
+
+/* Membership messages keep a copy of the member names and the message
+ * body, and only decode them into members, and into group_id,
+ * changed_member and extra, when those are first looked at.  If the
+ * members tuple has been built already (see view_update()), it is passed
+ * in as members_tuple, else that is NULL.
+ */
+static PyObject *
+new_membership_msg(NameCache *cache, int type, PyObject *group,
+		   int num_members, char (*members)[MAX_GROUP_NAME],
+		   char *buffer, int size, PyObject *members_tuple)
+{
+	MembershipMsg *self;
+	size_t members_size = MAX_GROUP_NAME * (size_t)num_members;
+	char *block;
+
+	assert(group != NULL);
+	block = malloc(members_size + size + 1);
+	if (block == NULL)
+		return PyErr_NoMemory();
+	LOCK(&msg_free);
+	self = NULL;
+	if (msg_free.num_membership > 0)
+		self = msg_free.membership[--msg_free.num_membership];
+	UNLOCK(&msg_free);
+	if (self != NULL)
+		(void)PyObject_INIT(self, MembershipMsg_Type);
+	else {
+		self = PyObject_New(MembershipMsg, MembershipMsg_Type);
+		if (self == NULL) {
+			free(block);
+			return NULL;
+		}
+	}
+	MUTEX_INIT(self);
+	self->reason = type & CAUSED_BY_MASK; /* from sp.h defines */
+	self->msg_subtype = type & (TRANSITION_MESS | REG_MEMB_MESS);
+	Py_INCREF(group);
+	self->group = group;
+	Py_XINCREF(members_tuple);
+	self->members = members_tuple;
+	self->extra = NULL;
+	self->group_id = NULL;
+	self->changed_member = NULL;
+	self->svc_type = type;
+	self->num_members = num_members;
+	self->raw_members = (char (*)[MAX_GROUP_NAME])block;
+	self->raw_body = block + members_size;
+	memcpy(self->raw_members, members, members_size);
+	memcpy(self->raw_body, buffer, size);
+	cache_incref(cache);
+	self->cache = cache;
+	return (PyObject *)self;
+}
+
+/* Free the raw copy once everything has been decoded from it. */
+static void
+membership_msg_drop_raw(MembershipMsg *self)
+{
+	if (self->members != NULL && self->group_id != NULL &&
+	    self->cache != NULL) {
+		free(self->raw_members);
+		self->raw_members = NULL;
+		self->raw_body = NULL;
+		cache_decref(self->cache);
+		self->cache = NULL;
+	}
+}
+
+static int
+membership_msg_decode_members(MembershipMsg *self)
+{
+	PyObject *members;
+	int i;
+
+	members = PyTuple_New(self->num_members);
+	if (members == NULL)
+		return -1;
+	for (i = 0; i < self->num_members; ++i) {
+		PyObject *s = cache_name(self->cache, self->raw_members[i]);
+		if (!s) {
+			Py_DECREF(members);
+			return -1;
+		}
+		PyTuple_SET_ITEM(members, i, s);
+	}
+	self->members = members;
+	membership_msg_drop_raw(self);
+	return 0;
+}
+
+static int
+membership_msg_decode_info(MembershipMsg *self)
+{
+	int type = self->svc_type;
+	group_id grp_id;
+	membership_info memb_info;
+	int32 num_extra_members = 0;
+	PyObject *gid = NULL, *changed = NULL, *extra = NULL;
+	int i;
+	int ret;
+
+	if ((ret = SP_get_memb_info(self->raw_body, type, &memb_info)) < 0) {
+		PyErr_Format(SpreadError, "error %d on SP_get_memb_info", ret);
+		return -1;
+	}
+
+	memcpy(&grp_id, &memb_info.gid, sizeof(group_id));
+	gid = new_group_id(grp_id);
+	if (gid == NULL)
+		return -1;
+
+	/* The extra attribute is a tuple initialized for 0 or more items.
+	 * If the member event is a single member event such as a join,
+	 * leave or disconnect, the changed member attribute is set from
+	 * memb_info.changed_member and a single value from vs_set, which is
+	 * stored inside the message, is added to extra tuple.  If the member
+	 * event is a merge or partition, the list of member names from
+	 * vs_set is stored in extra.
+	 */
+	if (Is_reg_memb_mess(type) && (Is_caused_join_mess(type) ||
+				       Is_caused_disconnect_mess(type) ||
+				       Is_caused_leave_mess(type)))
+		changed = cache_name(self->cache, memb_info.changed_member);
+	else
+		changed = Py_BuildValue("");
+	if (changed == NULL)
+		goto Error;
+
+	num_extra_members = memb_info.my_vs_set.num_members;
+	extra = PyTuple_New(num_extra_members);
+	if (extra == NULL)
+		goto Error;
+
+	if (num_extra_members > 0) {
+		char (*member_names)[MAX_GROUP_NAME] = (char (*)[MAX_GROUP_NAME])
+			malloc(num_extra_members * MAX_GROUP_NAME);
+
+		if (member_names == NULL) {
+			PyErr_NoMemory();
+			goto Error;
+		}
+		if ((ret = SP_get_vs_set_members(self->raw_body,
+						 &memb_info.my_vs_set,
+						 member_names,
+						 num_extra_members)) < 0) {
+			PyErr_Format(SpreadError,
+				     "error %d on SP_get_vs_set_members", ret);
+			free(member_names);
+			goto Error;
+		}
+		for (i = 0; i < num_extra_members; i++) {
+			PyObject *s = cache_name(self->cache, member_names[i]);
+			if (!s) {
+				free(member_names);
+				goto Error;
+			}
+			PyTuple_SET_ITEM(extra, i, s);
+		}
+		free(member_names);
+	}
+
+	self->group_id = gid;
+	self->changed_member = changed;
+	self->extra = extra;
+	membership_msg_drop_raw(self);
+	return 0;
+
+Error:
+	Py_XDECREF(gid);
+	Py_XDECREF(changed);
+	Py_XDECREF(extra);
+	return -1;
+}
+
+static void
+membership_msg_dealloc(MembershipMsg *self)
+{
+	Py_XDECREF(self->group);
+	Py_XDECREF(self->members);
+	Py_XDECREF(self->extra);
+	Py_XDECREF(self->group_id);
+  Py_XDECREF(self->changed_member);
+	if (self->cache != NULL) {
+		free(self->raw_members);
+		cache_decref(self->cache);
+	}
+	LOCK(&msg_free);
+	if (msg_free.num_membership < MSG_FREELIST_SIZE) {
+		msg_free.membership[msg_free.num_membership++] = self;
+		self = NULL;
+	}
+	UNLOCK(&msg_free);
+	if (self != NULL)
+		PyObject_Del(self);
+	HEAPTYPE_DECREF(MembershipMsg_Type);
+}
+
+#define OFF(x) offsetof(MembershipMsg, x)
+
+static PyMemberDef MembershipMsg_members[] = {
+	{"reason",	T_INT,		OFF(reason),	READONLY},
+	{"msg_subtype",	T_INT,		OFF(msg_subtype),	READONLY},
+	{"group",	T_OBJECT,	OFF(group),	READONLY},
+	{NULL}
+};
+
+#undef OFF
+
+static PyObject *
+membership_msg_get_members(MembershipMsg *self, void *closure)
+{
+	PyObject *v = NULL;
+
+	LOCK(self);
+	if (self->members != NULL ||
+	    membership_msg_decode_members(self) == 0) {
+		v = self->members;
+		Py_INCREF(v);
+	}
+	UNLOCK(self);
+	return v;
+}
+
+/* group_id, changed_member and extra:  closure is the field's offset. */
+static PyObject *
+membership_msg_get_info(MembershipMsg *self, void *closure)
+{
+	PyObject *v = NULL;
+
+	LOCK(self);
+	if (self->group_id != NULL || membership_msg_decode_info(self) == 0) {
+		v = *(PyObject **)((char *)self + (size_t)closure);
+		Py_INCREF(v);
+	}
+	UNLOCK(self);
+	return v;
+}
+
+static PyGetSetDef MembershipMsg_getset[] = {
+	{"members",	(getter)membership_msg_get_members},
+	{"group_id",	(getter)membership_msg_get_info, NULL, NULL,
+	 (void *)offsetof(MembershipMsg, group_id)},
+	{"changed_member",	(getter)membership_msg_get_info, NULL, NULL,
+	 (void *)offsetof(MembershipMsg, changed_member)},
+	{"extra",	(getter)membership_msg_get_info, NULL, NULL,
+	 (void *)offsetof(MembershipMsg, extra)},
+	{NULL}
+};
+
+static PyType_Slot MembershipMsg_slots[] = {
+	{Py_tp_dealloc, membership_msg_dealloc},
+	{Py_tp_members, MembershipMsg_members},
+	{Py_tp_getset, MembershipMsg_getset},
+	{0, NULL}
+};
+
+static PyType_Spec MembershipMsg_spec = {
+	"spread.MembershipMsg",			/* name */
+	sizeof(MembershipMsg),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	MembershipMsg_slots			/* slots */
+};
+
+/* The groups tuple of a regular message is only built (through the name
+ * cache) when it is first looked at; until then the message keeps a copy
+ * of the names.
+ */
+static PyObject *
+new_regular_msg(NameCache *cache, PyObject *sender, int num_groups,
+		char (*groups)[MAX_GROUP_NAME], int msg_type, int endian,
+		PyObject *message)
+{
+	RegularMsg *self;
+
+	LOCK(&msg_free);
+	self = NULL;
+	if (msg_free.num_regular > 0)
+		self = msg_free.regular[--msg_free.num_regular];
+	UNLOCK(&msg_free);
+	if (self != NULL)
+		(void)PyObject_INIT(self, RegularMsg_Type);
+	else {
+		self = PyObject_New(RegularMsg, RegularMsg_Type);
+		if (self == NULL)
+			return NULL;
+	}
+
+	MUTEX_INIT(self);
+	self->groups = NULL;
+	self->num_groups = num_groups;
+	if (num_groups <= 1)
+		self->raw_groups = &self->group0;
+	else {
+		self->raw_groups = malloc(MAX_GROUP_NAME * num_groups);
+		if (self->raw_groups == NULL) {
+			self->cache = NULL;
+			self->sender = self->message = NULL;
+			Py_DECREF(self);
+			return PyErr_NoMemory();
+		}
+	}
+	memcpy(self->raw_groups, groups, MAX_GROUP_NAME * num_groups);
+	cache_incref(cache);
+	self->cache = cache;
+	Py_INCREF(sender);
+	self->sender = sender;
+	Py_INCREF(message);
+	self->message = message;
+	self->msg_type = msg_type;
+	self->endian = endian;
+	return (PyObject *)self;
+}
+
+static void
+regular_msg_drop_raw(RegularMsg *self)
+{
+	if (self->raw_groups != &self->group0)
+		free(self->raw_groups);
+	self->raw_groups = NULL;
+	if (self->cache != NULL)
+		cache_decref(self->cache);
+	self->cache = NULL;
+}
+
+static void
+regular_msg_dealloc(RegularMsg *self)
+{
+	Py_XDECREF(self->sender);
+	Py_XDECREF(self->groups);
 	Py_XDECREF(self->message);
-	PyObject_Del(self);
+	regular_msg_drop_raw(self);
+	LOCK(&msg_free);
+	if (msg_free.num_regular < MSG_FREELIST_SIZE) {
+		msg_free.regular[msg_free.num_regular++] = self;
+		self = NULL;
+	}
+	UNLOCK(&msg_free);
+	if (self != NULL)
+		PyObject_Del(self);
+	HEAPTYPE_DECREF(RegularMsg_Type);
 }
 
 #define OFF(x) offsetof(RegularMsg, x)
 
-static struct memberlist RegularMsg_memberlist[] = {
-	{"msg_type", T_INT,		OFF(msg_type)},
-	{"endian",   T_INT,		OFF(endian)},
-	{"sender",   T_OBJECT,		OFF(sender)},
-	{"groups",   T_OBJECT,		OFF(groups)},
-	{"message",  T_OBJECT,		OFF(message)},
+static PyMemberDef RegularMsg_members[] = {
+	{"msg_type", T_INT,		OFF(msg_type),	READONLY},
+	{"endian",   T_INT,		OFF(endian),	READONLY},
+	{"sender",   T_OBJECT,		OFF(sender),	READONLY},
+	{"message",  T_OBJECT,		OFF(message),	READONLY},
 	{NULL}
 };
 
 #undef OFF
 
 static PyObject *
-regular_msg_getattr(RegularMsg *self, char *name)
-{
-	return PyMember_Get((char *)self, RegularMsg_memberlist, name);
-}
-
-static PyTypeObject RegularMsg_Type = {
-	/* The ob_type field must be initialized in the module init function
-	 * to be portable to Windows without using C++. */
-	PyObject_HEAD_INIT(NULL)
-	0,					/* ob_size */
-	"RegularMsg",				/* tp_name */
-	sizeof(RegularMsg),			/* tp_basicsize */
-	0,					/* tp_itemsize */
-	/* methods */
-	(destructor)regular_msg_dealloc,	/* tp_dealloc */
-	0,					/* tp_print */
-	(getattrfunc)regular_msg_getattr,	/* tp_getattr */
-	0,					/* tp_setattr */
-	0,					/* tp_compare */
-	0,					/* tp_repr */
-	0,					/* tp_as_number */
-	0,					/* tp_as_sequence */
-	0,					/* tp_as_mapping */
+regular_msg_get_groups(RegularMsg *self, void *closure)
+{
+	PyObject *v;
+
+	LOCK(self);
+	if (self->groups == NULL) {
+		self->groups = cache_groups(self->cache, self->num_groups,
+					    self->raw_groups);
+		if (self->groups != NULL)
+			regular_msg_drop_raw(self);
+	}
+	v = self->groups;
+	Py_XINCREF(v);
+	UNLOCK(self);
+	return v;
+}
+
+static PyGetSetDef RegularMsg_getset[] = {
+	{"groups",	(getter)regular_msg_get_groups},
+	{NULL}
+};
+
+static PyType_Slot RegularMsg_slots[] = {
+	{Py_tp_dealloc, regular_msg_dealloc},
+	{Py_tp_members, RegularMsg_members},
+	{Py_tp_getset, RegularMsg_getset},
+	{0, NULL}
+};
+
+static PyType_Spec RegularMsg_spec = {
+	"spread.RegularMsg",			/* name */
+	sizeof(RegularMsg),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	RegularMsg_slots			/* slots */
 };
 
 static MailboxObject *
 new_mailbox(mailbox mbox)
 {
 	MailboxObject *self;
-	self = PyObject_New(MailboxObject, &Mailbox_Type);
-	if (self == NULL)
+	NameCache *names;
+
+	names = cache_new(DEFAULT_NAME_CACHE_SIZE);
+	if (names == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	self = PyObject_GC_New(MailboxObject, Mailbox_Type);
+	if (self == NULL) {
+		cache_decref(names);
 		return NULL;
+	}
 	self->mbox = mbox;
 	self->private_group = NULL;
 	self->disconnected = 0;
-#ifdef SPREAD_DISCONNECT_RACE_BUG
-	self->spread_lock = NULL;
+	self->closing = 0;
+	self->inflight = 0;
+#ifdef WITH_THREAD
+	self->drained = NULL;
+#endif
+#ifndef MS_WINDOWS
+	self->wake[0] = self->wake[1] = -1;
+#endif
+	self->rbuf = NULL;
+	self->rbuf_size = 0;
+	self->rgroups = NULL;
+	self->rgroups_size = 0;
+	self->rbuf_busy = 0;
+	self->rbuf_min = DEFAULT_BUFFER_SIZE;
+	self->rbuf_max = DEFAULT_BUFFER_MAX;
+	self->rbuf_window = DEFAULT_BUFFER_WINDOW;
+	self->window_count = 0;
+	self->window_size = 0;
+	self->window_groups = 0;
+	self->rbuf_grows = 0;
+	self->rbuf_shrinks = 0;
+	self->rbuf_retries = 0;
+	self->rbuf_saved = 0;
+	self->rbuf_high = 0;
+	self->names = names;
+	self->views = NULL;
+	self->view_groups = NULL;
+	self->view_version = 0;
+	self->filter = NULL;
+	self->handlers = NULL;
+	self->handlers_size = 0;
+	self->on_membership = NULL;
+	self->run_stop = 0;
+	self->receiving = 0;
+	self->batcher = NULL;
+	self->unbatch = 0;
+	self->frames = NULL;
+	self->frames_tail = NULL;
+	self->z_msgs = 0;
+	self->z_skipped = 0;
+	self->z_in = 0;
+	self->z_out = 0;
+	self->z_time = 0;
+	self->unz_msgs = 0;
+	self->unz_in = 0;
+	self->unz_out = 0;
+	self->unz_time = 0;
+	self->frag_seq = 0;
+	self->partials = NULL;
+	self->reasm_bytes = 0;
+	self->reasm_max = DEFAULT_REASSEMBLY_MAX;
+	self->reasm_done = 0;
+	self->reasm_evicted = 0;
+	self->reasm_left = 0;
+	self->reasm_dropped = 0;
+	memset(&self->stats, 0, sizeof(MboxStats));
+	self->idle_since = 0;
+	self->stamp = 0;
+	self->lat = NULL;
+	self->lat_size = 0;
+	self->lat_used = 0;
+#ifdef HAVE_RECEIVER
+	self->queue = NULL;
 #endif
+	PyObject_GC_Track(self);
 	return self;
 }
 
 /* mailbox methods */
 
+/* Callbacks registered with register() usually refer to their mailbox
+ * (bound methods, closures), so the collector has to see them.
+ */
+static int
+mailbox_traverse(MailboxObject *self, visitproc visit, void *arg)
+{
+	int i;
+
+	for (i = 0; self->handlers != NULL && i < self->handlers_size; i++)
+		Py_VISIT(self->handlers[i].callback);
+	Py_VISIT(self->on_membership);
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	return 0;
+}
+
+static int
+mailbox_clear(MailboxObject *self)
+{
+	Handler *handlers = self->handlers;
+	int size = self->handlers_size;
+
+	self->handlers = NULL;
+	self->handlers_size = 0;
+	handlers_free(handlers, size);
+	Py_CLEAR(self->on_membership);
+	return 0;
+}
+
 static void
 mailbox_dealloc(MailboxObject *self)
 {
+	PyObject_GC_UnTrack(self);
+#ifdef HAVE_RECEIVER
+	if (self->queue != NULL)
+		receiver_stop(self, NULL);
+#endif
+	if (self->batcher != NULL) {
+		batch_close(self->batcher, self->disconnected == 0);
+		batch_decref(self->batcher);
+	}
 	if (self->disconnected == 0)
 		SP_disconnect(self->mbox);
-	Py_DECREF(self->private_group);
-#ifdef SPREAD_DISCONNECT_RACE_BUG
-	if (self->spread_lock)
-		PyThread_free_lock(self->spread_lock);
+	Py_XDECREF(self->private_group);
+#ifdef WITH_THREAD
+	if (self->drained)
+		PyThread_free_lock(self->drained);
 #endif
-	PyObject_Del(self);
+#ifndef MS_WINDOWS
+	if (self->wake[0] >= 0) {
+		close(self->wake[0]);
+		close(self->wake[1]);
+	}
+#endif
+	free(self->rbuf);
+	free(self->rgroups);
+	cache_decref(self->names);
+	Py_XDECREF(self->views);
+	Py_XDECREF(self->view_groups);
+	if (self->filter != NULL)
+		filter_decref(self->filter);
+	handlers_free(self->handlers, self->handlers_size);
+	Py_XDECREF(self->on_membership);
+	frames_free(self->frames);
+	partials_free(self->partials);
+	lat_free(self->lat, self->lat_size);
+	PyObject_GC_Del(self);
+	HEAPTYPE_DECREF(Mailbox_Type);
 }
 
 static PyObject *
@@ -481,165 +1839,714 @@ err_disconnected(char *methodname)
 	return NULL;
 }
 
-static PyObject *
-mailbox_disconnect(MailboxObject *self, PyObject *args)
+/* Count a call into Spread as in progress, so disconnect() waits for it
+ * before closing the connection.  Called with the GIL held (attached, on
+ * a free-threaded build), just before releasing it for the call.
+ * Returns 0, or sets an exception and returns -1 if the mailbox is closed
+ * or closing.
+ */
+static int
+mbox_enter(MailboxObject *self, char *methodname)
 {
-	PyObject *result = Py_None;
+	int usable;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	usable = !self->disconnected && !self->closing;
+	if (usable)
+		self->inflight++;
+	Py_END_CRITICAL_SECTION();
+	if (!usable) {
+		err_disconnected(methodname);
+		return -1;
+	}
+	return 0;
+}
 
-	if (!PyArg_ParseTuple(args, ":disconnect"))
-		return NULL;
-	if (!self->disconnected) {
-		ACQUIRE_MBOX_LOCK(self);
-		if (!self->disconnected) {
-			int err;
-			self->disconnected = 1;
-			Py_BEGIN_ALLOW_THREADS
-			err = SP_disconnect(self->mbox);
-			Py_END_ALLOW_THREADS
-			if (err != 0)
-				result = spread_error(err, self);
+/* End a call counted by mbox_enter(), whose result was err.  Called with
+ * the GIL held, as soon as it is taken back and before anything that
+ * could run Python code, which might be a disconnect() that would then
+ * wait for this very call.
+ */
+static void
+mbox_leave(MailboxObject *self, int err)
+{
+	note_disconnect(err, self);
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (--self->inflight == 0 && self->closing) {
+#ifdef WITH_THREAD
+		PyThread_release_lock(self->drained);
+#endif
+	}
+	Py_END_CRITICAL_SECTION();
+}
+
+/* The read end of the pipe disconnect() writes to, made the first time a
+ * receive is going to wait.  Returns -1 where there is no such pipe, and
+ * sets an exception and returns -2 if it can't be made.
+ */
+static int
+mbox_wake(MailboxObject *self)
+{
+#ifdef MS_WINDOWS
+	return -1;
+#else
+	int fd, err = 0;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->wake[0] < 0 && pipe_open(self->wake) < 0) {
+		err = errno;
+		self->wake[0] = self->wake[1] = -1;
+	}
+	fd = self->wake[0];
+	Py_END_CRITICAL_SECTION();
+	if (err) {
+		errno = err;
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -2;
+	}
+	return fd;
+#endif
+}
+
+/* Count a receive as running on self, and the time since the last one
+ * ended as time spent in Python.  Called in a critical section on self.
+ * Returns that time.
+ */
+static double
+receive_started(MailboxObject *self, double now)
+{
+	double idle = 0;
+
+	if (self->receiving++ == 0 && self->idle_since > 0) {
+		idle = now - self->idle_since;
+		self->stats.python += idle;
+	}
+	return idle;
+}
+
+/* Check that a receive method may run on this mailbox, and count it as
+ * running; the caller calls end_receive() when done, with the time stored
+ * in *start.  Returns 0, or sets an exception and returns -1.
+ */
+static int
+begin_receive(MailboxObject *self, char *methodname, double *start)
+{
+	int busy = 0;
+	double idle = 0;
+
+	*start = stat_clock();
+#ifdef HAVE_RECEIVER
+	Py_BEGIN_CRITICAL_SECTION(self);
+	busy = self->queue != NULL;
+	if (!busy)
+		idle = receive_started(self, *start);
+	Py_END_CRITICAL_SECTION();
+	if (busy) {
+		PyErr_Format(SpreadError,
+			     "%s() called while the receiver is running; "
+			     "use mbox.queue", methodname);
+		return -1;
+	}
+#else
+	idle = receive_started(self, *start);
+#endif
+	if (idle > 0) {
+		LOCK(&all_stats);
+		all_stats.stats.python += idle;
+		UNLOCK(&all_stats);
+	}
+	if (mbox_enter(self, methodname) < 0) {
+		Py_BEGIN_CRITICAL_SECTION(self);
+		self->receiving--;
+		Py_END_CRITICAL_SECTION();
+		return -1;
+	}
+	return 0;
+}
+
+/* End a receive counted by begin_receive(), adding what it counted in rs
+ * (and the time since start, as time blocked) to the statistics.
+ */
+static void
+end_receive(MailboxObject *self, int err, RecvStats *rs, double start)
+{
+	double now = stat_clock();
+
+	rs->blocked += now - start;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (--self->receiving == 0)
+		self->idle_since = now;
+	Py_END_CRITICAL_SECTION();
+	stats_receive_done(self, rs);
+	mbox_leave(self, err);
+}
+
+/* Stop new calls on the mailbox, wake the receives waiting in it, and wait
+ * (without the GIL) for the calls in progress to return.  Returns 1 if
+ * the caller should go on to SP_disconnect(); 0 if there is nothing left
+ * to do, because the mailbox is closed, or another thread's disconnect()
+ * is already at it, or a call that was in progress found the connection
+ * gone (so Spread has closed the socket already); or -1 with an exception
+ * set, in which case the mailbox is usable again.
+ */
+static int
+mbox_drain(MailboxObject *self)
+{
+	int wait = 0, result = 1;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->disconnected || self->closing)
+		result = 0;
+	else {
+#ifdef WITH_THREAD
+		if (self->inflight > 0 && self->drained == NULL)
+			self->drained = PyThread_allocate_lock();
+		if (self->inflight > 0 && self->drained == NULL)
+			result = -1;
+		else if (self->inflight > 0) {
+			/* Take the lock now, while inflight can't change;
+			 * the last call out releases it, and the second
+			 * acquire below waits for that. */
+			PyThread_acquire_lock(self->drained, 1);
+			wait = 1;
+		}
+#endif
+		/* Only once nothing can fail:  a wake left in the pipe
+		 * would fail every later receive with CONNECTION_CLOSED. */
+		if (result > 0) {
+			self->closing = 1;
+#ifndef MS_WINDOWS
+			if (self->wake[1] >= 0)
+				pipe_signal(self->wake[1]);
+#endif
 		}
-		RELEASE_MBOX_LOCK(self);
 	}
-	Py_XINCREF(result);
+	Py_END_CRITICAL_SECTION();
+	if (result < 0) {
+		PyErr_NoMemory();
+		return -1;
+	}
+#ifdef WITH_THREAD
+	if (wait) {
+		Py_BEGIN_ALLOW_THREADS
+		PyThread_acquire_lock(self->drained, 1);
+		Py_END_ALLOW_THREADS
+		PyThread_release_lock(self->drained);
+	}
+#endif
+	if (result) {
+		Py_BEGIN_CRITICAL_SECTION(self);
+		if (self->disconnected)
+			result = 0;
+		self->disconnected = 1;
+		Py_END_CRITICAL_SECTION();
+	}
 	return result;
 }
 
+/* Let go of run()'s callbacks.  They often refer back to the mailbox,
+ * which the garbage collector can't see through, so disconnect() breaks
+ * those cycles here.
+ */
+static void
+mbox_forget_callbacks(MailboxObject *self)
+{
+	Handler *handlers;
+	PyObject *on_membership;
+	int size;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	handlers = self->handlers;
+	size = self->handlers_size;
+	on_membership = self->on_membership;
+	self->handlers = NULL;
+	self->handlers_size = 0;
+	self->on_membership = NULL;
+	Py_END_CRITICAL_SECTION();
+	handlers_free(handlers, size);
+	Py_XDECREF(on_membership);
+}
+
+/* Close the mailbox:  wait for calls in progress, stop the receiver
+ * thread, send what batching has gathered, and end the session.  Returns
+ * -1 with an exception set, or 0 with *err set to SP_disconnect()'s error
+ * or the last batch's (0 if none, or if the mailbox was already closed).
+ */
+static int
+mbox_close(MailboxObject *self, int *err)
+{
+	Batcher *b;
+	int r, batch_err = 0;
+
+	*err = 0;
+	r = mbox_drain(self);
+	if (r < 0)
+		return -1;
+#ifdef HAVE_RECEIVER
+	/* The thread isn't counted as a call in progress, but once the
+	 * mailbox is closing no new one can start. */
+	if (receiver_stop(self, NULL) < 0)
+		return -1;
+#endif
+	Py_BEGIN_CRITICAL_SECTION(self);
+	b = self->batcher;
+	self->batcher = NULL;
+	Py_END_CRITICAL_SECTION();
+	if (b != NULL) {
+		batch_err = batch_close(b, r > 0);
+		batch_decref(b);
+	}
+	if (r > 0) {
+		Py_BEGIN_ALLOW_THREADS
+		*err = SP_disconnect(self->mbox);
+		Py_END_ALLOW_THREADS
+	}
+	if (*err == 0)
+		*err = batch_err;
+	mbox_forget_callbacks(self);
+	return 0;
+}
+
 static PyObject *
-mailbox_fileno(MailboxObject *self, PyObject *args)
+mailbox_disconnect(MailboxObject *self, PyObject *unused)
 {
-	if (!PyArg_ParseTuple(args, ":fileno"))
+	int err;
+
+	if (mbox_close(self, &err) < 0)
 		return NULL;
-	if (self->disconnected)
+	if (err != 0)
+		return spread_error(err, self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_fileno(MailboxObject *self, PyObject *unused)
+{
+	int closed;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	closed = self->disconnected;
+	Py_END_CRITICAL_SECTION();
+	if (closed)
 		return err_disconnected("fileno");
 	return PyInt_FromLong(self->mbox);
 }
 
 static PyObject *
-mailbox_join(MailboxObject *self, PyObject *args)
+mailbox_join(MailboxObject *self, PyObject *arg)
 {
-	char *group;
+	const char *group = NULL;
 	PyObject *result = Py_None;
 
-	if (!PyArg_ParseTuple(args, "s:join", &group))
+	if (arg_name(arg, &group) < 0)
 		return NULL;
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected)
-		result = err_disconnected("join");
+	if (mbox_enter(self, "join") < 0)
+		result = NULL;
 	else {
 		int err;
 		Py_BEGIN_ALLOW_THREADS
 		err = SP_join(self->mbox, group);
 		Py_END_ALLOW_THREADS
+		mbox_leave(self, err);
 		if (err < 0)
 			result = spread_error(err, self);
 	}
-	RELEASE_MBOX_LOCK(self);
 	Py_XINCREF(result);
 	return result;
 }
 
 static PyObject *
-mailbox_leave(MailboxObject *self, PyObject *args)
+mailbox_leave(MailboxObject *self, PyObject *arg)
 {
-	char *group;
+	const char *group = NULL;
 	PyObject *result = Py_None;
 
-	if (!PyArg_ParseTuple(args, "s:leave", &group))
+	if (arg_name(arg, &group) < 0)
 		return NULL;
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected)
-		result = err_disconnected("leave");
+	if (mbox_enter(self, "leave") < 0)
+		result = NULL;
 	else {
 		int err;
 		Py_BEGIN_ALLOW_THREADS
 		err = SP_leave(self->mbox, group);
 		Py_END_ALLOW_THREADS
+		mbox_leave(self, err);
 		if (err < 0)
 			result = spread_error(err, self);
 	}
-	RELEASE_MBOX_LOCK(self);
 	Py_XINCREF(result);
 	return result;
 }
 
-static PyObject *
-mailbox_receive(MailboxObject *self, PyObject *args)
-{
-	/* CAUTION:  initializing svc_type is critical.  It's not clear from
-	 * the docs, but this is an input as well as an output parameter.
-	 * We didn't initialize it before, and very rarely the DROP_RECV flag
-	 * would end up getting set in it.  That in turn has miserable
-	 * consequences, and consequences only visible if a buffer (data or
-	 * group) is too small for the msg being received (so it goes crazy
-	 * at the worst possible times).
-	 */
+/* A message as SP_receive() left it, before any Python objects exist.
+ * raw_receive() runs without the GIL, so the buffers are plain C memory;
+ * build_msg() turns the result into a message object afterwards.
+ */
+typedef struct {
 	service svc_type;
-	int num_groups, endian, size;
+	char sender[MAX_GROUP_NAME];
+	int num_groups;
 	int16 msg_type;
+	int endian;
+	int size;
+	char (*groups)[MAX_GROUP_NAME];
+	int max_groups;
+	char *data;
+	int bufsize;
+	int own_groups;		/* groups was malloc'ed by raw_receive() */
+	int own_data;		/* data was malloc'ed by raw_receive() */
+	int fixed_data;		/* data belongs to the caller; don't grow it */
+	int retries;		/* buffers were too short this many times */
+	int groups_retries;	/* ... the groups buffer, that is */
+	int codec;		/* data is compressed; see raw_codec() */
+	int orig_size;		/* its length once decompressed */
+	int frag;		/* a fragment; see raw_codec() */
+	int stamped;		/* had a timestamp; see raw_codec() */
+	int skipped;		/* data was moved this far past the buffer
+				   it points into, over the timestamp */
+	long long arrived;	/* realtime_us() when it came, or 0 */
+	long long latency;	/* microseconds from its timestamp to arrived */
+	PyObject *whole;	/* the data of a reassembled message, set
+				   (with the GIL) by reasm_take() */
+	char *assertmsg;
+} RawMsg;
+
+/* raw_receive() failures that aren't Spread error codes */
+#define RAW_NOMEM	1
+#define RAW_ASSERT	2
 
-	char senderbuffer[MAX_GROUP_NAME];
-	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
-	char databuffer[DEFAULT_BUFFER_SIZE];
+static void
+raw_init(RawMsg *rm, char (*groups)[MAX_GROUP_NAME], int max_groups,
+	 char *data, int bufsize)
+{
+	rm->groups = groups;
+	rm->max_groups = max_groups;
+	rm->data = data;
+	rm->bufsize = bufsize;
+	rm->own_groups = 0;
+	rm->own_data = 0;
+	rm->fixed_data = 0;
+	rm->retries = 0;
+	rm->groups_retries = 0;
+	rm->codec = 0;
+	rm->frag = 0;
+	rm->stamped = 0;
+	rm->skipped = 0;
+	rm->arrived = 0;
+	rm->whole = NULL;
+	rm->assertmsg = "internal error";
+}
 
-	int max_groups = DEFAULT_GROUPS_SIZE;
-	char (*groups)[MAX_GROUP_NAME] = groupbuffer;
+/* Point rm->data back at the start of its buffer. */
+static void
+raw_unskip(RawMsg *rm)
+{
+	rm->data -= rm->skipped;
+	rm->skipped = 0;
+}
 
-	int bufsize = DEFAULT_BUFFER_SIZE;
-	char *pbuffer = databuffer;
+static void
+raw_free(RawMsg *rm)
+{
+	raw_unskip(rm);
+	if (rm->own_groups)
+		free(rm->groups);
+	if (rm->own_data)
+		free(rm->data);
+	rm->own_groups = 0;
+	rm->own_data = 0;
+	/* Only ever set with the GIL, so only ever freed with it. */
+	Py_CLEAR(rm->whole);
+}
 
-	PyObject *sender = NULL, *data = NULL, *msg = NULL;
+/* Round a buffer size up to a power of 2 (but at least 'least'), so a
+ * run of slightly different sizes doesn't cost a retry each.
+ */
+static int
+round_size(int n, int least)
+{
+	int size = least;
 
-	if (!PyArg_ParseTuple(args, ":receive"))
-		return NULL;
+	while (size < n && size <= INT_MAX / 2)
+		size <<= 1;
+	return size < n ? n : size;
+}
 
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected) {
-		err_disconnected("receive");
-		goto error;
-	}
+/* Take a timestamp off the message in rm (see STAMPED_MSG_TYPE), noting
+ * its latency:  rm->data is moved past it, rather than the data being
+ * copied down, except into a caller's buffer.  Then note whether it is compressed (see compress_msg()),
+ * and if it is, take its msg_type and length from the header; the data is
+ * decompressed when the message is built.  Likewise note a fragment and
+ * take its msg_type, for the filter; reasm_take() reads the rest.
+ * Called without the GIL.
+ */
+static void
+raw_codec(RawMsg *rm)
+{
+	const unsigned char *p = (const unsigned char *)rm->data;
+	unsigned long size;
 
-	for (;;) {
-		char *assertmsg = "internal error";
+	rm->codec = 0;
+	rm->frag = 0;
+	rm->stamped = 0;
+	if (!Is_regular_mess(rm->svc_type))
+		return;
+	if ((rm->msg_type == STAMPED_MSG_TYPE ||
+	     rm->msg_type == BATCH_MSG_TYPE) && rm->arrived == 0)
+		rm->arrived = realtime_us();
+	if (rm->msg_type == STAMPED_MSG_TYPE && rm->size >= STAMP_HEADER) {
+		unsigned long long sent = 0;
+		int i;
+
+		for (i = 2; i < STAMP_HEADER; i++)
+			sent = sent << 8 | p[i];
+		rm->latency = rm->arrived - (long long)sent;
+		/* Clocks out of step can make it look negative. */
+		if (rm->latency < 0)
+			rm->latency = 0;
+		rm->msg_type = (int16)(p[0] << 8 | p[1]);
+		rm->size -= STAMP_HEADER;
+		if (rm->fixed_data)
+			memmove(rm->data, rm->data + STAMP_HEADER, rm->size);
+		else {
+			rm->data += STAMP_HEADER;
+			rm->skipped += STAMP_HEADER;
+			p = (const unsigned char *)rm->data;
+		}
+		rm->stamped = 1;
+	}
+	if (rm->msg_type == FRAGMENT_MSG_TYPE && rm->size >= FRAGMENT_HEADER) {
+		rm->frag = 1;
+		rm->msg_type = (int16)(p[0] << 8 | p[1]);
+		return;
+	}
+	if (rm->msg_type != COMPRESSED_MSG_TYPE || rm->size < COMPRESS_HEADER)
+		return;
+	size = (unsigned long)p[3] << 24 | p[4] << 16 | p[5] << 8 | p[6];
+	rm->codec = p[0];
+	rm->msg_type = (int16)(p[1] << 8 | p[2]);
+	/* A length no buffer can hold fails as corrupt data. */
+	rm->orig_size = size > INT_MAX ? -1 : (int)size;
+}
 
-		Py_BEGIN_ALLOW_THREADS
-		svc_type = 0;	/* initializing this is critical */
-		size = SP_receive(self->mbox, &svc_type,
-				  senderbuffer,
-				  max_groups, &num_groups, groups,
-				  &msg_type, &endian,
-				  bufsize, pbuffer);
-		Py_END_ALLOW_THREADS
+/* The codecs compiled in, for get_codec() and spread.COMPRESSORS. */
+static const int codecs[] = {
+#ifdef HAVE_LZ4
+	CODEC_LZ4,
+#endif
+#ifdef HAVE_ZLIB
+	CODEC_ZLIB,
+#endif
+	0
+};
 
-		if (size >= 0) {
-			if (num_groups < 0) {
+static const char *
+codec_name(int codec)
+{
+	switch (codec) {
+	case CODEC_ZLIB:
+		return "zlib";
+	case CODEC_LZ4:
+		return "lz4";
+	}
+	return NULL;
+}
+
+/* Compress the len bytes at msg with codec into a new malloc'ed block,
+ * header first (see COMPRESSED_MSG_TYPE), and point *out at it.  Called
+ * without the GIL.  Returns the length of the block; 0 if compression
+ * wouldn't make the message smaller, in which case nothing is allocated;
+ * or -1 if memory is short.
+ */
+static int
+compress_msg(int codec, const char *msg, int len, int msg_type, char **out)
+{
+	unsigned char *buf = NULL;
+	long n = 0;
+
+	*out = NULL;
+	switch (codec) {
+#ifdef HAVE_ZLIB
+	case CODEC_ZLIB: {
+		uLongf zn = compressBound((uLong)len);
+
+		buf = malloc(COMPRESS_HEADER + zn);
+		if (buf == NULL)
+			return -1;
+		/* Messages are compressed for the network's sake, so speed
+		   matters more than the last few percent. */
+		if (compress2(buf + COMPRESS_HEADER, &zn, (const Bytef *)msg,
+			      (uLong)len, Z_BEST_SPEED) == Z_OK)
+			n = (long)zn;
+		break;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4: {
+		int bound = LZ4_compressBound(len);
+
+		buf = malloc(COMPRESS_HEADER + (size_t)bound);
+		if (buf == NULL)
+			return -1;
+		n = LZ4_compress_default(msg, (char *)buf + COMPRESS_HEADER,
+					 len, bound);
+		break;
+	}
+#endif
+	}
+	if (n <= 0 || COMPRESS_HEADER + n >= len) {
+		free(buf);
+		return 0;
+	}
+	buf[0] = (unsigned char)codec;
+	buf[1] = (unsigned char)((msg_type >> 8) & 0xff);
+	buf[2] = (unsigned char)(msg_type & 0xff);
+	buf[3] = (unsigned char)((unsigned)len >> 24);
+	buf[4] = (unsigned char)((unsigned)len >> 16);
+	buf[5] = (unsigned char)((unsigned)len >> 8);
+	buf[6] = (unsigned char)len;
+	*out = (char *)buf;
+	return COMPRESS_HEADER + (int)n;
+}
+
+/* Decompress the message in rm (see raw_codec()) into dst, which has
+ * room for rm->orig_size bytes, and count it in self's compression
+ * statistics.  Called with the GIL, which is released while the work is
+ * done.  Returns 0, or -1 with SpreadError set if the data is corrupt or
+ * was compressed with a codec this module was built without.
+ */
+static int
+unpack_msg(MailboxObject *self, RawMsg *rm, char *dst)
+{
+	int ok = 0, known = 1;
+	double t;
+#if defined(HAVE_ZLIB) || defined(HAVE_LZ4)
+	const char *src = rm->data + COMPRESS_HEADER;
+	int srclen = rm->size - COMPRESS_HEADER;
+#endif
+
+	if (rm->orig_size < 0) {
+		PyErr_SetString(SpreadError, "corrupt compressed message");
+		return -1;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	t = cpu_time();
+	switch (rm->codec) {
+#ifdef HAVE_ZLIB
+	case CODEC_ZLIB: {
+		uLongf n = (uLongf)rm->orig_size;
+
+		ok = uncompress((Bytef *)dst, &n, (const Bytef *)src,
+				(uLong)srclen) == Z_OK &&
+			n == (uLongf)rm->orig_size;
+		break;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		ok = LZ4_decompress_safe(src, dst, srclen, rm->orig_size) ==
+			rm->orig_size;
+		break;
+#endif
+	default:
+		known = 0;
+	}
+	t = cpu_time() - t;
+	Py_END_ALLOW_THREADS
+
+	if (!known) {
+		const char *name = codec_name(rm->codec);
+
+		if (name != NULL)
+			PyErr_Format(SpreadError, "message compressed with %s, "
+				     "which this module was built without",
+				     name);
+		else
+			PyErr_Format(SpreadError, "message compressed with "
+				     "unknown codec %d", rm->codec);
+		return -1;
+	}
+	if (!ok) {
+		PyErr_SetString(SpreadError, "corrupt compressed message");
+		return -1;
+	}
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->unz_msgs++;
+	self->unz_in += rm->size;
+	self->unz_out += rm->orig_size;
+	self->unz_time += t;
+	Py_END_CRITICAL_SECTION();
+	return 0;
+}
+
+/* Receive one message into rm, replacing its buffers with larger ones
+ * when SP_receive() says they're too short.  Must be called without the
+ * GIL.  Returns 0 on success, else a Spread error code, RAW_NOMEM, or
+ * RAW_ASSERT with rm->assertmsg set.  If rm->fixed_data is set, a too
+ * short data buffer is returned as BUFFER_TOO_SHORT with the required
+ * size in - rm->endian, and the message stays queued.
+ */
+static int
+raw_receive(mailbox mbox, RawMsg *rm)
+{
+	int size;
+
+	raw_unskip(rm);
+	rm->retries = 0;
+	rm->groups_retries = 0;
+	for (;;) {
+		/* CAUTION:  initializing svc_type is critical.  It's not
+		 * clear from the docs, but this is an input as well as an
+		 * output parameter.  We didn't initialize it before, and
+		 * very rarely the DROP_RECV flag would end up getting set
+		 * in it.  That in turn has miserable consequences, and
+		 * consequences only visible if a buffer (data or group) is
+		 * too small for the msg being received (so it goes crazy
+		 * at the worst possible times).
+		 */
+		rm->svc_type = 0;
+		size = SP_receive(mbox, &rm->svc_type, rm->sender,
+				  rm->max_groups, &rm->num_groups, rm->groups,
+				  &rm->msg_type, &rm->endian,
+				  rm->bufsize, rm->data);
+		rm->size = size;
+
+		if (size >= 0) {
+			if (rm->num_groups < 0) {
 				/* This isn't possible unless DROP_RECV is
 				 * passed to SP_receive in svc_type.
 				 */
-				assertmsg = "size >= 0 and num_groups < 0";
-				goto assert_error;
+				rm->assertmsg = "size >= 0 and num_groups < 0";
+				return RAW_ASSERT;
 			}
-			if (endian < 0) {
+			if (rm->endian < 0) {
 				/* This should never be possible. */
-				assertmsg = "size >= 0 and endian < 0";
-				goto assert_error;
+				rm->assertmsg = "size >= 0 and endian < 0";
+				return RAW_ASSERT;
 			}
-			break;	/* This is the only normal loop exit. */
+			rm->arrived = 0;
+			raw_codec(rm);
+			return 0;	/* This is the only normal exit. */
 		}
 		if (size == BUFFER_TOO_SHORT) {
-			if (endian >= 0) {
+			if (rm->endian >= 0) {
 				/* This isn't possible unless DROP_RECV is
 				 * passed to SP_receive in svc_type.
 				 */
-				assertmsg = "BUFFER_TOO_SHORT and endian >= 0";
-				goto assert_error;
+				rm->assertmsg = "BUFFER_TOO_SHORT and endian >= 0";
+				return RAW_ASSERT;
 			}
-			bufsize = - endian;
-			Py_XDECREF(data);
-			data = PyString_FromStringAndSize(NULL, bufsize);
-			if (data == NULL)
-				goto error;
-			pbuffer = PyString_AS_STRING(data);
+			if (rm->fixed_data)
+				return size;
+			if (rm->own_data)
+				free(rm->data);
+			rm->retries++;
+			rm->bufsize = round_size(- rm->endian, 1024);
+			rm->data = malloc(rm->bufsize);
+			rm->own_data = rm->data != NULL;
+			if (rm->data == NULL)
+				return RAW_NOMEM;
 			continue;
 		}
 		if (size == GROUPS_TOO_SHORT) {
@@ -654,364 +2561,4994 @@ mailbox_receive(MailboxObject *self, PyObject *args)
 			 * about the other (if another thread hasn't already
 			 * grabbed the msg).
 			 */
-			if (num_groups >= 0) {
+			if (rm->num_groups >= 0) {
 				/* This shouldn never be possible. */
-				assertmsg = "GROUPS_TOO_SHORT and num_groups >= 0";
-				goto assert_error;
-			}
-			max_groups = - num_groups;
-			if (groups != groupbuffer)
-				free(groups);
-			groups = malloc(MAX_GROUP_NAME * max_groups);
-			if (groups == NULL) {
-				PyErr_NoMemory();
-				goto error;
+				rm->assertmsg = "GROUPS_TOO_SHORT and num_groups >= 0";
+				return RAW_ASSERT;
 			}
+			if (rm->own_groups)
+				free(rm->groups);
+			rm->retries++;
+			rm->groups_retries++;
+			rm->max_groups = round_size(- rm->num_groups,
+						    DEFAULT_GROUPS_SIZE);
+			rm->groups = malloc(MAX_GROUP_NAME * rm->max_groups);
+			rm->own_groups = rm->groups != NULL;
+			if (rm->groups == NULL)
+				return RAW_NOMEM;
 			continue;
 		}
 		/* There's a real error we can't deal with (e.g., Spread
 		 * got disconnected).
 		 */
-		spread_error(size, self);
-		goto error;
-assert_error:
+		return size;
+	}
+}
+
+/* Copy the message in src into dst, in a single malloc'ed block sized
+ * for exactly this message, so src's buffers can be reused.  Called
+ * without the GIL.  Returns 0, or -1 if out of memory.
+ */
+static int
+raw_keep(RawMsg *dst, RawMsg *src)
+{
+	size_t groups_size = MAX_GROUP_NAME * (size_t)src->num_groups;
+	char *block = malloc(groups_size + src->size + 1);
+
+	if (block == NULL)
+		return -1;
+	*dst = *src;
+	memcpy(block, src->groups, groups_size);
+	memcpy(block + groups_size, src->data, src->size);
+	dst->groups = (char (*)[MAX_GROUP_NAME])block;
+	dst->max_groups = src->num_groups;
+	dst->data = block + groups_size;
+	dst->bufsize = src->size;
+	dst->own_groups = 1;	/* frees the whole block */
+	dst->own_data = 0;
+	dst->skipped = 0;
+	dst->whole = NULL;
+	return 0;
+}
+
+/* Count a message raw_receive() got in rs, as it came over the wire:  a
+ * batch frame is one message (its records aren't counted again), each
+ * fragment is one, and a compressed message counts its compressed length.
+ * Called without the GIL.
+ */
+static void
+stats_received(RecvStats *rs, RawMsg *rm)
+{
+	int i = stat_service(rm->svc_type);
+
+	if (Is_regular_mess(rm->svc_type) && i >= 0) {
+		rs->msgs[i]++;
+		rs->bytes[i] += rm->size;
+	}
+	else if (Is_membership_mess(rm->svc_type))
+		rs->membership++;
+	rs->buffer_retries += rm->retries - rm->groups_retries;
+	rs->groups_retries += rm->groups_retries;
+	if (rm->size > rs->largest)
+		rs->largest = rm->size;
+}
+
+/* The bucket of a LatHist that holds v microseconds. */
+static int
+lat_bucket(long long v)
+{
+	int shift = 0;
+
+	if (v >= 1LL << LAT_BITS)
+		v = (1LL << LAT_BITS) - 1;
+	while (v >> shift >= 2 * LAT_SUB)
+		shift++;
+	return shift * LAT_SUB + (int)(v >> shift);
+}
+
+/* The smallest value bucket i holds, and how many values it holds. */
+static long long
+lat_low(int i, long long *width)
+{
+	int shift = i < 2 * LAT_SUB ? 0 : i / LAT_SUB - 1;
+
+	*width = 1LL << shift;
+	return (long long)(i - shift * LAT_SUB) << shift;
+}
+
+static void
+lat_add(LatHist *h, long long v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->counts[lat_bucket(v)]++;
+}
+
+static void
+lat_merge(LatHist *dst, const LatHist *src)
+{
+	int i;
+
+	if (src->count == 0)
+		return;
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+}
+
+static void
+lat_free(LatGroup *table, int size)
+{
+	int i, j;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < size; i++)
+		for (j = 0; j < STAT_SERVICES; j++)
+			free(table[i].hist[j]);
+	free(table);
+}
+
+/* The slot of group in a table of size slots:  its own, or the free one
+   it would take. */
+static LatGroup *
+lat_slot(LatGroup *table, int size, const char *group)
+{
+	int i = name_hash(group) & (size - 1);
+
+	while (table[i].group[0] != '\0' &&
+	       strncmp(table[i].group, group, MAX_GROUP_NAME) != 0)
+		i = (i + 1) & (size - 1);
+	return &table[i];
+}
+
+/* self's entry for group, added if it has none, or NULL if out of memory.
+   Called with self locked. */
+static LatGroup *
+lat_group(MailboxObject *self, const char *group)
+{
+	LatGroup *g;
+	int i;
+
+	if (self->lat != NULL) {
+		g = lat_slot(self->lat, self->lat_size, group);
+		if (g->group[0] != '\0')
+			return g;
+	}
+	if (2 * (self->lat_used + 1) > self->lat_size) {
+		int size = round_size(2 * (self->lat_used + 1), 8);
+		LatGroup *table = calloc(size, sizeof(LatGroup));
+
+		if (table == NULL)
+			return NULL;
+		for (i = 0; i < self->lat_size; i++)
+			if (self->lat[i].group[0] != '\0')
+				*lat_slot(table, size, self->lat[i].group) =
+					self->lat[i];
+		free(self->lat);
+		self->lat = table;
+		self->lat_size = size;
+	}
+	g = lat_slot(self->lat, self->lat_size, group);
+	strncpy(g->group, group, MAX_GROUP_NAME - 1);
+	self->lat_used++;
+	return g;
+}
+
+/* Note how long a timestamped message took, under the first group it was
+   sent to and its service type.  Called with the GIL, once per message
+   handed out (or dropped by run() for want of a callback). */
+static void
+latency_note(MailboxObject *self, RawMsg *rm)
+{
+	int i = stat_service(rm->svc_type);
+	LatGroup *g;
+
+	if (!rm->stamped || i < 0 || rm->num_groups < 1)
+		return;
+	rm->stamped = 0;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	g = lat_group(self, rm->groups[0]);
+	if (g != NULL && g->hist[i] == NULL)
+		g->hist[i] = calloc(1, sizeof(LatHist));
+	/* Out of memory, the sample is let go. */
+	if (g != NULL && g->hist[i] != NULL)
+		lat_add(g->hist[i], rm->latency);
+	Py_END_CRITICAL_SECTION();
+}
+
+/* Point rm at the mailbox's persistent receive buffers, allocating them
+ * on first use.  Called with the GIL.  Returns 1 if rm now uses them, in
+ * which case rbuf_release() must be called after the message has been
+ * built; 0 if another thread is using them (or memory is short), in which
+ * case rm keeps the buffers it was initialized with.
+ */
+static int
+rbuf_acquire(MailboxObject *self, RawMsg *rm)
+{
+	int ok = 0;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (!self->rbuf_busy && self->rbuf == NULL) {
+		self->rbuf_size = self->rbuf_min;
+		self->rbuf = malloc(self->rbuf_size);
+	}
+	if (!self->rbuf_busy && self->rgroups == NULL) {
+		self->rgroups_size = DEFAULT_GROUPS_SIZE;
+		self->rgroups = malloc(MAX_GROUP_NAME * self->rgroups_size);
+	}
+	if (!self->rbuf_busy && self->rbuf != NULL && self->rgroups != NULL) {
+		self->rbuf_busy = 1;
+		rm->data = self->rbuf;
+		rm->bufsize = self->rbuf_size;
+		rm->groups = self->rgroups;
+		rm->max_groups = self->rgroups_size;
+		ok = 1;
+	}
+	Py_END_CRITICAL_SECTION();
+	return ok;
+}
+
+/* Record a message received into the buffers handed out by
+ * rbuf_acquire().  The caller owns those buffers, so this may be called
+ * without the GIL.
+ */
+static void
+rbuf_account(MailboxObject *self, RawMsg *rm)
+{
+	self->rbuf_retries += rm->retries;
+	if (rm->retries == 0 && (rm->size > DEFAULT_BUFFER_SIZE ||
+				 rm->num_groups > DEFAULT_GROUPS_SIZE))
+		self->rbuf_saved++;
+	if (rm->size > self->rbuf_high)
+		self->rbuf_high = rm->size;
+	if (rm->size > self->window_size)
+		self->window_size = rm->size;
+	if (rm->num_groups > self->window_groups)
+		self->window_groups = rm->num_groups;
+	self->window_count++;
+}
+
+/* Shrink the receive buffers when a whole window of messages has fit in
+ * much less, and start a new window.
+ */
+static void
+rbuf_shrink(MailboxObject *self)
+{
+	int want;
+
+	want = round_size(self->window_size, 1024);
+	if (want < self->rbuf_min)
+		want = self->rbuf_min;
+	if (self->rbuf_size > 2 * want) {
+		char *p = malloc(want);
+		if (p != NULL) {
+			free(self->rbuf);
+			self->rbuf = p;
+			self->rbuf_size = want;
+			self->rbuf_shrinks++;
+		}
+	}
+	want = round_size(self->window_groups, DEFAULT_GROUPS_SIZE);
+	if (self->rgroups_size > 2 * want) {
+		char (*p)[MAX_GROUP_NAME] = malloc(MAX_GROUP_NAME * want);
+		if (p != NULL) {
+			free(self->rgroups);
+			self->rgroups = p;
+			self->rgroups_size = want;
+			self->rbuf_shrinks++;
+		}
+	}
+	self->window_count = 0;
+	self->window_size = 0;
+	self->window_groups = 0;
+}
+
+/* Give back the buffers handed out by rbuf_acquire(), keeping any larger
+ * one raw_receive() had to allocate, and shrink them at the end of a
+ * window.  Called with the GIL, once rm's contents are no longer needed.
+ */
+static void
+rbuf_release(MailboxObject *self, RawMsg *rm)
+{
+	raw_unskip(rm);
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (rm->own_data && rm->bufsize <= self->rbuf_max) {
+		free(self->rbuf);
+		self->rbuf = rm->data;
+		self->rbuf_size = rm->bufsize;
+		rm->own_data = 0;
+		self->rbuf_grows++;
+	}
+	if (rm->own_groups) {
+		free(self->rgroups);
+		self->rgroups = rm->groups;
+		self->rgroups_size = rm->max_groups;
+		rm->own_groups = 0;
+		self->rbuf_grows++;
+	}
+	if (self->window_count >= self->rbuf_window)
+		rbuf_shrink(self);
+	self->rbuf_busy = 0;
+	Py_END_CRITICAL_SECTION();
+}
+
+/* Set the Python exception for a raw_receive() failure. */
+static PyObject *
+raw_error(int err, RawMsg *rm, MailboxObject *self)
+{
+	if (err == RAW_NOMEM)
+		return PyErr_NoMemory();
+	if (err == RAW_ASSERT) {
 		PyErr_Format(PyExc_AssertionError,
 			     "SP_receive: %s; "
 			     "size=%d svc_type=%d num_groups=%d "
 			     "msg_type=%d endian=%d",
-			     assertmsg,
-			     size, svc_type, num_groups, msg_type, endian);
-		goto error;
+			     rm->assertmsg,
+			     rm->size, rm->svc_type, rm->num_groups,
+			     rm->msg_type, rm->endian);
+		return NULL;
 	}
+	return spread_error(err, self);
+}
 
-	/* It's not clear from the SP_receive() man page what all the
-	   possible categories of services types are possible. */
+#define TYPE_BIT(map, t) \
+	((map)[(unsigned short)(t) >> 3] & (1 << ((t) & 7)))
 
-	sender = PyString_FromString(senderbuffer);
-	if (sender == NULL)
-		goto error;
+static int
+nameset_has(NameSet *set, const char *name)
+{
+	int i = name_hash(name) & (set->size - 1);
 
-	if (Is_regular_mess(svc_type)) {
-		if (data == NULL) {
-			data = PyString_FromStringAndSize(databuffer, size);
-			if (data == NULL)
-				goto error;
-		}
-		else if (PyString_GET_SIZE(data) != size) {
-			if (_PyString_Resize(&data, size) < 0)
-				goto error;
-		}
-		msg = new_regular_msg(sender, num_groups, groups,
-				      msg_type, endian, data);
+	while (set->names[i][0]) {
+		if (strncmp(set->names[i], name, MAX_GROUP_NAME) == 0)
+			return 1;
+		i = (i + 1) & (set->size - 1);
 	}
-	else if (Is_membership_mess(svc_type)) {
-		msg = new_membership_msg(svc_type, sender,
-					 num_groups, groups,
-					 pbuffer, size);
+	return 0;
+}
+
+/* Whether a name passes an allow set and a deny set. */
+static int
+names_pass(NameSet *allow, NameSet *deny, const char *name)
+{
+	return (allow->names == NULL || nameset_has(allow, name)) &&
+		(deny->names == NULL || !nameset_has(deny, name));
+}
+
+/* Whether f lets the message in rm through.  If not, the reason is
+ * counted in drops.  Touches nothing but f's sets, so it may be called
+ * without the GIL.
+ */
+static int
+filter_pass(MsgFilter *f, RawMsg *rm, long *drops)
+{
+	int i, reason;
+
+	if (Is_membership_mess(rm->svc_type)) {
+		/* The sender of a membership message is the group. */
+		if (!f->membership)
+			reason = FILTER_MEMBERSHIP;
+		else if (!names_pass(&f->allow_groups, &f->deny_groups,
+				     rm->sender))
+			reason = FILTER_GROUP;
+		else
+			return 1;
+		drops[reason]++;
+		return 0;
 	}
+	/* A batch frame's msg_type is checked record by record. */
+	if (rm->msg_type != BATCH_MSG_TYPE &&
+	    ((f->allow_types != NULL &&
+	      !TYPE_BIT(f->allow_types, rm->msg_type)) ||
+	     (f->deny_types != NULL &&
+	      TYPE_BIT(f->deny_types, rm->msg_type))))
+		reason = FILTER_MSG_TYPE;
+	else if (!names_pass(&f->allow_senders, &f->deny_senders, rm->sender))
+		reason = FILTER_SENDER;
+	else if (f->allow_groups.names == NULL &&
+		 f->deny_groups.names == NULL)
+		return 1;
 	else {
-		PyErr_Format(SpreadError,
-			     "unexpected service type: 0x%x", svc_type);
-		goto error;
+		/* Wanted if it was sent to any group that is. */
+		for (i = 0; i < rm->num_groups; i++)
+			if (names_pass(&f->allow_groups, &f->deny_groups,
+				       rm->groups[i]))
+				return 1;
+		reason = FILTER_GROUP;
 	}
+	drops[reason]++;
+	return 0;
+}
 
-  error:
-	RELEASE_MBOX_LOCK(self);
-	if (groups != groupbuffer)
-		free(groups);
-	Py_XDECREF(sender);
-	Py_XDECREF(data);
-	return msg;
+static void
+filter_decref(MsgFilter *f)
+{
+	int refcnt;
+
+	LOCK(f);
+	refcnt = --f->refcnt;
+	UNLOCK(f);
+	if (refcnt == 0) {
+		free(f->allow_types);
+		free(f->deny_types);
+		free(f->allow_groups.names);
+		free(f->deny_groups.names);
+		free(f->allow_senders.names);
+		free(f->deny_senders.names);
+		free(f);
+	}
 }
 
-const int valid_svc_type = (UNRELIABLE_MESS | RELIABLE_MESS | FIFO_MESS
-			    | CAUSAL_MESS | AGREED_MESS | SAFE_MESS
-			    | SELF_DISCARD);
+/* A reference to self's filter for a receive to use, or NULL. */
+static MsgFilter *
+filter_get(MailboxObject *self)
+{
+	MsgFilter *f;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	f = self->filter;
+	if (f != NULL) {
+		LOCK(f);
+		f->refcnt++;
+		UNLOCK(f);
+	}
+	Py_END_CRITICAL_SECTION();
+	return f;
+}
 
-static PyObject *
-mailbox_multicast(MailboxObject *self, PyObject *args)
+/* Add a receive's drops to f's counts, and let go of it. */
+static void
+filter_done(MsgFilter *f, long *drops)
 {
-	int svc_type, bytes, msg_len;
-	int msg_type = 0;
-	char *group, *msg;
-	PyObject *result = NULL;
+	int i;
 
-	if (!PyArg_ParseTuple(args, "iss#|i:multicast",
-			      &svc_type, &group, &msg, &msg_len, &msg_type))
-		return NULL;
+	if (f == NULL)
+		return;
+	LOCK(f);
+	for (i = 0; i < FILTER_REASONS; i++)
+		f->drops[i] += drops[i];
+	UNLOCK(f);
+	filter_decref(f);
+}
 
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected) {
-		err_disconnected("multicast");
-		goto Done;
+/* A batch frame received with set_unbatching() on, kept by the mailbox
+ * until unbatch_next() has taken all of its records.
+ */
+struct frame {
+	RawMsg rm;		/* made by raw_keep() */
+	int off;		/* where the next record starts */
+	struct frame *next;
+};
+
+static void
+frames_free(struct frame *f)
+{
+	while (f != NULL) {
+		struct frame *next = f->next;
+
+		raw_free(&f->rm);
+		free(f);
+		f = next;
 	}
-	/* XXX This doesn't check that svc_type is set to exactly one of
-	   the service types. */
-	if ((svc_type & valid_svc_type) != svc_type) {
-		PyErr_SetString(PyExc_ValueError, "invalid service type");
-		goto Done;;
+}
+
+static int
+unbatching(MailboxObject *self)
+{
+	int on;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	on = self->unbatch;
+	Py_END_CRITICAL_SECTION();
+	return on;
+}
+
+/* Whether self has kept batch frames with records still to take. */
+static int
+frames_kept(MailboxObject *self)
+{
+	int kept;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	kept = self->frames != NULL;
+	Py_END_CRITICAL_SECTION();
+	return kept;
+}
+
+/* Keep the batch frame in rm for unbatch_next() to take apart, after
+ * the frames already kept, or before them if front is set.  Called with
+ * the GIL.  Returns 0, or -1 with an exception set (the frame is lost).
+ */
+static int
+unbatch_keep(MailboxObject *self, RawMsg *rm, int front)
+{
+	struct frame *f = malloc(sizeof(struct frame));
+
+	if (f == NULL || raw_keep(&f->rm, rm) < 0) {
+		free(f);
+		PyErr_NoMemory();
+		return -1;
+	}
+	f->off = 0;
+	f->next = NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->frames == NULL)
+		self->frames = self->frames_tail = f;
+	else if (front) {
+		f->next = self->frames;
+		self->frames = f;
+	}
+	else {
+		self->frames_tail->next = f;
+		self->frames_tail = f;
 	}
+	Py_END_CRITICAL_SECTION();
+	return 0;
+}
 
-	Py_BEGIN_ALLOW_THREADS
-	bytes = SP_multicast(self->mbox, svc_type, group, (int16)msg_type,
-			     msg_len, msg);
-	Py_END_ALLOW_THREADS
-	if (bytes < 0)
-		result = spread_error(bytes, self);
-	else
-		result = PyInt_FromLong(bytes);
-Done:
-	RELEASE_MBOX_LOCK(self);
-	return result;
+/* Put the message in rm back, with msg_type, as a frame of one record,
+ * to be the next message received:  receive_into() does this when it
+ * finds a message won't fit its buffer once decompressed or reassembled.
+ * Returns 0, or -1 with an exception set (the message is lost).
+ */
+static int
+unbatch_unget(MailboxObject *self, RawMsg *rm, int msg_type)
+{
+	RawMsg one = *rm;
+	unsigned char *p = malloc(BATCH_HEADER + (size_t)rm->size);
+	int r;
+
+	if (p == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	p[0] = (unsigned char)((msg_type >> 8) & 0xff);
+	p[1] = (unsigned char)(msg_type & 0xff);
+	p[2] = (unsigned char)((unsigned)rm->size >> 24);
+	p[3] = (unsigned char)((unsigned)rm->size >> 16);
+	p[4] = (unsigned char)((unsigned)rm->size >> 8);
+	p[5] = (unsigned char)rm->size;
+	memcpy(p + BATCH_HEADER, rm->data, rm->size);
+	one.data = (char *)p;
+	one.size = BATCH_HEADER + rm->size;
+	r = unbatch_keep(self, &one, 1);
+	free(p);
+	return r;
 }
 
-static PyObject *
-mailbox_multigroup_multicast(MailboxObject *self, PyObject *args)
+/* Take the next record of the oldest kept batch frame into rm, as a
+ * message from the frame's sender to the frame's groups, growing rm's
+ * buffers if they are too short.  If rm->fixed_data is set, a record too
+ * long for its buffer is left where it is and reported as
+ * BUFFER_TOO_SHORT with the length needed, as raw_receive() does.  A
+ * malformed frame is thrown away.  Called with the GIL.  Returns 1, 0 if
+ * no frame is kept, or -1 with an exception set.
+ */
+#define UNBATCH_MALFORMED	(-1)
+#define UNBATCH_TOO_SHORT	(-2)
+#define UNBATCH_NOMEM		(-3)
+
+static int
+unbatch_next(MailboxObject *self, RawMsg *rm)
+{
+	struct frame *f, *done = NULL;
+	const unsigned char *p;
+	unsigned long len = 0;
+	int r = 0;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	while (r == 0 && (f = self->frames) != NULL) {
+		int left = f->rm.size - f->off;
+
+		p = (const unsigned char *)f->rm.data + f->off;
+		if (left >= BATCH_HEADER)
+			len = (unsigned long)p[2] << 24 | p[3] << 16 |
+				p[4] << 8 | p[5];
+		if (left == 0 || left < BATCH_HEADER ||
+		    len > (unsigned long)(left - BATCH_HEADER)) {
+			if (left > 0)
+				r = UNBATCH_MALFORMED;
+			self->frames = f->next;
+			f->next = done;
+			done = f;
+			continue;
+		}
+		raw_unskip(rm);
+		if ((int)len > rm->bufsize) {
+			if (rm->fixed_data) {
+				r = UNBATCH_TOO_SHORT;
+				break;
+			}
+			if (rm->own_data)
+				free(rm->data);
+			rm->bufsize = round_size((int)len, 1024);
+			rm->data = malloc(rm->bufsize);
+			rm->own_data = rm->data != NULL;
+		}
+		if (f->rm.num_groups > rm->max_groups) {
+			if (rm->own_groups)
+				free(rm->groups);
+			rm->max_groups = f->rm.num_groups;
+			rm->groups = malloc(MAX_GROUP_NAME * rm->max_groups);
+			rm->own_groups = rm->groups != NULL;
+		}
+		if (rm->data == NULL || rm->groups == NULL) {
+			r = UNBATCH_NOMEM;
+			break;
+		}
+		rm->svc_type = f->rm.svc_type;
+		memcpy(rm->sender, f->rm.sender, MAX_GROUP_NAME);
+		rm->num_groups = f->rm.num_groups;
+		memcpy(rm->groups, f->rm.groups,
+		       MAX_GROUP_NAME * (size_t)rm->num_groups);
+		rm->msg_type = (int16)(p[0] << 8 | p[1]);
+		rm->endian = f->rm.endian;
+		rm->size = (int)len;
+		memcpy(rm->data, p + BATCH_HEADER, len);
+		/* Its latency runs to when the frame came. */
+		rm->arrived = f->rm.arrived;
+		raw_codec(rm);
+		f->off += BATCH_HEADER + (int)len;
+		if (f->off == f->rm.size) {
+			self->frames = f->next;
+			f->next = done;
+			done = f;
+		}
+		r = 1;
+	}
+	if (self->frames == NULL)
+		self->frames_tail = NULL;
+	Py_END_CRITICAL_SECTION();
+	frames_free(done);
+
+	if (r == UNBATCH_MALFORMED)
+		PyErr_SetString(SpreadError, "malformed batch frame");
+	else if (r == UNBATCH_TOO_SHORT)
+		spread_error_extra(BUFFER_TOO_SHORT, self, (int)len);
+	else if (r == UNBATCH_NOMEM)
+		PyErr_NoMemory();
+	return r < 0 ? -1 : r;
+}
+
+/* unbatch_next(), skipping the records the filter drops. */
+static int
+unbatch_take(MailboxObject *self, RawMsg *rm)
 {
-        int svc_type, bytes, msg_len, group_len;
-        int msg_type = 0;
-	PyObject *group_tuple, *temp;
-        char *msg;
+	MsgFilter *filter = NULL;
+	long drops[FILTER_REASONS] = {0};
+	int r, first = 1;
+
+	while ((r = unbatch_next(self, rm)) > 0) {
+		if (first)
+			filter = filter_get(self);
+		first = 0;
+		if (filter == NULL || filter_pass(filter, rm, drops))
+			break;
+	}
+	filter_done(filter, drops);
+	return r;
+}
 
-	char (*groups)[MAX_GROUP_NAME];
-	int index;
+static void
+partials_free(struct partial *p)
+{
+	while (p != NULL) {
+		struct partial *next = p->next;
 
-        PyObject *result = NULL;
+		Py_XDECREF(p->data);
+		free(p);
+		p = next;
+	}
+}
+
+/* Unlink *pp from self's partials and push it on *done, to be freed once
+ * self is unlocked.
+ */
+static void
+reasm_drop(MailboxObject *self, struct partial **pp, struct partial **done)
+{
+	struct partial *p = *pp;
 
-        if (! PyArg_ParseTuple(args, "iO!s#|i:multicast",
-                               &svc_type,
-                               &PyTuple_Type, &group_tuple,
-                               &msg, &msg_len,
-                               &msg_type))
-                return NULL;
+	*pp = p->next;
+	self->reasm_bytes -= p->total;
+	p->next = *done;
+	*done = p;
+}
 
-	if(! PyTuple_Check(group_tuple)) {
-		PyErr_SetString(PyExc_TypeError,
-				"only tuples are allowed for groups");
-		return NULL;
+/* Drop the partials that can no longer be completed after the membership
+ * message in rm:  those sent to its group by a member no longer in it,
+ * and all those sent to it once we have left it.
+ */
+static void
+reasm_membership(MailboxObject *self, RawMsg *rm)
+{
+	struct partial **pp, *p, *done = NULL;
+	int self_leave = Is_self_leave(rm->svc_type);
+	int i, sent_to, member;
+
+	if (!self_leave && !Is_reg_memb_mess(rm->svc_type))
+		return;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	pp = &self->partials;
+	while ((p = *pp) != NULL) {
+		sent_to = strcmp(p->group, rm->sender) == 0;
+		member = 0;
+		for (i = 0; sent_to && !self_leave && i < rm->num_groups; i++)
+			if (strcmp(rm->groups[i], p->sender) == 0)
+				member = 1;
+		if (sent_to && !member) {
+			reasm_drop(self, pp, &done);
+			self->reasm_left++;
+		}
+		else
+			pp = &p->next;
 	}
+	Py_END_CRITICAL_SECTION();
+	partials_free(done);
+}
 
-	group_len = PyTuple_Size(group_tuple);
-	if (group_len == 0) {
-		PyErr_SetString(PyExc_ValueError,
-				"there must be at least one group in the tuple");
-		return NULL;
+/* Put the fragments multicast_large() sends back together.  Each one is
+ * copied into place in a bytes object as long as the whole message,
+ * allocated when the first one arrives; when the last arrives, rm becomes
+ * the whole message, with the bytes object as its data in rm->whole.
+ * Partial messages take at most self->reasm_max bytes:  the oldest are
+ * dropped to make room for a new one, a message longer than that is
+ * dropped outright, and so are the fragments of a message whose start
+ * was missed.  A membership message drops the partials of senders that
+ * left (see reasm_membership()).  Called with the GIL on each message a
+ * receive method is about to return.  Returns 0 if rm is to be returned,
+ * 1 if it was a fragment and there is nothing to return, or -1 with an
+ * exception set.
+ */
+static int
+reasm_take(MailboxObject *self, RawMsg *rm)
+{
+	const unsigned char *h = (const unsigned char *)rm->data;
+	struct partial **pp, *p, *done = NULL;
+	unsigned long seq, off, total;
+	int len, r = 1;
+
+	if (!rm->frag) {
+		if (Is_membership_mess(rm->svc_type))
+			reasm_membership(self, rm);
+		return 0;
+	}
+	seq = (unsigned long)h[2] << 24 | h[3] << 16 | h[4] << 8 | h[5];
+	off = (unsigned long)h[6] << 24 | h[7] << 16 | h[8] << 8 | h[9];
+	total = (unsigned long)h[10] << 24 | h[11] << 16 | h[12] << 8 | h[13];
+	len = rm->size - FRAGMENT_HEADER;
+	if (total > INT_MAX || off > total || (unsigned long)len > total - off) {
+		PyErr_SetString(SpreadError, "malformed message fragment");
+		return -1;
 	}
 
-	groups = malloc(MAX_GROUP_NAME * group_len);
-	if (groups == NULL) {
-		PyErr_NoMemory();
-		return NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	for (pp = &self->partials; (p = *pp) != NULL; pp = &p->next)
+		if (p->seq == seq && strcmp(p->sender, rm->sender) == 0)
+			break;
+	if (p != NULL && (unsigned long)p->got != off) {
+		/* A gap:  what is missing isn't coming. */
+		reasm_drop(self, pp, &done);
+		self->reasm_dropped++;
+		p = NULL;
+	}
+	else if (p == NULL && (off != 0 || (long long)total > self->reasm_max))
+		self->reasm_dropped++;
+	else if (p == NULL) {
+		while (self->partials != NULL &&
+		       self->reasm_bytes + (long long)total > self->reasm_max) {
+			reasm_drop(self, &self->partials, &done);
+			self->reasm_evicted++;
+		}
+		p = malloc(sizeof(struct partial));
+		if (p != NULL)
+			p->data = PyBytes_FromStringAndSize(NULL,
+							    (Py_ssize_t)total);
+		if (p == NULL || p->data == NULL) {
+			free(p);
+			p = NULL;
+			if (!PyErr_Occurred())
+				PyErr_NoMemory();
+			r = -1;
+		}
+		else {
+			memcpy(p->sender, rm->sender, MAX_GROUP_NAME);
+			memcpy(p->group, rm->groups[0], MAX_GROUP_NAME);
+			p->seq = seq;
+			p->total = (int)total;
+			p->got = 0;
+			p->next = NULL;
+			for (pp = &self->partials; *pp != NULL;
+			     pp = &(*pp)->next)
+				;
+			*pp = p;
+			self->reasm_bytes += p->total;
+		}
 	}
+	if (p != NULL) {
+		memcpy(PyBytes_AS_STRING(p->data) + off,
+		       rm->data + FRAGMENT_HEADER, len);
+		p->got += len;
+		if (p->got == p->total) {
+			reasm_drop(self, pp, &done);
+			self->reasm_done++;
+			rm->whole = p->data;
+			p->data = NULL;
+			rm->size = p->total;
+			rm->frag = 0;
+			r = 0;
+		}
+	}
+	Py_END_CRITICAL_SECTION();
+	partials_free(done);
+	return r;
+}
 
-	for (index = 0; index < group_len; index++) {
-		temp = PyTuple_GetItem(group_tuple, index);
-		if(! PyString_Check(temp)) {
-			PyErr_SetString(PyExc_TypeError,
-					"groups must be strings only");
-			goto Done;
+/* Apply a membership message for group to self's membership view, if it
+ * is on:  a regular membership message replaces the group's entry, and
+ * the message saying we left removes it.  Transitional messages change
+ * nothing; the regular one follows.  The members tuple is built here
+ * (and returned in *members, for the message object to share) so that
+ * members() hands out the same tuple until the next change.  Called as
+ * each message object is built, so the view is as of the last message
+ * received.  Returns 0, or -1 with an exception set.
+ */
+static int
+view_update(MailboxObject *self, RawMsg *rm, PyObject *group,
+	    PyObject **members)
+{
+	membership_info info;
+	PyObject *gid, *entry;
+	int on, i, ret = 0;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	on = self->views != NULL;
+	Py_END_CRITICAL_SECTION();
+	if (!on)
+		return 0;
+
+	if (Is_self_leave(rm->svc_type)) {
+		Py_BEGIN_CRITICAL_SECTION(self);
+		if (self->views != NULL &&
+		    PyDict_GetItem(self->views, group) != NULL) {
+			ret = PyDict_DelItem(self->views, group);
+			Py_CLEAR(self->view_groups);
+			self->view_version++;
 		}
-		strncpy(groups[index],
-			PyString_AsString(PyTuple_GetItem(group_tuple, index)),
-			MAX_GROUP_NAME);
+		Py_END_CRITICAL_SECTION();
+		return ret;
+	}
+	if (!Is_reg_memb_mess(rm->svc_type))
+		return 0;
+
+	if ((ret = SP_get_memb_info(rm->data, rm->svc_type, &info)) < 0) {
+		PyErr_Format(SpreadError, "error %d on SP_get_memb_info", ret);
+		return -1;
+	}
+	*members = PyTuple_New(rm->num_groups);
+	if (*members == NULL)
+		return -1;
+	for (i = 0; i < rm->num_groups; i++) {
+		PyObject *s = cache_name(self->names, rm->groups[i]);
+		if (s == NULL)
+			return -1;
+		PyTuple_SET_ITEM(*members, i, s);
+	}
+	gid = new_group_id(info.gid);
+	if (gid == NULL)
+		return -1;
+	entry = PyTuple_Pack(2, gid, *members);
+	Py_DECREF(gid);
+	if (entry == NULL)
+		return -1;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->views != NULL) {
+		if (PyDict_GetItem(self->views, group) == NULL)
+			Py_CLEAR(self->view_groups);
+		ret = PyDict_SetItem(self->views, group, entry);
+		self->view_version++;
+	}
+	Py_END_CRITICAL_SECTION();
+	Py_DECREF(entry);
+	return ret;
+}
+
+/* Build the RegularMsg or MembershipMsg object for a message received on
+ * self.  If with_data is false, a RegularMsg's message attribute is None.
+ */
+static PyObject *
+build_msg(MailboxObject *self, RawMsg *rm, int with_data)
+{
+	PyObject *sender, *data, *msg = NULL;
+
+	latency_note(self, rm);
+	sender = cache_name(self->names, rm->sender);
+	if (sender == NULL)
+		return NULL;
+
+	/* It's not clear from the SP_receive() man page what all the
+	   possible categories of services types are possible. */
+
+	if (Is_regular_mess(rm->svc_type)) {
+		if (with_data && rm->whole != NULL) {
+			data = rm->whole;
+			Py_INCREF(data);
+		}
+		else if (with_data && rm->codec) {
+			data = PyBytes_FromStringAndSize(NULL, rm->orig_size < 0
+							 ? 0 : rm->orig_size);
+			if (data != NULL &&
+			    unpack_msg(self, rm, PyBytes_AS_STRING(data)) < 0)
+				Py_CLEAR(data);
+		}
+		else if (with_data)
+			data = PyBytes_FromStringAndSize(rm->data, rm->size);
+		else {
+			data = Py_None;
+			Py_INCREF(data);
+		}
+		if (data != NULL)
+			msg = new_regular_msg(self->names, sender,
+					      rm->num_groups, rm->groups,
+					      rm->msg_type, rm->endian, data);
+		Py_XDECREF(data);
+	}
+	else if (Is_membership_mess(rm->svc_type)) {
+		PyObject *members = NULL;
+
+		if (view_update(self, rm, sender, &members) == 0)
+			msg = new_membership_msg(self->names, rm->svc_type,
+						 sender, rm->num_groups,
+						 rm->groups, rm->data,
+						 rm->size, members);
+		Py_XDECREF(members);
+	}
+	else {
+		PyErr_Format(SpreadError,
+			     "unexpected service type: 0x%x", rm->svc_type);
+	}
+	Py_DECREF(sender);
+	return msg;
+}
+
+/* Convert the timeout argument of the receive methods to seconds, with
+ * None meaning -1.0 (wait forever).  Returns -1 with an exception set if
+ * it isn't a non-negative number.
+ */
+static int
+get_timeout(PyObject *obj, double *timeout)
+{
+	*timeout = -1.0;
+	if (obj == NULL || obj == Py_None)
+		return 0;
+	*timeout = PyFloat_AsDouble(obj);
+	if (*timeout == -1.0 && PyErr_Occurred())
+		return -1;
+	if (!(*timeout >= 0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"timeout must be non-negative");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait up to 'timeout' seconds (forever if it is negative) for the
+ * mailbox socket to become readable, or for the pipe 'wake' to (unless it
+ * is -1, as it always is on Windows).  Called without the GIL.  Returns 1
+ * if the socket is readable (or has hung up, which the following
+ * SP_receive() reports), WOKEN if the pipe is, 0 if the timeout expired,
+ * and -1 with errno set on error.
+ */
+#define WOKEN 2
+
+static int
+wait_readable(mailbox mbox, int wake, double timeout)
+{
+#ifdef MS_WINDOWS
+	fd_set fds;
+	struct timeval tv;
+	int n;
+
+	FD_ZERO(&fds);
+	FD_SET(mbox, &fds);
+	tv.tv_sec = (long)timeout;
+	tv.tv_usec = (long)((timeout - tv.tv_sec) * 1e6);
+	n = select(mbox + 1, &fds, NULL, NULL, timeout < 0 ? NULL : &tv);
+	return n < 0 ? -1 : n > 0;
+#else
+	struct pollfd pfd[2];
+	double deadline = monotonic() + timeout;
+	int n;
+
+	pfd[0].fd = mbox;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake;
+	pfd[1].events = POLLIN;
+	for (;;) {
+		double left = deadline - monotonic();
+		int ms;
+
+		if (left < 0)
+			left = 0;
+		ms = left > INT_MAX / 1000 ? INT_MAX : (int)(left * 1000 + 0.999);
+		if (timeout < 0)
+			ms = -1;
+		pfd[0].revents = pfd[1].revents = 0;
+		n = poll(pfd, wake < 0 ? 1 : 2, ms);
+		if (n > 0)
+			return pfd[1].revents ? WOKEN : 1;
+		if (n == 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+#endif
+}
+
+/* Wait as a receive method does before calling SP_receive():  up to
+ * 'timeout' seconds, or until disconnect() says to give up.  A blocking
+ * receive waits here too where there is a wake pipe, rather than in
+ * SP_receive(), unless a message is already waiting (SP_poll() is the
+ * cheaper test).  Called without the GIL; wake is from mbox_wake().
+ */
+static int
+receive_wait(MailboxObject *self, int wake, double timeout)
+{
+	if (timeout < 0 && (wake < 0 || SP_poll(self->mbox) > 0))
+		return 1;
+	return wait_readable(self->mbox, wake, timeout);
+}
+
+/* Wait for and receive the next message that f (if not NULL) lets
+ * through, dropping the others, within 'timeout' seconds in all, and
+ * count all of them in rs.  Called without the GIL.  Returns as
+ * receive_wait() does; if it returns 1, the message is in rm, or *err is
+ * set.
+ */
+static int
+receive_next(MailboxObject *self, MsgFilter *f, int wake, double timeout,
+	     RawMsg *rm, int *err, long *drops, RecvStats *rs)
+{
+#ifndef MS_WINDOWS
+	double deadline = f != NULL && timeout > 0 ? monotonic() + timeout : 0;
+#endif
+	int ready;
+
+	for (;;) {
+		ready = receive_wait(self, wake, timeout);
+		if (ready != 1)
+			return ready;
+		*err = raw_receive(self->mbox, rm);
+		if (*err)
+			return 1;
+		stats_received(rs, rm);
+		if (f == NULL || filter_pass(f, rm, drops))
+			return 1;
+#ifndef MS_WINDOWS
+		if (timeout > 0) {
+			timeout = deadline - monotonic();
+			if (timeout < 0)
+				timeout = 0;
+		}
+#endif
+	}
+}
+
+/* Wait up to 'timeout' seconds for a message that the filter lets
+ * through, and receive it into rm (set up with raw_init()).  Returns 1 if
+ * it did, in which case rm may be using the mailbox's receive buffers,
+ * and if *pooled is set the caller must call rbuf_release() once it is
+ * done with it; 0 on timeout; or -1 with an exception set.  If
+ * rm->fixed_data is set, rm keeps its own buffers, and a message too long
+ * for them is reported as BUFFER_TOO_SHORT with the length needed.
+ */
+static int
+receive_raw(MailboxObject *self, char *methodname, double timeout,
+	    RawMsg *rm, int *pooled)
+{
+	int err = 0, ready, wake;
+	MsgFilter *filter = NULL;
+	long drops[FILTER_REASONS] = {0};
+	RecvStats rs = {{0}};
+	double start;
+
+	*pooled = 0;
+	wake = timeout != 0 ? mbox_wake(self) : -1;
+	if (wake < -1 || begin_receive(self, methodname, &start) < 0)
+		return -1;
+	*pooled = rm->fixed_data ? 0 : rbuf_acquire(self, rm);
+	filter = filter_get(self);
+
+	Py_BEGIN_ALLOW_THREADS
+	ready = receive_next(self, filter, wake, timeout, rm, &err, drops,
+			     &rs);
+	Py_END_ALLOW_THREADS
+	end_receive(self, err, &rs, start);
+	filter_done(filter, drops);
+
+	if (ready == 1 && !err) {
+		if (*pooled)
+			rbuf_account(self, rm);
+		return 1;
+	}
+	if (ready < 0)
+		PyErr_SetFromErrno(PyExc_OSError);
+	else if (ready == WOKEN)
+		spread_error(CONNECTION_CLOSED, NULL);
+	else if (err == BUFFER_TOO_SHORT && rm->fixed_data && rm->endian < 0)
+		/* The message is still queued; say how big a buffer it
+		 * needs. */
+		spread_error_extra(err, self, - rm->endian);
+	else if (ready == 1)
+		raw_error(err, rm, self);
+	if (*pooled)
+		rbuf_release(self, rm);
+	*pooled = 0;
+	return ready == 0 ? 0 : -1;
+}
+
+/* The body of receive(), receive_into() and run():  receive_raw(), except
+ * that the records of a kept batch frame come first, a batch frame
+ * received with unbatching on is kept and its first record returned in
+ * its place, and fragments are received until one completes a message.
+ */
+static int
+receive_one(MailboxObject *self, char *methodname, double timeout,
+	    RawMsg *rm, int *pooled)
+{
+	RawMsg init = *rm;
+#ifndef MS_WINDOWS
+	double deadline = timeout > 0 ? monotonic() + timeout : 0;
+#endif
+	int r;
+
+	for (;;) {
+		*pooled = 0;
+		r = unbatch_take(self, rm);
+		if (r != 0)
+			return r;
+		r = receive_raw(self, methodname, timeout, rm, pooled);
+		if (r <= 0)
+			return r;
+		if (IS_BATCH(rm) && unbatching(self))
+			r = unbatch_keep(self, rm, 0);
+		else if ((r = reasm_take(self, rm)) == 0)
+			return 1;
+		if (*pooled)
+			rbuf_release(self, rm);
+		*pooled = 0;
+		raw_free(rm);
+		*rm = init;
+		if (r < 0)
+			return -1;
+#ifndef MS_WINDOWS
+		if (timeout > 0) {
+			timeout = deadline - monotonic();
+			if (timeout < 0)
+				timeout = 0;
+		}
+#endif
+	}
+}
+
+static PyObject *
+mailbox_receive(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"timeout", 0};
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	char databuffer[DEFAULT_BUFFER_SIZE];
+	RawMsg rm;
+	int r, pooled;
+	double timeout;
+	PyObject *argv[1];
+	PyObject *msg = NULL;
+
+	if (unpack_args("receive", ARGS, kwlist, 0, argv) < 0 ||
+	    get_timeout(argv[0], &timeout) < 0)
+		return NULL;
+
+	raw_init(&rm, groupbuffer, DEFAULT_GROUPS_SIZE,
+		 databuffer, DEFAULT_BUFFER_SIZE);
+	r = receive_one(self, "receive", timeout, &rm, &pooled);
+	if (r == 0) {
+		msg = Py_None;
+		Py_INCREF(msg);
+	}
+	else if (r > 0) {
+		msg = build_msg(self, &rm, 1);
+		if (pooled)
+			rbuf_release(self, &rm);
+	}
+	raw_free(&rm);
+	return msg;
+}
+
+/* The body of receive_many():  wait up to 'timeout' seconds for
+ * a message, then receive it and whatever else SP_poll() says is already
+ * waiting, up to max_msgs, in one release of the GIL.  If 'unbatch' is
+ * set, a batch frame ends the batch, so that the records the caller can't
+ * take yet are the last messages received.  Returns the number of
+ * messages, stored in a malloc'ed array in *msgs for the caller to free
+ * with raw_free() and free(); 0 on timeout; or -1 with an exception set.
+ */
+static int
+receive_batch(MailboxObject *self, char *methodname, int max_msgs,
+	      double timeout, int unbatch, RawMsg **msgs)
+{
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	char databuffer[DEFAULT_BUFFER_SIZE];
+	RawMsg scratch;
+	int num_msgs = 0, allocated = 0;
+	int ready, wake, err = 0, pooled = 0;
+	MsgFilter *filter = NULL;
+	long drops[FILTER_REASONS] = {0};
+	RecvStats rs = {{0}};
+	double start;
+
+	*msgs = NULL;
+	raw_init(&scratch, groupbuffer, DEFAULT_GROUPS_SIZE,
+		 databuffer, DEFAULT_BUFFER_SIZE);
+
+	wake = timeout != 0 ? mbox_wake(self) : -1;
+	if (wake < -1 || begin_receive(self, methodname, &start) < 0) {
+		num_msgs = -1;
+		goto Done;
+	}
+	pooled = rbuf_acquire(self, &scratch);
+	filter = filter_get(self);
+
+	/* Block for the first message only; after that, take whatever
+	 * SP_poll() says is already waiting, up to max_msgs.
+	 */
+	Py_BEGIN_ALLOW_THREADS
+	ready = receive_next(self, filter, wake, timeout, &scratch, &err,
+			     drops, &rs);
+	while (ready == 1 && !err) {
+		if (pooled)
+			rbuf_account(self, &scratch);
+		if (num_msgs == allocated) {
+			int n = allocated ? 2 * allocated : 16;
+			RawMsg *p;
+
+			if (n > max_msgs)
+				n = max_msgs;
+			p = realloc(*msgs, n * sizeof(RawMsg));
+			if (p == NULL) {
+				err = RAW_NOMEM;
+				break;
+			}
+			*msgs = p;
+			allocated = n;
+		}
+		if (raw_keep(&(*msgs)[num_msgs], &scratch) < 0) {
+			err = RAW_NOMEM;
+			break;
+		}
+		num_msgs++;
+		if (unbatch && IS_BATCH(&scratch))
+			break;
+		do {
+			if (num_msgs == max_msgs ||
+			    SP_poll(self->mbox) <= 0)
+				goto Received;
+			err = raw_receive(self->mbox, &scratch);
+			if (!err)
+				stats_received(&rs, &scratch);
+		} while (!err && filter != NULL &&
+			 !filter_pass(filter, &scratch, drops));
+	}
+Received:
+	Py_END_ALLOW_THREADS
+	end_receive(self, err, &rs, start);
+	filter_done(filter, drops);
+
+	if (pooled)
+		rbuf_release(self, &scratch);
+	if (ready < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		num_msgs = -1;
+	}
+	else if (ready == WOKEN) {
+		spread_error(CONNECTION_CLOSED, NULL);
+		num_msgs = -1;
+	}
+	/* After an error, hand back what was received before it; the next
+	 * call reports it again if it persists.
+	 */
+	else if (err && num_msgs == 0) {
+		raw_error(err, &scratch, self);
+		num_msgs = -1;
+	}
+Done:
+	raw_free(&scratch);
+	return num_msgs;
+}
+
+/* Append the records of the kept batch frames to list, as long as it is
+ * shorter than max_msgs.  Returns 0, or -1 with an exception set.
+ */
+static int
+unbatch_list(MailboxObject *self, RawMsg *rm, PyObject *list, int max_msgs)
+{
+	PyObject *msg;
+	int r = 0;
+
+	while (PyList_GET_SIZE(list) < max_msgs &&
+	       (r = unbatch_take(self, rm)) > 0) {
+		msg = build_msg(self, rm, 1);
+		if (msg == NULL || PyList_Append(list, msg) < 0)
+			r = -1;
+		Py_XDECREF(msg);
+		if (r < 0)
+			break;
+	}
+	return r < 0 ? -1 : 0;
+}
+
+static PyObject *
+mailbox_receive_many(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"max_msgs", "timeout", 0};
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	char databuffer[DEFAULT_BUFFER_SIZE];
+	RawMsg *msgs, rm;
+	int max_msgs = 0, num_msgs, unbatch, i, r;
+	double timeout;
+#ifndef MS_WINDOWS
+	double deadline;
+#endif
+	PyObject *argv[2];
+	PyObject *result, *msg;
+
+	if (unpack_args("receive_many", ARGS, kwlist, 1, argv) < 0 ||
+	    arg_int(argv[0], &max_msgs) < 0)
+		return NULL;
+	if (max_msgs < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_msgs must be at least 1");
+		return NULL;
+	}
+	if (get_timeout(argv[1], &timeout) < 0)
+		return NULL;
+#ifndef MS_WINDOWS
+	deadline = monotonic() + timeout;
+#endif
+
+	result = PyList_New(0);
+	if (result == NULL)
+		return NULL;
+	raw_init(&rm, groupbuffer, DEFAULT_GROUPS_SIZE,
+		 databuffer, DEFAULT_BUFFER_SIZE);
+
+	/* The records left in kept batch frames come first, on their own. */
+	if (unbatch_list(self, &rm, result, max_msgs) < 0)
+		Py_CLEAR(result);
+	while (result != NULL && PyList_GET_SIZE(result) == 0) {
+		unbatch = unbatching(self);
+		num_msgs = receive_batch(self, "receive_many", max_msgs,
+					 timeout, unbatch, &msgs);
+		if (num_msgs <= 0) {
+			if (num_msgs < 0)
+				Py_CLEAR(result);
+			break;
+		}
+		for (i = 0; result != NULL && i < num_msgs; i++) {
+			if (unbatch && IS_BATCH(&msgs[i])) {
+				/* The last one; see receive_batch(). */
+				if (unbatch_keep(self, &msgs[i], 0) < 0 ||
+				    unbatch_list(self, &rm, result,
+						 max_msgs) < 0)
+					Py_CLEAR(result);
+				continue;
+			}
+			r = reasm_take(self, &msgs[i]);
+			if (r < 0)
+				Py_CLEAR(result);
+			if (r != 0)
+				continue;
+			msg = build_msg(self, &msgs[i], 1);
+			if (msg == NULL || PyList_Append(result, msg) < 0)
+				Py_CLEAR(result);
+			Py_XDECREF(msg);
+		}
+		for (i = 0; i < num_msgs; i++)
+			raw_free(&msgs[i]);
+		free(msgs);
+		/* Go on only if a batch frame had nothing to let through, or
+		   fragments completed nothing. */
+#ifndef MS_WINDOWS
+		if (timeout > 0) {
+			timeout = deadline - monotonic();
+			if (timeout < 0)
+				timeout = 0;
+		}
+#endif
+	}
+	raw_free(&rm);
+	return result;
+}
+
+static PyObject *
+mailbox_receive_into(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"buffer", "timeout", 0};
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	PyObject *argv[2];
+	PyObject *msg = NULL, *result = NULL;
+	Py_ssize_t buflen;
+	RawMsg rm;
+	int r, pooled;
+	double timeout;
+	Py_buffer view;
+
+	if (unpack_args("receive_into", ARGS, kwlist, 1, argv) < 0 ||
+	    get_timeout(argv[1], &timeout) < 0)
+		return NULL;
+	if (get_buffer(argv[0], &view, 1) < 0) {
+		PyErr_SetString(PyExc_TypeError,
+				"receive_into() argument must be a "
+				"writable buffer");
+		return NULL;
+	}
+	buflen = view.len;
+	if (buflen > INT_MAX)
+		buflen = INT_MAX;
+
+	raw_init(&rm, groupbuffer, DEFAULT_GROUPS_SIZE, view.buf, (int)buflen);
+	rm.fixed_data = 1;
+
+	r = receive_one(self, "receive_into", timeout, &rm, &pooled);
+	if (r > 0 && rm.codec) {
+		/* The compressed data is in the caller's buffer, where it is
+		   to be decompressed to. */
+		RawMsg packed = rm;
+
+		packed.data = NULL;
+		if (rm.orig_size > buflen) {
+			if (unbatch_unget(self, &rm,
+					  COMPRESSED_MSG_TYPE) == 0)
+				spread_error_extra(BUFFER_TOO_SHORT, self,
+						   rm.orig_size);
+			r = -1;
+		}
+		else if ((packed.data = malloc(rm.size)) == NULL) {
+			PyErr_NoMemory();
+			r = -1;
+		}
+		else {
+			memcpy(packed.data, rm.data, rm.size);
+			if (unpack_msg(self, &packed, rm.data) < 0)
+				r = -1;
+			rm.size = rm.orig_size;
+		}
+		free(packed.data);
+	}
+	else if (r > 0 && rm.whole != NULL) {
+		if (rm.size > buflen) {
+			RawMsg whole = rm;
+
+			whole.data = PyBytes_AS_STRING(rm.whole);
+			if (unbatch_unget(self, &whole, rm.msg_type) == 0)
+				spread_error_extra(BUFFER_TOO_SHORT, self,
+						   rm.size);
+			r = -1;
+		}
+		else
+			memcpy(view.buf, PyBytes_AS_STRING(rm.whole), rm.size);
+	}
+	if (r == 0) {
+		result = Py_None;
+		Py_INCREF(result);
+	}
+	else if (r > 0) {
+		msg = build_msg(self, &rm, 0);
+		if (msg != NULL)
+			result = Py_BuildValue("iN", rm.size, msg);
+	}
+	raw_free(&rm);
+	PyBuffer_Release(&view);
+	return result;
+}
+
+/* run():  receive messages and hand each to the callback registered for
+ * it, deciding in C which one that is, so that messages nobody wants
+ * never become objects and the rest go straight to their handler.
+ */
+static unsigned long
+handler_hash(const char *group, int any_type, int msg_type)
+{
+	return name_hash(group) ^
+		(any_type ? 0x9e3779b9UL : (unsigned long)msg_type * 2654435761UL);
+}
+
+/* The callback registered for exactly this group and msg_type, or NULL. */
+static PyObject *
+handler_find(Handler *table, int size, const char *group, int any_type,
+	     int msg_type)
+{
+	int i = handler_hash(group, any_type, msg_type) & (size - 1);
+
+	for (; table[i].callback != NULL; i = (i + 1) & (size - 1))
+		if (table[i].any_type == any_type &&
+		    (any_type || table[i].msg_type == msg_type) &&
+		    strncmp(table[i].group, group, MAX_GROUP_NAME) == 0)
+			return table[i].callback;
+	return NULL;
+}
+
+static void
+handlers_free(Handler *table, int size)
+{
+	int i;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < size; i++)
+		Py_XDECREF(table[i].callback);
+	free(table);
+}
+
+/* The callback for a regular message:  the one for the first of its
+ * groups that has one, for its msg_type or else for any; failing that,
+ * the one for any group.  Returns a new reference, or NULL if none.
+ */
+static PyObject *
+handler_route(MailboxObject *self, RawMsg *rm)
+{
+	PyObject *cb = NULL;
+	int i;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->handlers != NULL) {
+		Handler *t = self->handlers;
+		int size = self->handlers_size;
+
+		for (i = 0; cb == NULL && i <= rm->num_groups; i++) {
+			const char *group = i < rm->num_groups ?
+				rm->groups[i] : "";
+
+			cb = handler_find(t, size, group, 0, rm->msg_type);
+			if (cb == NULL)
+				cb = handler_find(t, size, group, 1, 0);
+		}
+		Py_XINCREF(cb);
+	}
+	Py_END_CRITICAL_SECTION();
+	return cb;
+}
+
+static char mailbox_register__doc__[] =
+"register(group=None, msg_type=None, callback)\n"
+"\n"
+"Have run() call callback(msg) for the regular messages sent to group\n"
+"with the given msg_type.  None for group or msg_type matches any.  A\n"
+"callback of None removes the registration.";
+
+/* Registrations are rare, so each one builds a new table. */
+static PyObject *
+mailbox_register(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"group", "msg_type", "callback", 0};
+	PyObject *argv[3], *callback;
+	const char *group = "";
+	int msg_type = 0, any_type, i, n = 0, size, old_size;
+	Handler *table, *old;
+	char name[MAX_GROUP_NAME];
+
+	if (unpack_args("register", ARGS, kwlist, 0, argv) < 0)
+		return NULL;
+	if (argv[2] == NULL) {
+		PyErr_SetString(PyExc_TypeError,
+				"register() missing required argument "
+				"'callback'");
+		return NULL;
+	}
+	if (argv[0] != Py_None && arg_name(argv[0], &group) < 0)
+		return NULL;
+	any_type = argv[1] == NULL || argv[1] == Py_None;
+	if (!any_type && arg_int(argv[1], &msg_type) < 0)
+		return NULL;
+	callback = argv[2] == Py_None ? NULL : argv[2];
+	if (callback != NULL && !PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	if (strlen(group) >= MAX_GROUP_NAME) {
+		PyErr_Format(PyExc_ValueError, "group name too long: %.100s",
+			     group);
+		return NULL;
+	}
+	memset(name, 0, sizeof(name));
+	strcpy(name, group);
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	old = self->handlers;
+	old_size = self->handlers_size;
+	for (i = 0; old != NULL && i < old_size; i++)
+		n += old[i].callback != NULL;
+	size = round_size(2 * (n + 1), 8);
+	table = calloc(size, sizeof(Handler));
+	if (table != NULL) {
+		/* Copy all but the one being replaced, then add it. */
+		for (i = 0; old != NULL && i < old_size; i++) {
+			Handler *h = &old[i];
+			int j;
+
+			if (h->callback == NULL ||
+			    (h->any_type == any_type &&
+			     (any_type || h->msg_type == msg_type) &&
+			     strcmp(h->group, name) == 0))
+				continue;
+			j = handler_hash(h->group, h->any_type, h->msg_type) &
+				(size - 1);
+			while (table[j].callback != NULL)
+				j = (j + 1) & (size - 1);
+			table[j] = *h;
+			Py_INCREF(h->callback);
+		}
+		if (callback != NULL) {
+			Handler *h;
+
+			i = handler_hash(name, any_type, msg_type) & (size - 1);
+			while (table[i].callback != NULL)
+				i = (i + 1) & (size - 1);
+			h = &table[i];
+			memcpy(h->group, name, MAX_GROUP_NAME);
+			h->msg_type = any_type ? 0 : msg_type;
+			h->any_type = any_type;
+			Py_INCREF(callback);
+			h->callback = callback;
+		}
+		self->handlers = table;
+		self->handlers_size = size;
+	}
+	Py_END_CRITICAL_SECTION();
+	if (table == NULL)
+		return PyErr_NoMemory();
+	handlers_free(old, old_size);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_register_membership(MailboxObject *self, PyObject *callback)
+{
+	PyObject *old;
+
+	if (callback == Py_None)
+		callback = NULL;
+	else if (!PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+	Py_XINCREF(callback);
+	Py_BEGIN_CRITICAL_SECTION(self);
+	old = self->on_membership;
+	self->on_membership = callback;
+	Py_END_CRITICAL_SECTION();
+	Py_XDECREF(old);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_stop(MailboxObject *self, PyObject *unused)
+{
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->run_stop = 1;
+	Py_END_CRITICAL_SECTION();
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* Hand one received message to its callback, if it has one.  Returns 0,
+ * or -1 with an exception set (the callback's, or from building the
+ * message).
+ */
+static int
+dispatch(MailboxObject *self, RawMsg *rm)
+{
+	PyObject *cb, *msg, *r;
+	int build;
+
+	if (Is_regular_mess(rm->svc_type)) {
+		cb = handler_route(self, rm);
+		build = cb != NULL;
+	}
+	else {
+		Py_BEGIN_CRITICAL_SECTION(self);
+		cb = self->on_membership;
+		Py_XINCREF(cb);
+		/* The membership view is kept up to date either way. */
+		build = cb != NULL || self->views != NULL;
+		Py_END_CRITICAL_SECTION();
+	}
+	if (!build) {
+		latency_note(self, rm);
+		return 0;
+	}
+	msg = build_msg(self, rm, 1);
+	if (msg == NULL || cb == NULL) {
+		Py_XDECREF(cb);
+		Py_XDECREF(msg);
+		return msg == NULL ? -1 : 0;
+	}
+	r = PyObject_CallFunctionObjArgs(cb, msg, NULL);
+	Py_DECREF(cb);
+	Py_DECREF(msg);
+	Py_XDECREF(r);
+	return r == NULL ? -1 : 0;
+}
+
+static char mailbox_run__doc__[] =
+"run([timeout[, max_msgs]]) -> number of messages received\n"
+"\n"
+"Receive messages and hand each to its callback (see register() and\n"
+"register_membership()) until timeout seconds have passed (default:\n"
+"forever), max_msgs messages have been received, stop() is called, or\n"
+"a callback raises an exception, which run() passes on.";
+
+static PyObject *
+mailbox_run(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"timeout", "max_msgs", 0};
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	char databuffer[DEFAULT_BUFFER_SIZE];
+	PyObject *argv[2];
+	RawMsg rm;
+	double timeout, left;
+#ifndef MS_WINDOWS
+	double deadline;
+#endif
+	int max_msgs = -1, count = 0, r = 1, pooled, stop;
+
+	if (unpack_args("run", ARGS, kwlist, 0, argv) < 0 ||
+	    get_timeout(argv[0], &timeout) < 0 ||
+	    (argv[1] != Py_None && arg_int(argv[1], &max_msgs) < 0))
+		return NULL;
+#ifndef MS_WINDOWS
+	deadline = monotonic() + timeout;
+#endif
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->run_stop = 0;
+	Py_END_CRITICAL_SECTION();
+
+	left = timeout;
+	while (max_msgs < 0 || count < max_msgs) {
+#ifndef MS_WINDOWS
+		if (timeout > 0) {
+			left = deadline - monotonic();
+			if (left < 0)
+				left = 0;
+		}
+#endif
+		raw_init(&rm, groupbuffer, DEFAULT_GROUPS_SIZE,
+			 databuffer, DEFAULT_BUFFER_SIZE);
+		r = receive_one(self, "run", left, &rm, &pooled);
+		if (r > 0) {
+			count++;
+			if (dispatch(self, &rm) < 0)
+				r = -1;
+			if (pooled)
+				rbuf_release(self, &rm);
+		}
+		raw_free(&rm);
+		if (r <= 0)
+			break;
+		Py_BEGIN_CRITICAL_SECTION(self);
+		stop = self->run_stop;
+		Py_END_CRITICAL_SECTION();
+		if (stop)
+			break;
+	}
+	if (r < 0)
+		return NULL;
+	return PyInt_FromLong(count);
+}
+
+#ifdef HAVE_RECEIVER
+
+/* The background receiver.  start_receiver() starts a thread that owns
+ * SP_receive() for the mailbox:  it copies each message into a bounded
+ * ring of RawMsgs, and Python takes them from there through the mailbox's
+ * queue object, so the socket keeps being drained while Python is busy.
+ *
+ * The ring has exactly one producer (the thread) and any number of
+ * consumers, which claim a slot under 'taking' and move its message out
+ * before building anything from it:  building can let the GIL go, and
+ * with it another consumer; head and tail are free-running counters
+ * updated with atomic stores.  Each side
+ * sleeps in poll(2) on a pipe the other side writes a byte to:  'wake'
+ * when the ring stops being empty, 'ctl' when it stops being full or the
+ * thread should stop.  The sleeper drains its pipe and checks the ring
+ * again before sleeping, so no wakeup is lost.
+ */
+typedef struct {
+	PyObject_HEAD
+	MailboxObject *mbox;	/* borrowed; NULL once stopped */
+	mailbox fd;
+	RawMsg *ring;		/* NULL once stopped */
+	unsigned int capacity;	/* a power of 2 */
+	unsigned int head;	/* messages taken; written by consumers */
+	unsigned int tail;	/* messages added; written by the thread */
+	int wake[2];		/* thread -> consumers:  messages waiting */
+	int ctl[2];		/* consumers -> thread:  space, or stop */
+	int stopping;
+	int done;		/* the thread has exited */
+	int err;		/* why, if it wasn't asked to */
+	RawMsg scratch;		/* the thread's receive buffers */
+	PyThread_type_lock running;	/* held until the thread exits */
+	PyThread_type_lock taking;	/* guards head, ring and mbox for
+					   consumers; never held while the
+					   GIL could be let go */
+	long received;
+	long full_waits;	/* times the thread waited for space */
+	unsigned int high_water;
+} QueueObject;
+
+#define DEFAULT_QUEUE_CAPACITY 1024
+
+static PyTypeObject *Queue_Type;
+
+static void
+receiver_main(void *arg)
+{
+	QueueObject *q = (QueueObject *)arg;
+	unsigned int mask = q->capacity - 1;
+	struct pollfd pfd[2];
+	int err = 0;
+
+	pfd[0].fd = q->ctl[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = q->fd;
+	pfd[1].events = POLLIN;
+	while (!ATOMIC_LOAD(&q->stopping)) {
+		unsigned int tail = q->tail;
+		unsigned int head = ATOMIC_LOAD(&q->head);
+		int n;
+
+		if (tail - head == q->capacity) {
+			pipe_drain(q->ctl[0]);
+			if (ATOMIC_LOAD(&q->head) != head ||
+			    ATOMIC_LOAD(&q->stopping))
+				continue;
+			q->full_waits++;
+			n = poll(pfd, 1, -1);
+		}
+		else {
+			n = poll(pfd, 2, -1);
+			if (n > 0 && pfd[1].revents) {
+				err = raw_receive(q->fd, &q->scratch);
+				if (err)
+					break;
+				if (raw_keep(&q->ring[tail & mask],
+					     &q->scratch) < 0) {
+					err = RAW_NOMEM;
+					break;
+				}
+				ATOMIC_STORE(&q->tail, tail + 1);
+				q->received++;
+				head = ATOMIC_LOAD(&q->head);
+				if (tail + 1 - head > q->high_water)
+					q->high_water = tail + 1 - head;
+				if (head == tail)
+					pipe_signal(q->wake[1]);
+				continue;
+			}
+		}
+		if (n < 0 && errno != EINTR) {
+			q->scratch.assertmsg = "poll() failed in the receiver";
+			err = RAW_ASSERT;
+			break;
+		}
+		if (n > 0 && pfd[0].revents)
+			pipe_drain(q->ctl[0]);
+	}
+	q->err = err;
+	ATOMIC_STORE(&q->done, 1);
+	pipe_signal(q->wake[1]);
+	PyThread_release_lock(q->running);
+}
+
+/* Take the oldest message that the mailbox's filter lets through off the
+ * ring, dropping the ones before it, and build its message object in
+ * *msg.  With unbatching on, a batch frame is kept by the mailbox, and
+ * its records are taken before anything else.  Called with the GIL.
+ * Returns 1, 0 if the ring is empty (or only held dropped messages) or
+ * gone, or -1 with an exception set (the message is lost).
+ */
+static int
+queue_take(QueueObject *q, PyObject **msg, int stopping)
+{
+	char groupbuffer[DEFAULT_GROUPS_SIZE][MAX_GROUP_NAME];
+	char databuffer[DEFAULT_BUFFER_SIZE];
+	unsigned int head, tail;
+	RawMsg rm, taken;
+	MsgFilter *filter = NULL;
+	long drops[FILTER_REASONS] = {0};
+	RecvStats rs = {{0}};
+	MailboxObject *mbox;
+	int r = 0, unbatch, got;
+
+	/* Once the receiver is stopping, only receiver_stop() (with
+	 * stopping set) takes what is left:  the mailbox may be on its way
+	 * out. */
+	PyThread_acquire_lock(q->taking, 1);
+	mbox = q->ring != NULL && (stopping || !ATOMIC_LOAD(&q->stopping)) ?
+		q->mbox : NULL;
+	Py_XINCREF(mbox);
+	PyThread_release_lock(q->taking);
+	if (mbox == NULL)
+		return 0;
+
+	raw_init(&rm, groupbuffer, DEFAULT_GROUPS_SIZE,
+		 databuffer, DEFAULT_BUFFER_SIZE);
+	filter = filter_get(mbox);
+	unbatch = unbatching(mbox);
+	while (r == 0) {
+		r = unbatch_take(mbox, &rm);
+		if (r > 0) {
+			*msg = build_msg(mbox, &rm, 1);
+			r = *msg == NULL ? -1 : 1;
+		}
+		if (r != 0)
+			break;
+		/* Claim the oldest slot:  its message becomes ours, and the
+		 * thread may reuse the slot at once. */
+		got = 0;
+		PyThread_acquire_lock(q->taking, 1);
+		if (q->ring != NULL &&
+		    ATOMIC_LOAD(&q->tail) != (head = q->head)) {
+			taken = q->ring[head & (q->capacity - 1)];
+			ATOMIC_STORE(&q->head, head + 1);
+			tail = ATOMIC_LOAD(&q->tail);
+			if (tail - head == q->capacity)
+				pipe_signal(q->ctl[1]);
+			/* The thread only signals an empty ring, and a
+			 * waiting consumer may have drained that:  pass it
+			 * on while messages are left. */
+			if (tail != head + 1)
+				pipe_signal(q->wake[1]);
+			got = 1;
+		}
+		PyThread_release_lock(q->taking);
+		if (!got)
+			break;
+		stats_received(&rs, &taken);
+		if (unbatch && IS_BATCH(&taken)) {
+			if (filter == NULL ||
+			    filter_pass(filter, &taken, drops))
+				r = unbatch_keep(mbox, &taken, 0);
+		}
+		else if ((filter == NULL ||
+			  filter_pass(filter, &taken, drops)) &&
+			 (r = reasm_take(mbox, &taken)) == 0) {
+			*msg = build_msg(mbox, &taken, 1);
+			r = *msg == NULL ? -1 : 1;
+		}
+		else if (r > 0)
+			r = 0;	/* a fragment; look further */
+		raw_free(&taken);
+	}
+	/* The thread did the waiting, so no time is counted. */
+	stats_receive_done(mbox, &rs);
+	filter_done(filter, drops);
+	raw_free(&rm);
+	Py_DECREF(mbox);
+	return r;
+}
+
+/* Set the exception for a queue that has nothing more to give:  stopped,
+ * or the thread died of a receive error.
+ */
+static PyObject *
+queue_error(QueueObject *q)
+{
+	if (q->ring == NULL || q->err == 0)
+		PyErr_SetString(SpreadError, "receiver is not running");
+	else if (q->err < 0)
+		spread_error(q->err, q->mbox);
+	else
+		raw_error(q->err, &q->scratch, q->mbox);
+	return NULL;
+}
+
+/* Wait until the ring has a message, the thread is gone, or 'deadline'
+ * passes (never, if 'timeout' is negative).  Called with the GIL.
+ * Returns 1 if there is something to look at, 0 on timeout, -1 with an
+ * exception set on error.
+ */
+static int
+queue_wait(QueueObject *q, double timeout, double deadline)
+{
+	int ready = 1;
+
+	for (;;) {
+		if (q->ring == NULL || ATOMIC_LOAD(&q->tail) != q->head ||
+		    ATOMIC_LOAD(&q->done) || frames_kept(q->mbox))
+			return 1;
+		if (timeout >= 0) {
+			timeout = deadline - monotonic();
+			if (timeout < 0)
+				timeout = 0;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		pipe_drain(q->wake[0]);
+		if (ATOMIC_LOAD(&q->tail) == ATOMIC_LOAD(&q->head) &&
+		    !ATOMIC_LOAD(&q->done))
+			ready = wait_readable(q->wake[0], -1, timeout);
+		Py_END_ALLOW_THREADS
+		if (ready < 0) {
+			PyErr_SetFromErrno(PyExc_OSError);
+			return -1;
+		}
+		if (ready == 0)
+			return 0;
+	}
+}
+
+static PyObject *
+queue_get(QueueObject *q, ARGS_DECL)
+{
+	static char *kwlist[] = {"timeout", 0};
+	PyObject *argv[1], *msg;
+	double timeout, deadline;
+	int ready;
+
+	if (unpack_args("get", ARGS, kwlist, 0, argv) < 0 ||
+	    get_timeout(argv[0], &timeout) < 0)
+		return NULL;
+	deadline = monotonic() + timeout;
+	for (;;) {
+		ready = queue_wait(q, timeout, deadline);
+		if (ready <= 0) {
+			if (ready < 0)
+				return NULL;
+			Py_INCREF(Py_None);
+			return Py_None;
+		}
+		if (q->ring == NULL)
+			return queue_error(q);
+		switch (queue_take(q, &msg, 0)) {
+		case 1:
+			return msg;
+		case 0:
+			/* Unless the filter dropped all there was. */
+			if (ATOMIC_LOAD(&q->done) ||
+			    ATOMIC_LOAD(&q->stopping))
+				return queue_error(q);
+			break;
+		default:
+			return NULL;
+		}
+	}
+}
+
+static PyObject *
+queue_get_many(QueueObject *q, ARGS_DECL)
+{
+	static char *kwlist[] = {"max_msgs", "timeout", 0};
+	PyObject *argv[2], *result, *msg;
+	double timeout, deadline;
+	int max_msgs = 0, ready, got = 0;
+
+	if (unpack_args("get_many", ARGS, kwlist, 1, argv) < 0 ||
+	    arg_int(argv[0], &max_msgs) < 0)
+		return NULL;
+	if (max_msgs < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_msgs must be at least 1");
+		return NULL;
+	}
+	if (get_timeout(argv[1], &timeout) < 0)
+		return NULL;
+	deadline = monotonic() + timeout;
+	result = PyList_New(0);
+	if (result == NULL)
+		return NULL;
+Again:
+	ready = queue_wait(q, timeout, deadline);
+	if (ready <= 0) {
+		if (ready < 0)
+			Py_CLEAR(result);
+		return result;
+	}
+	if (q->ring == NULL) {
+		Py_DECREF(result);
+		return queue_error(q);
+	}
+	while (got < max_msgs) {
+		int r = queue_take(q, &msg, 0);
+
+		if (r == 0)
+			break;
+		if (r < 0 || PyList_Append(result, msg) < 0) {
+			Py_XDECREF(msg);
+			Py_DECREF(result);
+			return NULL;
+		}
+		Py_DECREF(msg);
+		got++;
+	}
+	/* Messages first; a dead receiver's error comes with the next call. */
+	if (got == 0) {
+		/* Unless the filter dropped all there was. */
+		if (!ATOMIC_LOAD(&q->done) && !ATOMIC_LOAD(&q->stopping))
+			goto Again;
+		Py_DECREF(result);
+		return queue_error(q);
+	}
+	return result;
+}
+
+static PyObject *
+queue_qsize(QueueObject *q, PyObject *unused)
+{
+	if (q->ring == NULL)
+		return PyInt_FromLong(0);
+	return PyInt_FromLong(ATOMIC_LOAD(&q->tail) - q->head);
+}
+
+static PyObject *
+queue_fileno(QueueObject *q, PyObject *unused)
+{
+	return PyInt_FromLong(q->wake[0]);
+}
+
+static PyObject *
+queue_stats(QueueObject *q, PyObject *unused)
+{
+	unsigned int depth = 0;
+
+	if (q->ring != NULL)
+		depth = ATOMIC_LOAD(&q->tail) - q->head;
+	return Py_BuildValue("{s:I,s:I,s:I,s:l,s:l,s:i}",
+			     "capacity", q->capacity,
+			     "depth", depth,
+			     "high_water", q->high_water,
+			     "received", q->received,
+			     "full_waits", q->full_waits,
+			     "running", q->ring != NULL &&
+					!ATOMIC_LOAD(&q->done));
+}
+
+static PyMethodDef Queue_methods[] = {
+	{"fileno",	(PyCFunction)queue_fileno,	METH_NOARGS},
+	{"get",		(PyCFunction)queue_get,
+	 METH_ARGS},
+	{"get_many",	(PyCFunction)queue_get_many,
+	 METH_ARGS},
+	{"qsize",	(PyCFunction)queue_qsize,	METH_NOARGS},
+	{"stats",	(PyCFunction)queue_stats,	METH_NOARGS},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static void
+queue_dealloc(QueueObject *q)
+{
+	/* The mailbox holds a reference until the thread has exited. */
+	if (q->running != NULL)
+		PyThread_free_lock(q->running);
+	if (q->taking != NULL)
+		PyThread_free_lock(q->taking);
+	close(q->wake[0]);
+	close(q->wake[1]);
+	close(q->ctl[0]);
+	close(q->ctl[1]);
+	PyObject_Del(q);
+	HEAPTYPE_DECREF(Queue_Type);
+}
+
+static PyType_Slot Queue_slots[] = {
+	{Py_tp_dealloc, queue_dealloc},
+	{Py_tp_methods, Queue_methods},
+	{0, NULL}
+};
+
+static PyType_Spec Queue_spec = {
+	"spread.ReceiveQueue",			/* name */
+	sizeof(QueueObject),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	Queue_slots				/* slots */
+};
+
+/* Free what start_receiver() allocated for the ring, once the thread is
+ * not running.
+ */
+static void
+queue_free_ring(QueueObject *q)
+{
+	unsigned int i;
+
+	if (q->ring != NULL) {
+		for (i = q->head; i != q->tail; i++)
+			raw_free(&q->ring[i & (q->capacity - 1)]);
+		free(q->ring);
+		q->ring = NULL;
+	}
+	raw_free(&q->scratch);
+}
+
+static PyObject *
+mailbox_start_receiver(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"capacity", 0};
+	int capacity = DEFAULT_QUEUE_CAPACITY;
+	PyObject *argv[1];
+	QueueObject *q;
+	const char *err = NULL;
+
+	if (unpack_args("start_receiver", ARGS, kwlist, 0, argv) < 0 ||
+	    arg_int(argv[0], &capacity) < 0)
+		return NULL;
+	if (capacity < 1 || capacity > (1 << 24)) {
+		PyErr_SetString(PyExc_ValueError,
+				"capacity must be between 1 and 2**24");
+		return NULL;
+	}
+
+	q = PyObject_New(QueueObject, Queue_Type);
+	if (q == NULL)
+		return NULL;
+	q->mbox = self;
+	q->fd = self->mbox;
+	q->capacity = round_size(capacity, 1);
+	q->head = q->tail = 0;
+	q->wake[0] = q->wake[1] = q->ctl[0] = q->ctl[1] = -1;
+	q->stopping = q->done = q->err = 0;
+	q->received = q->full_waits = 0;
+	q->high_water = 0;
+	raw_init(&q->scratch, NULL, 0, NULL, 0);
+	q->running = NULL;
+	q->taking = NULL;
+	q->ring = calloc(q->capacity, sizeof(RawMsg));
+	q->scratch.groups = malloc(MAX_GROUP_NAME * DEFAULT_GROUPS_SIZE);
+	q->scratch.own_groups = q->scratch.groups != NULL;
+	q->scratch.max_groups = DEFAULT_GROUPS_SIZE;
+	q->scratch.data = malloc(DEFAULT_BUFFER_SIZE);
+	q->scratch.own_data = q->scratch.data != NULL;
+	q->scratch.bufsize = DEFAULT_BUFFER_SIZE;
+	if (q->ring == NULL || !q->scratch.own_groups ||
+	    !q->scratch.own_data) {
+		queue_free_ring(q);
+		Py_DECREF(q);
+		return PyErr_NoMemory();
+	}
+	if (pipe_open(q->wake) < 0 || pipe_open(q->ctl) < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		queue_free_ring(q);
+		Py_DECREF(q);
+		return NULL;
+	}
+	q->running = PyThread_allocate_lock();
+	q->taking = PyThread_allocate_lock();
+	if (q->running == NULL || q->taking == NULL) {
+		queue_free_ring(q);
+		Py_DECREF(q);
+		return PyErr_NoMemory();
+	}
+
+	/* Claim the mailbox for the thread, checking everything that would
+	 * prevent it at once. */
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->disconnected || self->closing)
+		err = "start_receiver() called on closed mbox";
+	else if (self->queue != NULL)
+		err = "receiver is already running";
+	else if (self->receiving)
+		err = "start_receiver() called during a receive";
+	else {
+		Py_INCREF(q);
+		self->queue = (PyObject *)q;
+	}
+	Py_END_CRITICAL_SECTION();
+	if (err != NULL) {
+		queue_free_ring(q);
+		Py_DECREF(q);
+		PyErr_SetString(SpreadError, err);
+		return NULL;
+	}
+
+	PyThread_acquire_lock(q->running, 1);
+	if ((unsigned long)PyThread_start_new_thread(receiver_main, q) ==
+	    PYTHREAD_INVALID_THREAD_ID) {
+		PyThread_release_lock(q->running);
+		Py_BEGIN_CRITICAL_SECTION(self);
+		self->queue = NULL;
+		Py_END_CRITICAL_SECTION();
+		Py_DECREF(q);
+		queue_free_ring(q);
+		Py_DECREF(q);
+		PyErr_SetString(SpreadError, "can't start receiver thread");
+		return NULL;
+	}
+	return (PyObject *)q;
+}
+
+/* Stop the receiver thread and wait for it to exit.  If leftovers isn't
+ * NULL, the messages still in the ring are returned in a new list there;
+ * otherwise they are dropped.  Returns 0, or -1 with an exception set.
+ */
+static int
+receiver_stop(MailboxObject *self, PyObject **leftovers)
+{
+	QueueObject *q;
+	PyObject *list = NULL, *msg;
+	int r, stopping = 0;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	q = (QueueObject *)self->queue;
+	if (q != NULL) {
+		stopping = q->stopping;
+		ATOMIC_STORE(&q->stopping, 1);
+	}
+	Py_END_CRITICAL_SECTION();
+	if (q == NULL) {
+		if (leftovers != NULL)
+			*leftovers = PyList_New(0);
+		return leftovers != NULL && *leftovers == NULL ? -1 : 0;
+	}
+	if (stopping) {
+		/* Another thread is stopping it.  Only stop_receiver()
+		 * calls that an error. */
+		if (leftovers == NULL)
+			return 0;
+		PyErr_SetString(SpreadError, "receiver is already stopping");
+		return -1;
+	}
+	pipe_signal(q->ctl[1]);
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(q->running, 1);
+	Py_END_ALLOW_THREADS
+	PyThread_release_lock(q->running);
+
+	if (leftovers != NULL) {
+		list = PyList_New(0);
+		while (list != NULL && (r = queue_take(q, &msg, 1)) != 0) {
+			if (r < 0 || PyList_Append(list, msg) < 0)
+				Py_CLEAR(list);
+			Py_XDECREF(msg);
+		}
+		*leftovers = list;
+	}
+	PyThread_acquire_lock(q->taking, 1);
+	queue_free_ring(q);
+	q->mbox = NULL;
+	PyThread_release_lock(q->taking);
+	/* Wake any thread still waiting in get(). */
+	pipe_signal(q->wake[1]);
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->queue = NULL;
+	Py_END_CRITICAL_SECTION();
+	Py_DECREF(q);
+	return list == NULL && leftovers != NULL ? -1 : 0;
+}
+
+static PyObject *
+mailbox_stop_receiver(MailboxObject *self, PyObject *unused)
+{
+	PyObject *leftovers;
+
+	if (self->queue == NULL) {
+		PyErr_SetString(SpreadError, "receiver is not running");
+		return NULL;
+	}
+	if (receiver_stop(self, &leftovers) < 0)
+		return NULL;
+	return leftovers;
+}
+
+#endif /* HAVE_RECEIVER */
+
+const int valid_svc_type = (UNRELIABLE_MESS | RELIABLE_MESS | FIFO_MESS
+			    | CAUSAL_MESS | AGREED_MESS | SAFE_MESS
+			    | SELF_DISCARD);
+
+static int
+check_svc_type(int svc_type)
+{
+	/* XXX This doesn't check that svc_type is set to exactly one of
+	   the service types. */
+	if ((svc_type & valid_svc_type) != svc_type) {
+		PyErr_SetString(PyExc_ValueError, "invalid service type");
+		return -1;
+	}
+	return 0;
+}
+
+/* Pack an iterable of group names into the array of MAX_GROUP_NAME
+ * strings SP_multigroup_multicast() wants.  Returns a malloc'ed array and
+ * stores its length in *num_groups, or sets an exception and returns NULL.
+ */
+static char (*
+pack_groups(PyObject *obj, int *num_groups))[MAX_GROUP_NAME]
+{
+	char (*groups)[MAX_GROUP_NAME] = NULL;
+	PyObject *seq, *temp;
+	int group_len, index;
+
+	if (Name_Check(obj)) {
+		/* A string is iterable, but surely not meant that way. */
+		PyErr_SetString(PyExc_TypeError,
+				"groups must be a tuple or other iterable "
+				"of strings");
+		return NULL;
+	}
+	seq = PySequence_Fast(obj, "groups must be a tuple or other "
+			      "iterable of strings");
+	if (seq == NULL)
+		return NULL;
+
+	group_len = PySequence_Fast_GET_SIZE(seq);
+	if (group_len == 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"there must be at least one group in groups");
+		goto Done;
+	}
+
+	groups = malloc(MAX_GROUP_NAME * group_len);
+	if (groups == NULL) {
+		PyErr_NoMemory();
+		goto Done;
+	}
+
+	for (index = 0; index < group_len; index++) {
+		const char *name;
+		Py_ssize_t len;
+
+		temp = PySequence_Fast_GET_ITEM(seq, index);
+		if (! Name_Check(temp)) {
+			PyErr_SetString(PyExc_TypeError,
+					"groups must be strings only");
+			goto Error;
+		}
+		name = name_chars(temp, &len);
+		if (name == NULL)
+			goto Error;
+		if (len >= MAX_GROUP_NAME) {
+			PyErr_Format(PyExc_ValueError,
+				     "group name too long: %.100s", name);
+			goto Error;
+		}
+		strncpy(groups[index], name, MAX_GROUP_NAME);
+	}
+	*num_groups = group_len;
+	goto Done;
+Error:
+	free(groups);
+	groups = NULL;
+Done:
+	Py_DECREF(seq);
+	return groups;
+}
+
+/* A GroupSet is a list of group names packed once, up front, for any
+ * number of multicasts to the same groups.
+ */
+typedef struct {
+	PyObject_HEAD
+	int num_groups;
+	char (*groups)[MAX_GROUP_NAME];
+	PyObject *names;	/* the names, as a tuple */
+} GroupSetObject;
+
+static PyObject *
+new_group_set(PyObject *groups)
+{
+	GroupSetObject *self;
+	PyObject *names;
+	int i;
+
+	self = PyObject_New(GroupSetObject, GroupSet_Type);
+	if (self == NULL)
+		return NULL;
+	self->names = NULL;
+	self->groups = pack_groups(groups, &self->num_groups);
+	if (self->groups == NULL) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	names = PyTuple_New(self->num_groups);
+	if (names == NULL) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	self->names = names;
+	for (i = 0; i < self->num_groups; i++) {
+		PyObject *s = Name_FromString(self->groups[i]);
+		if (s == NULL) {
+			Py_DECREF(self);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(names, i, s);
+	}
+	return (PyObject *)self;
+}
+
+static void
+group_set_dealloc(GroupSetObject *self)
+{
+	free(self->groups);
+	Py_XDECREF(self->names);
+	PyObject_Del(self);
+	HEAPTYPE_DECREF(GroupSet_Type);
+}
+
+static PyObject *
+group_set_repr(GroupSetObject *self)
+{
+	PyObject *names, *result;
+
+	names = PyObject_Repr(self->names);
+	if (names == NULL)
+		return NULL;
+	result = Name_FromFormat("<GroupSet %s>", Name_AsString(names));
+	Py_DECREF(names);
+	return result;
+}
+
+static Py_ssize_t
+group_set_length(GroupSetObject *self)
+{
+	return self->num_groups;
+}
+
+#define OFF(x) offsetof(GroupSetObject, x)
+
+static PyMemberDef GroupSet_members[] = {
+	{"groups",	T_OBJECT,	OFF(names),	READONLY},
+	{NULL}
+};
+
+#undef OFF
+
+static PyType_Slot GroupSet_slots[] = {
+	{Py_tp_dealloc, group_set_dealloc},
+	{Py_tp_repr, group_set_repr},
+	{Py_sq_length, group_set_length},
+	{Py_tp_members, GroupSet_members},
+	{0, NULL}
+};
+
+static PyType_Spec GroupSet_spec = {
+	"spread.GroupSet",			/* name */
+	sizeof(GroupSetObject),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	GroupSet_slots				/* slots */
+};
+
+/* Where a message is going:  either one group, or several packed by
+ * pack_groups() or borrowed from a GroupSet.  See get_target().
+ */
+typedef struct {
+	const char *group;
+	char (*groups)[MAX_GROUP_NAME];
+	int num_groups;
+	int own_groups;		/* groups must be freed */
+} Target;
+
+/* Fill in t from a group name, a GroupSet, or an iterable of names.  The
+ * object must stay alive while t is in use.  Returns 0, or sets an
+ * exception and returns -1.  target_free() releases t either way.
+ */
+static int
+get_target(PyObject *obj, Target *t)
+{
+	t->group = NULL;
+	t->groups = NULL;
+	t->num_groups = 1;
+	t->own_groups = 0;
+	if (Name_Check(obj))
+		return arg_name(obj, &t->group);
+	if (GroupSet_Check(obj)) {
+		t->groups = ((GroupSetObject *)obj)->groups;
+		t->num_groups = ((GroupSetObject *)obj)->num_groups;
+		return 0;
+	}
+	t->groups = pack_groups(obj, &t->num_groups);
+	t->own_groups = 1;
+	return t->groups == NULL ? -1 : 0;
+}
+
+static void
+target_free(Target *t)
+{
+	if (t->own_groups)
+		free(t->groups);
+	t->groups = NULL;
+}
+
+/* Send scattered data with SP_scat_multicast() or
+ * SP_multigroup_scat_multicast(), as target says.  Called without the GIL.
+ */
+static int
+target_scat_send(mailbox mbox, int svc_type, Target *target, int msg_type,
+		 const scatter *scat)
+{
+	if (target->group != NULL)
+		return SP_scat_multicast(mbox, svc_type, target->group,
+					 (int16)msg_type, scat);
+	return SP_multigroup_scat_multicast(
+		mbox, svc_type, target->num_groups,
+		(const char (*)[MAX_GROUP_NAME])target->groups,
+		(int16)msg_type, scat);
+}
+
+/* Write a timestamp header for a message of msg_type, sent now. */
+static void
+stamp_header(unsigned char *p, int msg_type)
+{
+	unsigned long long t = (unsigned long long)realtime_us();
+	int i;
+
+	p[0] = (unsigned char)(msg_type >> 8);
+	p[1] = (unsigned char)msg_type;
+	for (i = STAMP_HEADER - 1; i >= 2; i--) {
+		p[i] = (unsigned char)t;
+		t >>= 8;
+	}
+}
+
+/* Send a message with SP_multicast() or SP_multigroup_multicast(), as
+ * target says, with a timestamp in front if stamp is set (the length
+ * returned is still the message's).  Called without the GIL.
+ */
+static int
+target_send(mailbox mbox, int svc_type, Target *target, const char *msg,
+	    int msg_len, int msg_type, int stamp)
+{
+	unsigned char header[STAMP_HEADER];
+	scatter scat;
+	int r;
+
+	if (!stamp && target->group != NULL)
+		return SP_multicast(mbox, svc_type, target->group,
+				    (int16)msg_type, msg_len, msg);
+	if (!stamp)
+		return SP_multigroup_multicast(
+			mbox, svc_type, target->num_groups,
+			(const char (*)[MAX_GROUP_NAME])target->groups,
+			(int16)msg_type, msg_len, msg);
+	stamp_header(header, msg_type);
+	scat.num_elements = 2;
+	scat.elements[0].buf = (char *)header;
+	scat.elements[0].len = STAMP_HEADER;
+	scat.elements[1].buf = (char *)msg;
+	scat.elements[1].len = msg_len;
+	r = target_scat_send(mbox, svc_type, target, STAMPED_MSG_TYPE, &scat);
+	return r < 0 ? r : r - STAMP_HEADER;
+}
+
+#ifdef WITH_THREAD
+#define BATCH_LOCK(b)		PyThread_acquire_lock((b)->lock, 1)
+#define BATCH_UNLOCK(b)		PyThread_release_lock((b)->lock)
+#else
+#define BATCH_LOCK(b)
+#define BATCH_UNLOCK(b)
+#endif
+
+/* A reference to self's batcher for a send to use, or NULL. */
+static Batcher *
+batch_get(MailboxObject *self)
+{
+	Batcher *b;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	b = self->batcher;
+	if (b != NULL) {
+		LOCK(b);
+		b->refcnt++;
+		UNLOCK(b);
+	}
+	Py_END_CRITICAL_SECTION();
+	return b;
+}
+
+static void
+batch_decref(Batcher *b)
+{
+	int refcnt;
+
+	LOCK(b);
+	refcnt = --b->refcnt;
+	UNLOCK(b);
+	if (refcnt > 0)
+		return;
+#ifdef WITH_THREAD
+	if (b->lock != NULL)
+		PyThread_free_lock(b->lock);
+#endif
+#ifdef HAVE_RECEIVER
+	if (b->running != NULL)
+		PyThread_free_lock(b->running);
+	if (b->ctl[0] >= 0) {
+		close(b->ctl[0]);
+		close(b->ctl[1]);
+	}
+#endif
+	free(b->buf);
+	free(b);
+}
+
+/* Send what b's frame holds:  a lone message as itself, more as a batch
+ * frame.  Called without the GIL, with b locked.  Returns 0, or a Spread
+ * error code (the messages are lost).
+ */
+static int
+batch_send(Batcher *b)
+{
+	unsigned char *p = (unsigned char *)b->buf;
+	int r;
+
+	if (b->count == 0)
+		return 0;
+	if (b->count == 1)
+		r = SP_multicast(b->mbox, b->svc_type, b->group,
+				 (int16)(p[0] << 8 | p[1]),
+				 b->len - BATCH_HEADER, b->buf + BATCH_HEADER);
+	else
+		r = SP_multicast(b->mbox, b->svc_type, b->group,
+				 BATCH_MSG_TYPE, b->len, b->buf);
+	b->len = 0;
+	b->count = 0;
+	return r < 0 ? r : 0;
+}
+
+/* Send a message through b:  add it to the frame, or, if it is too long
+ * to batch or is for several groups, send it on its own, after the frame
+ * so that the order holds.  With stamp set, the message has a timestamp
+ * of its own, taken as it is added.  Called without the GIL.  Returns
+ * what SP_multicast() would:  the message's length, or a Spread error
+ * code.
+ */
+static int
+batch_add(Batcher *b, int svc_type, Target *target, const char *msg,
+	  int msg_len, int msg_type, int stamp)
+{
+	unsigned char *p;
+	int r = 0, fits, extra = stamp ? STAMP_HEADER : 0;
+
+	BATCH_LOCK(b);
+	fits = !b->closed && target->group != NULL &&
+		msg_len <= b->max_bytes - BATCH_HEADER - extra &&
+		strlen(target->group) < MAX_GROUP_NAME;
+	if (b->count > 0 &&
+	    (!fits || b->svc_type != svc_type ||
+	     strcmp(b->group, target->group) != 0 ||
+	     b->len + BATCH_HEADER + extra + msg_len > b->max_bytes)) {
+		r = batch_send(b);
+		if (r < 0)
+			goto Done;
+	}
+	if (!fits) {
+		r = target_send(b->mbox, svc_type, target, msg, msg_len,
+				msg_type, stamp);
+		goto Done;
+	}
+	if (b->count == 0) {
+		strcpy(b->group, target->group);
+		b->svc_type = svc_type;
+#ifndef MS_WINDOWS
+		b->first = monotonic();
+#endif
+#ifdef HAVE_RECEIVER
+		if (b->ctl[1] >= 0)
+			pipe_signal(b->ctl[1]);
+#endif
+	}
+	p = (unsigned char *)b->buf + b->len;
+	if (stamp) {
+		stamp_header(p + BATCH_HEADER, msg_type);
+		msg_type = STAMPED_MSG_TYPE;
+	}
+	p[0] = (unsigned char)(msg_type >> 8);
+	p[1] = (unsigned char)msg_type;
+	p[2] = (unsigned char)((extra + msg_len) >> 24);
+	p[3] = (unsigned char)((extra + msg_len) >> 16);
+	p[4] = (unsigned char)((extra + msg_len) >> 8);
+	p[5] = (unsigned char)(extra + msg_len);
+	memcpy(p + BATCH_HEADER + extra, msg, msg_len);
+	b->len += BATCH_HEADER + extra + msg_len;
+	b->count++;
+	if (b->count >= b->max_msgs || b->len + BATCH_HEADER >= b->max_bytes
+#ifndef MS_WINDOWS
+	    || (b->delay >= 0 && monotonic() - b->first >= b->delay)
+#endif
+	    )
+		r = batch_send(b);
+	if (r == 0)
+		r = msg_len;
+Done:
+	BATCH_UNLOCK(b);
+	return r;
+}
+
+/* Send what b's frame holds now.  Called without the GIL.  Returns 0, or
+ * a Spread error code from this send or, with 'deferred' set, from a
+ * failed one by the timer.
+ */
+static int
+batch_flush(Batcher *b, int deferred)
+{
+	int r;
+
+	BATCH_LOCK(b);
+	r = batch_send(b);
+	if (deferred) {
+		if (r == 0)
+			r = b->err;
+		b->err = 0;
+	}
+	BATCH_UNLOCK(b);
+	return r;
+}
+
+#ifdef HAVE_RECEIVER
+/* Send b's frame from the timer thread, as a call counted by
+ * mbox_enter() and mbox_leave() would:  not once the mailbox is closed or
+ * closing, and noting a disconnect.  Takes the GIL for that; called with
+ * b locked, and nothing takes b's lock with the GIL held.  Returns 0, a
+ * Spread error code, or 1 if the mailbox can't be used (the frame is left
+ * for batch_close()).
+ */
+static int
+batch_timer_send(Batcher *b)
+{
+	MailboxObject *self = (MailboxObject *)b->owner;
+	PyGILState_STATE gstate = PyGILState_Ensure();
+	int usable, r = 1;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	usable = !self->disconnected && !self->closing;
+	if (usable)
+		self->inflight++;
+	Py_END_CRITICAL_SECTION();
+	if (usable) {
+		Py_BEGIN_ALLOW_THREADS
+		r = batch_send(b);
+		Py_END_ALLOW_THREADS
+		mbox_leave(self, r);
+	}
+	PyGILState_Release(gstate);
+	return r;
+}
+
+/* The timer thread:  sends the frame once its first message has waited
+ * b->delay seconds.  batch_add() writes to b->ctl when it starts a frame,
+ * and batch_close() when the thread should exit.  Once the mailbox can't
+ * be used, it only waits for that.
+ */
+static void
+batch_main(void *arg)
+{
+	Batcher *b = (Batcher *)arg;
+	struct pollfd pfd;
+	int idle = 0;
+
+	pfd.fd = b->ctl[0];
+	pfd.events = POLLIN;
+	BATCH_LOCK(b);
+	while (!b->closed) {
+		double left = b->first + b->delay - monotonic();
+		int ms = -1, err;
+
+		if (b->count > 0 && left <= 0 && !idle) {
+			err = batch_timer_send(b);
+			if (err > 0)
+				idle = 1;
+			else if (err && !b->err)
+				b->err = err;
+			continue;
+		}
+		if (b->count > 0 && !idle)
+			ms = left > INT_MAX / 1000 ? INT_MAX :
+				(int)(left * 1000 + 0.999);
+		BATCH_UNLOCK(b);
+		if (poll(&pfd, 1, ms) > 0)
+			pipe_drain(b->ctl[0]);
+		BATCH_LOCK(b);
+	}
+	BATCH_UNLOCK(b);
+	PyThread_release_lock(b->running);
+}
+#endif
+
+/* Stop using b:  send what its frame holds, unless 'send' is 0 because
+ * the connection is gone, and stop its timer thread.  Sends that still
+ * hold a reference then go straight to Spread.  Called with the GIL,
+ * which it releases while it waits.  Returns 0, or a Spread error code
+ * from this send or from a failed one by the timer.
+ */
+static int
+batch_close(Batcher *b, int send)
+{
+	int r;
+
+	Py_BEGIN_ALLOW_THREADS
+	BATCH_LOCK(b);
+	r = send ? batch_send(b) : 0;
+	if (r == 0)
+		r = b->err;
+	b->err = 0;
+	b->len = 0;
+	b->count = 0;
+	b->closed = 1;
+	BATCH_UNLOCK(b);
+#ifdef HAVE_RECEIVER
+	if (b->running != NULL) {
+		pipe_signal(b->ctl[1]);
+		PyThread_acquire_lock(b->running, 1);
+		PyThread_release_lock(b->running);
+	}
+#endif
+	Py_END_ALLOW_THREADS
+	return r;
+}
+
+/* Send what self's batcher holds, before a message that doesn't go
+ * through it or for flush() (which sets 'deferred' to report a failed
+ * send by the timer too).  Called, like a send, between mbox_enter() and
+ * mbox_leave().  Returns 0 or a Spread error code.
+ */
+static int
+mbox_flush(MailboxObject *self, int deferred)
+{
+	Batcher *b = batch_get(self);
+	int r;
+
+	if (b == NULL)
+		return 0;
+	Py_BEGIN_ALLOW_THREADS
+	r = batch_flush(b, deferred);
+	Py_END_ALLOW_THREADS
+	batch_decref(b);
+	return r;
+}
+
+/* Refuse to send a message whose msg_type the module sends its own
+ * messages with:  BATCH_MSG_TYPE, COMPRESSED_MSG_TYPE, FRAGMENT_MSG_TYPE
+ * and STAMPED_MSG_TYPE.  (Any mailbox with unbatching on would take a
+ * message of the first apart, whoever sent it.)  Returns 0, or -1 with
+ * ValueError set.
+ */
+static int
+reserved_msg_type(int msg_type)
+{
+	int16 t = (int16)msg_type;
+
+	if (t == BATCH_MSG_TYPE || t == COMPRESSED_MSG_TYPE ||
+	    t == FRAGMENT_MSG_TYPE || t == STAMPED_MSG_TYPE) {
+		PyErr_Format(PyExc_ValueError,
+			     "message_type %d is reserved for %s", t,
+			     t == BATCH_MSG_TYPE ? "batch frames" :
+			     t == COMPRESSED_MSG_TYPE ? "compressed messages" :
+			     t == FRAGMENT_MSG_TYPE ? "message fragments" :
+			     "timestamped messages");
+		return -1;
+	}
+	return 0;
+}
+
+/* Convert the compress argument of the multicast methods:  None, or the
+ * name of a codec the module was built with.  Returns 0, or -1 with an
+ * exception set.
+ */
+static int
+get_codec(PyObject *obj, int *codec)
+{
+	const char *name;
+	int i;
+
+	*codec = 0;
+	if (obj == NULL || obj == Py_None)
+		return 0;
+	if (!Name_Check(obj) || (name = Name_AsString(obj)) == NULL) {
+		PyErr_Clear();
+		PyErr_SetString(PyExc_TypeError,
+				"compress must be a codec name or None");
+		return -1;
+	}
+	for (i = 0; codecs[i] != 0; i++) {
+		if (strcmp(name, codec_name(codecs[i])) == 0) {
+			*codec = codecs[i];
+			return 0;
+		}
+	}
+	if (strcmp(name, "zlib") == 0 || strcmp(name, "lz4") == 0)
+		PyErr_Format(PyExc_ValueError, "this module was built "
+			     "without %s compression", name);
+	else
+		PyErr_Format(PyExc_ValueError,
+			     "unknown compression codec: %s", name);
+	return -1;
+}
+
+/* Whether self's sends are timestamped; see set_timestamps(). */
+static int
+stamping(MailboxObject *self)
+{
+	int on;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	on = self->stamp;
+	Py_END_CRITICAL_SECTION();
+	return on;
+}
+
+/* The body of multicast() and multigroup_multicast().  The message is
+ * compressed with codec first (see compress_msg()) if codec isn't 0 and
+ * it is at least min_size bytes long.
+ */
+static PyObject *
+send_to_target(MailboxObject *self, char *methodname, int svc_type,
+	       Target *target, const char *msg, int msg_len, int msg_type,
+	       int codec, int min_size)
+{
+	Batcher *b;
+	char *packed = NULL;
+	int bytes, packed_len = 0, tried, stamp;
+	double t = 0;
+
+	if (check_svc_type(svc_type) < 0)
+		return NULL;
+	stamp = stamping(self);
+	b = batch_get(self);
+	if (reserved_msg_type(msg_type) < 0 ||
+	    mbox_enter(self, methodname) < 0) {
+		if (b != NULL)
+			batch_decref(b);
+		return NULL;
+	}
+
+	tried = codec != 0 && msg_len >= min_size;
+	Py_BEGIN_ALLOW_THREADS
+	if (tried) {
+		t = cpu_time();
+		packed_len = compress_msg(codec, msg, msg_len, msg_type,
+					  &packed);
+		t = cpu_time() - t;
+	}
+	if (packed_len < 0)
+		bytes = 0;
+	else if (packed != NULL && b != NULL)
+		bytes = batch_add(b, svc_type, target, packed, packed_len,
+				  COMPRESSED_MSG_TYPE, stamp);
+	else if (packed != NULL)
+		bytes = target_send(self->mbox, svc_type, target, packed,
+				    packed_len, COMPRESSED_MSG_TYPE, stamp);
+	else if (b != NULL)
+		bytes = batch_add(b, svc_type, target, msg, msg_len, msg_type,
+				  stamp);
+	else
+		bytes = target_send(self->mbox, svc_type, target, msg,
+				    msg_len, msg_type, stamp);
+	Py_END_ALLOW_THREADS
+	free(packed);
+	mbox_leave(self, bytes);
+	if (b != NULL)
+		batch_decref(b);
+
+	if (tried) {
+		Py_BEGIN_CRITICAL_SECTION(self);
+		if (packed_len > 0) {
+			self->z_msgs++;
+			self->z_in += msg_len;
+			self->z_out += packed_len;
+		}
+		else
+			self->z_skipped++;
+		self->z_time += t;
+		Py_END_CRITICAL_SECTION();
+	}
+	if (packed_len < 0)
+		return PyErr_NoMemory();
+	if (bytes < 0)
+		return spread_error(bytes, self);
+	/* What was sent is the caller's message, however it traveled. */
+	stats_sent(self, svc_type, 1, msg_len, msg_len);
+	return PyInt_FromLong(packed_len > 0 ? msg_len : bytes);
+}
+
+/* Get the message argument of the multicast methods:  any bytes-like
+ * object.  Returns 0, or -1 with an exception set.
+ */
+static int
+get_message(PyObject *obj, Py_buffer *view)
+{
+	if (get_buffer(obj, view, 0) < 0)
+		return -1;
+	if (view->len > INT_MAX) {
+		PyBuffer_Release(view);
+		PyErr_SetString(PyExc_ValueError, "message too large");
+		return -1;
+	}
+	return 0;
+}
+
+/* Chooses the mailbox a message to target is sent on:  self itself for a
+ * Mailbox, one of its mailboxes for a MailboxPool.  Returns a borrowed
+ * reference.
+ */
+typedef MailboxObject *(*pickfunc)(PyObject *self, Target *target);
+
+static MailboxObject *
+pick_self(PyObject *self, Target *target)
+{
+	return (MailboxObject *)self;
+}
+
+/* multicast() and multigroup_multicast() of Mailbox and MailboxPool:
+ * multigroup says which. */
+static PyObject *
+multicast_args(PyObject *self, pickfunc pick, int multigroup, ARGS_DECL)
+{
+	static char *kwlist[] = {"service_type", "group", "message",
+				 "message_type", "compress", "min_size", 0};
+	static char *multi_kwlist[] = {"service_type", "groups", "message",
+				       "message_type", "compress", "min_size",
+				       0};
+	char *methodname = multigroup ? "multigroup_multicast" : "multicast";
+	PyObject *argv[6], *result;
+	int svc_type = 0, msg_type = 0, codec, min_size = DEFAULT_COMPRESS_MIN;
+	Py_buffer view;
+	Target target;
+
+	if (unpack_args(methodname, ARGS,
+			multigroup ? multi_kwlist : kwlist, 3, argv) < 0 ||
+	    arg_int(argv[0], &svc_type) < 0 ||
+	    arg_int(argv[3], &msg_type) < 0 ||
+	    get_codec(argv[4], &codec) < 0 ||
+	    arg_int(argv[5], &min_size) < 0)
+		return NULL;
+	if (multigroup && Name_Check(argv[1])) {
+		PyErr_SetString(PyExc_TypeError,
+				"groups must be a GroupSet, or a tuple or "
+				"other iterable of strings");
+		return NULL;
+	}
+	if (!multigroup && !Name_Check(argv[1]) && !GroupSet_Check(argv[1])) {
+		PyErr_SetString(PyExc_TypeError,
+				"group must be a string or a GroupSet");
+		return NULL;
+	}
+	if (get_message(argv[2], &view) < 0)
+		return NULL;
+	if (get_target(argv[1], &target) < 0)
+		result = NULL;
+	else
+		result = send_to_target(pick(self, &target), methodname,
+					svc_type, &target, view.buf,
+					(int)view.len, msg_type, codec,
+					min_size);
+	target_free(&target);
+	PyBuffer_Release(&view);
+	return result;
+}
+
+static PyObject *
+mailbox_multicast(MailboxObject *self, ARGS_DECL)
+{
+	return multicast_args((PyObject *)self, pick_self, 0, ARGS);
+}
+
+static PyObject *
+mailbox_multigroup_multicast(MailboxObject *self, ARGS_DECL)
+{
+	return multicast_args((PyObject *)self, pick_self, 1, ARGS);
+}
+
+static PyObject *
+mailbox_multicast_scatter(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"service_type", "group", "buffers",
+				 "message_type", 0};
+	int svc_type = 0, bytes, msg_type = 0;
+	int num_bufs = 0, stamp, max_bufs, i;
+	PyObject *argv[4], *seq = NULL;
+	PyObject *result = NULL;
+	Target target;
+	scatter scat;
+	Py_buffer views[MAX_CLIENT_SCATTER_ELEMENTS];
+	unsigned char header[STAMP_HEADER];
+
+	if (unpack_args("multicast_scatter", ARGS, kwlist, 3, argv) < 0 ||
+	    arg_int(argv[0], &svc_type) < 0 ||
+	    arg_int(argv[3], &msg_type) < 0 ||
+	    reserved_msg_type(msg_type) < 0)
+		return NULL;
+	/* A string or buffer is a sequence too, of characters or ints. */
+	if (PyBytes_Check(argv[2]) || PyUnicode_Check(argv[2]) ||
+	    PyObject_CheckBuffer(argv[2])) {
+		PyErr_SetString(PyExc_TypeError,
+				"buffers must be a sequence of buffer objects, "
+				"not a single one");
+		return NULL;
+	}
+	if (get_target(argv[1], &target) < 0)
+		return NULL;
+
+	seq = PySequence_Fast(argv[2],
+			      "buffers must be a sequence of buffer objects");
+	if (seq == NULL)
+		goto Done;
+	/* A timestamp takes the first element. */
+	stamp = stamping(self);
+	max_bufs = MAX_CLIENT_SCATTER_ELEMENTS - stamp;
+	if (PySequence_Fast_GET_SIZE(seq) > max_bufs) {
+		PyErr_Format(PyExc_ValueError,
+			     "at most %d buffers can be sent in one message",
+			     max_bufs);
+		goto Done;
+	}
+
+	/* Collect a pointer to each buffer's memory, holding on to the
+	 * buffers so they stay put while Spread reads them without the GIL.
+	 */
+	scat.num_elements = 0;
+	for (; num_bufs < PySequence_Fast_GET_SIZE(seq); num_bufs++) {
+		PyObject *obj = PySequence_Fast_GET_ITEM(seq, num_bufs);
+		Py_buffer *view = &views[num_bufs];
+
+		if (get_buffer(obj, view, 0) < 0)
+			goto Done;
+		if (view->len > INT_MAX) {
+			PyErr_SetString(PyExc_ValueError, "buffer too large");
+			num_bufs++;
+			goto Done;
+		}
+		scat.elements[stamp + num_bufs].buf = view->buf;
+		scat.elements[stamp + num_bufs].len = (int)view->len;
+	}
+	scat.num_elements = stamp + num_bufs;
+
+	if (check_svc_type(svc_type) < 0 ||
+	    mbox_enter(self, "multicast_scatter") < 0)
+		goto Done;
+
+	bytes = mbox_flush(self, 0);
+	if (bytes == 0) {
+		Py_BEGIN_ALLOW_THREADS
+		if (stamp) {
+			stamp_header(header, msg_type);
+			scat.elements[0].buf = (char *)header;
+			scat.elements[0].len = STAMP_HEADER;
+			bytes = target_scat_send(self->mbox, svc_type, &target,
+						 STAMPED_MSG_TYPE, &scat);
+			if (bytes >= 0)
+				bytes -= STAMP_HEADER;
+		}
+		else
+			bytes = target_scat_send(self->mbox, svc_type, &target,
+						 msg_type, &scat);
+		Py_END_ALLOW_THREADS
+	}
+	mbox_leave(self, bytes);
+
+	if (bytes < 0)
+		result = spread_error(bytes, self);
+	else {
+		stats_sent(self, svc_type, 1, bytes, bytes);
+		result = PyInt_FromLong(bytes);
+	}
+Done:
+	for (i = 0; i < num_bufs; i++)
+		PyBuffer_Release(&views[i]);
+	Py_XDECREF(seq);
+	target_free(&target);
+	return result;
+}
+
+static PyObject *
+mailbox_multicast_large(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"service_type", "group", "message",
+				 "message_type", "fragment_size", 0};
+	int svc_type = 0, msg_type = 0, frag_size = DEFAULT_FRAGMENT_SIZE;
+	int bytes = 0, off, len;
+	unsigned long seq;
+	unsigned char header[FRAGMENT_HEADER];
+	PyObject *argv[5], *result = NULL;
+	Py_buffer view;
+	Target target;
+	scatter scat;
+
+	if (unpack_args("multicast_large", ARGS, kwlist, 3, argv) < 0 ||
+	    arg_int(argv[0], &svc_type) < 0 ||
+	    arg_int(argv[3], &msg_type) < 0 ||
+	    arg_int(argv[4], &frag_size) < 0)
+		return NULL;
+	if (frag_size < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"fragment_size must be at least 1");
+		return NULL;
+	}
+	if (get_message(argv[2], &view) < 0)
+		return NULL;
+	if (get_target(argv[1], &target) < 0)
+		goto Done;
+	if (view.len <= frag_size) {
+		result = send_to_target(self, "multicast_large", svc_type,
+					&target, view.buf, (int)view.len,
+					msg_type, 0, 0);
+		goto Done;
+	}
+	/* The fragments are put back together in the order they arrive. */
+	if (check_svc_type(svc_type) < 0 ||
+	    reserved_msg_type(msg_type) < 0)
+		goto Done;
+	if (!(svc_type & (FIFO_MESS | CAUSAL_MESS | AGREED_MESS | SAFE_MESS))) {
+		PyErr_SetString(PyExc_ValueError,
+				"multicast_large needs FIFO_MESS or a "
+				"stronger service type");
+		goto Done;
+	}
+	if (mbox_enter(self, "multicast_large") < 0)
+		goto Done;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	seq = self->frag_seq++ & 0xffffffffUL;
+	Py_END_CRITICAL_SECTION();
+	len = (int)view.len;
+	header[0] = (unsigned char)((msg_type >> 8) & 0xff);
+	header[1] = (unsigned char)(msg_type & 0xff);
+	header[2] = (unsigned char)(seq >> 24);
+	header[3] = (unsigned char)(seq >> 16);
+	header[4] = (unsigned char)(seq >> 8);
+	header[5] = (unsigned char)seq;
+	header[10] = (unsigned char)((unsigned)len >> 24);
+	header[11] = (unsigned char)((unsigned)len >> 16);
+	header[12] = (unsigned char)((unsigned)len >> 8);
+	header[13] = (unsigned char)len;
+	scat.num_elements = 2;
+	scat.elements[0].buf = (char *)header;
+	scat.elements[0].len = FRAGMENT_HEADER;
+
+	bytes = mbox_flush(self, 0);
+	Py_BEGIN_ALLOW_THREADS
+	for (off = 0; bytes >= 0 && off < len; off += frag_size) {
+		header[6] = (unsigned char)((unsigned)off >> 24);
+		header[7] = (unsigned char)((unsigned)off >> 16);
+		header[8] = (unsigned char)((unsigned)off >> 8);
+		header[9] = (unsigned char)off;
+		scat.elements[1].buf = (char *)view.buf + off;
+		scat.elements[1].len = len - off < frag_size ?
+			len - off : frag_size;
+		bytes = target_scat_send(self->mbox, svc_type, &target,
+					 FRAGMENT_MSG_TYPE, &scat);
+	}
+	Py_END_ALLOW_THREADS
+	mbox_leave(self, bytes);
+
+	if (bytes < 0)
+		result = spread_error(bytes, self);
+	else {
+		stats_sent(self, svc_type, 1, len, len);
+		result = PyInt_FromLong(len);
+	}
+Done:
+	target_free(&target);
+	PyBuffer_Release(&view);
+	return result;
+}
+
+/* One message for multicast_many(). */
+typedef struct {
+	Target target;
+	const void *data;
+	int len;
+	int16 msg_type;
+	int bytes;		/* SP_multicast() result */
+	Py_buffer view;
+} SendItem;
+
+static PyObject *
+mailbox_multicast_many(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"service_type", "messages", 0};
+	int svc_type = 0, num_items = 0, num_sent = 0, largest = 0, stamp, i;
+	long long total = 0;
+	PyObject *argv[2], *seq = NULL, *result = NULL;
+	SendItem *items = NULL;
+	Batcher *b = NULL;
+
+	if (unpack_args("multicast_many", ARGS, kwlist, 2, argv) < 0 ||
+	    arg_int(argv[0], &svc_type) < 0)
+		return NULL;
+	if (check_svc_type(svc_type) < 0)
+		return NULL;
+	seq = PySequence_Fast(argv[1],
+			      "expected an iterable of (group, message"
+			      "[, message_type]) tuples");
+	if (seq == NULL)
+		return NULL;
+	if (PySequence_Fast_GET_SIZE(seq) > INT_MAX / (int)sizeof(SendItem)) {
+		PyErr_NoMemory();
+		goto Done;
+	}
+	items = malloc(sizeof(SendItem) * (PySequence_Fast_GET_SIZE(seq) + 1));
+	if (items == NULL) {
+		PyErr_NoMemory();
+		goto Done;
+	}
+	stamp = stamping(self);
+	b = batch_get(self);
+
+	/* Check and convert everything before sending anything. */
+	for (; num_items < PySequence_Fast_GET_SIZE(seq); num_items++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, num_items);
+		SendItem *it = &items[num_items];
+		PyObject *group, *data;
+		int msg_type = 0;
+
+		it->target.groups = NULL;
+		if (!PyTuple_Check(item) ||
+		    !PyArg_ParseTuple(item, "OO|i", &group, &data, &msg_type)) {
+			PyErr_Clear();
+			PyErr_Format(PyExc_TypeError,
+				     "item %d is not a (group, message"
+				     "[, message_type]) tuple", num_items);
+			goto Done;
+		}
+		if (reserved_msg_type(msg_type) < 0)
+			goto Done;
+		if (get_target(group, &it->target) < 0)
+			goto Done;
+		if (get_buffer(data, &it->view, 0) < 0) {
+			target_free(&it->target);
+			goto Done;
+		}
+		if (it->view.len > INT_MAX) {
+			PyErr_Format(PyExc_ValueError,
+				     "item %d is too large", num_items);
+			num_items++;
+			goto Done;
+		}
+		it->data = it->view.buf;
+		it->len = (int)it->view.len;
+		it->msg_type = (int16)msg_type;
+		it->bytes = 0;
+	}
+
+	if (mbox_enter(self, "multicast_many") < 0)
+		goto Done;
+
+	Py_BEGIN_ALLOW_THREADS
+	for (; num_sent < num_items; num_sent++) {
+		SendItem *it = &items[num_sent];
+
+		if (b != NULL)
+			it->bytes = batch_add(b, svc_type, &it->target,
+					      it->data, it->len, it->msg_type,
+					      stamp);
+		else
+			it->bytes = target_send(self->mbox, svc_type,
+						&it->target, it->data,
+						it->len, it->msg_type, stamp);
+		if (it->bytes < 0)
+			break;
+	}
+	Py_END_ALLOW_THREADS
+	mbox_leave(self, num_sent < num_items ? items[num_sent].bytes : 0);
+
+	for (i = 0; i < num_sent; i++) {
+		total += items[i].len;
+		if (items[i].len > largest)
+			largest = items[i].len;
+	}
+	stats_sent(self, svc_type, num_sent, total, largest);
+	if (num_sent < num_items) {
+		/* Messages before this one were sent; none after it were. */
+		spread_error_extra(items[num_sent].bytes, self, num_sent);
+		goto Done;
+	}
+	result = PyList_New(num_items);
+	if (result == NULL)
+		goto Done;
+	for (i = 0; i < num_items; i++) {
+		PyObject *n = PyInt_FromLong(items[i].bytes);
+		if (n == NULL) {
+			Py_CLEAR(result);
+			break;
+		}
+		PyList_SET_ITEM(result, i, n);
+	}
+Done:
+	for (i = 0; i < num_items; i++) {
+		target_free(&items[i].target);
+		PyBuffer_Release(&items[i].view);
+	}
+	free(items);
+	Py_XDECREF(seq);
+	if (b != NULL)
+		batch_decref(b);
+	return result;
+}
+
+static PyObject *
+mailbox_poll(MailboxObject *self, PyObject *unused)
+{
+	int bytes;
+
+	if (mbox_enter(self, "poll") < 0)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	bytes = SP_poll(self->mbox);
+	Py_END_ALLOW_THREADS
+	mbox_leave(self, bytes);
+	if (bytes < 0)
+		return spread_error(bytes, self);
+	return PyInt_FromLong(bytes);
+}
+
+static PyObject *
+mailbox_set_buffer_policy(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"min_size", "max_size", "window", 0};
+	int min_size, max_size, window;
+	PyObject *argv[3];
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	min_size = self->rbuf_min;
+	max_size = self->rbuf_max;
+	window = self->rbuf_window;
+	Py_END_CRITICAL_SECTION();
+	if (unpack_args("set_buffer_policy", ARGS, kwlist, 0, argv) < 0 ||
+	    arg_int(argv[0], &min_size) < 0 ||
+	    arg_int(argv[1], &max_size) < 0 ||
+	    arg_int(argv[2], &window) < 0)
+		return NULL;
+	if (min_size < 1 || max_size < min_size || window < 1) {
+		PyErr_SetString(PyExc_ValueError,
+				"need 1 <= min_size <= max_size and window >= 1");
+		return NULL;
+	}
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->rbuf_min = min_size;
+	self->rbuf_max = max_size;
+	self->rbuf_window = window;
+	self->window_count = 0;
+	self->window_size = 0;
+	self->window_groups = 0;
+	if (!self->rbuf_busy && self->rbuf != NULL &&
+	    (self->rbuf_size < min_size || self->rbuf_size > max_size)) {
+		/* Reallocated at the right size by the next receive. */
+		free(self->rbuf);
+		self->rbuf = NULL;
+		self->rbuf_size = 0;
+	}
+	Py_END_CRITICAL_SECTION();
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_buffer_stats(MailboxObject *self, PyObject *unused)
+{
+	PyObject *result;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	result = Py_BuildValue("{s:i,s:i,s:i,s:l,s:l,s:l,s:l}",
+			       "size", self->rbuf_size,
+			       "groups_size", self->rgroups_size,
+			       "high_water", self->rbuf_high,
+			       "grows", self->rbuf_grows,
+			       "shrinks", self->rbuf_shrinks,
+			       "retries", self->rbuf_retries,
+			       "retries_saved", self->rbuf_saved);
+	Py_END_CRITICAL_SECTION();
+	return result;
+}
+
+static PyObject *
+mailbox_set_name_cache(MailboxObject *self, PyObject *arg)
+{
+	int size = 0;
+
+	if (arg_int(arg, &size) < 0)
+		return NULL;
+	if (size < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"cache size must be non-negative");
+		return NULL;
+	}
+	cache_resize(self->names, size ? round_size(size, 1) : 0);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_name_cache_stats(MailboxObject *self, PyObject *unused)
+{
+	NameCache *c = self->names;
+	int size;
+	long hits, misses, groups_hits, groups_misses;
+
+	LOCK(c);
+	size = c->size;
+	hits = c->hits;
+	misses = c->misses;
+	groups_hits = c->groups_hits;
+	groups_misses = c->groups_misses;
+	UNLOCK(c);
+	return Py_BuildValue("{s:i,s:l,s:l,s:l,s:l}",
+			     "size", size,
+			     "hits", hits,
+			     "misses", misses,
+			     "groups_hits", groups_hits,
+			     "groups_misses", groups_misses);
+}
+
+/* Fill in a NameSet from an iterable of names, or leave it unset if obj
+ * is NULL or None.  Returns 0, or -1 with an exception set.
+ */
+static int
+nameset_init(NameSet *set, PyObject *obj)
+{
+	char (*names)[MAX_GROUP_NAME];
+	int n, i, j;
+
+	set->names = NULL;
+	set->size = 0;
+	if (obj == NULL || obj == Py_None)
+		return 0;
+	names = pack_groups(obj, &n);
+	if (names == NULL)
+		return -1;
+	set->size = round_size(2 * n, 8);
+	set->names = calloc(set->size, MAX_GROUP_NAME);
+	if (set->names == NULL) {
+		free(names);
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (names[i][0] == '\0' || nameset_has(set, names[i]))
+			continue;
+		j = name_hash(names[i]) & (set->size - 1);
+		while (set->names[j][0])
+			j = (j + 1) & (set->size - 1);
+		strncpy(set->names[j], names[i], MAX_GROUP_NAME);
+	}
+	free(names);
+	return 0;
+}
+
+/* Make a msg_type bitmap from an iterable of ints, or leave *map NULL if
+ * obj is NULL or None.  Returns 0, or -1 with an exception set.
+ */
+static int
+types_init(unsigned char **map, PyObject *obj)
+{
+	PyObject *seq;
+	Py_ssize_t i;
+	int t = 0;
+
+	*map = NULL;
+	if (obj == NULL || obj == Py_None)
+		return 0;
+	seq = PySequence_Fast(obj, "msg_type sets must be iterables of ints");
+	if (seq == NULL)
+		return -1;
+	*map = calloc(65536 / 8, 1);
+	if (*map == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return -1;
+	}
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		if (arg_int(PySequence_Fast_GET_ITEM(seq, i), &t) < 0)
+			goto Error;
+		if (t < -32768 || t > 32767) {
+			PyErr_SetString(PyExc_ValueError,
+					"msg_type out of range");
+			goto Error;
+		}
+		(*map)[(unsigned short)t >> 3] |= 1 << (t & 7);
+	}
+	Py_DECREF(seq);
+	return 0;
+Error:
+	Py_DECREF(seq);
+	free(*map);
+	*map = NULL;
+	return -1;
+}
+
+static PyObject *
+mailbox_set_filter(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"msg_types", "groups", "senders",
+				 "deny_msg_types", "deny_groups",
+				 "deny_senders", "membership", 0};
+	PyObject *argv[7];
+	MsgFilter *f, *old;
+	int i, membership = 1;
+
+	if (unpack_args("set_filter", ARGS, kwlist, 0, argv) < 0)
+		return NULL;
+	if (argv[6] != NULL && (membership = PyObject_IsTrue(argv[6])) < 0)
+		return NULL;
+	f = calloc(1, sizeof(MsgFilter));
+	if (f == NULL)
+		return PyErr_NoMemory();
+	f->refcnt = 1;
+	f->membership = membership;
+	MUTEX_INIT(f);
+	if (types_init(&f->allow_types, argv[0]) < 0 ||
+	    nameset_init(&f->allow_groups, argv[1]) < 0 ||
+	    nameset_init(&f->allow_senders, argv[2]) < 0 ||
+	    types_init(&f->deny_types, argv[3]) < 0 ||
+	    nameset_init(&f->deny_groups, argv[4]) < 0 ||
+	    nameset_init(&f->deny_senders, argv[5]) < 0) {
+		filter_decref(f);
+		return NULL;
+	}
+	/* No conditions at all means no filter, and no cost. */
+	for (i = 0; i < 6 && (argv[i] == NULL || argv[i] == Py_None); i++)
+		;
+	if (i == 6 && membership) {
+		filter_decref(f);
+		f = NULL;
+	}
+	Py_BEGIN_CRITICAL_SECTION(self);
+	old = self->filter;
+	self->filter = f;
+	Py_END_CRITICAL_SECTION();
+	if (old != NULL)
+		filter_decref(old);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_filter_stats(MailboxObject *self, PyObject *unused)
+{
+	long drops[FILTER_REASONS] = {0};
+	MsgFilter *f = filter_get(self);
+	int i;
+
+	if (f != NULL) {
+		LOCK(f);
+		for (i = 0; i < FILTER_REASONS; i++)
+			drops[i] = f->drops[i];
+		UNLOCK(f);
+		filter_decref(f);
+	}
+	return Py_BuildValue("{s:l,s:l,s:l,s:l}",
+			     "msg_type", drops[FILTER_MSG_TYPE],
+			     "group", drops[FILTER_GROUP],
+			     "sender", drops[FILTER_SENDER],
+			     "membership", drops[FILTER_MEMBERSHIP]);
+}
+
+/* Defaults for set_batching(). */
+#define DEFAULT_BATCH_BYTES	8192
+#define DEFAULT_BATCH_MSGS	64
+#define DEFAULT_BATCH_DELAY	0.001
+
+static PyObject *
+mailbox_set_batching(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"max_bytes", "max_msgs", "delay", 0};
+	int max_bytes = DEFAULT_BATCH_BYTES, max_msgs = DEFAULT_BATCH_MSGS;
+	int err, r, swapped;
+	double delay = DEFAULT_BATCH_DELAY;
+	PyObject *argv[3];
+	Batcher *b = NULL, *old;
+
+	if (unpack_args("set_batching", ARGS, kwlist, 0, argv) < 0 ||
+	    arg_int(argv[0], &max_bytes) < 0 ||
+	    arg_int(argv[1], &max_msgs) < 0)
+		return NULL;
+	if (argv[2] == Py_None)
+		delay = -1.0;
+	else if (argv[2] != NULL) {
+		delay = PyFloat_AsDouble(argv[2]);
+		if (delay == -1.0 && PyErr_Occurred())
+			return NULL;
+	}
+	if (max_bytes < 0 || max_msgs < 1 || !(delay >= 0 || delay == -1.0)) {
+		PyErr_SetString(PyExc_ValueError,
+				"need max_bytes >= 0, max_msgs >= 1 and "
+				"delay >= 0 or None");
+		return NULL;
+	}
+	if (mbox_enter(self, "set_batching") < 0)
+		return NULL;
+
+	/* max_bytes 0 turns batching off. */
+	if (max_bytes > 0) {
+		b = calloc(1, sizeof(Batcher));
+		if (b == NULL)
+			goto NoMemory;
+		b->mbox = self->mbox;
+		b->owner = (PyObject *)self;
+		b->max_bytes = max_bytes;
+		b->max_msgs = max_msgs;
+		b->delay = delay;
+		b->refcnt = 1;
+		MUTEX_INIT(b);
+#ifdef HAVE_RECEIVER
+		b->ctl[0] = b->ctl[1] = -1;
+#endif
+		b->buf = malloc(max_bytes);
+#ifdef WITH_THREAD
+		b->lock = PyThread_allocate_lock();
+		if (b->lock == NULL)
+			goto NoMemory;
+#endif
+		if (b->buf == NULL)
+			goto NoMemory;
+#ifdef HAVE_RECEIVER
+		if (delay >= 0) {
+#if PY_VERSION_HEX < 0x03070000
+			/* The thread takes the GIL (see batch_timer_send()). */
+			PyEval_InitThreads();
+#endif
+			if (pipe_open(b->ctl) < 0) {
+				b->ctl[0] = b->ctl[1] = -1;
+				PyErr_SetFromErrno(PyExc_OSError);
+				goto Error;
+			}
+			b->running = PyThread_allocate_lock();
+			if (b->running == NULL)
+				goto NoMemory;
+			PyThread_acquire_lock(b->running, 1);
+			if ((unsigned long)PyThread_start_new_thread(
+				    batch_main, b) ==
+			    PYTHREAD_INVALID_THREAD_ID) {
+				PyThread_release_lock(b->running);
+				PyThread_free_lock(b->running);
+				b->running = NULL;
+				PyErr_SetString(SpreadError,
+						"can't start the batch timer");
+				goto Error;
+			}
+		}
+#endif
+	}
+
+	/* The old batcher's frame goes out, and it is closed so that sends
+	   still holding it go straight out, before b is published:  nothing
+	   sent through b can overtake them.  If another set_batching()
+	   swapped in a batcher meanwhile, close that one too. */
+	err = 0;
+	do {
+		old = batch_get(self);
+		if (old != NULL) {
+			r = batch_close(old, 1);
+			if (err == 0)
+				err = r;
+		}
+		Py_BEGIN_CRITICAL_SECTION(self);
+		swapped = self->batcher == old;
+		if (swapped)
+			self->batcher = b;
+		Py_END_CRITICAL_SECTION();
+		if (old != NULL) {
+			batch_decref(old);
+			if (swapped)
+				batch_decref(old);
+		}
+	} while (!swapped);
+	mbox_leave(self, err);
+	if (err < 0)
+		return spread_error(err, self);
+	Py_INCREF(Py_None);
+	return Py_None;
+
+NoMemory:
+	PyErr_NoMemory();
+Error:
+	mbox_leave(self, 0);
+	if (b != NULL)
+		batch_decref(b);
+	return NULL;
+}
+
+static PyObject *
+mailbox_flush(MailboxObject *self, PyObject *unused)
+{
+	int err;
+
+	if (mbox_enter(self, "flush") < 0)
+		return NULL;
+	err = mbox_flush(self, 1);
+	mbox_leave(self, err);
+	if (err < 0)
+		return spread_error(err, self);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_set_unbatching(MailboxObject *self, PyObject *arg)
+{
+	int on = PyObject_IsTrue(arg);
+
+	if (on < 0)
+		return NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->unbatch = on;
+	Py_END_CRITICAL_SECTION();
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_compression_stats(MailboxObject *self, PyObject *unused)
+{
+	long z_msgs, z_skipped, unz_msgs;
+	long long z_in, z_out, unz_in, unz_out;
+	double z_time, unz_time;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	z_msgs = self->z_msgs;
+	z_skipped = self->z_skipped;
+	z_in = self->z_in;
+	z_out = self->z_out;
+	z_time = self->z_time;
+	unz_msgs = self->unz_msgs;
+	unz_in = self->unz_in;
+	unz_out = self->unz_out;
+	unz_time = self->unz_time;
+	Py_END_CRITICAL_SECTION();
+	return Py_BuildValue("{s:l,s:l,s:L,s:L,s:d,s:d,s:l,s:L,s:L,s:d}",
+			     "compressed", z_msgs,
+			     "skipped", z_skipped,
+			     "bytes_in", z_in,
+			     "bytes_out", z_out,
+			     "ratio", z_in > 0 ? (double)z_out / z_in : 1.0,
+			     "compress_time", z_time,
+			     "decompressed", unz_msgs,
+			     "decompressed_bytes_in", unz_in,
+			     "decompressed_bytes_out", unz_out,
+			     "decompress_time", unz_time);
+}
+
+static PyObject *
+mailbox_set_reassembly_limit(MailboxObject *self, PyObject *arg)
+{
+	struct partial *done = NULL;
+	long long max_bytes = PyLong_AsLongLong(arg);
+
+	if (max_bytes == -1 && PyErr_Occurred())
+		return NULL;
+	if (max_bytes < 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"max_bytes must not be negative");
+		return NULL;
+	}
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->reasm_max = max_bytes;
+	while (self->partials != NULL && self->reasm_bytes > max_bytes) {
+		reasm_drop(self, &self->partials, &done);
+		self->reasm_evicted++;
+	}
+	Py_END_CRITICAL_SECTION();
+	partials_free(done);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_reassembly_stats(MailboxObject *self, PyObject *unused)
+{
+	struct partial *p;
+	long partial = 0, done, evicted, left, dropped;
+	long long bytes, limit;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	for (p = self->partials; p != NULL; p = p->next)
+		partial++;
+	bytes = self->reasm_bytes;
+	limit = self->reasm_max;
+	done = self->reasm_done;
+	evicted = self->reasm_evicted;
+	left = self->reasm_left;
+	dropped = self->reasm_dropped;
+	Py_END_CRITICAL_SECTION();
+	return Py_BuildValue("{s:l,s:L,s:L,s:l,s:l,s:l,s:l}",
+			     "partial", partial,
+			     "bytes", bytes,
+			     "limit", limit,
+			     "completed", done,
+			     "evicted", evicted,
+			     "left", left,
+			     "dropped", dropped);
+}
+
+/* The keys of stats()'s counts by service type. */
+static const char *service_names[STAT_SERVICES] = {
+	"UNRELIABLE_MESS", "RELIABLE_MESS", "FIFO_MESS", "CAUSAL_MESS",
+	"AGREED_MESS", "SAFE_MESS"
+};
+
+/* Set d[key] to a dict of counts by service type.  Returns 0, or -1 with
+   an exception set. */
+static int
+stats_by_service(PyObject *d, const char *key, const long long *counts)
+{
+	PyObject *sub, *n;
+	int i, r;
+
+	sub = PyDict_New();
+	for (i = 0; sub != NULL && i < STAT_SERVICES; i++) {
+		n = PyLong_FromLongLong(counts[i]);
+		if (n == NULL ||
+		    PyDict_SetItemString(sub, service_names[i], n) < 0)
+			Py_CLEAR(sub);
+		Py_XDECREF(n);
+	}
+	if (sub == NULL)
+		return -1;
+	r = PyDict_SetItemString(d, key, sub);
+	Py_DECREF(sub);
+	return r;
+}
+
+/* The dict stats() and spread.stats() return for st. */
+static PyObject *
+stats_dict(const MboxStats *st)
+{
+	const RecvStats *rs = &st->recv;
+	PyObject *d, *errors, *code, *n;
+	long long regular = 0;
+	int i;
+
+	for (i = 0; i < STAT_SERVICES; i++)
+		regular += rs->msgs[i];
+	d = Py_BuildValue("{s:L,s:L,s:L,s:L,s:i,s:i,s:d,s:d}",
+			  "regular", regular,
+			  "membership", rs->membership,
+			  "buffer_retries", rs->buffer_retries,
+			  "groups_retries", rs->groups_retries,
+			  "largest_sent", st->largest_sent,
+			  "largest_received", rs->largest,
+			  "blocked_time", rs->blocked,
+			  "python_time", st->python);
+	if (d == NULL ||
+	    stats_by_service(d, "sent", st->sent) < 0 ||
+	    stats_by_service(d, "sent_bytes", st->sent_bytes) < 0 ||
+	    stats_by_service(d, "received", rs->msgs) < 0 ||
+	    stats_by_service(d, "received_bytes", rs->bytes) < 0 ||
+	    (errors = PyDict_New()) == NULL) {
+		Py_XDECREF(d);
+		return NULL;
+	}
+	for (i = 0; errors != NULL && i < STAT_ERRORS; i++) {
+		if (st->errors[i] == 0)
+			continue;
+		code = PyInt_FromLong(-i);
+		n = PyLong_FromLongLong(st->errors[i]);
+		if (code == NULL || n == NULL ||
+		    PyDict_SetItem(errors, code, n) < 0)
+			Py_CLEAR(errors);
+		Py_XDECREF(code);
+		Py_XDECREF(n);
+	}
+	if (errors == NULL || PyDict_SetItemString(d, "errors", errors) < 0)
+		Py_CLEAR(d);
+	Py_XDECREF(errors);
+	return d;
+}
+
+static PyObject *
+mailbox_stats(MailboxObject *self, PyObject *unused)
+{
+	MboxStats st;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	st = self->stats;
+	Py_END_CRITICAL_SECTION();
+	return stats_dict(&st);
+}
+
+static PyObject *
+mailbox_reset_stats(MailboxObject *self, PyObject *unused)
+{
+	LatGroup *lat;
+	int lat_size;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	memset(&self->stats, 0, sizeof(MboxStats));
+	lat = self->lat;
+	lat_size = self->lat_size;
+	self->lat = NULL;
+	self->lat_size = 0;
+	self->lat_used = 0;
+	Py_END_CRITICAL_SECTION();
+	lat_free(lat, lat_size);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *
+mailbox_set_timestamps(MailboxObject *self, PyObject *arg)
+{
+	int on = PyObject_IsTrue(arg);
+
+	if (on < 0)
+		return NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	self->stamp = on;
+	Py_END_CRITICAL_SECTION();
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* The percentiles latency() reports unless asked for others. */
+static const double default_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+/* The value in h at percentile pct, in microseconds:  the middle of the
+   bucket it falls in, kept within h's min and max. */
+static long long
+lat_percentile(const LatHist *h, double pct)
+{
+	long long rank = (long long)ceil(pct / 100.0 * h->count);
+	long long seen = 0, low = h->max, width = 1;
+	int i;
+
+	if (rank < 1)
+		return h->min;
+	if (rank >= h->count)
+		return h->max;
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			low = lat_low(i, &width);
+			break;
+		}
+	}
+	low += width / 2;
+	return low < h->min ? h->min : low > h->max ? h->max : low;
+}
+
+/* The dict latency() returns for h, with the percentiles in pcts. */
+static PyObject *
+latency_dict(const LatHist *h, const double *pcts, Py_ssize_t npcts)
+{
+	PyObject *d, *sub, *key, *v;
+	Py_ssize_t i;
+
+	if (h->count == 0)
+		d = Py_BuildValue("{s:i,s:O,s:O,s:O}", "count", 0,
+				  "min", Py_None, "mean", Py_None,
+				  "max", Py_None);
+	else
+		d = Py_BuildValue("{s:L,s:d,s:d,s:d}", "count", h->count,
+				  "min", h->min * 1e-6,
+				  "mean", (double)h->sum / h->count * 1e-6,
+				  "max", h->max * 1e-6);
+	sub = PyDict_New();
+	for (i = 0; d != NULL && sub != NULL && i < npcts; i++) {
+		key = PyFloat_FromDouble(pcts[i]);
+		if (h->count == 0) {
+			v = Py_None;
+			Py_INCREF(v);
+		}
+		else
+			v = PyFloat_FromDouble(lat_percentile(h, pcts[i]) *
+					       1e-6);
+		if (key == NULL || v == NULL ||
+		    PyDict_SetItem(sub, key, v) < 0)
+			Py_CLEAR(sub);
+		Py_XDECREF(key);
+		Py_XDECREF(v);
+	}
+	if (d != NULL &&
+	    (sub == NULL || PyDict_SetItemString(d, "percentiles", sub) < 0))
+		Py_CLEAR(d);
+	Py_XDECREF(sub);
+	return d;
+}
+
+static PyObject *
+mailbox_latency(MailboxObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"group", "service_type", "percentiles", 0};
+	PyObject *argv[3], *seq = NULL, *result = NULL;
+	const char *group = NULL;
+	double *pcts = NULL;
+	Py_ssize_t npcts, i;
+	int svc_type = 0, svc = -1, j;
+	LatHist *h;
+
+	if (unpack_args("latency", ARGS, kwlist, 0, argv) < 0 ||
+	    (argv[0] != NULL && argv[0] != Py_None &&
+	     arg_name(argv[0], &group) < 0) ||
+	    (argv[1] != Py_None && arg_int(argv[1], &svc_type) < 0))
+		return NULL;
+	if (argv[1] != NULL && argv[1] != Py_None) {
+		svc = stat_service(svc_type);
+		if (svc < 0 || svc_type != (UNRELIABLE_MESS << svc)) {
+			PyErr_SetString(PyExc_ValueError,
+					"service_type must be one of "
+					"UNRELIABLE_MESS ... SAFE_MESS");
+			return NULL;
+		}
+	}
+	if (argv[2] == NULL || argv[2] == Py_None)
+		npcts = sizeof(default_percentiles) / sizeof(double);
+	else {
+		seq = PySequence_Fast(argv[2], "percentiles must be a "
+				      "sequence of numbers");
+		if (seq == NULL)
+			return NULL;
+		npcts = PySequence_Fast_GET_SIZE(seq);
+	}
+	pcts = malloc(sizeof(double) * (npcts + 1));
+	h = calloc(1, sizeof(LatHist));
+	if (pcts == NULL || h == NULL) {
+		PyErr_NoMemory();
+		goto Done;
+	}
+	for (i = 0; i < npcts; i++) {
+		if (seq == NULL) {
+			pcts[i] = default_percentiles[i];
+			continue;
+		}
+		pcts[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+		if (pcts[i] == -1.0 && PyErr_Occurred())
+			goto Done;
+		if (!(pcts[i] >= 0.0 && pcts[i] <= 100.0)) {
+			PyErr_SetString(PyExc_ValueError,
+					"percentiles must be from 0 to 100");
+			goto Done;
+		}
+	}
+
+	/* Add up the histograms asked for. */
+	Py_BEGIN_CRITICAL_SECTION(self);
+	for (i = 0; self->lat != NULL && i < self->lat_size; i++) {
+		LatGroup *g = &self->lat[i];
+
+		if (g->group[0] == '\0' ||
+		    (group != NULL &&
+		     strncmp(g->group, group, MAX_GROUP_NAME) != 0))
+			continue;
+		for (j = 0; j < STAT_SERVICES; j++)
+			if ((svc < 0 || j == svc) && g->hist[j] != NULL)
+				lat_merge(h, g->hist[j]);
+	}
+	Py_END_CRITICAL_SECTION();
+	result = latency_dict(h, pcts, npcts);
+Done:
+	free(h);
+	free(pcts);
+	Py_XDECREF(seq);
+	return result;
+}
+
+static PyObject *
+mailbox_set_membership_view(MailboxObject *self, PyObject *arg)
+{
+	PyObject *views = NULL, *old;
+	int on = PyObject_IsTrue(arg);
+
+	if (on < 0)
+		return NULL;
+	if (on && (views = PyDict_New()) == NULL)
+		return NULL;
+	Py_BEGIN_CRITICAL_SECTION(self);
+	old = self->views;
+	if (on && old != NULL) {
+		/* Already on:  keep what it has seen. */
+		old = views;
+	}
+	else {
+		self->views = views;
+		Py_CLEAR(self->view_groups);
+		self->view_version++;
+	}
+	Py_END_CRITICAL_SECTION();
+	Py_XDECREF(old);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/* The item of group's membership view entry at index i (0 for group_id,
+ * 1 for members), or None if the view has no entry for it.
+ */
+static PyObject *
+view_lookup(MailboxObject *self, PyObject *group, char *methodname, int i)
+{
+	PyObject *v = NULL;
+
+	if (!Name_Check(group)) {
+		PyErr_Format(PyExc_TypeError, "expected str, got %.200s",
+			     Py_TYPE(group)->tp_name);
+		return NULL;
+	}
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->views == NULL)
+		PyErr_Format(SpreadError, "%s() called with the membership "
+			     "view off", methodname);
+	else {
+		v = PyDict_GetItem(self->views, group);
+		v = v != NULL ? PyTuple_GET_ITEM(v, i) : Py_None;
+		Py_INCREF(v);
+	}
+	Py_END_CRITICAL_SECTION();
+	return v;
+}
+
+static PyObject *
+mailbox_members(MailboxObject *self, PyObject *group)
+{
+	return view_lookup(self, group, "members", 1);
+}
+
+static PyObject *
+mailbox_group_id(MailboxObject *self, PyObject *group)
+{
+	return view_lookup(self, group, "group_id", 0);
+}
+
+static PyObject *
+mailbox_groups(MailboxObject *self, PyObject *unused)
+{
+	PyObject *v = NULL;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	if (self->views == NULL)
+		PyErr_SetString(SpreadError,
+				"groups() called with the membership view off");
+	else {
+		if (self->view_groups == NULL) {
+			PyObject *keys = PyDict_Keys(self->views);
+
+			if (keys != NULL) {
+				self->view_groups = PyList_AsTuple(keys);
+				Py_DECREF(keys);
+			}
+		}
+		v = self->view_groups;
+		Py_XINCREF(v);
+	}
+	Py_END_CRITICAL_SECTION();
+	return v;
+}
+
+static PyObject *
+mailbox_get_view_version(MailboxObject *self, void *closure)
+{
+	long version;
+
+	Py_BEGIN_CRITICAL_SECTION(self);
+	version = self->view_version;
+	Py_END_CRITICAL_SECTION();
+	return PyInt_FromLong(version);
+}
+
+static PyGetSetDef Mailbox_getset[] = {
+	{"view_version",	(getter)mailbox_get_view_version},
+	{NULL}
+};
+
+static PyMethodDef Mailbox_methods[] = {
+	{"buffer_stats",	(PyCFunction)mailbox_buffer_stats, METH_NOARGS},
+	{"compression_stats",	(PyCFunction)mailbox_compression_stats,
+	 METH_NOARGS},
+	{"disconnect",	(PyCFunction)mailbox_disconnect,METH_NOARGS},
+	{"fileno",	(PyCFunction)mailbox_fileno,	METH_NOARGS},
+	{"filter_stats",	(PyCFunction)mailbox_filter_stats, METH_NOARGS},
+	{"flush",	(PyCFunction)mailbox_flush,	METH_NOARGS},
+	{"group_id",	(PyCFunction)mailbox_group_id,	METH_O},
+	{"groups",	(PyCFunction)mailbox_groups,	METH_NOARGS},
+	{"join",	(PyCFunction)mailbox_join,	METH_O},
+	{"latency",	(PyCFunction)mailbox_latency,	METH_ARGS},
+	{"leave",	(PyCFunction)mailbox_leave,	METH_O},
+	{"members",	(PyCFunction)mailbox_members,	METH_O},
+	{"multicast",   (PyCFunction)mailbox_multicast, METH_ARGS},
+	{"multicast_large",	(PyCFunction)mailbox_multicast_large,
+	 METH_ARGS},
+	{"multicast_many",	(PyCFunction)mailbox_multicast_many, METH_ARGS},
+	{"multicast_scatter",	(PyCFunction)mailbox_multicast_scatter, METH_ARGS},
+	{"multigroup_multicast",	(PyCFunction)mailbox_multigroup_multicast, METH_ARGS},
+	{"name_cache_stats",	(PyCFunction)mailbox_name_cache_stats, METH_NOARGS},
+	{"poll",	(PyCFunction)mailbox_poll,	METH_NOARGS},
+	{"receive",	(PyCFunction)mailbox_receive,
+	 METH_ARGS},
+	{"receive_into",	(PyCFunction)mailbox_receive_into,
+	 METH_ARGS},
+	{"receive_many",	(PyCFunction)mailbox_receive_many,
+	 METH_ARGS},
+	{"reassembly_stats",	(PyCFunction)mailbox_reassembly_stats,
+	 METH_NOARGS},
+	{"register",	(PyCFunction)mailbox_register,	METH_ARGS,
+	 mailbox_register__doc__},
+	{"register_membership",	(PyCFunction)mailbox_register_membership,
+	 METH_O},
+	{"reset_stats",	(PyCFunction)mailbox_reset_stats, METH_NOARGS},
+	{"run",		(PyCFunction)mailbox_run,	METH_ARGS,
+	 mailbox_run__doc__},
+	{"set_batching",	(PyCFunction)mailbox_set_batching,	METH_ARGS},
+	{"set_buffer_policy",	(PyCFunction)mailbox_set_buffer_policy,
+	 METH_ARGS},
+	{"set_filter",	(PyCFunction)mailbox_set_filter,	METH_ARGS},
+	{"set_membership_view",	(PyCFunction)mailbox_set_membership_view,
+	 METH_O},
+	{"set_name_cache",	(PyCFunction)mailbox_set_name_cache, METH_O},
+	{"set_reassembly_limit",	(PyCFunction)mailbox_set_reassembly_limit,
+	 METH_O},
+	{"set_timestamps",	(PyCFunction)mailbox_set_timestamps, METH_O},
+	{"set_unbatching",	(PyCFunction)mailbox_set_unbatching, METH_O},
+#ifdef HAVE_RECEIVER
+	{"start_receiver",	(PyCFunction)mailbox_start_receiver,
+	 METH_ARGS},
+	{"stop_receiver",	(PyCFunction)mailbox_stop_receiver, METH_NOARGS},
+#endif
+	{"stats",	(PyCFunction)mailbox_stats,	METH_NOARGS},
+	{"stop",	(PyCFunction)mailbox_stop,	METH_NOARGS},
+	{NULL,		NULL}		/* sentinel */
+};
+
+#define OFF(x) offsetof(MailboxObject, x)
+
+static PyMemberDef Mailbox_members[] = {
+	{"private_group",	T_OBJECT,	OFF(private_group),	READONLY},
+#ifdef HAVE_RECEIVER
+	{"queue",		T_OBJECT,	OFF(queue),	READONLY},
+#endif
+	{NULL}
+};
+
+#undef OFF
+
+static PyType_Slot Mailbox_slots[] = {
+	{Py_tp_dealloc, mailbox_dealloc},
+	{Py_tp_traverse, mailbox_traverse},
+	{Py_tp_clear, mailbox_clear},
+	{Py_tp_methods, Mailbox_methods},
+	{Py_tp_members, Mailbox_members},
+	{Py_tp_getset, Mailbox_getset},
+	{0, NULL}
+};
+
+static PyType_Spec Mailbox_spec = {
+	"spread.Mailbox",			/* name */
+	sizeof(MailboxObject),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS | Py_TPFLAGS_HAVE_GC,	/* flags */
+	Mailbox_slots				/* slots */
+};
+
+/* The Mailbox object for a session SP_connect() has opened, whose private
+ * group is group_name.  The session is closed if this fails.
+ */
+static PyObject *
+connected_mailbox(mailbox _mbox, const char *group_name)
+{
+	MailboxObject *mbox;
+
+	mbox = new_mailbox(_mbox);
+	if (mbox == NULL) {
+		SP_disconnect(_mbox);
+		return NULL;
+	}
+	mbox->private_group = Name_FromString(group_name);
+	if (mbox->private_group == NULL) {
+		Py_DECREF(mbox);
+		return NULL;
+	}
+	return (PyObject *)mbox;
+}
+
+static char spread_connect__doc__[] =
+"connect(daemon=\"N@localhost\", name=\"\", priority=0, membership=1) -> mbox\n"
+"\n"
+"All arguments are optional, and can be specified by keyword or position.\n"
+"\n"
+"Connect to a Spread daemon, via Spread's SP_connect().  Return a Mailbox\n"
+"object representing the connection.  Communication with Spread on this\n"
+"connection is done via invoking methods of the Mailbox object.\n"
+"\n"
+"'daemon' is the name of the desired Spread daemon.  It defaults to\n"
+"    \"%d@localhost\" % spread.DEFAULT_SPREAD_PORT\n"
+"'name' is the desired private name for the connection.  It defaults to an\n"
+"    empty string, in which case Spread generates a unique random name.\n"
+"'priority' is an int, default 0, currently unused (see Spread docs).\n"
+"'membership' is a Boolean, default 1 (true), determining whether you want\n"
+"    to receive membership messages on this connection.  If your application\n"
+"    doesn't make mbox.receive() calls, pass 0 to avoid creating an\n"
+"    unboundedly large queue of unread membership messages.\n"
+"\n"
+"Upon successful connect, mbox.private_group is the private group name\n"
+"Spread assigned to the connection.";
+
+static PyObject *
+spread_connect(PyObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"daemon", "name", "priority", "membership",
+				  0};
+	const char *daemon = NULL;
+	const char *name = "";
+	int priority = 0;
+	int membership = 1;
+	PyObject *argv[4];
+
+	mailbox _mbox;
+	int ret;
+	char group_name[MAX_GROUP_NAME];
+	char default_daemon[100];
+
+	if (unpack_args("connect", ARGS, kwlist, 0, argv) < 0 ||
+	    arg_name(argv[0], &daemon) < 0 ||
+	    arg_name(argv[1], &name) < 0 ||
+	    arg_int(argv[2], &priority) < 0 ||
+	    arg_int(argv[3], &membership) < 0)
+		return NULL;
+
+	if (daemon == NULL) {
+		/* XXX Can't use PyOS_snprintf before 2.2.
+		PyOS_snprintf(default_daemon, sizeof(default_daemon),
+			      "%d@localhost", DEFAULT_SPREAD_PORT);
+		*/
+		sprintf(default_daemon, "%d@localhost", DEFAULT_SPREAD_PORT);
+		daemon = default_daemon;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ret = SP_connect(daemon, name, priority, membership, &_mbox,
+			 group_name);
+	Py_END_ALLOW_THREADS
+
+	if (ret != ACCEPT_SESSION)
+		return spread_error(ret, NULL);
+	return connected_mailbox(_mbox, group_name);
+}
+
+/* MailboxPool:  several sessions with one daemon, for publishers that
+ * would otherwise all wait on one.  MailboxPool() opens them at once, from
+ * a few threads, since each SP_connect() waits for a round trip to the
+ * daemon.  multicast() picks a session per message, either by a hash of
+ * the group names, so that each group's messages leave in order on one
+ * session (Spread only orders messages within a session), or round robin.
+ */
+#define POOL_ROUTE_GROUP	0
+#define POOL_ROUTE_ROUND_ROBIN	1
+
+/* At most this many threads connect at once. */
+#define POOL_CONNECT_THREADS	16
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *mailboxes;		/* tuple of MailboxObjects */
+	PyObject *private_groups;	/* tuple of their names */
+	int route;
+	unsigned int next;		/* round robin position */
+} PoolObject;
+
+static PyTypeObject *Pool_Type;
+
+typedef struct {
+	char name[MAX_PRIVATE_NAME + 1];
+	mailbox mbox;
+	int ret;
+	char group_name[MAX_GROUP_NAME];
+} PoolConnect;
+
+/* The connections MailboxPool() opens, and the threads opening them. */
+typedef struct {
+	const char *daemon;
+	int priority;
+	int membership;
+	PoolConnect *conns;
+	int num_conns;
+	int next;		/* the next connection to open */
+#ifdef WITH_THREAD
+	int running;		/* threads still opening connections */
+	PyThread_type_lock mutex;	/* guards next and running */
+	PyThread_type_lock done;	/* released when running drops to 0 */
+#endif
+} PoolBatch;
+
+/* Open connections from the batch until none are left.  Runs without the
+ * GIL, in the calling thread and in the threads pool_connect() starts.
+ */
+static void
+pool_worker(void *arg)
+{
+	PoolBatch *b = (PoolBatch *)arg;
+
+	for (;;) {
+		PoolConnect *c;
+		int i;
+
+#ifdef WITH_THREAD
+		PyThread_acquire_lock(b->mutex, 1);
+#endif
+		i = b->next < b->num_conns ? b->next++ : -1;
+#ifdef WITH_THREAD
+		PyThread_release_lock(b->mutex);
+#endif
+		if (i < 0)
+			break;
+		c = &b->conns[i];
+		c->ret = SP_connect(b->daemon, c->name, b->priority,
+				    b->membership, &c->mbox, c->group_name);
+	}
+#ifdef WITH_THREAD
+	{
+		int last;
+
+		PyThread_acquire_lock(b->mutex, 1);
+		last = --b->running == 0;
+		PyThread_release_lock(b->mutex);
+		if (last)
+			PyThread_release_lock(b->done);
+	}
+#endif
+}
+
+/* Open all of the batch's connections, and return when they are open (or
+ * have failed).  Called without the GIL, with b->done acquired.
+ */
+static void
+pool_connect(PoolBatch *b)
+{
+#ifdef WITH_THREAD
+	int i;
+
+	b->running = 1;
+	for (i = 1; i < b->num_conns && i < POOL_CONNECT_THREADS; i++) {
+		PyThread_acquire_lock(b->mutex, 1);
+		b->running++;
+		PyThread_release_lock(b->mutex);
+		if ((unsigned long)PyThread_start_new_thread(pool_worker, b) ==
+		    PYTHREAD_INVALID_THREAD_ID) {
+			/* The threads already started do the rest. */
+			PyThread_acquire_lock(b->mutex, 1);
+			b->running--;
+			PyThread_release_lock(b->mutex);
+			break;
+		}
+	}
+	pool_worker(b);
+	PyThread_acquire_lock(b->done, 1);
+#else
+	pool_worker(b);
+#endif
+}
+
+/* Set SpreadError for the connections of a batch that failed:  the first
+ * failure's code and message, and a list of (index, code) pairs for all.
+ */
+static void
+pool_error(PoolConnect *conns, int num_conns)
+{
+	PyObject *failures, *val;
+	int i, err = 0;
+
+	failures = PyList_New(0);
+	if (failures == NULL)
+		return;
+	for (i = 0; i < num_conns; i++) {
+		PyObject *pair;
+
+		if (conns[i].ret == ACCEPT_SESSION)
+			continue;
+		if (err == 0)
+			err = conns[i].ret;
+		pair = Py_BuildValue("ii", i, conns[i].ret);
+		if (pair == NULL || PyList_Append(failures, pair) < 0) {
+			Py_XDECREF(pair);
+			Py_DECREF(failures);
+			return;
+		}
+		Py_DECREF(pair);
+	}
+	val = Py_BuildValue("isN", err, error_message(err), failures);
+	if (val != NULL) {
+		PyErr_SetObject(SpreadError, val);
+		Py_DECREF(val);
 	}
+}
 
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected) {
-		err_disconnected("multigroup_multicast");
-		goto Done;
-	}
+static MailboxObject *
+pool_pick(PyObject *self, Target *target)
+{
+	PoolObject *pool = (PoolObject *)self;
+	Py_ssize_t n = PyTuple_GET_SIZE(pool->mailboxes);
+	unsigned long h;
+	int i;
 
-	/* XXX This doesn't check that svc_type is set to exactly one of
-	   the service types. */
-	if ((svc_type & valid_svc_type) != svc_type) {
-		PyErr_SetString(PyExc_ValueError, "invalid service type");
-		goto Done;
+	if (pool->route == POOL_ROUTE_ROUND_ROBIN) {
+		Py_BEGIN_CRITICAL_SECTION(pool);
+		h = pool->next++;
+		Py_END_CRITICAL_SECTION();
 	}
+	else if (target->group != NULL)
+		h = name_hash(target->group);
+	else if (target->num_groups == 1)
+		/* The same connection as for the group by name, so its
+		   messages stay in order however they are addressed. */
+		h = name_hash(target->groups[0]);
+	else {
+		h = target->num_groups;
+		for (i = 0; i < target->num_groups; i++)
+			h = h * 1000003UL ^ name_hash(target->groups[i]);
+	}
+	return (MailboxObject *)PyTuple_GET_ITEM(pool->mailboxes, h % n);
+}
 
-	Py_BEGIN_ALLOW_THREADS
-	bytes = SP_multigroup_multicast(self->mbox, svc_type, group_len,
-				        (const char (*)[MAX_GROUP_NAME]) groups,
-		                        (int16)msg_type, msg_len, msg);
-	Py_END_ALLOW_THREADS
+static PyObject *
+pool_multicast(PoolObject *self, ARGS_DECL)
+{
+	return multicast_args((PyObject *)self, pool_pick, 0, ARGS);
+}
 
-	if (bytes < 0)
-		result = spread_error(bytes, self);
-	else
-		result = PyInt_FromLong(bytes);
+static PyObject *
+pool_multigroup_multicast(PoolObject *self, ARGS_DECL)
+{
+	return multicast_args((PyObject *)self, pool_pick, 1, ARGS);
+}
 
-Done:
-	RELEASE_MBOX_LOCK(self);
-	free(groups);
-	return result;
+/* The mailbox multicast() would use for a message to group. */
+static PyObject *
+pool_mailbox(PoolObject *self, PyObject *group)
+{
+	PyObject *mbox = NULL;
+	Target target;
+
+	if (get_target(group, &target) == 0) {
+		mbox = (PyObject *)pool_pick((PyObject *)self, &target);
+		Py_INCREF(mbox);
+	}
+	target_free(&target);
+	return mbox;
 }
 
+/* Disconnect every mailbox, even after one fails.  The errors are
+ * reported together, like MailboxPool()'s.
+ */
 static PyObject *
-mailbox_poll(MailboxObject *self, PyObject *args)
+pool_disconnect(PoolObject *self, PyObject *unused)
 {
-	int bytes;
-	PyObject *result = NULL;
+	Py_ssize_t i, n = PyTuple_GET_SIZE(self->mailboxes);
+	PoolConnect *conns;
+	int failed = 0;
+
+	conns = calloc(n, sizeof(PoolConnect));
+	if (conns == NULL)
+		return PyErr_NoMemory();
+	for (i = 0; i < n; i++) {
+		MailboxObject *mbox;
+		int err;
 
-	if (!PyArg_ParseTuple(args, ":poll"))
-		return NULL;
-	ACQUIRE_MBOX_LOCK(self);
-	if (self->disconnected) {
-		err_disconnected("poll");
-		goto Done;
+		mbox = (MailboxObject *)PyTuple_GET_ITEM(self->mailboxes, i);
+		if (mbox_close(mbox, &err) < 0) {
+			free(conns);
+			return NULL;
+		}
+		note_disconnect(err, mbox);
+		conns[i].ret = err != 0 ? err : ACCEPT_SESSION;
+		failed |= err != 0;
 	}
-	Py_BEGIN_ALLOW_THREADS
-	bytes = SP_poll(self->mbox);
-	Py_END_ALLOW_THREADS
-	if (bytes < 0)
-		result = spread_error(bytes, self);
-	else
-		result = PyInt_FromLong(bytes);
-Done:
-	RELEASE_MBOX_LOCK(self);
-	return result;
+	if (failed)
+		pool_error(conns, (int)n);
+	free(conns);
+	if (failed)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-static PyMethodDef Mailbox_methods[] = {
-	{"disconnect",	(PyCFunction)mailbox_disconnect,METH_VARARGS},
-	{"fileno",	(PyCFunction)mailbox_fileno,	METH_VARARGS},
-	{"join",	(PyCFunction)mailbox_join,	METH_VARARGS},
-	{"leave",	(PyCFunction)mailbox_leave,	METH_VARARGS},
-	{"multicast",   (PyCFunction)mailbox_multicast, METH_VARARGS},
-	{"multigroup_multicast",	(PyCFunction)mailbox_multigroup_multicast, METH_VARARGS},
-	{"poll",	(PyCFunction)mailbox_poll,	METH_VARARGS},
-	{"receive",	(PyCFunction)mailbox_receive,	METH_VARARGS},
+static Py_ssize_t
+pool_length(PoolObject *self)
+{
+	return PyTuple_GET_SIZE(self->mailboxes);
+}
+
+static void
+pool_dealloc(PoolObject *self)
+{
+	Py_XDECREF(self->mailboxes);
+	Py_XDECREF(self->private_groups);
+	PyObject_Del(self);
+	HEAPTYPE_DECREF(Pool_Type);
+}
+
+static PyMethodDef Pool_methods[] = {
+	{"disconnect",	(PyCFunction)pool_disconnect,	METH_NOARGS},
+	{"mailbox",	(PyCFunction)pool_mailbox,	METH_O},
+	{"multicast",	(PyCFunction)pool_multicast,	METH_ARGS},
+	{"multigroup_multicast",	(PyCFunction)pool_multigroup_multicast,
+	 METH_ARGS},
 	{NULL,		NULL}		/* sentinel */
 };
 
-#define OFF(x) offsetof(MailboxObject, x)
+#define OFF(x) offsetof(PoolObject, x)
 
-static struct memberlist Mailbox_memberlist[] = {
-	{"private_group",	T_OBJECT,	OFF(private_group)},
+static PyMemberDef Pool_members[] = {
+	{"mailboxes",		T_OBJECT,	OFF(mailboxes),	READONLY},
+	{"private_groups",	T_OBJECT,	OFF(private_groups),	READONLY},
 	{NULL}
 };
 
-static PyObject *
-mailbox_getattr(PyObject *self, char *name)
-{
-	PyObject *meth;
-
-	meth = Py_FindMethod(Mailbox_methods, self, name);
-	if (meth)
-		return meth;
-	PyErr_Clear();
-	return PyMember_Get((char *)self, Mailbox_memberlist, name);
-}
-
-static PyTypeObject Mailbox_Type = {
-	/* The ob_type field must be initialized in the module init function
-	 * to be portable to Windows without using C++. */
-	PyObject_HEAD_INIT(NULL)
-	0,					/* ob_size */
-	"Mailbox",				/* tp_name */
-	sizeof(MailboxObject),			/* tp_basicsize */
-	0,					/* tp_itemsize */
-	/* methods */
-	(destructor)mailbox_dealloc,		/* tp_dealloc */
-	0,					/* tp_print */
-	(getattrfunc)mailbox_getattr,		/* tp_getattr */
-	0,					/* tp_setattr */
-	0,					/* tp_compare */
-	0,					/* tp_repr */
-	0,					/* tp_as_number */
-	0,					/* tp_as_sequence */
-	0,					/* tp_as_mapping */
+#undef OFF
+
+static PyType_Slot Pool_slots[] = {
+	{Py_tp_dealloc, pool_dealloc},
+	{Py_tp_methods, Pool_methods},
+	{Py_tp_members, Pool_members},
+	{Py_sq_length, pool_length},
+	{0, NULL}
 };
 
-static char spread_connect__doc__[] =
-"connect(daemon=\"N@localhost\", name=\"\", priority=0, membership=1) -> mbox\n"
-"\n"
-"All arguments are optional, and can be specified by keyword or position.\n"
-"\n"
-"Connect to a Spread daemon, via Spread's SP_connect().  Return a Mailbox\n"
-"object representing the connection.  Communication with Spread on this\n"
-"connection is done via invoking methods of the Mailbox object.\n"
+static PyType_Spec Pool_spec = {
+	"spread.MailboxPool",			/* name */
+	sizeof(PoolObject),			/* basicsize */
+	0,					/* itemsize */
+	SPREAD_TPFLAGS,				/* flags */
+	Pool_slots				/* slots */
+};
+
+static char spread_MailboxPool__doc__[] =
+"MailboxPool(daemon=\"N@localhost\", size=4, name=\"\", priority=0,\n"
+"            membership=0, route=\"group\") -> pool\n"
 "\n"
-"'daemon' is the name of the desired Spread daemon.  It defaults to\n"
-"    \"%d@localhost\" % spread.DEFAULT_SPREAD_PORT\n"
-"'name' is the desired private name for the connection.  It defaults to an\n"
-"    empty string, in which case Spread generates a unique random name.\n"
-"'priority' is an int, default 0, currently unused (see Spread docs).\n"
-"'membership' is a Boolean, default 1 (true), determining whether you want\n"
-"    to receive membership messages on this connection.  If your application\n"
-"    doesn't make mbox.receive() calls, pass 0 to avoid creating an\n"
-"    unboundedly large queue of unread membership messages.\n"
+"Open 'size' connections to a Spread daemon at once, and return a\n"
+"MailboxPool object that spreads multicasts over them.  'daemon' and\n"
+"'priority' are as for connect().  If 'name' is given, the connections'\n"
+"private names are name + \"0\", name + \"1\" and so on; otherwise Spread\n"
+"makes them up.  'membership' defaults to 0, since a pool is for sending.\n"
+"'route' chooses the connection for each message:  \"group\" (a hash of\n"
+"the group names, so each group's messages keep their order) or\n"
+"\"round_robin\".\n"
 "\n"
-"Upon successful connect, mbox.private_group is the private group name\n"
-"Spread assigned to the connection.";
+"If any connection fails, the others are closed and SpreadError is\n"
+"raised with the first failure's code and message, and a list of\n"
+"(index, code) pairs for all of them.";
 
 static PyObject *
-spread_connect(PyObject *self, PyObject *args, PyObject* kwds)
+spread_MailboxPool(PyObject *self, ARGS_DECL)
 {
-	static char *kwlist[] = {"daemon", "name", "priority", "membership",
-				  0};
-	char *daemon = NULL;
-	char *name = "";
-	int priority = 0;
-	int membership = 1;
-
-	MailboxObject *mbox;
-	mailbox _mbox;
-	int ret;
-	PyObject *group_name = NULL;
+	static char *kwlist[] = {"daemon", "size", "name", "priority",
+				 "membership", "route", 0};
+	const char *daemon = NULL;
+	const char *name = "";
+	const char *route = "group";
+	int size = 4, priority = 0, membership = 0;
+	int i, failed = 0;
 	char default_daemon[100];
-
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ssii:connect", kwlist,
-					 &daemon, &name, &priority,
-					 &membership))
+	PyObject *argv[6];
+	PoolBatch b;
+	PoolObject *pool;
+
+	if (unpack_args("MailboxPool", ARGS, kwlist, 0, argv) < 0 ||
+	    arg_name(argv[0], &daemon) < 0 ||
+	    arg_int(argv[1], &size) < 0 ||
+	    arg_name(argv[2], &name) < 0 ||
+	    arg_int(argv[3], &priority) < 0 ||
+	    arg_int(argv[4], &membership) < 0 ||
+	    arg_name(argv[5], &route) < 0)
 		return NULL;
-
+	if (size < 1 || size > 1000) {
+		PyErr_SetString(PyExc_ValueError,
+				"size must be between 1 and 1000");
+		return NULL;
+	}
+	if (*name && strlen(name) + (size > 100 ? 3 : size > 10 ? 2 : 1) >
+	    MAX_PRIVATE_NAME) {
+		PyErr_SetString(PyExc_ValueError,
+				"name too long to number the connections");
+		return NULL;
+	}
+	if (strcmp(route, "group") != 0 && strcmp(route, "round_robin") != 0) {
+		PyErr_SetString(PyExc_ValueError,
+				"route must be \"group\" or \"round_robin\"");
+		return NULL;
+	}
 	if (daemon == NULL) {
-		/* XXX Can't use PyOS_snprintf before 2.2.
-		PyOS_snprintf(default_daemon, sizeof(default_daemon),
-			      "%d@localhost", DEFAULT_SPREAD_PORT);
-		*/
 		sprintf(default_daemon, "%d@localhost", DEFAULT_SPREAD_PORT);
 		daemon = default_daemon;
 	}
 
-	/* initialize output buffer for group name */
-	group_name = PyString_FromStringAndSize(NULL, MAX_GROUP_NAME);
-	if (group_name == NULL)
-		return NULL;
+	b.daemon = daemon;
+	b.priority = priority;
+	b.membership = membership;
+	b.num_conns = size;
+	b.next = 0;
+	b.conns = calloc(size, sizeof(PoolConnect));
+	if (b.conns == NULL)
+		return PyErr_NoMemory();
+	for (i = 0; i < size; i++)
+		if (*name)
+			sprintf(b.conns[i].name, "%s%d", name, i);
+#ifdef WITH_THREAD
+	b.mutex = PyThread_allocate_lock();
+	b.done = PyThread_allocate_lock();
+	if (b.mutex == NULL || b.done == NULL) {
+		if (b.mutex != NULL)
+			PyThread_free_lock(b.mutex);
+		if (b.done != NULL)
+			PyThread_free_lock(b.done);
+		free(b.conns);
+		return PyErr_NoMemory();
+	}
+	PyThread_acquire_lock(b.done, 1);
+#endif
 
 	Py_BEGIN_ALLOW_THREADS
-	ret = SP_connect(daemon, name, priority, membership, &_mbox,
-			 PyString_AS_STRING(group_name));
+	pool_connect(&b);
+	for (i = 0; i < size; i++)
+		if (b.conns[i].ret != ACCEPT_SESSION)
+			failed = 1;
+	/* All or nothing. */
+	for (i = 0; failed && i < size; i++)
+		if (b.conns[i].ret == ACCEPT_SESSION)
+			SP_disconnect(b.conns[i].mbox);
 	Py_END_ALLOW_THREADS
+#ifdef WITH_THREAD
+	PyThread_release_lock(b.done);
+	PyThread_free_lock(b.done);
+	PyThread_free_lock(b.mutex);
+#endif
 
-	if (ret != ACCEPT_SESSION) {
-		Py_DECREF(group_name);
-		return spread_error(ret, NULL);
-	}
-
-	mbox = new_mailbox(_mbox);
-	if (mbox == NULL) {
-		SP_disconnect(_mbox);
-		Py_DECREF(group_name);
-		return NULL;
+	pool = NULL;
+	if (failed) {
+		pool_error(b.conns, size);
+		goto Done;
 	}
-#ifdef SPREAD_DISCONNECT_RACE_BUG
-	mbox->spread_lock = PyThread_allocate_lock();
-	if (mbox->spread_lock == NULL) {
-		Py_DECREF(mbox);
-		return NULL;
+	pool = PyObject_New(PoolObject, Pool_Type);
+	if (pool != NULL) {
+		pool->route = strcmp(route, "group") == 0 ?
+			POOL_ROUTE_GROUP : POOL_ROUTE_ROUND_ROBIN;
+		pool->next = 0;
+		pool->mailboxes = PyTuple_New(size);
+		pool->private_groups = PyTuple_New(size);
 	}
-#endif
-	if (_PyString_Resize(
-		&group_name,
-		strlen(PyString_AS_STRING(group_name))) < 0)
-	{
-		SP_disconnect(_mbox);
-		Py_DECREF(mbox);
-		return NULL;
+	/* Every session is closed by now, or owned by a Mailbox object. */
+	for (i = 0; i < size; i++) {
+		PyObject *mbox = NULL;
+
+		if (pool != NULL && pool->mailboxes != NULL &&
+		    pool->private_groups != NULL)
+			mbox = connected_mailbox(b.conns[i].mbox,
+						 b.conns[i].group_name);
+		else
+			SP_disconnect(b.conns[i].mbox);
+		if (mbox == NULL) {
+			Py_CLEAR(pool);
+			continue;
+		}
+		PyTuple_SET_ITEM(pool->mailboxes, i, mbox);
+		Py_INCREF(((MailboxObject *)mbox)->private_group);
+		PyTuple_SET_ITEM(pool->private_groups, i,
+				 ((MailboxObject *)mbox)->private_group);
 	}
-	mbox->private_group = group_name;
-	return (PyObject*)mbox;
+Done:
+	free(b.conns);
+	return (PyObject *)pool;
+}
+
+static char spread_GroupSet__doc__[] =
+"GroupSet(groups) -> GroupSet\n"
+"\n"
+"Return a GroupSet object holding the group names in 'groups', which may\n"
+"be a tuple, list or any other iterable of strings.  The names are checked\n"
+"and packed into Spread's format once, so passing the GroupSet to\n"
+"mbox.multicast() or mbox.multigroup_multicast() costs nothing per call.";
+
+static PyObject *
+spread_GroupSet(PyObject *self, PyObject *groups)
+{
+	return new_group_set(groups);
 }
 
 static char spread_version__doc__[] =
@@ -1021,12 +7558,10 @@ static char spread_version__doc__[] =
 "from Spread's SP_version().";
 
 static PyObject *
-spread_version(PyObject *self, PyObject *args)
+spread_version(PyObject *self, PyObject *unused)
 {
 	int major, minor, patch;
 
-	if (!PyArg_ParseTuple(args, ":version"))
-		return NULL;
 	if (!SP_version(&major, &minor, &patch)) {
 		PyErr_SetString(SpreadError, "SP_version failed");
 		return NULL;
@@ -1034,87 +7569,216 @@ spread_version(PyObject *self, PyObject *args)
 	return Py_BuildValue("iii", major, minor, patch);
 }
 
+static char spread_stats__doc__[] =
+"stats() -> dict\n"
+"\n"
+"Return the statistics Mailbox.stats() returns, summed over every mailbox\n"
+"since the module was loaded (or reset_stats() was called), with the\n"
+"errors no mailbox raised, e.g. from connect(), counted as well.";
+
+static PyObject *
+spread_stats(PyObject *self, PyObject *unused)
+{
+	MboxStats st;
+
+	LOCK(&all_stats);
+	st = all_stats.stats;
+	UNLOCK(&all_stats);
+	return stats_dict(&st);
+}
+
+static char spread_reset_stats__doc__[] =
+"reset_stats() -> None\n"
+"\n"
+"Zero the statistics stats() returns.  Those of each mailbox are left\n"
+"alone.";
+
+static PyObject *
+spread_reset_stats(PyObject *self, PyObject *unused)
+{
+	LOCK(&all_stats);
+	memset(&all_stats.stats, 0, sizeof(MboxStats));
+	UNLOCK(&all_stats);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+#ifdef FAKESPREAD
+
+/* Built against the in-process stand-in in fakespread/ (see setup.py):
+   hooks for scripting what a daemon would do on its own. */
+
+static char spread__fake_membership_event__doc__[] =
+"_fake_membership_event(group, reason, members) -> None\n"
+"\n"
+"Stand-in library only.  Install 'members' (an iterable of private group\n"
+"names, possibly empty, possibly naming clients that are not connected)\n"
+"as the view of 'group', and deliver a membership message with 'reason'\n"
+"(e.g. CAUSED_BY_NETWORK for a partition or merge) to its members.";
+
+static PyObject *
+spread__fake_membership_event(PyObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"group", "reason", "members", 0};
+	const char *group = NULL;
+	int reason = CAUSED_BY_NETWORK, num_members = 0, ret;
+	char (*members)[MAX_GROUP_NAME] = NULL;
+	PyObject *argv[3];
+
+	if (unpack_args("_fake_membership_event", ARGS, kwlist, 3, argv) < 0 ||
+	    arg_name(argv[0], &group) < 0 ||
+	    arg_int(argv[1], &reason) < 0)
+		return NULL;
+	if (PyObject_Size(argv[2]) != 0) {
+		PyErr_Clear();
+		members = pack_groups(argv[2], &num_members);
+		if (members == NULL)
+			return NULL;
+	}
+	else if (PyErr_Occurred())
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	ret = SPfake_membership_event(group, reason, num_members,
+				      (const char (*)[MAX_GROUP_NAME])members);
+	Py_END_ALLOW_THREADS
+	free(members);
+	if (ret < 0)
+		return spread_error(ret, NULL);
+	Py_RETURN_NONE;
+}
+
+static char spread__fake_kill_session__doc__[] =
+"_fake_kill_session(private_group, after=0) -> None\n"
+"\n"
+"Stand-in library only.  Close the connection whose private group is\n"
+"'private_group' from the daemon's side:  its groups see it disconnect,\n"
+"and its mailbox gets CONNECTION_CLOSED.  With 'after', that happens\n"
+"once it has multicast that many more messages.";
+
+static PyObject *
+spread__fake_kill_session(PyObject *self, ARGS_DECL)
+{
+	static char *kwlist[] = {"private_group", "after", 0};
+	const char *private_group = NULL;
+	int after = 0, ret;
+	PyObject *argv[2];
+
+	if (unpack_args("_fake_kill_session", ARGS, kwlist, 1, argv) < 0 ||
+	    arg_name(argv[0], &private_group) < 0 ||
+	    arg_int(argv[1], &after) < 0)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	ret = SPfake_kill_session_after(private_group, after);
+	Py_END_ALLOW_THREADS
+	if (ret < 0)
+		return spread_error(ret, NULL);
+	Py_RETURN_NONE;
+}
+
+#endif /* FAKESPREAD */
+
 /* List of functions defined in the module */
 
 static PyMethodDef spread_methods[] = {
-	{"connect", (PyCFunction)spread_connect, METH_VARARGS | METH_KEYWORDS,
+	{"connect", (PyCFunction)spread_connect, METH_ARGS,
 	 spread_connect__doc__},
-	{"version", spread_version, METH_VARARGS,
+	{"GroupSet", spread_GroupSet, METH_O,
+	 spread_GroupSet__doc__},
+	{"MailboxPool", (PyCFunction)spread_MailboxPool, METH_ARGS,
+	 spread_MailboxPool__doc__},
+	{"reset_stats", spread_reset_stats, METH_NOARGS,
+	 spread_reset_stats__doc__},
+	{"stats", spread_stats, METH_NOARGS,
+	 spread_stats__doc__},
+	{"version", spread_version, METH_NOARGS,
 	 spread_version__doc__},
+#ifdef FAKESPREAD
+	{"_fake_kill_session", (PyCFunction)spread__fake_kill_session,
+	 METH_ARGS, spread__fake_kill_session__doc__},
+	{"_fake_membership_event", (PyCFunction)spread__fake_membership_event,
+	 METH_ARGS, spread__fake_membership_event__doc__},
+#endif
 	{NULL, NULL}		/* sentinel */
 };
 
-/* spread_error(): helper function for setting exceptions from SP_xxx
-   return value */
+/* error_message(): the message spread_error() reports for a Spread
+   error code */
 
-static PyObject *
-spread_error(int err, MailboxObject *mbox)
+static char *
+error_message(int err)
 {
-	char *message = NULL;
-	PyObject *val;
-
 	/* XXX It would be better if spread provided an API function to
 	   map these to error strings.  SP_error() merely prints a string,
 	   which is useful in only limited circumstances. */
 	switch (err) {
 	case ILLEGAL_SPREAD:
-		message = "Illegal spread was provided";
-		break;
+		return "Illegal spread was provided";
 	case COULD_NOT_CONNECT:
-		message = "Could not connect. Is Spread running?";
-		break;
+		return "Could not connect. Is Spread running?";
 	case REJECT_QUOTA:
-		message = "Connection rejected, too many users";
-		break;
+		return "Connection rejected, too many users";
 	case REJECT_NO_NAME:
-		message = "Connection rejected, no name was supplied";
-		break;
+		return "Connection rejected, no name was supplied";
 	case REJECT_ILLEGAL_NAME:
-		message = "Connection rejected, illegal name";
-		break;
+		return "Connection rejected, illegal name";
 	case REJECT_NOT_UNIQUE:
-		message = "Connection rejected, name not unique";
-		break;
+		return "Connection rejected, name not unique";
 	case REJECT_VERSION:
-		message = "Connection rejected, library does not fit daemon";
-		break;
+		return "Connection rejected, library does not fit daemon";
 	case CONNECTION_CLOSED:
-		message = "Connection closed by spread";
-		if (mbox)
-			mbox->disconnected = 1;
-		break;
+		return "Connection closed by spread";
 	case REJECT_AUTH:
-		message = "Connection rejected, authentication failed";
-		break;
+		return "Connection rejected, authentication failed";
 	case ILLEGAL_SESSION:
-		message = "Illegal session was supplied";
-		if (mbox)
-			mbox->disconnected = 1;
-		break;
+		return "Illegal session was supplied";
 	case ILLEGAL_SERVICE:
-		message = "Illegal service request";
-		break;
+		return "Illegal service request";
 	case ILLEGAL_MESSAGE:
-		message = "Illegal message";
-		break;
+		return "Illegal message";
 	case ILLEGAL_GROUP:
-		message = "Illegal group";
-		break;
+		return "Illegal group";
 	case BUFFER_TOO_SHORT:
-		message = "The supplied buffer was too short";
-		break;
+		return "The supplied buffer was too short";
 	case GROUPS_TOO_SHORT:
-		message = "The supplied groups list was too short";
-		break;
+		return "The supplied groups list was too short";
 	case MESSAGE_TOO_LONG:
-		message = "The message body + group names "
-			  "was too large to fit in a message";
-		break;
+		return "The message body + group names "
+		       "was too large to fit in a message";
 	default:
-		message = "unrecognized error";
+		return "unrecognized error";
+	}
+}
+
+/* spread_error(): helper function for setting exceptions from SP_xxx
+   return value */
+
+static PyObject *
+spread_error(int err, MailboxObject *mbox)
+{
+	PyObject *val;
+
+	note_disconnect(err, mbox);
+	stats_error(mbox, err);
+	val = Py_BuildValue("is", err, error_message(err));
+	if (val) {
+		PyErr_SetObject(SpreadError, val);
+		Py_DECREF(val);
 	}
 
-	val = Py_BuildValue("is", err, message);
+	return NULL;
+}
+
+/* spread_error_extra(): like spread_error(), but with a third argument
+   saying more about the error (e.g., the index of the failing message) */
+
+static PyObject *
+spread_error_extra(int err, MailboxObject *mbox, int extra)
+{
+	PyObject *val;
+
+	note_disconnect(err, mbox);
+	stats_error(mbox, err);
+	val = Py_BuildValue("isi", err, error_message(err), extra);
 	if (val) {
 		PyErr_SetObject(SpreadError, val);
 		Py_DECREF(val);
@@ -1123,6 +7787,20 @@ spread_error(int err, MailboxObject *mbox)
 	return NULL;
 }
 
+/* note_disconnect(): mark mbox closed if err is one of the errors after
+   which Spread has closed the connection (see the comment at the top of
+   this file) */
+
+static void
+note_disconnect(int err, MailboxObject *mbox)
+{
+	if (mbox && (err == CONNECTION_CLOSED || err == ILLEGAL_SESSION)) {
+		Py_BEGIN_CRITICAL_SECTION(mbox);
+		mbox->disconnected = 1;
+		Py_END_CRITICAL_SECTION();
+	}
+}
+
 /* Table of symbolic constants defined by Spread.
    (Programmatically generated from sp.h.) */
 
@@ -1138,6 +7816,7 @@ static struct constdef {
 	{"MAX_GROUP_NAME", MAX_GROUP_NAME},
 	{"MAX_PRIVATE_NAME", MAX_PRIVATE_NAME},
 	{"MAX_PROC_NAME", MAX_PROC_NAME},
+	{"MAX_CLIENT_SCATTER_ELEMENTS", MAX_CLIENT_SCATTER_ELEMENTS},
 	{"UNRELIABLE_MESS", UNRELIABLE_MESS},
 	{"RELIABLE_MESS", RELIABLE_MESS},
 	{"FIFO_MESS", FIFO_MESS},
@@ -1178,58 +7857,147 @@ static struct constdef {
 	/* Not Spread constants, but still useful */
 	{"DEFAULT_BUFFER_SIZE", DEFAULT_BUFFER_SIZE},
 	{"DEFAULT_GROUPS_SIZE", DEFAULT_GROUPS_SIZE},
+	{"BATCH_MSG_TYPE", BATCH_MSG_TYPE},
+	{"COMPRESSED_MSG_TYPE", COMPRESSED_MSG_TYPE},
+	{"FRAGMENT_MSG_TYPE", FRAGMENT_MSG_TYPE},
+	{"STAMPED_MSG_TYPE", STAMPED_MSG_TYPE},
 	{NULL}
 };
 
+/* Create the type for spec in *tp.  The types are made once and kept
+ * for the life of the process, like the static types they replace:
+ * messages and mailboxes can outlive the module object.
+ */
+static int
+make_type(PyTypeObject **tp, PyType_Spec *spec)
+{
+	if (*tp == NULL) {
+		*tp = (PyTypeObject *)PyType_FromSpec(spec);
+		if (*tp == NULL)
+			return -1;
+		/* Instances only come from this module. */
+		(*tp)->tp_new = NULL;
+	}
+	return 0;
+}
+
 /* Initialization function for the module */
 
-DL_EXPORT(void)
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef spread_module = {
+	PyModuleDef_HEAD_INIT,
+	"spread",				/* m_name */
+	NULL,					/* m_doc */
+	-1,					/* m_size */
+	spread_methods				/* m_methods */
+};
+
+#define INIT_RETURN(m)	return (m)
+
+PyMODINIT_FUNC
+PyInit_spread(void)
+#else
+#define INIT_RETURN(m)	return
+
+PyMODINIT_FUNC
 initspread(void)
+#endif
 {
-	PyObject *m;
+	PyObject *m, *names;
 	struct constdef *p;
+	int i;
 
 	/* Create the module and add the functions */
+#if PY_MAJOR_VERSION >= 3
+	m = PyModule_Create(&spread_module);
+#else
 	m = Py_InitModule("spread", spread_methods);
+#endif
 	if (m == NULL)
-		return;
+		INIT_RETURN(NULL);
+#ifdef Py_GIL_DISABLED
+	/* Everything shared is locked; see MUTEX. */
+	if (PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED) < 0)
+		goto Error;
+#endif
 
-	/* Initialize the type of the new type object here; doing it here
-	 * is required for portability to Windows without requiring C++. */
-	Mailbox_Type.ob_type = &PyType_Type;
-	RegularMsg_Type.ob_type = &PyType_Type;
-	MembershipMsg_Type.ob_type = &PyType_Type;
+	if (make_type(&Mailbox_Type, &Mailbox_spec) < 0 ||
+	    make_type(&RegularMsg_Type, &RegularMsg_spec) < 0 ||
+	    make_type(&MembershipMsg_Type, &MembershipMsg_spec) < 0 ||
+	    make_type(&GroupId_Type, &GroupId_spec) < 0 ||
+	    make_type(&GroupSet_Type, &GroupSet_spec) < 0 ||
+	    make_type(&Pool_Type, &Pool_spec) < 0)
+		goto Error;
+#ifdef HAVE_RECEIVER
+	if (make_type(&Queue_Type, &Queue_spec) < 0)
+		goto Error;
+#endif
 
 	/* PyModule_AddObject() DECREFs its third argument */
-	Py_INCREF(&Mailbox_Type);
+	Py_INCREF(Mailbox_Type);
 	if (PyModule_AddObject(m, "MailboxType",
-			       (PyObject *)&Mailbox_Type) < 0)
-		return;
-	Py_INCREF(&RegularMsg_Type);
+			       (PyObject *)Mailbox_Type) < 0)
+		goto Error;
+	Py_INCREF(RegularMsg_Type);
 	if (PyModule_AddObject(m, "RegularMsgType",
-			       (PyObject *)&RegularMsg_Type) < 0)
-		return;
-	Py_INCREF(&MembershipMsg_Type);
+			       (PyObject *)RegularMsg_Type) < 0)
+		goto Error;
+	Py_INCREF(MembershipMsg_Type);
 	if (PyModule_AddObject(m, "MembershipMsgType",
-			       (PyObject *)&MembershipMsg_Type) < 0)
-		return;
+			       (PyObject *)MembershipMsg_Type) < 0)
+		goto Error;
+	Py_INCREF(GroupSet_Type);
+	if (PyModule_AddObject(m, "GroupSetType",
+			       (PyObject *)GroupSet_Type) < 0)
+		goto Error;
+	Py_INCREF(Pool_Type);
+	if (PyModule_AddObject(m, "MailboxPoolType",
+			       (PyObject *)Pool_Type) < 0)
+		goto Error;
+#ifdef HAVE_RECEIVER
+	Py_INCREF(Queue_Type);
+	if (PyModule_AddObject(m, "ReceiveQueueType",
+			       (PyObject *)Queue_Type) < 0)
+		goto Error;
+#endif
 
 	/* Create the exception, if necessary */
 	if (SpreadError == NULL) {
 		SpreadError = PyErr_NewException("spread.error", NULL, NULL);
 		if (SpreadError == NULL)
-			return;
+			goto Error;
 	}
 
 	/* Add the exception to the module */
 	Py_INCREF(SpreadError);
 	if (PyModule_AddObject(m, "error", SpreadError) < 0)
-		return;
+		goto Error;
 
 	/* Add the Spread symbolic constants to the module */
 	for (p = spread_constants; p->name != NULL; p++) {
 		if (PyModule_AddIntConstant(m, p->name, p->value) < 0)
-			return;
+			goto Error;
+	}
+
+	/* The names multicast(compress=...) takes, best first */
+	for (i = 0; codecs[i] != 0; i++)
+		;
+	names = PyTuple_New(i);
+	if (names == NULL)
+		goto Error;
+	for (i = 0; codecs[i] != 0; i++)
+		PyTuple_SET_ITEM(names, i, Name_FromString(
+					 codec_name(codecs[i])));
+	if (PyErr_Occurred() || PyModule_AddObject(m, "COMPRESSORS",
+						   names) < 0) {
+		Py_DECREF(names);
+		goto Error;
 	}
+	INIT_RETURN(m);
 
+Error:
+#if PY_MAJOR_VERSION >= 3
+	Py_DECREF(m);
+#endif
+	INIT_RETURN(NULL);
 }
@@ -3,16 +3,33 @@
 # This code is released under the standard PSF license.
 # See the file LICENSE.
 
+from __future__ import print_function
+
+import gc
 import sys
 import os
 import time
 import unittest
-from distutils.util import get_platform
+import weakref
+from sysconfig import get_platform
+
+try:
+    import thread
+except ImportError:
+    try:
+        import _thread as thread
+    except ImportError:
+        thread = None
 
 def setup_path():
-    PLAT_SPEC = "%s-%s" % (get_platform(), sys.version[0:3])
-    DIRS = [os.path.join("build", "lib.%s" % PLAT_SPEC),
+    PLAT = get_platform()
+    DIRS = [os.path.join("build", "lib.%s-%d.%d" % ((PLAT,) +
+                                                   sys.version_info[:2])),
             ]
+    if hasattr(sys, "implementation"):
+        # newer setuptools name the directory after the cache tag
+        DIRS.append(os.path.join("build", "lib.%s-%s" %
+                                 (PLAT, sys.implementation.cache_tag)))
     for d in DIRS:
         sys.path.insert(0, d)
 
@@ -139,6 +156,35 @@ class SpreadTest(unittest.TestCase):
         # know what that is, so can't check it.
         m.disconnect()
 
+    def testArguments(self):
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        mbox.multicast(service_type=spread.FIFO_MESS, group=group,
+                       message=b"by keyword", message_type=5)
+        msg = mbox.receive(timeout=5)
+        self.assertEqual(type(msg.message), bytes)
+        self.assertEqual(msg.message, b"by keyword")
+        self.assertEqual(msg.msg_type, 5)
+        self.assertEqual(type(msg.sender), str)
+        self.assertEqual(type(msg.groups[0]), str)
+        self.assertEqual(type(mbox.private_group), str)
+
+        self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS, group)
+        self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS,
+                          group, b"x", 0, 1)
+        self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS,
+                          group, b"x", bogus=1)
+        self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS,
+                          group, b"x", service_type=1)
+        self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS,
+                          group, b"x", 1.5)
+        if sys.version_info[0] >= 3:
+            self.assertRaises(TypeError, mbox.multicast, spread.FIFO_MESS,
+                              group, "text is not bytes")
+        self.assertRaises(TypeError, spread.MailboxType)
+        mbox.disconnect()
+
     def testTwoConnect(self):
         group = self._group()
 
@@ -194,25 +240,25 @@ class SpreadTest(unittest.TestCase):
         group, members = self._connect_group(12)
 
         wr = members[0]
-        wr.multicast(spread.FIFO_MESS, group, "1")
+        wr.multicast(spread.FIFO_MESS, group, b"1")
 
         for rd in members:
             msg = rd.receive()
             if not hasattr(msg, 'message'):
-                print msg
-                print msg.reason
-                print msg.svc_type
-            self.assertEqual(msg.message, "1")
+                print(msg)
+                print(msg.reason)
+                print(msg.svc_type)
+            self.assertEqual(msg.message, b"1")
             self.assertEqual(msg.sender, wr.private_group)
             self.assertEqual(len(msg.groups), 1)
             self.assertEqual(msg.groups[0], group)
 
         wr = members[0]
-        wr.multicast(spread.FIFO_MESS, group, "2")
+        wr.multicast(spread.FIFO_MESS, group, b"2")
 
         for rd in members:
             msg = rd.receive()
-            self.assertEqual(msg.message, "2")
+            self.assertEqual(msg.message, b"2")
             self.assertEqual(msg.sender, wr.private_group)
             self.assertEqual(len(msg.groups), 1)
             self.assertEqual(msg.groups[0], group)
@@ -223,24 +269,24 @@ class SpreadTest(unittest.TestCase):
         member_private_names = tuple([m.private_group for m in members])
 
         wr = members[0]
-        wr.multigroup_multicast(spread.FIFO_MESS, member_private_names, "1")
+        wr.multigroup_multicast(spread.FIFO_MESS, member_private_names, b"1")
 
         for rd in members:
             msg = rd.receive()
-            self.assert_(hasattr(msg, 'message'))
-            self.assertEqual(msg.message, "1")
+            self.assertTrue(hasattr(msg, 'message'))
+            self.assertEqual(msg.message, b"1")
             self.assertEqual(msg.sender, wr.private_group)
             self.assertEqual(len(msg.groups), 12)
-            self.failUnless(rd.private_group in msg.groups)
+            self.assertTrue(rd.private_group in msg.groups)
 
-        wr.multigroup_multicast(spread.FIFO_MESS, member_private_names, "2")
+        wr.multigroup_multicast(spread.FIFO_MESS, member_private_names, b"2")
 
         for rd in members:
             msg = rd.receive()
-            self.assertEqual(msg.message, "2")
+            self.assertEqual(msg.message, b"2")
             self.assertEqual(msg.sender, wr.private_group)
             self.assertEqual(len(msg.groups), 12)
-            self.failUnless(rd.private_group in msg.groups)
+            self.assertTrue(rd.private_group in msg.groups)
 
     def testBigMessage(self):
         group = self._group()
@@ -251,14 +297,450 @@ class SpreadTest(unittest.TestCase):
 
         size = 2 * spread.DEFAULT_BUFFER_SIZE
         try:
-            mbox.multicast(spread.SAFE_MESS, group, "X" * size)
-        except spread.error, err:
-            print err
-            print size
+            mbox.multicast(spread.SAFE_MESS, group, b"X" * size)
+        except spread.error as err:
+            print(err)
+            print(size)
             raise
         msg = mbox.receive()
         self.assertEqual(len(msg.message), size)
 
+    def testReceiveMany(self):
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        self.assertEqual(mbox.receive_many(10, 0.1), [])
+
+        msgs = [b'm%d' % i for i in range(5)]
+        for msg in msgs:
+            mbox.multicast(spread.FIFO_MESS, group, msg)
+        got = []
+        while len(got) < len(msgs):
+            batch = mbox.receive_many(2)
+            self.assertTrue(1 <= len(batch) <= 2)
+            got.extend(batch)
+        self.assertEqual([m.message for m in got], msgs)
+        for m in got:
+            self.assertEqual(type(m), spread.RegularMsgType)
+            self.assertEqual(m.groups, (group,))
+
+        big = b"X" * (2 * spread.DEFAULT_BUFFER_SIZE)
+        mbox.multicast(spread.FIFO_MESS, group, big)
+        mbox.multicast(spread.FIFO_MESS, group, b"small")
+        got = []
+        while len(got) < 2:
+            got.extend(mbox.receive_many(10))
+        self.assertEqual([m.message for m in got], [big, b"small"])
+        self.assertRaises(ValueError, mbox.receive_many, 0)
+        mbox.disconnect()
+
+    def testReceiveTimeout(self):
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        t0 = time.time()
+        self.assertEqual(mbox.receive(0.1), None)
+        self.assertTrue(time.time() - t0 >= 0.09)
+        self.assertEqual(mbox.receive(timeout=0), None)
+        self.assertEqual(mbox.receive_into(bytearray(10), timeout=0), None)
+        self.assertEqual(mbox.receive_many(10, timeout=0), [])
+
+        mbox.multicast(spread.FIFO_MESS, group, b"waiting")
+        msg = mbox.receive(timeout=5)
+        self.assertEqual(msg.message, b"waiting")
+        mbox.multicast(spread.FIFO_MESS, group, b"into")
+        n, msg = mbox.receive_into(bytearray(10), 5)
+        self.assertEqual(n, 4)
+
+        self.assertRaises(ValueError, mbox.receive, -1)
+        self.assertRaises(ValueError, mbox.receive, float("nan"))
+        self.assertRaises(TypeError, mbox.receive, "1")
+        mbox.disconnect()
+
+    def testReceiveInto(self):
+        mbox = self._connect()
+        group = self._group()
+        mbox.join(group)
+        buf = bytearray(100)
+        n, msg = mbox.receive_into(buf)
+        self.assertEqual(type(msg), spread.MembershipMsgType)
+        self.assertEqual(msg.members, (mbox.private_group,))
+
+        mbox.multicast(spread.FIFO_MESS, group, b"hello", 3)
+        n, msg = mbox.receive_into(buf)
+        self.assertEqual(n, 5)
+        self.assertEqual(buf[:n], b"hello")
+        self.assertEqual(type(msg), spread.RegularMsgType)
+        self.assertEqual(msg.message, None)
+        self.assertEqual(msg.msg_type, 3)
+        self.assertEqual(msg.groups, (group,))
+
+        # A buffer that is too short leaves the message queued, and the
+        # error says how big a buffer is needed.
+        mbox.multicast(spread.FIFO_MESS, group, b"Y" * 500)
+        try:
+            mbox.receive_into(buf)
+        except spread.error as err:
+            self.assertEqual(err.args[0], spread.BUFFER_TOO_SHORT)
+            self.assertEqual(err.args[2], 500)
+        else:
+            self.fail("expected receive_into to complain about the buffer")
+        buf = bytearray(1000)
+        n, msg = mbox.receive_into(memoryview(buf)[200:])
+        self.assertEqual(n, 500)
+        self.assertEqual(buf[200:700], b"Y" * 500)
+        self.assertRaises(TypeError, mbox.receive_into, "immutable")
+
+        import mmap
+        buf = mmap.mmap(-1, 100)
+        mbox.multicast(spread.FIFO_MESS, group, b"mapped")
+        n, msg = mbox.receive_into(buf)
+        self.assertEqual(buf[:n], b"mapped")
+        mbox.disconnect()
+
+    def testAdaptiveBuffer(self):
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        size = 64 * 1024
+        for i in range(3):
+            mbox.multicast(spread.FIFO_MESS, group, b"X" * size)
+            self.assertEqual(len(mbox.receive().message), size)
+        stats = mbox.buffer_stats()
+        # Only the first big message should have needed a second
+        # SP_receive(); the buffer is remembered for the others.
+        self.assertEqual(stats['retries'], 1)
+        self.assertEqual(stats['retries_saved'], 2)
+        self.assertEqual(stats['high_water'], size)
+        self.assertTrue(stats['size'] >= size)
+
+        mbox.set_buffer_policy(window=2)
+        for i in range(2):
+            mbox.multicast(spread.FIFO_MESS, group, b"small")
+            self.assertEqual(mbox.receive().message, b"small")
+        stats = mbox.buffer_stats()
+        self.assertEqual(stats['shrinks'], 1)
+        self.assertEqual(stats['size'], spread.DEFAULT_BUFFER_SIZE)
+        self.assertRaises(ValueError, mbox.set_buffer_policy,
+                          min_size=100, max_size=10)
+        mbox.disconnect()
+
+    def testNameCache(self):
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        for i in range(3):
+            mbox.multicast(spread.FIFO_MESS, group, b"%d" % i)
+        msgs = [mbox.receive() for i in range(3)]
+        # groups tuples are only looked up when first used
+        self.assertEqual(mbox.name_cache_stats()['groups_misses'], 0)
+        groups = [m.groups for m in msgs]
+        self.assertTrue(groups[0] is groups[2])
+        self.assertTrue(msgs[0].groups is groups[0])
+        self.assertTrue(msgs[0].sender is msgs[2].sender)
+        stats = mbox.name_cache_stats()
+        self.assertEqual(stats['groups_hits'], 2)
+        self.assertEqual(stats['groups_misses'], 1)
+        self.assertTrue(stats['hits'] >= 2)
+
+        mbox.set_name_cache(0)
+        for i in range(2):
+            mbox.multicast(spread.FIFO_MESS, group, b"%d" % i)
+        msgs = [mbox.receive() for i in range(2)]
+        self.assertEqual(msgs[0].groups, msgs[1].groups)
+        self.assertFalse(msgs[0].groups is msgs[1].groups)
+        self.assertEqual(mbox.name_cache_stats()['size'], 0)
+        mbox.disconnect()
+
+    def testLazyDecode(self):
+        group, members = self._connect_group(2)
+        wr, rd = members
+        names = (group, rd.private_group)
+        wr.multigroup_multicast(spread.FIFO_MESS, names, b"wide")
+        msg = rd.receive()
+        rd.disconnect()
+        # Decoded after the mailbox is gone, and only once.
+        self.assertEqual(msg.groups, names)
+        self.assertTrue(msg.groups is msg.groups)
+
+        wr.disconnect()
+
+        mbox = self._connect()
+        mbox.join(group)
+        memb = mbox.receive()
+        mbox.disconnect()
+        self.assertEqual(memb.members, (mbox.private_group,))
+        self.assertTrue(memb.members is memb.members)
+        self.assertEqual(memb.changed_member, mbox.private_group)
+        self.assertTrue(memb.extra is memb.extra)
+        self.assertEqual(memb.group_id, memb.group_id)
+
+    def testMessageAttributes(self):
+        for name in "sender", "groups", "message", "msg_type", "endian":
+            self.assertTrue(hasattr(spread.RegularMsgType, name))
+        for name in "members", "group_id", "extra", "changed_member":
+            self.assertTrue(hasattr(spread.MembershipMsgType, name))
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        self.assertTrue("receive" in dir(mbox))
+        # Enough messages alive at once to overflow the freelist, then
+        # reused from it.
+        for n in 300, 300:
+            for i in range(n):
+                mbox.multicast(spread.FIFO_MESS, group, b"%d" % i, i)
+            msgs = [mbox.receive() for i in range(n)]
+            self.assertEqual([m.message for m in msgs],
+                             [b"%d" % i for i in range(n)])
+            self.assertEqual([m.msg_type for m in msgs], list(range(n)))
+            del msgs
+        self.assertEqual(mbox.receive(0), None)
+        mbox.multicast(spread.FIFO_MESS, group, b"ro")
+        msg = mbox.receive()
+        self.assertRaises((AttributeError, TypeError),
+                          setattr, msg, "groups", ())
+        self.assertRaises((AttributeError, TypeError),
+                          setattr, msg, "message", "changed")
+        self.assertRaises((AttributeError, TypeError),
+                          setattr, mbox, "private_group", "x")
+        mbox.disconnect()
+
+    def testMulticastScatter(self):
+        group, members = self._connect_group(2)
+        wr, rd = members
+        parts = [b"head:", bytearray(b"body"), memoryview(b":trailer")[1:]]
+        n = wr.multicast_scatter(spread.FIFO_MESS, group, parts, 7)
+        self.assertEqual(n, len("head:bodytrailer"))
+        for mbox in members:
+            msg = mbox.receive()
+            self.assertEqual(msg.message, b"head:bodytrailer")
+            self.assertEqual(msg.msg_type, 7)
+            self.assertEqual(msg.groups, (group,))
+
+        groups = (group, rd.private_group)
+        wr.multicast_scatter(spread.FIFO_MESS, groups, (b"a", b"b"))
+        msg = rd.receive()
+        self.assertEqual(msg.message, b"ab")
+        self.assertEqual(msg.groups, groups)
+
+        self.assertRaises(ValueError, wr.multicast_scatter,
+                          spread.FIFO_MESS, group,
+                          [b"x"] * (spread.MAX_CLIENT_SCATTER_ELEMENTS + 1))
+        self.assertRaises(TypeError, wr.multicast_scatter,
+                          spread.FIFO_MESS, group, [1])
+        self.assertRaises(TypeError, wr.multicast_scatter,
+                          spread.FIFO_MESS, 42, [b"x"])
+        for single in b"xy", u"xy", bytearray(b"xy"), memoryview(b"xy"):
+            self.assertRaises(TypeError, wr.multicast_scatter,
+                              spread.FIFO_MESS, group, single)
+        wr.disconnect()
+        rd.disconnect()
+
+    def testMulticastMany(self):
+        group, members = self._connect_group(2)
+        wr, rd = members
+        sends = [(group, b"one"),
+                 (group, bytearray(b"two"), 2),
+                 ((group, wr.private_group), b"three", 3)]
+        self.assertEqual(wr.multicast_many(spread.FIFO_MESS, iter(sends)),
+                         [3, 3, 5])
+        for mbox in members:
+            msgs = [mbox.receive() for i in range(3)]
+            self.assertEqual([m.message for m in msgs],
+                             [b"one", b"two", b"three"])
+            self.assertEqual([m.msg_type for m in msgs], [0, 2, 3])
+        self.assertEqual(wr.multicast_many(spread.FIFO_MESS, []), [])
+
+        # Nothing is sent if any item is malformed.
+        self.assertRaises(TypeError, wr.multicast_many, spread.FIFO_MESS,
+                          [(group, b"ok"), (group,)])
+        self.assertRaises(ValueError, wr.multicast_many, 0x1000,
+                          [(group, b"ok")])
+        self.assertEqual(rd.receive_many(10, 0.1), [])
+
+        # A Spread error stops the batch and reports the failing index.
+        too_long = b"X" * 1000000
+        try:
+            wr.multicast_many(spread.FIFO_MESS,
+                              [(group, b"sent"), (group, too_long),
+                               (group, b"not sent")])
+        except spread.error as err:
+            self.assertEqual(err.args[0], spread.MESSAGE_TOO_LONG)
+            self.assertEqual(err.args[2], 1)
+        else:
+            self.fail("expected multicast_many to fail on item 1")
+        self.assertEqual(rd.receive().message, b"sent")
+        self.assertEqual(rd.receive_many(10, 0.1), [])
+
+    def testGroupSet(self):
+        group, members = self._connect_group(2)
+        wr, rd = members
+        names = [group, rd.private_group]
+        gs = spread.GroupSet(iter(names))
+        self.assertEqual(type(gs), spread.GroupSetType)
+        self.assertEqual(gs.groups, tuple(names))
+        self.assertEqual(len(gs), 2)
+
+        wr.multicast(spread.FIFO_MESS, gs, b"via multicast")
+        wr.multigroup_multicast(spread.FIFO_MESS, gs, b"via multigroup")
+        wr.multigroup_multicast(spread.FIFO_MESS, names, b"via list")
+        for text in b"via multicast", b"via multigroup", b"via list":
+            msg = rd.receive()
+            self.assertEqual(msg.message, text)
+            self.assertEqual(msg.groups, tuple(names))
+
+        self.assertRaises(ValueError, spread.GroupSet, [])
+        self.assertRaises(ValueError, spread.GroupSet,
+                          ["x" * spread.MAX_GROUP_NAME])
+        self.assertRaises(TypeError, spread.GroupSet, [1])
+        self.assertRaises(TypeError, spread.GroupSet, "abc")
+        self.assertRaises(TypeError, wr.multicast, spread.FIFO_MESS,
+                          (group,), b"tuples go to multigroup_multicast")
+
+    def testReceiver(self):
+        mbox = self._connect()
+        if not hasattr(mbox, "start_receiver"):
+            print("skipping testReceiver() -- not built with the receiver")
+            return
+        group = self._group()
+        wr = self._connect(0)
+        mbox.join(group)
+        q = mbox.start_receiver(4)
+        self.assertTrue(mbox.queue is q)
+        self.assertEqual(type(q), spread.ReceiveQueueType)
+        msg = q.get(5)
+        self.assertEqual(type(msg), spread.MembershipMsgType)
+        self.assertRaises(spread.error, mbox.receive)
+        self.assertRaises(spread.error, mbox.start_receiver)
+
+        # More messages than the ring holds:  the receiver waits for room.
+        msgs = [b"m%d" % i for i in range(20)]
+        for m in msgs:
+            wr.multicast(spread.FIFO_MESS, group, m)
+        got = []
+        while len(got) < len(msgs):
+            batch = q.get_many(3, 5)
+            self.assertTrue(1 <= len(batch) <= 3)
+            got.extend(batch)
+        self.assertEqual([m.message for m in got], msgs)
+        self.assertEqual(q.get(0.05), None)
+        self.assertEqual(q.get_many(5, timeout=0), [])
+        stats = q.stats()
+        self.assertEqual(stats["capacity"], 4)
+        self.assertEqual(stats["received"], len(msgs) + 1)
+        self.assertEqual(stats["high_water"], 4)
+        self.assertTrue(stats["running"])
+
+        wr.multicast(spread.FIFO_MESS, group, b"left1")
+        wr.multicast(spread.FIFO_MESS, group, b"left2")
+        for i in range(500):
+            if q.qsize() == 2:
+                break
+            time.sleep(0.01)
+        left = mbox.stop_receiver()
+        self.assertEqual([m.message for m in left], [b"left1", b"left2"])
+        self.assertEqual(mbox.queue, None)
+        self.assertRaises(spread.error, q.get, 0)
+        self.assertRaises(spread.error, mbox.stop_receiver)
+        wr.multicast(spread.FIFO_MESS, group, b"direct")
+        self.assertEqual(mbox.receive().message, b"direct")
+
+        # A get() blocked in another thread sees messages, and
+        # disconnect() stops the receiver.
+        if thread is None:
+            mbox.disconnect()
+            return
+        q = mbox.start_receiver()
+        done = thread.allocate_lock()
+        done.acquire()
+        result = []
+        def consume():
+            result.append(q.get(10))
+            done.release()
+        thread.start_new_thread(consume, ())
+        time.sleep(0.05)
+        wr.multicast(spread.FIFO_MESS, group, b"threaded")
+        done.acquire()
+        self.assertEqual(result[0].message, b"threaded")
+        mbox.disconnect()
+        self.assertEqual(mbox.queue, None)
+        self.assertRaises(spread.error, q.get)
+        wr.disconnect()
+
+    def testReceiverConsumers(self):
+        # Several threads get() from one queue:  each message is taken
+        # once, even while building one lets the GIL go (decompressing).
+        mbox = self._connect(0)
+        if not hasattr(mbox, "start_receiver") or thread is None:
+            mbox.disconnect()
+            return
+        group = self._group()
+        wr = self._connect(0)
+        mbox.join(group)
+        q = mbox.start_receiver(1024)
+        codec = spread.COMPRESSORS and spread.COMPRESSORS[0] or None
+        n = 500
+        for i in range(n):
+            wr.multicast(spread.FIFO_MESS, group, (b"%06d" % i) * 200,
+                         compress=codec)
+        got, errors = [], []
+        lock = thread.allocate_lock()
+        done = []
+        def consume():
+            try:
+                while True:
+                    msg = q.get(1)
+                    if msg is None:
+                        break
+                    got.append(msg.message[:6])
+            except Exception as e:
+                errors.append(e)
+            lock.acquire()
+            done.append(1)
+            lock.release()
+        for i in range(4):
+            thread.start_new_thread(consume, ())
+        for i in range(1000):
+            if len(done) == 4:
+                break
+            time.sleep(0.01)
+        self.assertEqual(errors, [])
+        self.assertEqual(len(got), n)
+        self.assertEqual(len(set(got)), n)
+        mbox.disconnect()
+        wr.disconnect()
+
+    def testReceiverIdleConsumer(self):
+        # A consumer that takes one message and stops doesn't leave
+        # another, blocked in get(), asleep with the rest queued.
+        mbox = self._connect(0)
+        if not hasattr(mbox, "start_receiver") or thread is None:
+            mbox.disconnect()
+            return
+        group = self._group()
+        wr = self._connect(0)
+        mbox.join(group)
+        q = mbox.start_receiver(64)
+        for i in range(20):
+            got = []
+            def wait():
+                got.append(q.get(2))
+            thread.start_new_thread(wait, ())
+            time.sleep(0.01)
+            wr.multicast(spread.FIFO_MESS, group, b"a")
+            wr.multicast(spread.FIFO_MESS, group, b"b")
+            first = q.get(2)
+            for j in range(300):
+                if got:
+                    break
+                time.sleep(0.01)
+            self.assertNotEqual(first, None)
+            self.assertNotEqual(got, [None])
+            self.assertEqual(sorted([first.message, got[0].message]),
+                             [b"a", b"b"])
+        mbox.disconnect()
+        wr.disconnect()
+
     def testBigGroup(self):
         group, members = self._connect_group(12)
         m1 = members[1]
@@ -281,14 +763,12 @@ class SpreadTest(unittest.TestCase):
     # This will almost certainly deadlock if the receive call in the
     # receiver blocks all calls to Spread for the duration.
     def testSelfSend(self):
-        try:
-            import thread
-        except ImportError:
-            print "skipping testSelfSend() -- it requires threads"
+        if thread is None:
+            print("skipping testSelfSend() -- it requires threads")
             return
         mbox = self._connect(0)
         group = self._group()
-        msgs = ['aaa', 'bbb', 'ccc', 'quit!']
+        msgs = [b'aaa', b'bbb', b'ccc', b'quit!']
         start = thread.allocate_lock()
         stop = thread.allocate_lock()
         start.acquire()
@@ -310,5 +790,898 @@ class SpreadTest(unittest.TestCase):
         mbox.leave(group)
         stop.release()
 
+    # Several threads multicast on one mbox while another is blocked in
+    # receive() on it, then a disconnect() from yet another thread wakes
+    # the receiver and stops the senders.
+    def testConcurrentSendReceive(self):
+        if thread is None:
+            print("skipping testConcurrentSendReceive() -- "
+                  "it requires threads")
+            return
+        mbox = self._connect(0)
+        group = self._group()
+        mbox.join(group)
+        nsenders, count = 4, 500
+        done = [thread.allocate_lock() for i in range(nsenders + 1)]
+        for lock in done:
+            lock.acquire()
+        received = []
+        errors = []
+
+        def send(n):
+            try:
+                for i in range(count):
+                    mbox.multicast(spread.FIFO_MESS, group,
+                                   ("%d %d" % (n, i)).encode())
+                # Keep sending until the disconnect stops us.
+                while 1:
+                    mbox.multicast(spread.FIFO_MESS, group, b"more")
+                    time.sleep(0.001)
+            except spread.error:
+                pass
+            except Exception as err:
+                errors.append(err)
+            done[n].release()
+
+        def receive():
+            try:
+                while 1:
+                    received.append(mbox.receive().message)
+            except spread.error as err:
+                received.append(err)
+            except Exception as err:
+                errors.append(err)
+            done[nsenders].release()
+
+        thread.start_new_thread(receive, ())
+        for n in range(nsenders):
+            thread.start_new_thread(send, (n,))
+        deadline = time.time() + 30
+        while (len([m for m in received if m != b"more"]) < nsenders * count
+               and time.time() < deadline):
+            time.sleep(0.01)
+        mbox.disconnect()
+        for lock in done:
+            lock.acquire()
+        self.assertEqual(errors, [])
+
+        # Everything sent came back, each sender's messages in order, and
+        # the receiver ended with an error:  CONNECTION_CLOSED if it was
+        # blocked in receive() at the disconnect, else "closed mbox".
+        err = received.pop()
+        self.assertTrue(isinstance(err, spread.error))
+        last = [-1] * nsenders
+        for data in received:
+            if data == b"more":
+                continue
+            n, i = map(int, data.split())
+            self.assertEqual(i, last[n] + 1)
+            last[n] = i
+        self.assertEqual(last, [count - 1] * nsenders)
+        self.assertRaises(spread.error, mbox.multicast,
+                          spread.FIFO_MESS, group, b"late")
+
+        # disconnect() wakes a receive() that is blocked with nothing
+        # coming.
+        mbox = self._connect(0)
+        del received[:]
+        thread.start_new_thread(receive, ())
+        time.sleep(0.1)
+        mbox.disconnect()
+        done[nsenders].acquire()
+        self.assertEqual(errors, [])
+        self.assertEqual(received[0].args[0], spread.CONNECTION_CLOSED)
+
+    # Publisher threads share a small pool of mailboxes while other
+    # threads decode the same received messages and resize the receiving
+    # mailbox's name cache under them.  Meant for free-threaded builds,
+    # where these really run at once, but it holds with a GIL too.
+    def testThreadedPool(self):
+        if thread is None:
+            print("skipping testThreadedPool() -- it requires threads")
+            return
+        pool = [self._connect(0) for i in range(2)]
+        rd = self._connect(0)
+        group = self._group()
+        rd.join(group)
+        nthreads, count = 4, 200
+        done = [thread.allocate_lock() for i in range(nthreads)]
+        errors = []
+
+        def publish(n):
+            try:
+                mbox = pool[n % len(pool)]
+                for i in range(count):
+                    mbox.multicast(spread.FIFO_MESS, group,
+                                   ("%d %d" % (n, i)).encode())
+            except Exception as err:
+                errors.append(err)
+            done[n].release()
+
+        for n in range(nthreads):
+            done[n].acquire()
+            thread.start_new_thread(publish, (n,))
+        msgs = [rd.receive(10) for i in range(nthreads * count)]
+        for lock in done:
+            lock.acquire()
+        self.assertEqual(errors, [])
+        self.assertEqual(msgs.count(None), 0)
+        self.assertEqual(sorted(m.message for m in msgs),
+                         sorted(("%d %d" % (n, i)).encode()
+                                for n in range(nthreads)
+                                for i in range(count)))
+
+        def decode(n):
+            try:
+                for m in msgs:
+                    if m.groups != (group,):
+                        errors.append(m.groups)
+                    if n == 0:
+                        rd.set_name_cache(16 * (len(errors) % 2 + 1))
+            except Exception as err:
+                errors.append(err)
+            done[n].release()
+
+        for n in range(nthreads):
+            thread.start_new_thread(decode, (n,))
+        for lock in done:
+            lock.acquire()
+        self.assertEqual(errors, [])
+        for mbox in pool + [rd]:
+            mbox.disconnect()
+
+    def testMembershipView(self):
+        mbox = self._connect()
+        group = self._group()
+        self.assertRaises(spread.error, mbox.members, group)
+        self.assertRaises(spread.error, mbox.groups)
+        mbox.set_membership_view(True)
+        self.assertEqual(mbox.groups(), ())
+        self.assertEqual(mbox.members(group), None)
+        self.assertEqual(mbox.group_id(group), None)
+        version = mbox.view_version
+
+        mbox.join(group)
+        msg = mbox.receive()
+        self.assertEqual(mbox.members(group), (mbox.private_group,))
+        self.assertTrue(mbox.members(group) is msg.members)
+        self.assertEqual(mbox.group_id(group), msg.group_id)
+        self.assertEqual(mbox.groups(), (group,))
+        self.assertTrue(mbox.groups() is mbox.groups())
+        self.assertEqual(mbox.view_version, version + 1)
+
+        other = self._connect(0)
+        other.join(group)
+        msg = mbox.receive()
+        members = mbox.members(group)
+        self.assertEqual(sorted(members),
+                         sorted([mbox.private_group, other.private_group]))
+        self.assertTrue(members is msg.members)
+        self.assertTrue(mbox.members(group) is members)
+        self.assertEqual(mbox.view_version, version + 2)
+        # Messages that aren't views change nothing.
+        other.multicast(spread.FIFO_MESS, group, b"data")
+        self.assertEqual(mbox.receive().message, b"data")
+        self.assertEqual(mbox.view_version, version + 2)
+
+        other.disconnect()
+        mbox.receive()
+        self.assertEqual(mbox.members(group), (mbox.private_group,))
+        mbox.leave(group)
+        msg = mbox.receive()
+        self.assertEqual(mbox.members(group), None)
+        self.assertEqual(mbox.groups(), ())
+        self.assertEqual(mbox.view_version, version + 4)
+
+        mbox.set_membership_view(False)
+        self.assertRaises(spread.error, mbox.members, group)
+        mbox.disconnect()
+
+    def testFilter(self):
+        rd = self._connect()
+        wr, other = self._connect(0), self._connect(0)
+        g1, g2 = self._group(), self._group()
+        rd.join(g1)
+        rd.join(g2)
+
+        def send(*msgs):
+            for mbox, groups, data, msg_type in msgs:
+                if isinstance(groups, tuple):
+                    mbox.multigroup_multicast(spread.FIFO_MESS, groups,
+                                              data, msg_type)
+                else:
+                    mbox.multicast(spread.FIFO_MESS, groups, data, msg_type)
+
+        rd.set_filter(msg_types=[1, 2], deny_senders=[other.private_group],
+                      groups=[g1], membership=False)
+        send((wr, g1, b"type 3", 3),
+             (other, g1, b"other", 1),
+             (wr, g2, b"g2 only", 1),
+             (wr, (g2, g1), b"g2 and g1", 1),
+             (wr, g1, b"wanted", 2))
+        self.assertEqual(rd.receive().message, b"g2 and g1")
+        self.assertEqual([m.message for m in rd.receive_many(10)],
+                         [b"wanted"])
+        self.assertEqual(rd.filter_stats(),
+                         {"msg_type": 1, "sender": 1, "group": 1,
+                          "membership": 2})
+        # Nothing left that passes:  a timed receive times out.
+        send((wr, g1, b"type 3", 3))
+        self.assertEqual(rd.receive(0.05), None)
+        self.assertEqual(rd.filter_stats()["msg_type"], 2)
+
+        send((wr, g1, b"type 3", 3), (wr, g1, b"a", 1),
+             (wr, g1, b"type 3", 3), (wr, g1, b"b", 2))
+        self.assertEqual([m.message for m in rd.receive_many(10)],
+                         [b"a", b"b"])
+        send((wr, g2, b"x", 1), (wr, g1, b"into", 1))
+        size, msg = rd.receive_into(bytearray(10))
+        self.assertEqual(size, 4)
+
+        rd.set_filter(deny_msg_types=[-5], deny_groups=[g2])
+        other.join(g1)
+        self.assertEqual(rd.receive().group, g1)
+        send((wr, g1, b"minus five", -5), (wr, g2, b"g2", 0),
+             (wr, g1, b"zero", 0))
+        self.assertEqual(rd.receive().message, b"zero")
+        self.assertEqual(rd.filter_stats(),
+                         {"msg_type": 1, "sender": 0, "group": 1,
+                          "membership": 0})
+
+        if hasattr(rd, "start_receiver"):
+            queue = rd.start_receiver()
+            send((wr, g2, b"g2", 0), (wr, g1, b"queued", 0))
+            self.assertEqual(queue.get(10).message, b"queued")
+            send((wr, g2, b"g2", 0))
+            self.assertEqual(queue.get(0.05), None)
+            send((wr, g2, b"g2", 0), (wr, g1, b"many", 0))
+            self.assertEqual([m.message for m in queue.get_many(10, 10)],
+                             [b"many"])
+            self.assertEqual(rd.filter_stats()["group"], 4)
+            rd.stop_receiver()
+
+        rd.set_filter()
+        self.assertEqual(rd.filter_stats()["group"], 0)
+        send((wr, g2, b"g2", 0))
+        self.assertEqual(rd.receive().message, b"g2")
+        self.assertRaises(ValueError, rd.set_filter, msg_types=[1 << 20])
+        self.assertRaises(TypeError, rd.set_filter, groups="abc")
+        for mbox in rd, wr, other:
+            mbox.disconnect()
+
+    def testRun(self):
+        rd = self._connect()
+        wr = self._connect(0)
+        g1, g2 = self._group(), self._group()
+        got = []
+        rd.register(g1, 1, lambda msg: got.append(("g1/1", msg.message)))
+        rd.register(g1, None, lambda msg: got.append(("g1/*", msg.message)))
+        rd.register(None, 2, lambda msg: got.append(("*/2", msg.message)))
+        rd.register_membership(lambda msg: got.append(("memb", msg.group)))
+        rd.join(g1)
+        rd.join(g2)
+        for group, data, msg_type in ((g1, b"a", 1), (g1, b"b", 7),
+                                      (g2, b"c", 2), (g2, b"d", 3),
+                                      ((g2, g1), b"e", 1)):
+            if isinstance(group, tuple):
+                wr.multigroup_multicast(spread.FIFO_MESS, group, data,
+                                        msg_type)
+            else:
+                wr.multicast(spread.FIFO_MESS, group, data, msg_type)
+        self.assertEqual(rd.run(timeout=1, max_msgs=7), 7)
+        self.assertEqual(got, [("memb", g1), ("memb", g2), ("g1/1", b"a"),
+                               ("g1/*", b"b"), ("*/2", b"c"),
+                               ("g1/1", b"e")])
+
+        # max_msgs, timeout, stop() and exceptions end run().
+        del got[:]
+        rd.register(g1, 1, None)
+        rd.register(callback=lambda msg: got.append(("*/*", msg.message)))
+        for data in b"f", b"g", b"h", b"i":
+            wr.multicast(spread.FIFO_MESS, g1, data, 1)
+        self.assertEqual(rd.run(max_msgs=2), 2)
+        self.assertEqual(got, [("g1/*", b"f"), ("g1/*", b"g")])
+
+        def stop(msg):
+            got.append(("stop", msg.message))
+            rd.stop()
+        rd.register(g1, None, stop)
+        self.assertEqual(rd.run(), 1)
+        self.assertEqual(got[-1], ("stop", b"h"))
+
+        def fail(msg):
+            raise KeyError(msg.message)
+        rd.register(g1, None, fail)
+        self.assertRaises(KeyError, rd.run)
+        t0 = time.time()
+        self.assertEqual(rd.run(0.05), 0)
+        self.assertTrue(time.time() - t0 >= 0.04)
+
+        self.assertRaises(TypeError, rd.register, g1, 1)
+        self.assertRaises(TypeError, rd.register, g1, 1, 42)
+        rd.disconnect()
+        wr.disconnect()
+
+        # A callback referring to its mailbox makes a cycle the
+        # collector can break without disconnect().
+        class Handler:
+            def __init__(self, mbox):
+                self.mbox = mbox
+                mbox.register(g1, None, self.on_msg)
+                mbox.register_membership(self.on_msg)
+            def on_msg(self, msg):
+                pass
+        ref = weakref.ref(Handler(self._connect()))
+        gc.collect()
+        self.assertEqual(ref(), None)
+
+    def testMailboxPool(self):
+        pool = spread.MailboxPool(self.spread_name, 6, "pool")
+        self.assertEqual(type(pool), spread.MailboxPoolType)
+        self.assertEqual(len(pool), 6)
+        self.assertEqual(len(pool.mailboxes), 6)
+        for i, mbox in enumerate(pool.mailboxes):
+            self.assertEqual(mbox.private_group, pool.private_groups[i])
+            self.assertTrue(mbox.private_group.startswith("#pool%d#" % i))
+
+        # Each group's messages go out on one mailbox, in order.
+        rd = self._connect(0)
+        groups = tuple(self._group() for i in range(8))
+        for group in groups:
+            rd.join(group)
+            self.assertTrue(pool.mailbox(group) in pool.mailboxes)
+            self.assertTrue(pool.mailbox(group) is pool.mailbox(group))
+        for i in range(20):
+            for group in groups:
+                pool.multicast(spread.FIFO_MESS, group, str(i).encode())
+        seen = {}
+        for i in range(20 * len(groups)):
+            msg = rd.receive()
+            self.assertEqual(msg.sender, pool.mailbox(msg.groups[0]).
+                             private_group)
+            seen.setdefault(msg.groups[0], []).append(msg.message)
+        for group in groups:
+            self.assertEqual(seen[group],
+                             [str(i).encode() for i in range(20)])
+        pool.multigroup_multicast(spread.FIFO_MESS, groups[:2], b"both")
+        msg = rd.receive()
+        self.assertEqual((msg.message, msg.groups), (b"both", groups[:2]))
+        # A single group goes the same way however it is addressed.
+        for group in groups:
+            pool.multigroup_multicast(spread.FIFO_MESS, (group,), b"one")
+            pool.multicast(spread.FIFO_MESS, spread.GroupSet((group,)),
+                           b"one")
+            for i in range(2):
+                self.assertEqual(rd.receive().sender,
+                                 pool.mailbox(group).private_group)
+        pool.disconnect()
+        self.assertRaises(spread.error, pool.multicast,
+                          spread.FIFO_MESS, groups[0], b"closed")
+
+        pool = spread.MailboxPool(self.spread_name, 3, route="round_robin")
+        group = groups[0]
+        for i in range(6):
+            pool.multicast(spread.FIFO_MESS, group, b"rr")
+        senders = [rd.receive().sender for i in range(6)]
+        self.assertEqual(senders, list(pool.private_groups) * 2)
+        pool.disconnect()
+        rd.disconnect()
+
+        # One connection fails:  the others are closed again.
+        taken = spread.connect(self.spread_name, "pool2", 0, 0)
+        try:
+            spread.MailboxPool(self.spread_name, 4, "pool")
+        except spread.error as err:
+            self.assertEqual(err.args[0], spread.REJECT_NOT_UNIQUE)
+            self.assertEqual(err.args[2], [(2, spread.REJECT_NOT_UNIQUE)])
+        else:
+            self.fail("expected a name already in use to fail")
+        taken.disconnect()
+        spread.MailboxPool(self.spread_name, 4, "pool").disconnect()
+
+        self.assertRaises(ValueError, spread.MailboxPool, size=0)
+        self.assertRaises(ValueError, spread.MailboxPool, route="random")
+        self.assertRaises(ValueError, spread.MailboxPool, size=100,
+                          name="x" * (spread.MAX_PRIVATE_NAME - 1))
+
+    def testBatching(self):
+        rd = self._connect(0)
+        wr = self._connect(0)
+        g1, g2 = self._group(), self._group()
+        rd.join(g1)
+        rd.join(g2)
+        rd.set_unbatching(True)
+
+        # A frame goes out when it is full, and each message comes back
+        # on its own with its own msg_type.
+        wr.set_batching(max_bytes=1000, max_msgs=3, delay=None)
+        for i in range(3):
+            self.assertEqual(wr.multicast(spread.FIFO_MESS, g1,
+                                          b"m%d" % i, i), 2)
+        for i in range(3):
+            msg = rd.receive()
+            self.assertEqual((msg.message, msg.msg_type, msg.groups,
+                              msg.sender), (b"m%d" % i, i, (g1,),
+                                            wr.private_group))
+
+        # A message for another group, a multigroup message and flush()
+        # send what has been gathered first; so does a message too big
+        # to batch.
+        wr.multicast(spread.FIFO_MESS, g1, b"a", 1)
+        wr.multicast(spread.FIFO_MESS, g1, b"b", 2)
+        wr.multicast(spread.FIFO_MESS, g2, b"c", 3)
+        wr.multigroup_multicast(spread.FIFO_MESS, (g1, g2), b"d", 4)
+        wr.multicast(spread.FIFO_MESS, g1, b"e", 5)
+        wr.multicast(spread.FIFO_MESS, g1, b"f" * 2000, 6)
+        wr.multicast(spread.FIFO_MESS, g2, b"g", 7)
+        msgs = []
+        while len(msgs) < 6:
+            msgs += rd.receive_many(20, 1)
+        self.assertEqual(rd.receive(0), None)
+        wr.flush()
+        msgs.append(rd.receive(1))
+        got = [(m.message[:1], m.msg_type, m.groups) for m in msgs]
+        self.assertEqual(got, [(b"a", 1, (g1,)), (b"b", 2, (g1,)),
+                               (b"c", 3, (g2,)), (b"d", 4, (g1, g2)),
+                               (b"e", 5, (g1,)), (b"f", 6, (g1,)),
+                               (b"g", 7, (g2,))])
+
+        # The timer sends a frame whose first message has waited long
+        # enough; run() and receive_into() take frames apart too.
+        wr.set_batching(delay=0.01)
+        wr.multicast_many(spread.FIFO_MESS, [(g1, b"h", 8), (g1, b"i", 9)])
+        got = []
+        rd.register(callback=lambda msg: got.append(msg.message))
+        self.assertEqual(rd.run(timeout=1, max_msgs=2), 2)
+        self.assertEqual(got, [b"h", b"i"])
+        wr.multicast(spread.FIFO_MESS, g1, b"jj", 10)
+        wr.multicast(spread.FIFO_MESS, g1, b"kk", 11)
+        buf = bytearray(100)
+        size, msg = rd.receive_into(buf, 1)
+        self.assertEqual((buf[:size], msg.msg_type), (b"jj", 10))
+        self.assertRaises(spread.error, rd.receive_into, bytearray(1))
+        size, msg = rd.receive_into(buf, 1)
+        self.assertEqual((buf[:size], msg.msg_type), (b"kk", 11))
+
+        # The filter sees each message's own msg_type.
+        rd.set_filter(msg_types=[13])
+        wr.multicast(spread.FIFO_MESS, g1, b"l", 12)
+        wr.multicast(spread.FIFO_MESS, g1, b"m", 13)
+        wr.flush()
+        self.assertEqual(rd.receive(1).message, b"m")
+        self.assertEqual(rd.filter_stats()["msg_type"], 1)
+        rd.set_filter()
+
+        # So does the background receiver's queue.
+        if hasattr(rd, "start_receiver"):
+            q = rd.start_receiver()
+            wr.multicast_many(spread.FIFO_MESS,
+                              [(g1, b"x", 1), (g1, b"y", 2), (g1, b"z", 3)])
+            wr.flush()
+            self.assertEqual([m.message for m in q.get_many(2, 1)],
+                             [b"x", b"y"])
+            self.assertEqual(q.get(1).message, b"z")
+            rd.stop_receiver()
+
+        # Without unbatching, the frame itself is received.
+        rd.set_unbatching(False)
+        wr.multicast(spread.FIFO_MESS, g1, b"n", 14)
+        wr.multicast(spread.FIFO_MESS, g1, b"o", 15)
+        wr.flush()
+        msg = rd.receive(1)
+        self.assertEqual(msg.msg_type, spread.BATCH_MSG_TYPE)
+        self.assertEqual(msg.message, b"\x00\x0e\x00\x00\x00\x01n"
+                                      b"\x00\x0f\x00\x00\x00\x01o")
+
+        # Disconnecting sends what is left; batching can be turned off.
+        self.assertRaises(ValueError, wr.multicast, spread.FIFO_MESS, g1,
+                          b"p", spread.BATCH_MSG_TYPE)
+        self.assertRaises(ValueError, wr.set_batching, max_msgs=0)
+        wr.set_batching(0)
+        # Batching or not.
+        self.assertRaises(ValueError, wr.multicast, spread.FIFO_MESS, g1,
+                          b"p", spread.BATCH_MSG_TYPE)
+        self.assertRaises(ValueError, wr.multicast_scatter,
+                          spread.FIFO_MESS, g1, [b"p"], spread.BATCH_MSG_TYPE)
+        self.assertRaises(ValueError, wr.multicast_large, spread.FIFO_MESS,
+                          g1, b"p" * 1000, spread.BATCH_MSG_TYPE, 100)
+        wr.multicast(spread.FIFO_MESS, g1, b"q", 16)
+        self.assertEqual(rd.receive(1).msg_type, 16)
+        wr.set_batching(delay=None)
+        wr.multicast(spread.FIFO_MESS, g1, b"r", 17)
+        wr.disconnect()
+        self.assertEqual(rd.receive(1).msg_type, 17)
+
+        # A frame the timer fails to send is reported by flush(), not by
+        # the next message, which goes out.
+        if hasattr(rd, "start_receiver"):
+            wr = self._connect(0)
+            wr.set_batching(max_bytes=200000, max_msgs=100, delay=0.01)
+            for i in range(99):
+                wr.multicast(spread.FIFO_MESS, g1, b"t" * 1500, 19)
+            time.sleep(0.1)
+            wr.multicast(spread.FIFO_MESS, g1, b"u", 20)
+            try:
+                wr.flush()
+            except spread.error as e:
+                self.assertEqual(e.args[0], spread.MESSAGE_TOO_LONG)
+            else:
+                self.fail("flush() should have failed")
+            wr.flush()
+            self.assertEqual(rd.receive(1).msg_type, 20)
+            wr.disconnect()
+
+        # The timer notes that the daemon dropped the connection, like
+        # any other send.
+        if hasattr(spread, "_fake_kill_session") and \
+           hasattr(rd, "start_receiver"):
+            wr = self._connect(0)
+            wr.set_batching(delay=0.01)
+            wr.multicast(spread.FIFO_MESS, g1, b"s", 18)
+            spread._fake_kill_session(wr.private_group)
+            for i in range(100):
+                try:
+                    wr.fileno()
+                except spread.error:
+                    break
+                time.sleep(0.01)
+            self.assertRaises(spread.error, wr.fileno)
+            # The message it couldn't send is reported.
+            self.assertRaises(spread.error, wr.disconnect)
+        rd.disconnect()
+
+    def testCompression(self):
+        if "zlib" not in spread.COMPRESSORS:
+            return
+        rd = self._connect(0)
+        wr = self._connect(0)
+        group = self._group()
+        rd.join(group)
+        big = b"state " * 2000
+
+        # The message comes back as it was sent, msg_type and all.
+        for codec in spread.COMPRESSORS:
+            self.assertEqual(wr.multicast(spread.FIFO_MESS, group, big, 5,
+                                          compress=codec), len(big))
+            msg = rd.receive(1)
+            self.assertEqual((msg.message, msg.msg_type), (big, 5))
+        stats = wr.compression_stats()
+        n = len(spread.COMPRESSORS)
+        self.assertEqual((stats["compressed"], stats["bytes_in"]),
+                         (n, n * len(big)))
+        self.assertTrue(stats["ratio"] < 0.1)
+        self.assertTrue(stats["compress_time"] >= 0)
+        self.assertEqual(rd.compression_stats()["decompressed_bytes_out"],
+                         n * len(big))
+
+        # Short messages, and messages compression wouldn't shrink, are
+        # sent as they are.
+        noise = os.urandom(600)
+        wr.multicast(spread.FIFO_MESS, group, b"tiny", 1, compress="zlib")
+        wr.multicast(spread.FIFO_MESS, group, b"tiny", 2, compress="zlib",
+                     min_size=0)
+        wr.multicast(spread.FIFO_MESS, group, noise, 3,
+                     compress="zlib", min_size=0)
+        for i in (1, 2, 3):
+            self.assertEqual(rd.receive(1).msg_type, i)
+        self.assertEqual(wr.compression_stats()["skipped"], 2)
+
+        # Every way of receiving decompresses.
+        wr.multicast(spread.FIFO_MESS, group, big, 6, compress="zlib")
+        self.assertEqual(rd.receive_many(10, 1)[0].message, big)
+        got = []
+        rd.register(callback=lambda msg: got.append(msg.message))
+        wr.multicast(spread.FIFO_MESS, group, big, 7, compress="zlib")
+        self.assertEqual(rd.run(timeout=1, max_msgs=1), 1)
+        self.assertEqual(got, [big])
+        rd.register(callback=None)
+
+        # receive_into() leaves a message that won't fit to try again.
+        wr.multicast(spread.FIFO_MESS, group, big, 8, compress="zlib")
+        try:
+            rd.receive_into(bytearray(100), 1)
+        except spread.error as e:
+            self.assertEqual(e.args[0], spread.BUFFER_TOO_SHORT)
+            self.assertEqual(e.args[2], len(big))
+        else:
+            self.fail("receive_into() should have failed")
+        buf = bytearray(len(big))
+        size, msg = rd.receive_into(buf, 1)
+        self.assertEqual((size, bytes(buf), msg.msg_type), (len(big), big, 8))
+
+        # Batched messages are compressed one by one.
+        rd.set_unbatching(True)
+        wr.set_batching(delay=None)
+        wr.multicast(spread.FIFO_MESS, group, big, 9, compress="zlib")
+        wr.multicast(spread.FIFO_MESS, group, b"plain", 10)
+        wr.flush()
+        self.assertEqual(rd.receive(1).message, big)
+        self.assertEqual(rd.receive(1).message, b"plain")
+
+        self.assertRaises(ValueError, wr.multicast, spread.FIFO_MESS, group,
+                          big, compress="nonesuch")
+        self.assertRaises(ValueError, wr.multicast, spread.FIFO_MESS, group,
+                          big, spread.COMPRESSED_MSG_TYPE)
+        wr.disconnect()
+        rd.disconnect()
+
+    def testLargeMessages(self):
+        rd = self._connect(0)
+        wr = self._connect(0)
+        group = self._group()
+        rd.join(group)
+        big = os.urandom(1000000)
+
+        # Too long for one Spread message, so it goes in fragments and
+        # comes back whole, however it is received.
+        self.assertRaises(spread.error, wr.multicast, spread.FIFO_MESS,
+                          group, big)
+        self.assertEqual(wr.multicast_large(spread.FIFO_MESS, group, big, 3),
+                         len(big))
+        msg = rd.receive(1)
+        self.assertEqual((msg.message, msg.msg_type, msg.sender),
+                         (big, 3, wr.private_group))
+        wr.multicast_large(spread.AGREED_MESS, (group,), big, 4,
+                           fragment_size=100000)
+        self.assertEqual([m.message for m in rd.receive_many(10, 1)], [big])
+        got = []
+        rd.register(callback=lambda msg: got.append(msg.msg_type))
+        wr.multicast_large(spread.SAFE_MESS, group, big, 5)
+        self.assertEqual(rd.run(timeout=1, max_msgs=1), 1)
+        self.assertEqual(got, [5])
+        rd.register(callback=None)
+
+        # A message that fits is sent as it is.
+        wr.multicast_large(spread.FIFO_MESS, group, b"small", 6)
+        msg = rd.receive(1)
+        self.assertEqual((msg.message, msg.msg_type), (b"small", 6))
+
+        # receive_into() needs room for the whole message, and leaves it
+        # to try again if it doesn't have it.
+        wr.multicast_large(spread.FIFO_MESS, group, big, 7,
+                           fragment_size=1000)
+        try:
+            rd.receive_into(bytearray(2000), 1)
+        except spread.error as e:
+            self.assertEqual((e.args[0], e.args[2]),
+                             (spread.BUFFER_TOO_SHORT, len(big)))
+        else:
+            self.fail("receive_into() should have failed")
+        buf = bytearray(len(big))
+        self.assertEqual(rd.receive_into(buf, 1)[0], len(big))
+        self.assertEqual(bytes(buf), big)
+
+        # A message longer than the reassembly limit is dropped.
+        rd.set_reassembly_limit(len(big) - 1)
+        wr.multicast_large(spread.FIFO_MESS, group, big, 8)
+        wr.multicast(spread.FIFO_MESS, group, b"after", 9)
+        self.assertEqual(rd.receive(1).msg_type, 9)
+        stats = rd.reassembly_stats()
+        self.assertEqual((stats["completed"], stats["partial"],
+                          stats["bytes"], stats["limit"]),
+                         (4, 0, 0, len(big) - 1))
+        self.assertEqual(stats["dropped"], 8)
+
+        if hasattr(spread, "_fake_kill_session"):
+            # A sender that dies part way through:  the membership
+            # message for its disconnect drops what came before.
+            mem = self._connect()
+            mem.join(group)
+            mem.receive(1)
+            dead = self._connect(0)
+            dead.join(group)
+            mem.receive(1)
+            spread._fake_kill_session(dead.private_group, after=3)
+            self.assertRaises(spread.error, dead.multicast_large,
+                              spread.FIFO_MESS, group, big, 10,
+                              fragment_size=1000)
+            msg = mem.receive(1)
+            self.assertEqual((msg.reason, msg.extra),
+                             (spread.CAUSED_BY_DISCONNECT,
+                              (dead.private_group,)))
+            stats = mem.reassembly_stats()
+            self.assertEqual((stats["partial"], stats["bytes"],
+                              stats["left"], stats["completed"]),
+                             (0, 0, 1, 0))
+            mem.disconnect()
+
+        self.assertRaises(ValueError, wr.multicast_large,
+                          spread.RELIABLE_MESS, group, big)
+        self.assertRaises(ValueError, wr.multicast_large, spread.FIFO_MESS,
+                          group, big, spread.FRAGMENT_MSG_TYPE)
+        self.assertRaises(ValueError, rd.set_reassembly_limit, -1)
+        wr.disconnect()
+        rd.disconnect()
+
+    def testScriptedEvents(self):
+        if not hasattr(spread, "_fake_membership_event"):
+            # Only the stand-in library ("make fake") can script these.
+            return
+        group, (a, b) = self._connect_group(2)
+        remote = "#remote#elsewhere"
+
+        # A partition that leaves a with a member on another daemon.
+        spread._fake_membership_event(group, spread.CAUSED_BY_NETWORK,
+                                      [a.private_group, remote])
+        msg = a.receive(1)
+        self.assertEqual(msg.reason, spread.CAUSED_BY_NETWORK)
+        self.assertEqual(msg.members, (a.private_group, remote))
+        self.assertEqual(msg.extra, (a.private_group,))
+        msg = b.receive(1)
+        self.assertEqual((msg.reason, msg.members),
+                         (spread.CAUSED_BY_LEAVE, ()))
+        # And the merge.
+        spread._fake_membership_event(group, spread.CAUSED_BY_NETWORK,
+                                      (a.private_group, b.private_group))
+        self.assertEqual(sorted(a.receive(1).members),
+                         sorted([a.private_group, b.private_group]))
+        self.assertEqual(len(b.receive(1).members), 2)
+
+        # The daemon drops b.
+        spread._fake_kill_session(b.private_group)
+        msg = a.receive(1)
+        self.assertEqual((msg.reason, msg.members, msg.extra),
+                         (spread.CAUSED_BY_DISCONNECT, (a.private_group,),
+                          (b.private_group,)))
+        try:
+            b.receive(1)
+        except spread.error as e:
+            self.assertEqual(e.args[0], spread.CONNECTION_CLOSED)
+        else:
+            self.fail("receive() should have failed")
+        self.assertRaises(spread.error, spread._fake_kill_session,
+                          b.private_group)
+        self.assertRaises(spread.error, spread._fake_membership_event,
+                          "#bad", spread.CAUSED_BY_NETWORK, ())
+        a.disconnect()
+
+    def testStats(self):
+        rd = self._connect()
+        wr = self._connect(0)
+        group = self._group()
+        rd.join(group)
+        rd.receive(1)
+        before = spread.stats()
+        rd.reset_stats()
+        wr.reset_stats()
+        self.assertEqual(rd.stats()["regular"], 0)
+        self.assertEqual(rd.stats()["errors"], {})
+
+        wr.multicast(spread.FIFO_MESS, group, b"x" * 100)
+        wr.multicast(spread.SAFE_MESS, group, b"y" * 20000)
+        wr.multicast_many(spread.AGREED_MESS, [(group, b"a"), (group, b"bb")])
+        self.assertEqual(rd.receive(1).message, b"x" * 100)
+        self.assertEqual(len(rd.receive_many(10, 1)), 3)
+        self.assertEqual(rd.receive(0), None)
+        wr.join(group)
+        rd.receive(1)
+        self.assertRaises(spread.error, wr.multicast, spread.FIFO_MESS,
+                          group, b"z" * 1000000)
+
+        sent = wr.stats()
+        self.assertEqual((sent["sent"]["FIFO_MESS"], sent["sent"]["SAFE_MESS"],
+                          sent["sent"]["AGREED_MESS"]), (1, 1, 2))
+        self.assertEqual(sent["sent_bytes"]["AGREED_MESS"], 3)
+        self.assertEqual(sent["largest_sent"], 20000)
+        self.assertEqual(sent["errors"], {spread.MESSAGE_TOO_LONG: 1})
+        got = rd.stats()
+        self.assertEqual(got["received"], sent["sent"])
+        self.assertEqual(got["received_bytes"], sent["sent_bytes"])
+        self.assertEqual((got["regular"], got["membership"]), (4, 1))
+        self.assertEqual(got["largest_received"], 20000)
+        # The default 10000-byte buffer was too short once.
+        self.assertEqual((got["buffer_retries"], got["groups_retries"]),
+                         (1, 0))
+        self.assertTrue(got["blocked_time"] >= 0)
+        self.assertTrue(got["python_time"] >= 0)
+
+        after = spread.stats()
+        self.assertTrue(after["regular"] >= before["regular"] + 4)
+        self.assertTrue(after["errors"][spread.MESSAGE_TOO_LONG] >= 1)
+
+        # Received counts are wire counts:  three batched messages come
+        # over as one frame.
+        rd.set_unbatching(True)
+        wr.set_batching(max_msgs=3, delay=None)
+        rd.reset_stats()
+        wr.reset_stats()
+        for i in range(3):
+            wr.multicast(spread.FIFO_MESS, group, b"b%d" % i)
+        self.assertEqual(len([rd.receive(1) for i in range(3)]), 3)
+        self.assertEqual(wr.stats()["sent"]["FIFO_MESS"], 3)
+        self.assertEqual(wr.stats()["sent_bytes"]["FIFO_MESS"], 6)
+        got = rd.stats()
+        self.assertEqual((got["received"]["FIFO_MESS"], got["regular"]),
+                         (1, 1))
+        self.assertTrue(got["received_bytes"]["FIFO_MESS"] > 6)
+        wr.set_batching(0)
+
+        after = spread.stats()
+        rd.reset_stats()
+        self.assertEqual(rd.stats()["received"]["FIFO_MESS"], 0)
+        self.assertEqual(spread.stats()["regular"], after["regular"])
+        wr.disconnect()
+        rd.disconnect()
+
+    def testLatency(self):
+        rd = self._connect()
+        wr = self._connect(0)
+        group, other = self._group(), self._group()
+        rd.join(group)
+        rd.join(other)
+        rd.receive(1)
+        rd.receive(1)
+        # Unstamped messages are noted nowhere.
+        wr.multicast(spread.FIFO_MESS, group, b"plain")
+        self.assertEqual(rd.receive(1).message, b"plain")
+        self.assertEqual(rd.latency(group)["count"], 0)
+        self.assertEqual(rd.latency()["percentiles"][99.0], None)
+
+        wr.set_timestamps(True)
+        self.assertRaises(ValueError, wr.multicast, spread.FIFO_MESS, group,
+                          b"x", spread.STAMPED_MSG_TYPE)
+        wr.multicast(spread.FIFO_MESS, group, b"one", 7)
+        wr.multicast_scatter(spread.AGREED_MESS, group, [b"tw", b"o"], 8)
+        wr.multicast_many(spread.FIFO_MESS, [(group, b"three"),
+                                             (other, b"four", 9)])
+        if spread.COMPRESSORS:
+            wr.multicast(spread.FIFO_MESS, group, b"z" * 5000,
+                         compress=spread.COMPRESSORS[0])
+        buf = bytearray(100)
+        self.assertEqual(rd.receive_into(buf, 1)[0], 3)
+        self.assertEqual(bytes(buf[:3]), b"one")
+        got = [(m.msg_type, m.message) for m in rd.receive_many(10, 1)]
+        expected = [(8, b"two"), (0, b"three"), (9, b"four")]
+        if spread.COMPRESSORS:
+            expected.append((0, b"z" * 5000))
+        self.assertEqual(got, expected)
+
+        # Batched messages each keep a timestamp of their own.
+        rd.set_unbatching(True)
+        wr.set_batching(max_msgs=3)
+        for i in range(3):
+            wr.multicast(spread.SAFE_MESS, other, b"b%d" % i, i)
+        self.assertEqual([(m.msg_type, m.message) for m in
+                          rd.receive_many(10, 1)],
+                         [(0, b"b0"), (1, b"b1"), (2, b"b2")])
+
+        lat = rd.latency(group)
+        self.assertEqual(lat["count"], len(expected))
+        self.assertTrue(0 <= lat["min"] <= lat["mean"] <= lat["max"] < 10)
+        self.assertEqual(sorted(lat["percentiles"]), [50.0, 90.0, 99.0, 99.9])
+        for v in lat["percentiles"].values():
+            self.assertTrue(lat["min"] <= v <= lat["max"])
+        self.assertEqual(rd.latency(group, spread.AGREED_MESS)["count"], 1)
+        self.assertEqual(rd.latency(other)["count"], 4)
+        self.assertEqual(rd.latency(other, spread.SAFE_MESS)["count"], 3)
+        self.assertEqual(rd.latency()["count"], len(expected) + 4)
+        p = rd.latency(percentiles=[0, 100])["percentiles"]
+        self.assertEqual((p[0.0], p[100.0]),
+                         (rd.latency()["min"], rd.latency()["max"]))
+        self.assertRaises(ValueError, rd.latency, group, 3)
+        self.assertRaises(ValueError, rd.latency, group, None, [101])
+        rd.reset_stats()
+        self.assertEqual(rd.latency()["count"], 0)
+
+        # The timestamp is skipped in place, in the mailbox's own buffer
+        # (grown for a long message) and in the background queue's.
+        wr.set_batching(0)
+        big = os.urandom(50000)
+        for data in big, b"small", big[:20000]:
+            wr.multicast(spread.FIFO_MESS, group, data, 5)
+            msg = rd.receive(1)
+            self.assertEqual((msg.msg_type, msg.message), (5, data))
+        if hasattr(rd, "start_receiver"):
+            q = rd.start_receiver()
+            wr.multicast(spread.FIFO_MESS, group, big, 6)
+            wr.multicast(spread.FIFO_MESS, group, b"tail", 7)
+            self.assertEqual([(m.msg_type, m.message) for m in
+                              (q.get(1), q.get(1))],
+                             [(6, big), (7, b"tail")])
+            rd.stop_receiver()
+        self.assertEqual(rd.latency()["count"], 5)
+        wr.disconnect()
+        rd.disconnect()
+
 if __name__ == "__main__":
     unittest.main()